@@ -1,3 +1,5 @@
+/* the handler waits for a body that is still arriving */
+#define TW_ENABLE_COROUTINES
 #define THINWIRE_IMPL
 #include "../thinwire.h"
 
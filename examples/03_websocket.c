@@ -0,0 +1,58 @@
+#define TW_ENABLE_WEBSOCKET
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+
+#define PORT 8080
+
+static tw_websocket *clients[TW_MAX_CLIENTS];
+static size_t num_clients = 0;
+
+void on_message(tw_websocket *ws, tw_ws_opcode opcode, const char *data,
+                size_t len) {
+  (void)ws;
+
+  /* relay every message to all connected clients */
+  tw_ws_broadcast(clients, num_clients, opcode, data, len);
+}
+
+void on_close(tw_websocket *ws, uint16_t code) {
+  tw_log(TW_INFO, "Client disconnected (%u)", code);
+
+  for (size_t i = 0; i < num_clients; i++) {
+    if (clients[i] == ws) {
+      clients[i] = clients[--num_clients];
+      break;
+    }
+  }
+}
+
+void handle_request(tw_conn *conn, tw_request *req, tw_response *res) {
+  if (strcmp(req->path, "/ws") != 0) {
+    tw_response_set_status(res, 404);
+    tw_response_send(conn, res);
+    return;
+  }
+
+  tw_ws_handlers handlers = {on_message, on_close, NULL};
+  tw_websocket *ws = tw_ws_upgrade(conn, req, &handlers);
+  if (ws == NULL) {
+    tw_response_set_status(res, 400);
+    tw_response_send(conn, res);
+    return;
+  }
+
+  clients[num_clients++] = ws;
+}
+
+int main() {
+  tw_server server;
+  if (!tw_server_init(&server, PORT)) {
+    exit(EXIT_FAILURE);
+  };
+
+  tw_log(TW_INFO, "Server listening on port %d", PORT);
+  tw_server_run(&server, handle_request);
+
+  tw_server_stop(&server);
+  return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/* A server set up as tw_server_init_ex would, but without listeners, whose
+ * connections are added from socketpairs. Included after thinwire.h. */
+
+static tw_server server;
+
+/* Sets the server up with config, or with the defaults when it is NULL. */
+static inline bool server_setup(const tw_server_config *config) {
+  tw_server_config defaults;
+  if (config == NULL) {
+    tw_server_config_init(&defaults);
+    config = &defaults;
+  }
+  memset(&server, 0, sizeof(server));
+  return tw__server_setup(&server, config);
+}
+
+/* Adds fd to the server as tw__server_accept would. */
+static inline tw_conn *server_add_conn(int fd) {
+  int slot = server.nfds++;
+  tw_conn *conn = &server.conns[slot];
+  memset(conn, 0, sizeof(*conn));
+  conn->fd = fd;
+  conn->server = &server;
+  conn->last_active = server.tick;
+  tw__set_nonblocking(fd);
+  server.fds[slot].fd = fd;
+  server.fds[slot].events = POLLIN;
+  return conn;
+}
+
+#endif
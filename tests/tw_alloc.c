@@ -0,0 +1,335 @@
+#include <assert.h>
+
+#include "test.h"
+
+/* room for the idle connections */
+#define TW_MAX_CLIENTS 1024
+#define TW_ENABLE_WEBSOCKET
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+#include "server.h"
+
+/* Allocation ceilings per request once a connection is warm. A change
+ * that needs more has to raise them here, on purpose. */
+#define GET_ALLOCS 8
+#define POST_ALLOCS 7
+/* bytes a request may hold on the heap at its peak */
+#define HEAP_BUDGET 1024
+/* bytes of stack serving a request takes, handlers running
+ * on TW_CORO_STACK_SIZE stacks need room of their own */
+#define STACK_BUDGET (24 * 1024)
+/* keep-alive connections opened for the idle measurements */
+#define IDLE_CONNS 1000
+/* bytes of a connection's slot in the table, poll entry included */
+#define SLOT_BUDGET 256
+/* bytes an idle connection adds to the resident memory besides its
+ * slot, and to the heap, where a websocket keeps its state */
+#define IDLE_RSS_BUDGET 512
+#define IDLE_WS_HEAP_BUDGET 256
+
+/* glibc lets a program replace malloc, the test wraps the real one;
+ * sanitizers replace it themselves */
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+#include <malloc.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static bool counting;
+static size_t allocs;
+static size_t frees;
+static size_t live;
+static size_t peak;
+
+static void count_alloc(void *ptr) {
+  if (!counting || ptr == NULL) return;
+  allocs++;
+  live += malloc_usable_size(ptr);
+  if (live > peak) peak = live;
+}
+
+static void count_free(void *ptr) {
+  if (!counting || ptr == NULL) return;
+  frees++;
+  size_t size = malloc_usable_size(ptr);
+  live = live > size ? live - size : 0;
+}
+
+void *malloc(size_t size) {
+  void *ptr = __libc_malloc(size);
+  count_alloc(ptr);
+  return ptr;
+}
+
+void *calloc(size_t count, size_t size) {
+  void *ptr = __libc_calloc(count, size);
+  count_alloc(ptr);
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+  count_free(ptr);
+  ptr = __libc_realloc(ptr, size);
+  count_alloc(ptr);
+  return ptr;
+}
+
+void free(void *ptr) {
+  count_free(ptr);
+  __libc_free(ptr);
+}
+
+static void count_start(void) {
+  allocs = frees = live = peak = 0;
+  counting = true;
+}
+
+static void count_stop(void) { counting = false; }
+
+#define STACK_PROBE (64 * 1024)
+
+/* Fills the stack below the caller with a pattern, returns where. */
+static __attribute__((noinline)) uintptr_t stack_paint(void) {
+  volatile char area[STACK_PROBE];
+  for (size_t i = 0; i < sizeof(area); i++) area[i] = (char)0xa5;
+  return (uintptr_t)area;
+}
+
+/* Bytes of the painted area written since, counted from the caller. */
+static size_t stack_used(uintptr_t painted) {
+  volatile char *area = (volatile char *)painted;
+  size_t i = 0;
+  while (i < STACK_PROBE && area[i] == (char)0xa5) i++;
+  return STACK_PROBE - i;
+}
+
+static int peer;
+
+static void on_message(tw_websocket *ws, tw_ws_opcode opcode,
+                       const char *data, size_t len) {
+  tw_ws_send(ws, opcode, data, len);
+}
+
+static void handle_request(tw_conn *conn, tw_request *req, tw_response *res) {
+  if (strcmp(req->path, "/ws") == 0) {
+    tw_ws_handlers handlers = {.on_message = on_message};
+    tw_ws_upgrade(conn, req, &handlers);
+    return;
+  }
+  if (strcmp(req->method, "POST") == 0) {
+    if (tw_request_parse_body(conn, req) != TW_REQUEST_PARSE_SUCCESS) {
+      tw_response_set_status(res, 400);
+    }
+    tw_response_set_body(res, req->body, req->body_len);
+  } else {
+    static const char message[] = "Hello World!";
+    tw_response_set_header(res, "Content-Type", "text/plain");
+    tw_response_borrow_body(res, message, sizeof(message) - 1);
+  }
+  tw_response_send(conn, res);
+}
+
+/* A server with one keep-alive connection, served as tw_server_run
+ * would once its socket is readable. */
+static tw_conn *start(void) {
+  if (!server_setup(NULL)) return NULL;
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return NULL;
+  peer = fds[1];
+  return server_add_conn(fds[0]);
+}
+
+static void stop(tw_conn *conn) {
+  tw_conn_close(conn);
+  close(peer);
+  tw_server_stop(&server);
+}
+
+/* Sends raw, serves it and reads the response. */
+static bool serve(tw_conn *conn, const char *raw) {
+  send(peer, raw, strlen(raw), 0);
+  bool open = tw__conn_serve(conn, handle_request);
+  char response[1024];
+  ssize_t n = recv(peer, response, sizeof(response) - 1, 0);
+  return open && n > 12 && strncmp(response, "HTTP/1.1 200", 12) == 0;
+}
+
+static int test_tw_alloc_get(void) {
+  TEST_BEGIN();
+
+  tw_conn *conn = start();
+  ASSERT(conn != NULL);
+  const char *raw =
+      "GET /index.html HTTP/1.1\r\nHost: example.com\r\n"
+      "User-Agent: test\r\nAccept: */*\r\n\r\n";
+  ASSERT(serve(conn, raw));
+
+  for (int i = 0; i < 3; i++) {
+    count_start();
+    bool ok = serve(conn, raw);
+    count_stop();
+    ASSERT(ok);
+    if (allocs > GET_ALLOCS) {
+      fprintf(stderr, "GET: %zu allocations\n", allocs);
+    }
+    ASSERT(allocs <= GET_ALLOCS);
+    /* nothing is left behind between requests */
+    ASSERT(frees == allocs);
+    ASSERT(peak <= HEAP_BUDGET);
+  }
+
+  stop(conn);
+
+  TEST_END();
+}
+
+static int test_tw_alloc_post(void) {
+  TEST_BEGIN();
+
+  tw_conn *conn = start();
+  ASSERT(conn != NULL);
+  char raw[512];
+  snprintf(raw, sizeof(raw),
+           "POST /items HTTP/1.1\r\nHost: example.com\r\n"
+           "Content-Type: application/json\r\nContent-Length: 100\r\n\r\n"
+           "%0100d",
+           0);
+  ASSERT(serve(conn, raw));
+
+  for (int i = 0; i < 3; i++) {
+    count_start();
+    bool ok = serve(conn, raw);
+    count_stop();
+    ASSERT(ok);
+    if (allocs > POST_ALLOCS) {
+      fprintf(stderr, "POST: %zu allocations\n", allocs);
+    }
+    ASSERT(allocs <= POST_ALLOCS);
+    ASSERT(frees == allocs);
+    ASSERT(peak <= HEAP_BUDGET);
+  }
+
+  stop(conn);
+
+  TEST_END();
+}
+
+static int test_tw_alloc_stack(void) {
+  TEST_BEGIN();
+
+  tw_conn *conn = start();
+  ASSERT(conn != NULL);
+
+  uintptr_t painted = stack_paint();
+  ASSERT(serve(conn, "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n"));
+  size_t used = stack_used(painted);
+  if (used > STACK_BUDGET) {
+    fprintf(stderr, "stack: %zu bytes\n", used);
+  }
+  ASSERT(used > 0 && used <= STACK_BUDGET);
+
+  stop(conn);
+
+  TEST_END();
+}
+
+/* Bytes of the process in memory. */
+static size_t resident(void) {
+  FILE *file = fopen("/proc/self/statm", "r");
+  if (file == NULL) return 0;
+  unsigned long size = 0;
+  unsigned long pages = 0;
+  int n = fscanf(file, "%lu %lu", &size, &pages);
+  fclose(file);
+  return n == 2 ? (size_t)pages * (size_t)sysconf(_SC_PAGESIZE) : 0;
+}
+
+static int idle_peers[IDLE_CONNS];
+
+/* Opens IDLE_CONNS connections that each served one request, or
+ * exchanged one message after a websocket upgrade, and went idle.
+ * Returns the resident bytes they took per connection, the table being
+ * resident already. */
+static size_t open_idle(bool websocket, size_t *heap) {
+  if (!server_setup(NULL)) return SIZE_MAX;
+
+  const char *get = "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n";
+  const char *upgrade =
+      "GET /ws HTTP/1.1\r\nHost: example.com\r\nUpgrade: websocket\r\n"
+      "Connection: Upgrade\r\nSec-WebSocket-Version: 13\r\n"
+      "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n\r\n";
+  /* a masked "ping" text frame */
+  const char frame[] = "\x81\x84\x01\x02\x03\x04qkmc";
+  static char response[1024];
+
+  size_t before = resident();
+  count_start();
+  for (int i = 0; i < IDLE_CONNS; i++) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return SIZE_MAX;
+    idle_peers[i] = fds[1];
+    tw_conn *conn = server_add_conn(fds[0]);
+
+    const char *raw = websocket ? upgrade : get;
+    send(fds[1], raw, strlen(raw), 0);
+    if (!tw__conn_serve(conn, handle_request)) return SIZE_MAX;
+    if (websocket) {
+      if (conn->ws == NULL) return SIZE_MAX;
+      send(fds[1], frame, sizeof(frame) - 1, 0);
+      if (!tw__ws_on_ready(conn->ws, POLLIN)) return SIZE_MAX;
+    }
+    recv(fds[1], response, sizeof(response), 0);
+  }
+  *heap = live;
+  count_stop();
+  return (resident() - before) / IDLE_CONNS;
+}
+
+static void close_idle(void) {
+  for (int i = server.num_listeners; i < server.nfds; i++) {
+    tw_conn_close(&server.conns[i]);
+    close(idle_peers[i]);
+  }
+  tw_server_stop(&server);
+}
+
+static int test_tw_alloc_idle(void) {
+  TEST_BEGIN();
+
+  size_t slot = sizeof(tw_conn) + sizeof(struct pollfd);
+  printf("connection slot: %zu bytes\n", slot);
+  ASSERT(slot <= SLOT_BUDGET);
+
+  size_t heap = 0;
+  size_t rss = open_idle(false, &heap);
+  printf("idle keep-alive: %zu bytes resident, %zu on the heap\n", rss,
+         heap / IDLE_CONNS);
+  ASSERT(rss <= IDLE_RSS_BUDGET);
+  /* what is left is shared by every connection */
+  ASSERT(heap <= server.buffers.idle);
+  close_idle();
+
+  rss = open_idle(true, &heap);
+  printf("idle websocket: %zu bytes resident, %zu on the heap\n", rss,
+         heap / IDLE_CONNS);
+  ASSERT((heap - server.buffers.idle) / IDLE_CONNS <= IDLE_WS_HEAP_BUDGET);
+  ASSERT(rss <= IDLE_RSS_BUDGET + IDLE_WS_HEAP_BUDGET);
+  close_idle();
+
+  TEST_END();
+}
+#endif
+
+int main(void) {
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__)
+  RUN_TEST(test_tw_alloc_get);
+  RUN_TEST(test_tw_alloc_post);
+  RUN_TEST(test_tw_alloc_stack);
+  RUN_TEST(test_tw_alloc_idle);
+#endif
+
+  return test_summary();
+}
@@ -0,0 +1,168 @@
+#include <assert.h>
+
+#include "test.h"
+
+#define TW_ENABLE_CLIENT
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+
+/* Sends count requests and reads the responses from raw, as if an
+ * upstream had answered with it and then closed the connection. */
+static tw__client_result exchange(const char *raw,
+                                  const tw_client_request *reqs,
+                                  tw_client_response *res, size_t count,
+                                  size_t *answered) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    return TW__CLIENT_FAILED;
+  }
+  send(fds[1], raw, strlen(raw), 0);
+  shutdown(fds[1], SHUT_WR);
+
+  static tw_client client;
+  memset(&client, 0, sizeof(client));
+  snprintf(client.host, sizeof(client.host), "upstream");
+  client.timeout = 1000;
+
+  tw__client_conn c;
+  memset(&c, 0, sizeof(c));
+  c.fd = fds[0];
+  tw__set_nonblocking(c.fd);
+  for (size_t i = 0; i < count; i++) {
+    tw__client_response_init(&res[i]);
+    tw__client_serialize(&client, &reqs[i], &c.out, &c.out_len);
+  }
+
+  tw__client_result result =
+      tw__client_exchange(&client, &c, reqs, res, count, answered);
+  tw__client_conn_free(&c);
+  close(fds[0]);
+  close(fds[1]);
+  return result;
+}
+
+static int test_tw_client_serialize(void) {
+  TEST_BEGIN();
+
+  tw_client client;
+  memset(&client, 0, sizeof(client));
+  snprintf(client.host, sizeof(client.host), "127.0.0.1:8080");
+
+  tw_map headers;
+  tw_map_init(&headers);
+  tw_map_set(&headers, "X-Trace", "abc");
+
+  tw_client_request req = {0};
+  req.method = "POST";
+  req.path = "/items?id=1";
+  req.headers = &headers;
+  req.body = "hello";
+  req.body_len = 5;
+
+  char *out = NULL;
+  size_t out_len = 0;
+  ASSERT(tw__client_serialize(&client, &req, &out, &out_len));
+
+  /* the server side parser reads back what the client wrote */
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  send(fds[1], out, out_len, 0);
+  close(fds[1]);
+
+  static tw_conn conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.fd = fds[0];
+  static tw_request parsed;
+  tw_request_init(&parsed);
+  ASSERT(tw_request_parse(&conn, &parsed) == TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!strcmp(parsed.method, "POST"));
+  ASSERT(!strcmp(parsed.path, "/items"));
+  ASSERT(!strcmp(parsed.query, "id=1"));
+  ASSERT(!strcmp(tw_request_get_header(&parsed, "Host"), "127.0.0.1:8080"));
+  ASSERT(!strcmp(tw_request_get_header(&parsed, "X-Trace"), "abc"));
+  ASSERT(parsed.body_len == 5 && !memcmp(parsed.body, "hello", 5));
+  tw_request_free(&parsed);
+  tw_conn_close(&conn);
+
+  free(out);
+  tw_map_free(&headers);
+
+  TEST_END();
+}
+
+static int test_tw_client_pipelined(void) {
+  TEST_BEGIN();
+
+  tw_client_request reqs[4] = {{0}};
+  reqs[2].method = "HEAD";
+  tw_client_response res[4];
+  size_t answered = 0;
+
+  ASSERT(exchange("HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nfirst"
+                  "HTTP/1.1 100 Continue\r\n\r\n"
+                  "HTTP/1.1 201 Created\r\nTransfer-Encoding: chunked\r\n"
+                  "X-Id: 7\r\n\r\n"
+                  "3;ext=1\r\nsec\r\n3\r\nond\r\n0\r\nTrailer: x\r\n\r\n"
+                  "HTTP/1.1 200 OK\r\nContent-Length: 9\r\n\r\n"
+                  "HTTP/1.1 204 No Content\r\n\r\n",
+                  reqs, res, 4, &answered) == TW__CLIENT_OK);
+  ASSERT(answered == 4);
+
+  ASSERT(res[0].status == 200 && res[0].keep_alive);
+  ASSERT(res[0].body_len == 5 && !strcmp(res[0].body, "first"));
+
+  /* the interim response is skipped */
+  ASSERT(res[1].status == 201);
+  ASSERT(!strcmp(tw_client_response_get_header(&res[1], "x-id"), "7"));
+  ASSERT(res[1].body_len == 6 && !strcmp(res[1].body, "second"));
+
+  /* a response to HEAD has no body whatever its length says */
+  ASSERT(res[2].status == 200 && res[2].body_len == 0);
+  ASSERT(res[3].status == 204 && res[3].body_len == 0);
+
+  for (size_t i = 0; i < answered; i++) {
+    tw_client_response_free(&res[i]);
+  }
+
+  TEST_END();
+}
+
+static int test_tw_client_close(void) {
+  TEST_BEGIN();
+
+  tw_client_request reqs[2] = {{0}};
+  tw_client_response res[2];
+  size_t answered = 0;
+
+  /* the second request was never served and may be sent again */
+  ASSERT(exchange("HTTP/1.1 200 OK\r\nContent-Length: 2\r\n"
+                  "Connection: close\r\n\r\nok",
+                  reqs, res, 2, &answered) == TW__CLIENT_CLOSED);
+  ASSERT(answered == 1 && !res[0].keep_alive);
+  tw_client_response_free(&res[0]);
+
+  /* without a length the body ends with the connection */
+  ASSERT(exchange("HTTP/1.0 200 OK\r\n\r\nuntil the end", reqs, res, 1,
+                  &answered) == TW__CLIENT_OK);
+  ASSERT(answered == 1 && !res[0].keep_alive);
+  ASSERT(!strcmp(res[0].body, "until the end"));
+  tw_client_response_free(&res[0]);
+
+  ASSERT(exchange("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort",
+                  reqs, res, 1, &answered) == TW__CLIENT_FAILED);
+  tw_client_response_free(&res[0]);
+
+  ASSERT(exchange("HTTP/1.1 2x0 OK\r\n\r\n", reqs, res, 1, &answered) ==
+         TW__CLIENT_FAILED);
+  tw_client_response_free(&res[0]);
+
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_client_serialize);
+  RUN_TEST(test_tw_client_pipelined);
+  RUN_TEST(test_tw_client_close);
+
+  return test_summary();
+}
@@ -0,0 +1,186 @@
+#include <assert.h>
+
+#include "test.h"
+
+#define TW_ENABLE_COMPRESSION
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+
+static int test_tw_parse_accept_encoding(void) {
+  TEST_BEGIN();
+
+  ASSERT(tw_parse_accept_encoding(NULL) == TW_ENCODING_IDENTITY);
+  ASSERT(tw_parse_accept_encoding("") == TW_ENCODING_IDENTITY);
+  ASSERT(tw_parse_accept_encoding("gzip") == TW_ENCODING_GZIP);
+  ASSERT(tw_parse_accept_encoding("gzip, deflate, br") ==
+         (TW_ENCODING_GZIP | TW_ENCODING_DEFLATE));
+  ASSERT(tw_parse_accept_encoding("GZIP;q=0.5, identity") == TW_ENCODING_GZIP);
+  ASSERT(tw_parse_accept_encoding("gzip;q=0, deflate") == TW_ENCODING_DEFLATE);
+  ASSERT(tw_parse_accept_encoding("*") ==
+         (TW_ENCODING_GZIP | TW_ENCODING_DEFLATE));
+  ASSERT(tw_parse_accept_encoding("*, gzip;q=0") == TW_ENCODING_DEFLATE);
+  ASSERT(tw_parse_accept_encoding("br, zstd") == TW_ENCODING_IDENTITY);
+
+  TEST_END();
+}
+
+static bool inflate_body(tw_encoding encoding, const char *src, size_t len,
+                         char *out, size_t out_cap, size_t *out_len) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (inflateInit2(&stream, encoding == TW_ENCODING_GZIP ? 31 : 15) != Z_OK) {
+    return false;
+  }
+  stream.next_in = (Bytef *)src;
+  stream.avail_in = (uInt)len;
+  stream.next_out = (Bytef *)out;
+  stream.avail_out = (uInt)out_cap;
+  int ret = inflate(&stream, Z_FINISH);
+  *out_len = stream.total_out;
+  inflateEnd(&stream);
+  return ret == Z_STREAM_END;
+}
+
+static int test_tw_compress_roundtrip(void) {
+  TEST_BEGIN();
+
+  char body[4096];
+  for (size_t i = 0; i < sizeof(body); i++) {
+    body[i] = "{\"id\": 1, \"name\": \"thinwire\"}"[i % 30];
+  }
+
+  tw_encoding encodings[] = {TW_ENCODING_GZIP, TW_ENCODING_DEFLATE};
+  for (size_t i = 0; i < 2; i++) {
+    char *out = NULL;
+    size_t out_len = 0;
+    ASSERT(tw_compress(encodings[i], Z_DEFAULT_COMPRESSION, body,
+                       sizeof(body), &out, &out_len));
+    ASSERT(out_len > 0 && out_len < sizeof(body));
+
+    char plain[sizeof(body)];
+    size_t plain_len = 0;
+    ASSERT(inflate_body(encodings[i], out, out_len, plain, sizeof(plain),
+                        &plain_len));
+    ASSERT(plain_len == sizeof(body));
+    ASSERT(memcmp(plain, body, sizeof(body)) == 0);
+    free(out);
+  }
+
+  TEST_END();
+}
+
+static int test_tw_compression_cache(void) {
+  TEST_BEGIN();
+
+  tw_compression_cache cache;
+  tw_compression_cache_init(&cache);
+
+  const char *a = "aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+  const char *b = "bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb";
+
+  const tw_compression_cache_entry *first = tw_compression_cache_get(
+      &cache, TW_ENCODING_GZIP, a, strlen(a), Z_DEFAULT_COMPRESSION);
+  ASSERT(first != NULL);
+
+  /* same body from a different buffer hits the cached variant */
+  char copy[64];
+  strcpy(copy, a);
+  const tw_compression_cache_entry *again = tw_compression_cache_get(
+      &cache, TW_ENCODING_GZIP, copy, strlen(copy), Z_DEFAULT_COMPRESSION);
+  ASSERT(again == first);
+
+  /* encodings and bodies are cached separately */
+  const tw_compression_cache_entry *deflated = tw_compression_cache_get(
+      &cache, TW_ENCODING_DEFLATE, a, strlen(a), Z_DEFAULT_COMPRESSION);
+  ASSERT(deflated != NULL && deflated != first);
+  const tw_compression_cache_entry *other = tw_compression_cache_get(
+      &cache, TW_ENCODING_GZIP, b, strlen(b), Z_DEFAULT_COMPRESSION);
+  ASSERT(other != NULL && other != first && other != deflated);
+
+  /* and levels */
+  const tw_compression_cache_entry *fast = tw_compression_cache_get(
+      &cache, TW_ENCODING_GZIP, a, strlen(a), Z_BEST_SPEED);
+  ASSERT(fast != NULL && fast != first && fast != other);
+
+  /* a body whose hash collides with a cached one is not served its
+   * variant */
+  const char *c = "cccccccccccccccccccccccccccccccccccccccccccccccccccccccc";
+  ((tw_compression_cache_entry *)other)->hash = tw__hash(c, strlen(c));
+  const tw_compression_cache_entry *collided = tw_compression_cache_get(
+      &cache, TW_ENCODING_GZIP, c, strlen(c), Z_DEFAULT_COMPRESSION);
+  ASSERT(collided != NULL && collided != other);
+  ASSERT(memcmp(collided->body, c, strlen(c)) == 0);
+
+  tw_compression_cache_free(&cache);
+  TEST_END();
+}
+
+/* Compresses a text body for a gzip client the way tw_response_send
+ * does, with the headers the handler set. Returns whether it did. */
+static bool compress_response(tw_response *res, const char *name,
+                              const char *value) {
+  static tw_server server;
+  memset(&server, 0, sizeof(server));
+  tw_compression_config_init(&server.compression);
+  server.compression.enabled = true;
+  server.compression.cache = false;
+  static tw_conn conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.server = &server;
+
+  static char text[4096];
+  memset(text, 'a', sizeof(text));
+  tw_response_init(res);
+  tw_response_set_header(res, "Content-Type", "text/plain");
+  if (name != NULL) tw_response_set_header(res, name, value);
+  tw_response_set_body(res, text, sizeof(text));
+  res->accept_encoding = TW_ENCODING_GZIP;
+
+  const char *body = res->body;
+  size_t body_len = res->body_len;
+  char *owned = NULL;
+  tw__response_compress(&conn, res, &body, &body_len, &owned);
+  free(owned);
+  return owned != NULL;
+}
+
+static int test_tw_response_vary(void) {
+  TEST_BEGIN();
+
+  /* fields the handler varies on are kept */
+  const char *cases[][3] = {
+      {"Vary", "Origin", "Origin, Accept-Encoding"},
+      {"vary", "Origin", "Origin, Accept-Encoding"},
+      {"Vary", "origin , accept-encoding", "origin , accept-encoding"},
+      {"Vary", "*", "*"},
+  };
+  tw_response res;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    ASSERT(compress_response(&res, cases[i][0], cases[i][1]));
+    ASSERT(res.headers.size == 3);
+    const char *vary = tw_map_get(&res.headers, cases[i][0]);
+    ASSERT(vary != NULL && !strcmp(vary, cases[i][2]));
+    tw_response_free(&res);
+  }
+  ASSERT(compress_response(&res, NULL, NULL));
+  const char *vary = tw_map_get(&res.headers, "Vary");
+  ASSERT(vary != NULL && !strcmp(vary, "Accept-Encoding"));
+  tw_response_free(&res);
+
+  /* a body the handler encoded, in whatever case, is not encoded again */
+  ASSERT(!compress_response(&res, "content-encoding", "br"));
+  ASSERT(res.headers.size == 2);
+  ASSERT(tw_map_get(&res.headers, "Content-Encoding") == NULL);
+  tw_response_free(&res);
+
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_parse_accept_encoding);
+  RUN_TEST(test_tw_compress_roundtrip);
+  RUN_TEST(test_tw_compression_cache);
+  RUN_TEST(test_tw_response_vary);
+
+  return test_summary();
+}
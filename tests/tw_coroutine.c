@@ -0,0 +1,115 @@
+#include <assert.h>
+
+#include "test.h"
+
+#define TW_ENABLE_COROUTINES
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+#include "server.h"
+
+/* the client side of the connection whose handler is suspended */
+static int upload_peer;
+static tw_request_parse_result upload_result;
+static char upload_body[32];
+
+static bool setup(int drain_timeout) {
+  tw_server_config config;
+  tw_server_config_init(&config);
+  config.drain_timeout = drain_timeout;
+  return server_setup(&config);
+}
+
+static void handle_request(tw_conn *conn, tw_request *req, tw_response *res) {
+  if (strcmp(req->path, "/upload") == 0) {
+    /* waits for the rest of the body instead of failing */
+    upload_result = tw_request_parse_body(conn, req);
+    if (upload_result == TW_REQUEST_PARSE_SUCCESS) {
+      snprintf(upload_body, sizeof(upload_body), "%s", req->body);
+    }
+    tw_response_set_status(res, 200);
+    tw_response_set_body(res, req->body, req->body_len);
+  } else if (strcmp(req->path, "/finish") == 0) {
+    send(upload_peer, "world", 5, 0);
+    tw_server_drain(conn->server);
+    tw_response_set_status(res, 204);
+  } else if (strcmp(req->path, "/abandon") == 0) {
+    tw_server_drain(conn->server);
+    upload_result = tw_request_parse_body(conn, req);
+    tw_response_set_status(res, 400);
+  }
+  tw_response_send(conn, res);
+}
+
+static int test_tw_coro_suspend(void) {
+  TEST_BEGIN();
+
+  ASSERT(setup(0));
+  int upload[2], finish[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, upload) == 0);
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, finish) == 0);
+  upload_peer = upload[1];
+  upload_result = TW_REQUEST_PARSE_BLOCK;
+
+  const char *head =
+      "POST /upload HTTP/1.1\r\nContent-Length: 10\r\n"
+      "Connection: close\r\n\r\nhello";
+  send(upload[1], head, strlen(head), 0);
+  const char *other = "GET /finish HTTP/1.1\r\nConnection: close\r\n\r\n";
+  send(finish[1], other, strlen(other), 0);
+  server_add_conn(upload[0]);
+  server_add_conn(finish[0]);
+
+  /* the upload handler is suspended while the other one runs and sends
+   * the rest of its body */
+  ASSERT(tw_server_run(&server, handle_request));
+  ASSERT(upload_result == TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!strcmp(upload_body, "helloworld"));
+
+  char response[256];
+  ssize_t n = recv(upload[1], response, sizeof(response) - 1, 0);
+  ASSERT(n > 0);
+  response[n > 0 ? n : 0] = '\0';
+  ASSERT(strncmp(response, "HTTP/1.1 200", 12) == 0);
+  ASSERT(strstr(response, "\r\n\r\nhelloworld") != NULL);
+
+  /* both stacks went back to the pool */
+  ASSERT(server.coro_pooled == 2);
+  tw_server_stop(&server);
+  ASSERT(server.coro_pool == NULL);
+
+  close(upload[1]);
+  close(finish[1]);
+
+  TEST_END();
+}
+
+static int test_tw_coro_cancel(void) {
+  TEST_BEGIN();
+
+  ASSERT(setup(50));
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  upload_result = TW_REQUEST_PARSE_BLOCK;
+
+  const char *head = "POST /abandon HTTP/1.1\r\nContent-Length: 10\r\n\r\nhel";
+  send(fds[1], head, strlen(head), 0);
+  server_add_conn(fds[0]);
+
+  /* the drain timeout closes the connection under the suspended handler,
+   * which then sees its read fail */
+  ASSERT(tw_server_run(&server, handle_request));
+  ASSERT(upload_result == TW_REQUEST_PARSE_ERROR);
+  ASSERT(server.coro_pooled == 1);
+  tw_server_stop(&server);
+
+  close(fds[1]);
+
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_coro_suspend);
+  RUN_TEST(test_tw_coro_cancel);
+
+  return test_summary();
+}
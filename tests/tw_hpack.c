@@ -0,0 +1,193 @@
+#include <assert.h>
+
+#include "test.h"
+
+#define TW_ENABLE_HTTP2
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+#include "server.h"
+
+static size_t from_hex(const char *hex, uint8_t *out) {
+  size_t n = 0;
+  for (; hex[0] && hex[1]; hex += 2) {
+    unsigned int byte;
+    sscanf(hex, "%2x", &byte);
+    out[n++] = (uint8_t)byte;
+  }
+  return n;
+}
+
+static int test_tw_hpack_huffman_decode(void) {
+  TEST_BEGIN();
+
+  /* RFC 7541 C.4.1 */
+  uint8_t src[32];
+  size_t len = from_hex("f1e3c2e5f23a6ba0ab90f4ff", src);
+
+  char dst[64];
+  size_t dst_len = 0;
+  ASSERT(tw_hpack_huffman_decode(src, len, dst, &dst_len));
+  ASSERT(dst_len == strlen("www.example.com"));
+  ASSERT(memcmp(dst, "www.example.com", dst_len) == 0);
+
+  /* padding longer than 7 bits is invalid */
+  len = from_hex("f1e3c2e5f23a6ba0ab90f4ffff", src);
+  ASSERT(!tw_hpack_huffman_decode(src, len, dst, &dst_len));
+
+  TEST_END();
+}
+
+static int test_tw_hpack_decode_requests(void) {
+  TEST_BEGIN();
+
+  tw_hpack_table table;
+  ASSERT(tw_hpack_table_init(&table, 4096));
+
+  /* RFC 7541 C.4, three requests sharing one dynamic table */
+  uint8_t src[64];
+  size_t len = from_hex("828684418cf1e3c2e5f23a6ba0ab90f4ff", src);
+
+  tw_map headers;
+  ASSERT(tw_map_init(&headers));
+  ASSERT(tw_hpack_decode(&table, src, len, &headers));
+  ASSERT(!strcmp(tw_map_get(&headers, ":method"), "GET"));
+  ASSERT(!strcmp(tw_map_get(&headers, ":scheme"), "http"));
+  ASSERT(!strcmp(tw_map_get(&headers, ":path"), "/"));
+  ASSERT(!strcmp(tw_map_get(&headers, ":authority"), "www.example.com"));
+  ASSERT(table.size == 57);
+  tw_map_free(&headers);
+
+  len = from_hex("828684be5886a8eb10649cbf", src);
+  ASSERT(tw_map_init(&headers));
+  ASSERT(tw_hpack_decode(&table, src, len, &headers));
+  ASSERT(!strcmp(tw_map_get(&headers, ":authority"), "www.example.com"));
+  ASSERT(!strcmp(tw_map_get(&headers, "cache-control"), "no-cache"));
+  ASSERT(table.size == 110);
+  tw_map_free(&headers);
+
+  len = from_hex("828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf", src);
+  ASSERT(tw_map_init(&headers));
+  ASSERT(tw_hpack_decode(&table, src, len, &headers));
+  ASSERT(!strcmp(tw_map_get(&headers, ":scheme"), "https"));
+  ASSERT(!strcmp(tw_map_get(&headers, ":path"), "/index.html"));
+  ASSERT(!strcmp(tw_map_get(&headers, "custom-key"), "custom-value"));
+  ASSERT(table.size == 164);
+  tw_map_free(&headers);
+
+  tw_hpack_table_free(&table);
+  TEST_END();
+}
+
+static int test_tw_hpack_decode_eviction(void) {
+  TEST_BEGIN();
+
+  /* a 64 byte table only has room for one of the two entries */
+  tw_hpack_table table;
+  ASSERT(tw_hpack_table_init(&table, 64));
+
+  uint8_t src[64];
+  size_t len = from_hex("400161017840016201794003636363017a", src);
+
+  tw_map headers;
+  ASSERT(tw_map_init(&headers));
+  ASSERT(tw_hpack_decode(&table, src, len, &headers));
+  ASSERT(table.count == 1);
+  ASSERT(!strcmp(tw_map_get(&headers, "ccc"), "z"));
+  tw_map_free(&headers);
+
+  /* index 63 no longer exists */
+  len = from_hex("bf", src);
+  ASSERT(tw_map_init(&headers));
+  ASSERT(!tw_hpack_decode(&table, src, len, &headers));
+  tw_map_free(&headers);
+
+  tw_hpack_table_free(&table);
+  TEST_END();
+}
+
+static int test_tw_hpack_decode_invalid(void) {
+  TEST_BEGIN();
+
+  tw_hpack_table table;
+  ASSERT(tw_hpack_table_init(&table, 4096));
+
+  tw_map headers;
+  ASSERT(tw_map_init(&headers));
+
+  uint8_t src[16];
+  /* index 0 */
+  size_t len = from_hex("80", src);
+  ASSERT(!tw_hpack_decode(&table, src, len, &headers));
+  /* string longer than the block */
+  len = from_hex("400a61", src);
+  ASSERT(!tw_hpack_decode(&table, src, len, &headers));
+  /* table size update above the limit */
+  len = from_hex("3fe21f", src);
+  ASSERT(!tw_hpack_decode(&table, src, len, &headers));
+
+  tw_map_free(&headers);
+  tw_hpack_table_free(&table);
+  TEST_END();
+}
+
+static int test_tw_h2_ping_flood(void) {
+  TEST_BEGIN();
+
+  ASSERT(server_setup(NULL));
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  tw_conn *conn = server_add_conn(fds[0]);
+  tw__set_nonblocking(fds[1]);
+  conn->h2 = tw__h2_session_new();
+  ASSERT(conn->h2 != NULL);
+
+  /* a client that sends PINGs and never reads the acks */
+  static char pings[1024 * 17];
+  for (size_t i = 0; i < sizeof(pings); i += 17) {
+    memcpy(pings + i, "\0\0\x08\x06\0\0\0\0\0" "12345678", 17);
+  }
+  send(fds[1], tw__h2_preface, 24, 0);
+  bool open = true;
+  for (int i = 0; i < 1000 && open && !conn->h2->closing; i++) {
+    send(fds[1], pings, sizeof(pings), 0);
+    open = tw__h2_on_ready(conn, POLLIN, NULL);
+    /* the queue stays bounded whether or not it is polled for input */
+    ASSERT(conn->h2->out_len - conn->h2->out_off <=
+           TW_OUTPUT_HIGH_WATER + sizeof(conn->h2->in));
+  }
+  ASSERT(conn->h2->closing);
+
+  /* it is told why once it reads */
+  static char out[64 * 1024];
+  uint8_t last[17];
+  size_t total = 0;
+  ssize_t n;
+  while ((n = recv(fds[1], out, sizeof(out), 0)) > 0) {
+    /* keep the last 17 bytes read */
+    size_t keep = (size_t)n < sizeof(last) ? sizeof(last) - (size_t)n : 0;
+    memmove(last, last + sizeof(last) - keep, keep);
+    memcpy(last + keep, out + (size_t)n - (sizeof(last) - keep),
+           sizeof(last) - keep);
+    total += (size_t)n;
+    tw__h2_on_ready(conn, POLLOUT, NULL);
+  }
+  ASSERT(total >= sizeof(last) && conn->h2->out_len == 0);
+  /* GOAWAY is the last frame */
+  ASSERT(last[3] == TW_H2_GOAWAY);
+  ASSERT(tw__h2_get32(last + 13) == TW_H2_ENHANCE_YOUR_CALM);
+
+  tw_conn_close(conn);
+  close(fds[1]);
+  tw_server_stop(&server);
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_hpack_huffman_decode);
+  RUN_TEST(test_tw_hpack_decode_requests);
+  RUN_TEST(test_tw_hpack_decode_eviction);
+  RUN_TEST(test_tw_hpack_decode_invalid);
+  RUN_TEST(test_tw_h2_ping_flood);
+
+  return test_summary();
+}
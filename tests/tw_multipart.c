@@ -0,0 +1,271 @@
+#include <assert.h>
+
+#include "test.h"
+
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+
+#define CONTENT_TYPE "multipart/form-data; boundary=\"xyz\""
+
+/* a preamble, a field, a file whose data almost holds the delimiter and
+ * an epilogue */
+static const char body[] =
+    "ignored preamble\r\n"
+    "--xyz\r\n"
+    "Content-Disposition: form-data; name=\"title\"\r\n"
+    "\r\n"
+    "hello\r\n"
+    "--xyz  \r\n"
+    "content-disposition: form-data; name=upload; "
+    "filename=\"a \\\"b\\\".txt\"\r\n"
+    "Content-Type: text/plain\r\n"
+    "\r\n"
+    "line\r\n--xy\r\n-\r\n\r\n-x--xyz\r\n"
+    "--xyz--\r\n"
+    "ignored epilogue";
+
+static const char parsed[] =
+    "[title||]hello;"
+    "[upload|a \"b\".txt|text/plain]line\r\n--xy\r\n-\r\n\r\n-x--xyz;";
+
+/* what the callbacks saw, parts as "[name|filename|type]data;" */
+static char seen[1024];
+static size_t seen_len;
+/* the data callback fails after this many bytes when set */
+static size_t abort_after;
+
+static bool on_part(tw_multipart *mp, const tw_multipart_part *part) {
+  (void)mp;
+  seen_len += snprintf(seen + seen_len, sizeof(seen) - seen_len,
+                       "[%s|%s|%s]", part->name ? part->name : "",
+                       part->filename ? part->filename : "",
+                       part->content_type ? part->content_type : "");
+  if (mp->data != NULL && part->filename != NULL) {
+    tw_multipart_spool(mp, *(int *)mp->data);
+  }
+  return true;
+}
+
+static bool on_data(tw_multipart *mp, const char *data, size_t len) {
+  (void)mp;
+  if (abort_after > 0 && seen_len + len > abort_after) return false;
+  if (seen_len + len < sizeof(seen)) {
+    memcpy(seen + seen_len, data, len);
+    seen_len += len;
+    seen[seen_len] = '\0';
+  }
+  return true;
+}
+
+static bool on_part_end(tw_multipart *mp) {
+  (void)mp;
+  seen_len += snprintf(seen + seen_len, sizeof(seen) - seen_len, ";");
+  return true;
+}
+
+static bool init(tw_multipart *mp, const char *content_type) {
+  seen[0] = '\0';
+  seen_len = 0;
+  if (!tw_multipart_init(mp, content_type)) return false;
+  mp->on_part = on_part;
+  mp->on_data = on_data;
+  mp->on_part_end = on_part_end;
+  return true;
+}
+
+static int test_tw_multipart_init(void) {
+  TEST_BEGIN();
+
+  static tw_multipart mp;
+  ASSERT(tw_multipart_init(&mp, CONTENT_TYPE));
+  ASSERT(mp.delimiter_len == 7 && !memcmp(mp.delimiter, "\r\n--xyz", 7));
+  ASSERT(tw_multipart_init(&mp, "Multipart/Mixed;charset=x; Boundary=a-b"));
+  ASSERT(mp.delimiter_len == 7 && !memcmp(mp.delimiter, "\r\n--a-b", 7));
+
+  ASSERT(!tw_multipart_init(&mp, NULL));
+  ASSERT(!tw_multipart_init(&mp, "text/plain; boundary=xyz"));
+  ASSERT(!tw_multipart_init(&mp, "multipart/form-data"));
+  ASSERT(!tw_multipart_init(&mp, "multipart/form-data; boundary="));
+  ASSERT(!tw_multipart_init(&mp, "multipart/form-data; boundary=\"a "));
+  ASSERT(!tw_multipart_init(&mp, "multipart/form-data; boundary=\"a \""));
+  ASSERT(!tw_multipart_init(&mp,
+                            "multipart/form-data; boundary="
+                            "0123456789012345678901234567890123456789"
+                            "0123456789012345678901234567890"));
+
+  TEST_END();
+}
+
+static int test_tw_multipart_feed(void) {
+  TEST_BEGIN();
+
+  static tw_multipart mp;
+  size_t len = strlen(body);
+  ASSERT(init(&mp, CONTENT_TYPE));
+  ASSERT(tw_multipart_feed(&mp, body, len));
+  ASSERT(tw_multipart_done(&mp));
+  ASSERT(!strcmp(seen, parsed));
+
+  /* the same parts whichever way the body is split */
+  for (size_t step = 1; step < 24; step++) {
+    ASSERT(init(&mp, CONTENT_TYPE));
+    bool ok = true;
+    for (size_t pos = 0; pos < len; pos += step) {
+      ok = ok && tw_multipart_feed(&mp, body + pos,
+                                   pos + step < len ? step : len - pos);
+    }
+    ASSERT(ok && tw_multipart_done(&mp));
+    ASSERT(!strcmp(seen, parsed));
+  }
+
+  TEST_END();
+}
+
+static int test_tw_multipart_malformed(void) {
+  TEST_BEGIN();
+
+  static tw_multipart mp;
+  ASSERT(init(&mp, CONTENT_TYPE));
+  const char *bad = "--xyz\r\n\r\nab\r\n--xyzzy";
+  ASSERT(!tw_multipart_feed(&mp, bad, strlen(bad)));
+  ASSERT(!tw_multipart_done(&mp));
+  ASSERT(!tw_multipart_feed(&mp, "\r\n--xyz--", 9));
+
+  ASSERT(init(&mp, CONTENT_TYPE));
+  ASSERT(!tw_multipart_feed(&mp, "--xyz-\r\n", 8));
+
+  /* a part head past TW_MULTIPART_MAX_HEAD */
+  ASSERT(init(&mp, CONTENT_TYPE));
+  ASSERT(tw_multipart_feed(&mp, "--xyz\r\n", 7));
+  static char header[TW_MULTIPART_MAX_HEAD];
+  memset(header, 'a', sizeof(header));
+  ASSERT(!tw_multipart_feed(&mp, header, sizeof(header)));
+
+  /* the body ends before the closing delimiter */
+  ASSERT(init(&mp, CONTENT_TYPE));
+  ASSERT(tw_multipart_feed(&mp, "--xyz\r\n\r\ndata\r\n--xy", 19));
+  ASSERT(!tw_multipart_done(&mp));
+
+  TEST_END();
+}
+
+/* Sends raw on a nonblocking connection and parses the head. */
+static bool start(tw_conn *conn, tw_request *req, int fds[2],
+                  const char *raw) {
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return false;
+  send(fds[1], raw, strlen(raw), 0);
+  memset(conn, 0, sizeof(*conn));
+  conn->fd = fds[0];
+  tw__set_nonblocking(conn->fd);
+  tw_request_init(req);
+  return tw_request_parse(conn, req) == TW_REQUEST_PARSE_SUCCESS;
+}
+
+static int test_tw_request_parse_multipart(void) {
+  TEST_BEGIN();
+
+  char head[256];
+  snprintf(head, sizeof(head),
+           "POST /upload HTTP/1.1\r\nContent-Type: " CONTENT_TYPE "\r\n"
+           "Content-Length: %zu\r\n\r\n%.40s",
+           strlen(body), body);
+
+  static tw_conn conn;
+  static tw_request req;
+  static tw_multipart mp;
+  int fds[2];
+  ASSERT(start(&conn, &req, fds, head));
+  ASSERT(req.body_len == 40);
+  const char *content_type =
+      tw_request_get_known_header(&req, TW_HEADER_CONTENT_TYPE);
+  ASSERT(init(&mp, content_type));
+
+  /* the file goes to disk, only the field is seen in memory */
+  char path[] = "/tmp/tw_multipart_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT(fd >= 0);
+  mp.data = &fd;
+
+  ASSERT(tw_request_parse_multipart(&conn, &req, &mp) ==
+         TW_REQUEST_PARSE_BLOCK);
+  ASSERT(req.body == NULL);
+  send(fds[1], body + 40, strlen(body) - 40, 0);
+  send(fds[1], "GET / HTTP/1.1\r\n\r\n", 18, 0);
+  ASSERT(tw_request_parse_multipart(&conn, &req, &mp) ==
+         TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!strcmp(seen, "[title||]hello;[upload|a \"b\".txt|text/plain];"));
+
+  char spooled[64] = {0};
+  const char *file = "line\r\n--xy\r\n-\r\n\r\n-x--xyz";
+  ssize_t spooled_len = pread(fd, spooled, sizeof(spooled) - 1, 0);
+  ASSERT(spooled_len == (ssize_t)strlen(file));
+  ASSERT(!strcmp(spooled, file));
+  close(fd);
+  unlink(path);
+
+  /* the next request starts right after the body */
+  tw_request_free(&req);
+  tw_request_init(&req);
+  ASSERT(tw_request_parse(&conn, &req) == TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!strcmp(req.method, "GET"));
+  tw_request_free(&req);
+  tw_conn_close(&conn);
+  close(fds[1]);
+
+  TEST_END();
+}
+
+static int test_tw_request_parse_multipart_errors(void) {
+  TEST_BEGIN();
+
+  static tw_conn conn;
+  static tw_request req;
+  static tw_multipart mp;
+  int fds[2];
+  char raw[1024];
+
+  /* an aborted parse still reads past the body */
+  snprintf(raw, sizeof(raw),
+           "POST / HTTP/1.1\r\nContent-Length: %zu\r\n\r\n%s"
+           "GET /next HTTP/1.1\r\n\r\n",
+           strlen(body), body);
+  ASSERT(start(&conn, &req, fds, raw));
+  ASSERT(init(&mp, CONTENT_TYPE));
+  abort_after = 12;
+  ASSERT(tw_request_parse_multipart(&conn, &req, &mp) ==
+         TW_REQUEST_PARSE_ERROR);
+  abort_after = 0;
+  ASSERT(mp.aborted && !conn.rejected);
+  tw_request_free(&req);
+  tw_request_init(&req);
+  ASSERT(tw_request_parse(&conn, &req) == TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!strcmp(req.path, "/next"));
+  tw_request_free(&req);
+  tw_conn_close(&conn);
+  close(fds[1]);
+
+  /* a malformed one is refused with the body unread */
+  ASSERT(start(&conn, &req, fds,
+               "POST / HTTP/1.1\r\nContent-Length: 30\r\n\r\n--xyz!"));
+  ASSERT(init(&mp, CONTENT_TYPE));
+  ASSERT(tw_request_parse_multipart(&conn, &req, &mp) ==
+         TW_REQUEST_PARSE_REJECTED);
+  ASSERT(conn.rejected);
+  ssize_t n = recv(fds[1], raw, sizeof(raw) - 1, 0);
+  ASSERT(n > 12 && !strncmp(raw, "HTTP/1.1 400", 12));
+  tw_request_free(&req);
+  tw_conn_close(&conn);
+  close(fds[1]);
+
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_multipart_init);
+  RUN_TEST(test_tw_multipart_feed);
+  RUN_TEST(test_tw_multipart_malformed);
+  RUN_TEST(test_tw_request_parse_multipart);
+  RUN_TEST(test_tw_request_parse_multipart_errors);
+
+  return test_summary();
+}
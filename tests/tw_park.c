@@ -0,0 +1,180 @@
+#include <assert.h>
+#include <pthread.h>
+
+#include "test.h"
+
+/* small enough for a test to fall behind */
+#define TW_PARK_MAX_QUEUED 256
+#define TW_ENABLE_PARK
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+#include "server.h"
+
+static tw_parked *handles[4];
+static int num_handles;
+
+static void handle_request(tw_conn *conn, tw_request *req, tw_response *res) {
+  if (strcmp(req->path, "/events") == 0) {
+    handles[num_handles++] = tw_sse_start(conn, res);
+  } else if (strcmp(req->path, "/wait") == 0) {
+    handles[num_handles++] = tw_conn_park(conn, res);
+  } else {
+    tw_response_set_body(res, "now", 3);
+    tw_response_send(conn, res);
+  }
+}
+
+static bool setup(void) {
+  num_handles = 0;
+  return server_setup(NULL) && tw__park_open(&server);
+}
+
+/* Runs the loop over the wakeup and conn as tw_server_run would. */
+static bool pass(tw_conn *conn) {
+  if (poll(server.fds, (nfds_t)server.nfds, 1000) <= 0) return false;
+  if (server.fds[0].revents & POLLIN) {
+    tw__park_dispatch(&server, 0);
+    /* the writes queued go out on the next wakeup */
+    poll(server.fds, (nfds_t)server.nfds, 0);
+  }
+  struct pollfd *fd = &server.fds[conn - server.conns];
+  if (conn->parked == NULL || fd->revents == 0) return true;
+  if (!tw__park_on_ready(conn, fd->revents)) return false;
+  fd->events = tw__conn_events(conn);
+  return true;
+}
+
+static ssize_t receive(int fd, char *buf, size_t size) {
+  ssize_t n = recv(fd, buf, size - 1, MSG_DONTWAIT);
+  buf[n > 0 ? n : 0] = '\0';
+  return n;
+}
+
+static void *respond(void *parked) {
+  tw_response res;
+  tw_response_init(&res);
+  tw_response_set_body(&res, "later", 5);
+  tw_parked_respond((tw_parked *)parked, &res);
+  tw_response_free(&res);
+  return NULL;
+}
+
+static int test_tw_park_respond(void) {
+  TEST_BEGIN();
+
+  ASSERT(setup());
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  tw_conn *conn = server_add_conn(fds[0]);
+
+  /* the handler returns without an answer */
+  const char *raw = "GET /wait HTTP/1.1\r\n\r\nGET /next HTTP/1.1\r\n\r\n";
+  send(fds[1], raw, strlen(raw), 0);
+  ASSERT(tw__conn_serve(conn, handle_request));
+  ASSERT(num_handles == 1 && conn->parked == handles[0]);
+  static char buf[1024];
+  ASSERT(receive(fds[1], buf, sizeof(buf)) < 0);
+
+  /* another thread answers, waking the loop */
+  pthread_t thread;
+  ASSERT(pthread_create(&thread, NULL, respond, handles[0]) == 0);
+  pthread_join(thread, NULL);
+  ASSERT(pass(conn));
+  ASSERT(conn->parked == NULL);
+  ASSERT(receive(fds[1], buf, sizeof(buf)) > 0);
+  ASSERT(strncmp(buf, "HTTP/1.1 200 OK\r\n", 17) == 0);
+  ASSERT(strstr(buf, "Connection: keep-alive\r\n") != NULL);
+  ASSERT(strstr(buf, "\r\n\r\nlater") != NULL);
+
+  /* the handle is done, the pipelined request is served next */
+  ASSERT(!tw_parked_write(handles[0], "x", 1));
+  tw_parked_release(handles[0]);
+  ASSERT(tw__conn_serve(conn, handle_request));
+  ASSERT(receive(fds[1], buf, sizeof(buf)) > 0);
+  ASSERT(strstr(buf, "\r\n\r\nnow") != NULL);
+
+  tw_conn_close(conn);
+  close(fds[1]);
+  tw_server_stop(&server);
+
+  TEST_END();
+}
+
+static int test_tw_sse_broadcast(void) {
+  TEST_BEGIN();
+
+  ASSERT(setup());
+  int peers[3];
+  tw_conn *conns[3];
+  const char *raw = "GET /events HTTP/1.1\r\n\r\n";
+  for (int i = 0; i < 3; i++) {
+    int fds[2];
+    ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    conns[i] = server_add_conn(fds[0]);
+    peers[i] = fds[1];
+    send(peers[i], raw, strlen(raw), 0);
+    ASSERT(tw__conn_serve(conns[i], handle_request));
+  }
+  ASSERT(num_handles == 3);
+
+  ASSERT(tw_sse_broadcast(handles, 3, "tick", "a\nb\r\nc") == 3);
+  ASSERT(tw_sse_send(handles[1], NULL, "only") == true);
+  /* a line break in the type cannot add fields */
+  ASSERT(!tw_sse_send(handles[1], "tick\ndata: forged", "x"));
+  ASSERT(tw_sse_broadcast(handles, 3, "tick\r", "x") == 0);
+  static char buf[1024];
+  for (int i = 0; i < 3; i++) {
+    ASSERT(pass(conns[i]));
+    ASSERT(receive(peers[i], buf, sizeof(buf)) > 0);
+    ASSERT(strncmp(buf, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    ASSERT(strstr(buf, "Content-Type: text/event-stream\r\n") != NULL);
+    ASSERT(strstr(buf, "Content-Length") == NULL);
+    const char *event = strstr(buf, "\r\n\r\n");
+    ASSERT(event != NULL);
+    ASSERT(strcmp(event + 4, i == 1 ? "event: tick\ndata: a\ndata: b\n"
+                                      "data: c\n\ndata: only\n\n"
+                                    : "event: tick\ndata: a\ndata: b\n"
+                                      "data: c\n\n") == 0);
+  }
+
+  /* a client that went away is closed, its handle fails */
+  close(peers[0]);
+  ASSERT(!pass(conns[0]));
+  tw_conn_close(conns[0]);
+  conns[0]->fd = -1;
+  ASSERT(!tw_sse_send(handles[0], NULL, "gone"));
+  ASSERT(tw_sse_broadcast(handles, 3, NULL, "two") == 2);
+
+  /* one that does not read falls behind and is dropped */
+  char big[200];
+  memset(big, 'x', sizeof(big) - 1);
+  big[sizeof(big) - 1] = '\0';
+  ASSERT(tw_sse_send(handles[2], NULL, big));
+  ASSERT(tw_sse_send(handles[2], NULL, big));
+  ASSERT(pass(conns[1]));
+  ASSERT(conns[2]->fd < 0 && conns[2]->parked == NULL);
+  ASSERT(!tw_sse_send(handles[2], NULL, "late"));
+
+  /* closing ends the stream once it was written */
+  ASSERT(tw_parked_close(handles[1]));
+  ASSERT(!tw_sse_send(handles[1], NULL, "late"));
+  ASSERT(!pass(conns[1]));
+  ASSERT(receive(peers[1], buf, sizeof(buf)) > 0);
+  ASSERT(strcmp(buf, "data: two\n\n") == 0);
+
+  for (int i = 0; i < 3; i++) {
+    tw_parked_release(handles[i]);
+    if (conns[i]->fd >= 0) tw_conn_close(conns[i]);
+    if (i > 0) close(peers[i]);
+  }
+  tw_server_stop(&server);
+
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_park_respond);
+  RUN_TEST(test_tw_sse_broadcast);
+
+  return test_summary();
+}
@@ -0,0 +1,198 @@
+#include <assert.h>
+
+#include "test.h"
+
+/* one window over the whole table, so that eviction is predictable */
+#define TW_RATE_LIMIT_SIZE 4
+#define TW_RATE_LIMIT_PROBE 4
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+#include "server.h"
+
+static void handle_request(tw_conn *conn, tw_request *req, tw_response *res) {
+  (void)req;
+  tw_response_set_body(res, "ok", 2);
+  tw_response_send(conn, res);
+}
+
+static bool take(tw_rate_limit *limit, const char *key) {
+  return tw_rate_limit_take(limit, key, strlen(key));
+}
+
+/* Adds a connection as if accepted from 192.0.2.1. */
+static tw_conn *add_conn(int fd) {
+  tw_conn *conn = server_add_conn(fd);
+  struct sockaddr_in *addr = (struct sockaddr_in *)&conn->addr;
+  addr->sin_family = AF_INET;
+  inet_pton(AF_INET, "192.0.2.1", &addr->sin_addr);
+  return conn;
+}
+
+/* Counts the responses with the given status line in a response stream. */
+static int count(const char *responses, const char *status) {
+  int n = 0;
+  for (const char *p = responses; (p = strstr(p, status)) != NULL; p++) {
+    n++;
+  }
+  return n;
+}
+
+static int test_tw_rate_limit_take(void) {
+  TEST_BEGIN();
+
+  static tw_rate_limit limit;
+  tw_rate_limit_init(&limit);
+  limit.rate = 10;
+  limit.burst = 3;
+  limit.now = 1000;
+
+  /* a burst, then one request per 100 ms */
+  ASSERT(take(&limit, "a") && take(&limit, "a") && take(&limit, "a"));
+  ASSERT(!take(&limit, "a"));
+  limit.now += 99;
+  ASSERT(!take(&limit, "a"));
+  limit.now += 1;
+  ASSERT(take(&limit, "a") && !take(&limit, "a"));
+  /* refills stop at the burst */
+  limit.now += 10000;
+  ASSERT(take(&limit, "a") && take(&limit, "a") && take(&limit, "a"));
+  ASSERT(!take(&limit, "a"));
+
+  /* clients are independent */
+  limit.now += 1;
+  ASSERT(take(&limit, "b"));
+
+  /* a full table evicts the client seen least recently */
+  limit.burst = 1;
+  limit.now += 1;
+  ASSERT(take(&limit, "c") && take(&limit, "d"));
+  ASSERT(!take(&limit, "d"));
+  limit.now += 1;
+  ASSERT(take(&limit, "e"));
+  ASSERT(!take(&limit, "d"));
+  /* a was seen before b and starts over */
+  ASSERT(take(&limit, "a") && !take(&limit, "a"));
+
+  limit.burst = 0;
+  ASSERT(!take(&limit, "f"));
+
+  /* a bucket with the same hash but another key is not the client's */
+  tw_rate_limit_init(&limit);
+  limit.burst = 1;
+  ASSERT(take(&limit, "a") && !take(&limit, "a"));
+  for (int i = 0; i < 4; i++) {
+    if (limit.buckets[i].key_len == 1) limit.buckets[i].key[0] = 'z';
+  }
+  ASSERT(take(&limit, "a"));
+
+  TEST_END();
+}
+
+static bool take_addr(tw_rate_limit *limit, const char *text) {
+  unsigned char addr[16];
+  return tw__rate_limit_parse(text, addr) &&
+         tw__rate_limit_take_addr(limit, addr);
+}
+
+static int test_tw_rate_limit_addr(void) {
+  TEST_BEGIN();
+
+  static tw_rate_limit limit;
+  tw_rate_limit_init(&limit);
+  limit.burst = 1;
+
+  /* an IPv6 client is its /64 */
+  ASSERT(take_addr(&limit, "2001:db8:1:2::1"));
+  ASSERT(!take_addr(&limit, "2001:db8:1:2:ffff::9"));
+  ASSERT(take_addr(&limit, "2001:db8:1:3::1"));
+  /* while IPv4 clients on a dual stack socket stay apart */
+  ASSERT(take_addr(&limit, "::ffff:192.0.2.1"));
+  ASSERT(take_addr(&limit, "192.0.2.2"));
+  ASSERT(!take_addr(&limit, "192.0.2.1"));
+
+  ASSERT(tw_rate_limit_trust(&limit, "192.0.2.1"));
+  ASSERT(tw_rate_limit_trust(&limit, "::1"));
+  ASSERT(tw_rate_limit_trust(&limit, "unix"));
+  ASSERT(!tw_rate_limit_trust(&limit, "proxy"));
+  ASSERT(limit.num_trusted == 2 && limit.trust_unix);
+
+  TEST_END();
+}
+
+/* Sends four requests made from format and the numbers 0 and 1 over a new
+ * connection, reading back the responses. */
+static ssize_t serve_keyed(const char *format, char *responses,
+                           size_t size) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return -1;
+  server.nfds = 0;
+  tw_conn *conn = add_conn(fds[0]);
+  for (int i = 0; i < 4; i++) {
+    char raw[128];
+    snprintf(raw, sizeof(raw), format, i % 2);
+    send(fds[1], raw, strlen(raw), 0);
+  }
+  tw__conn_serve(conn, handle_request);
+  tw_conn_close(conn);
+  ssize_t n = recv(fds[1], responses, size - 1, 0);
+  responses[n > 0 ? n : 0] = '\0';
+  close(fds[1]);
+  return n;
+}
+
+static int test_tw_rate_limit_server(void) {
+  TEST_BEGIN();
+
+  ASSERT(server_setup(NULL));
+  server.rate_limit.enabled = true;
+  server.rate_limit.burst = 2;
+  server.rate_limit.now = 1000;
+
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  tw_conn *conn = add_conn(fds[0]);
+
+  /* the third request is answered before its body and the handler */
+  const char *get = "GET / HTTP/1.1\r\n\r\n";
+  const char *post = "POST / HTTP/1.1\r\nContent-Length: 4\r\n\r\nbody";
+  for (int i = 0; i < 2; i++) send(fds[1], get, strlen(get), 0);
+  send(fds[1], post, strlen(post), 0);
+  ASSERT(!tw__conn_serve(conn, handle_request));
+  tw_conn_close(conn);
+
+  static char responses[1024];
+  ssize_t n = recv(fds[1], responses, sizeof(responses) - 1, 0);
+  ASSERT(n > 0);
+  responses[n > 0 ? n : 0] = '\0';
+  ASSERT(count(responses, "HTTP/1.1 200 OK\r\n") == 2);
+  ASSERT(count(responses, "HTTP/1.1 429 Too Many Requests\r\n") == 1);
+  ASSERT(strstr(responses, "Retry-After: 1\r\n") != NULL);
+  close(fds[1]);
+
+  /* with a header the key, the same address holds several clients */
+  server.rate_limit.header = "X-Api-Key";
+  const char *keyed = "GET / HTTP/1.1\r\nX-Api-Key: k%d\r\n\r\n";
+  ASSERT(serve_keyed(keyed, responses, sizeof(responses)) > 0);
+  /* but only from a trusted proxy */
+  ASSERT(count(responses, "HTTP/1.1 200 OK\r\n") == 0);
+  ASSERT(tw_rate_limit_trust(&server.rate_limit, "192.0.2.1"));
+  ASSERT(serve_keyed(keyed, responses, sizeof(responses)) > 0);
+  ASSERT(count(responses, "HTTP/1.1 200 OK\r\n") == 4);
+
+  /* the client cannot pick its bucket through what the proxy forwards */
+  server.rate_limit.header = "X-Forwarded-For";
+  keyed = "GET / HTTP/1.1\r\nX-Forwarded-For: k%d, 198.51.100.7\r\n\r\n";
+  ASSERT(serve_keyed(keyed, responses, sizeof(responses)) > 0);
+  ASSERT(count(responses, "HTTP/1.1 200 OK\r\n") == 2);
+  tw_server_stop(&server);
+
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_rate_limit_take);
+  RUN_TEST(test_tw_rate_limit_addr);
+  RUN_TEST(test_tw_rate_limit_server);
+
+  return test_summary();
+}
@@ -0,0 +1,352 @@
+#include <assert.h>
+
+#include "test.h"
+
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+
+/* Parses raw as if it had arrived on a connection. */
+static tw_request_parse_result parse(const char *raw, tw_request *req) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    return TW_REQUEST_PARSE_ERROR;
+  }
+  send(fds[1], raw, strlen(raw), 0);
+  close(fds[1]);
+
+  /* the request keeps a pointer to its connection */
+  static tw_conn conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.fd = fds[0];
+
+  tw_request_init(req);
+  tw_request_parse_result result = tw_request_parse(&conn, req);
+  tw_conn_close(&conn);
+  return result;
+}
+
+static int test_tw_request_headers(void) {
+  TEST_BEGIN();
+
+  static tw_request req;
+  ASSERT(parse("POST /submit HTTP/1.1\r\n"
+               "host: example.com\r\n"
+               "X-Custom:   padded value \t\r\n"
+               "Content-Length: 5\r\n"
+               "x-empty:\r\n"
+               "\r\n"
+               "hello",
+               &req) == TW_REQUEST_PARSE_SUCCESS);
+
+  ASSERT(!strcmp(req.method, "POST"));
+  ASSERT(!strcmp(req.path, "/submit"));
+  ASSERT(req.keep_alive);
+  ASSERT(req.num_headers == 4);
+
+  ASSERT(!strcmp(tw_request_get_known_header(&req, TW_HEADER_HOST),
+                 "example.com"));
+  ASSERT(!strcmp(tw_request_get_header(&req, "HOST"), "example.com"));
+  ASSERT(!strcmp(tw_request_get_header(&req, "x-custom"), "padded value"));
+  ASSERT(!strcmp(tw_request_get_header(&req, "X-Empty"), ""));
+  ASSERT(tw_request_get_header(&req, "X-Missing") == NULL);
+  ASSERT(tw_request_get_known_header(&req, TW_HEADER_EXPECT) == NULL);
+
+  const char *name = NULL;
+  const char *value = NULL;
+  ASSERT(tw_request_header_at(&req, 2, &name, &value));
+  ASSERT(!strcmp(name, "Content-Length") && !strcmp(value, "5"));
+  ASSERT(!tw_request_header_at(&req, 4, &name, &value));
+
+  ASSERT(req.body_len == 5 && !memcmp(req.body, "hello", 5));
+  tw_request_free(&req);
+
+  TEST_END();
+}
+
+static int test_tw_request_connection(void) {
+  TEST_BEGIN();
+
+  static tw_request req;
+  ASSERT(parse("GET / HTTP/1.1\r\nConnection: Upgrade, close\r\n\r\n",
+               &req) == TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!req.keep_alive);
+  tw_request_free(&req);
+
+  ASSERT(parse("GET / HTTP/1.0\r\nconnection: keep-alive\r\n\r\n", &req) ==
+         TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(req.keep_alive);
+  tw_request_free(&req);
+
+  ASSERT(parse("GET / HTTP/1.0\r\n\r\n", &req) == TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!req.keep_alive);
+  ASSERT(req.num_headers == 0);
+  tw_request_free(&req);
+
+  TEST_END();
+}
+
+static int test_tw_request_malformed(void) {
+  TEST_BEGIN();
+
+  static tw_request req;
+  ASSERT(parse("GET / HTTP/1.1\r\nNo-Colon\r\n\r\n", &req) ==
+         TW_REQUEST_PARSE_ERROR);
+  tw_request_free(&req);
+
+  ASSERT(parse("GET / HTTP/1.1\r\nHost : a\r\n\r\n", &req) ==
+         TW_REQUEST_PARSE_ERROR);
+  tw_request_free(&req);
+
+  ASSERT(parse("GET / HTTP/1.1\r\nContent-Length: 1\r\n"
+               "Content-Length: 2\r\n\r\n",
+               &req) == TW_REQUEST_PARSE_ERROR);
+  tw_request_free(&req);
+
+  /* identical repeats are allowed */
+  ASSERT(parse("GET / HTTP/1.1\r\nContent-Length: 0\r\n"
+               "Content-Length: 0\r\n\r\n",
+               &req) == TW_REQUEST_PARSE_SUCCESS);
+  tw_request_free(&req);
+
+  TEST_END();
+}
+
+static int test_tw_request_pipelined(void) {
+  TEST_BEGIN();
+
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  tw__set_nonblocking(fds[0]);
+
+  const char *raw =
+      "POST /a HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc"
+      "GET /b HTTP/1.1\r\nHost: b\r\n\r\n"
+      "GET /c HTTP/1.1\r\n";
+  send(fds[1], raw, strlen(raw), 0);
+
+  static tw_conn conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.fd = fds[0];
+
+  /* the body ends where the next request starts */
+  static tw_request req;
+  tw_request_init(&req);
+  ASSERT(tw_request_parse(&conn, &req) == TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!strcmp(req.path, "/a"));
+  ASSERT(req.body_len == 3 && !memcmp(req.body, "abc", 3));
+  tw_request_free(&req);
+
+  tw_request_init(&req);
+  ASSERT(tw_request_parse(&conn, &req) == TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!strcmp(req.path, "/b") && req.body_len == 0);
+  ASSERT(!strcmp(tw_request_get_header(&req, "Host"), "b"));
+  tw_request_free(&req);
+
+  /* a partial head is kept until the rest arrives */
+  tw_request_init(&req);
+  ASSERT(tw_request_parse(&conn, &req) == TW_REQUEST_PARSE_BLOCK);
+  ASSERT(conn.pipelined_len == strlen("GET /c HTTP/1.1\r\n"));
+  tw_request_free(&req);
+
+  send(fds[1], "Host: c\r\n\r\n", 11, 0);
+  tw_request_init(&req);
+  ASSERT(tw_request_parse(&conn, &req) == TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!strcmp(req.path, "/c"));
+  ASSERT(!strcmp(tw_request_get_header(&req, "Host"), "c"));
+  ASSERT(conn.pipelined_len == 0);
+  tw_request_free(&req);
+
+  close(fds[1]);
+  tw_request_init(&req);
+  ASSERT(tw_request_parse(&conn, &req) == TW_REQUEST_PARSE_CLOSED);
+  tw_request_free(&req);
+  tw_conn_close(&conn);
+
+  TEST_END();
+}
+
+static int admit_small(tw_conn *conn, tw_request *req, size_t length) {
+  (void)conn;
+  (void)req;
+  return length > 10 ? 503 : 0;
+}
+
+static tw_server admit_server;
+
+/* Parses raw on a connection of admit_server and decides on its body,
+ * reading what was sent back into out. Returns whether it was admitted. */
+static bool admit(const char *raw, char *out, size_t size) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return false;
+  send(fds[1], raw, strlen(raw), 0);
+
+  static tw_conn conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.fd = fds[0];
+  conn.server = &admit_server;
+  static tw_request req;
+  tw_request_init(&req);
+  bool admitted =
+      tw_request_parse(&conn, &req) == TW_REQUEST_PARSE_SUCCESS &&
+      tw__request_admit_body(&conn, &req);
+
+  ssize_t n = recv(fds[1], out, size - 1, MSG_DONTWAIT);
+  out[n > 0 ? n : 0] = '\0';
+  tw_request_free(&req);
+  tw_conn_close(&conn);
+  close(fds[1]);
+  return admitted;
+}
+
+static int test_tw_request_admit_body(void) {
+  TEST_BEGIN();
+
+  memset(&admit_server, 0, sizeof(admit_server));
+  tw_server_config_init(&admit_server.config);
+  admit_server.config.max_body_size = 100;
+  static char out[1024];
+
+  /* bodies without a length cannot be read */
+  ASSERT(!admit("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n", out,
+                sizeof(out)));
+  ASSERT(strncmp(out, "HTTP/1.1 411 ", 13) == 0);
+  ASSERT(!admit("POST / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n", out,
+                sizeof(out)));
+  ASSERT(strncmp(out, "HTTP/1.1 400 ", 13) == 0);
+  ASSERT(!admit("POST / HTTP/1.1\r\nContent-Length: 101\r\n\r\n", out,
+                sizeof(out)));
+  ASSERT(strncmp(out, "HTTP/1.1 413 ", 13) == 0);
+
+  /* only 100-continue is understood */
+  ASSERT(!admit("POST / HTTP/1.1\r\nContent-Length: 4\r\n"
+                "Expect: something\r\n\r\n",
+                out, sizeof(out)));
+  ASSERT(strncmp(out, "HTTP/1.1 417 ", 13) == 0);
+
+  /* and answered with an interim response once the body is admitted, for
+   * HTTP/1.1 clients that did not send it yet */
+  const char *expect = "POST / %s\r\nContent-Length: 4\r\n"
+                       "Expect: 100-continue\r\n\r\n%s";
+  char raw[256];
+  snprintf(raw, sizeof(raw), expect, "HTTP/1.1", "");
+  ASSERT(admit(raw, out, sizeof(out)));
+  ASSERT(!strcmp(out, "HTTP/1.1 100 Continue\r\n\r\n"));
+  snprintf(raw, sizeof(raw), expect, "HTTP/1.1", "body");
+  ASSERT(admit(raw, out, sizeof(out)));
+  ASSERT(!strcmp(out, ""));
+  snprintf(raw, sizeof(raw), expect, "HTTP/1.0", "");
+  ASSERT(admit(raw, out, sizeof(out)));
+  ASSERT(!strcmp(out, ""));
+
+  /* the admission callback sees the declared length first */
+  admit_server.body_admission = admit_small;
+  snprintf(raw, sizeof(raw), expect, "HTTP/1.1", "");
+  ASSERT(admit(raw, out, sizeof(out)));
+  ASSERT(!strcmp(out, "HTTP/1.1 100 Continue\r\n\r\n"));
+  ASSERT(!admit("POST / HTTP/1.1\r\nContent-Length: 11\r\n"
+                "Expect: 100-continue\r\n\r\n",
+                out, sizeof(out)));
+  ASSERT(strncmp(out, "HTTP/1.1 503 ", 13) == 0);
+  ASSERT(admit("GET / HTTP/1.1\r\n\r\n", out, sizeof(out)));
+
+  TEST_END();
+}
+
+static int test_tw_percent_decode(void) {
+  TEST_BEGIN();
+
+  char out[128];
+  size_t len = tw_percent_decode(out, "a%20b+c%2Fd%zz%4", 16, true);
+  ASSERT(len == 12 && !memcmp(out, "a b c/d%zz%4", 12));
+
+  len = tw_percent_decode(out, "a+b", 3, false);
+  ASSERT(len == 3 && !memcmp(out, "a+b", 3));
+
+  /* escapes at every offset around the vector width */
+  char src[64];
+  char expected[64];
+  for (size_t at = 0; at + 3 <= 40; at++) {
+    memset(src, 'x', 40);
+    memcpy(src + at, "%41", 3);
+    memset(expected, 'x', 38);
+    expected[at] = 'A';
+    len = tw_percent_decode(out, src, 40, true);
+    ASSERT(len == 38 && !memcmp(out, expected, 38));
+
+    /* in place */
+    len = tw_percent_decode(src, src, 40, true);
+    ASSERT(len == 38 && !memcmp(src, expected, 38));
+  }
+
+  TEST_END();
+}
+
+static int test_tw_request_query(void) {
+  TEST_BEGIN();
+
+  static tw_request req;
+  ASSERT(parse("GET /search?q=hello+world&lang=en&&flag&enc=%C3%A9%00x "
+               "HTTP/1.1\r\nHost: a\r\n\r\n",
+               &req) == TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!strcmp(req.path, "/search"));
+  ASSERT(!strcmp(req.version, "HTTP/1.1"));
+  ASSERT(!strcmp(req.query, "q=hello+world&lang=en&&flag&enc=%C3%A9%00x"));
+
+  ASSERT(!strcmp(tw_request_get_param(&req, "q"), "hello world"));
+  ASSERT(!strcmp(tw_request_get_param(&req, "lang"), "en"));
+  ASSERT(!strcmp(tw_request_get_param(&req, "flag"), ""));
+  ASSERT(tw_request_get_param(&req, "missing") == NULL);
+  ASSERT(tw_request_param_count(&req) == 4);
+
+  const tw_param *enc = tw_request_param_at(&req, 3);
+  ASSERT(enc != NULL && enc->value_len == 4);
+  ASSERT(!memcmp(enc->value, "\xc3\xa9\0x", 4));
+  ASSERT(tw_request_param_at(&req, 4) == NULL);
+
+  /* the raw query is still intact after decoding */
+  ASSERT(!strcmp(req.query, "q=hello+world&lang=en&&flag&enc=%C3%A9%00x"));
+  tw_request_free(&req);
+
+  ASSERT(parse("GET /plain HTTP/1.1\r\n\r\n", &req) ==
+         TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(!strcmp(req.path, "/plain") && req.query_len == 0);
+  ASSERT(tw_request_param_count(&req) == 0);
+  tw_request_free(&req);
+
+  TEST_END();
+}
+
+static int test_tw_request_many_params(void) {
+  TEST_BEGIN();
+
+  char raw[1024] = "GET /?";
+  for (int i = 0; i < 40; i++) {
+    char pair[32];
+    snprintf(pair, sizeof(pair), "%sk%d=v%d", i ? "&" : "", i, i);
+    strcat(raw, pair);
+  }
+  strcat(raw, " HTTP/1.1\r\n\r\n");
+
+  static tw_request req;
+  ASSERT(parse(raw, &req) == TW_REQUEST_PARSE_SUCCESS);
+  ASSERT(tw_request_param_count(&req) == 40);
+  ASSERT(req.params != req.params_inline);
+  ASSERT(!strcmp(tw_request_get_param(&req, "k0"), "v0"));
+  ASSERT(!strcmp(tw_request_get_param(&req, "k39"), "v39"));
+  tw_request_free(&req);
+
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_request_headers);
+  RUN_TEST(test_tw_request_connection);
+  RUN_TEST(test_tw_request_malformed);
+  RUN_TEST(test_tw_request_pipelined);
+  RUN_TEST(test_tw_request_admit_body);
+  RUN_TEST(test_tw_percent_decode);
+  RUN_TEST(test_tw_request_query);
+  RUN_TEST(test_tw_request_many_params);
+
+  return test_summary();
+}
@@ -0,0 +1,272 @@
+#include <assert.h>
+
+#include "test.h"
+
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+#include "server.h"
+
+/* Sends res and reads back what went out. */
+static size_t send_response(tw_response *res, char *out, size_t size) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return 0;
+
+  static tw_conn conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.fd = fds[0];
+  tw_response_send(&conn, res);
+  tw_conn_close(&conn);
+
+  size_t len = 0;
+  ssize_t n;
+  while (len + 1 < size &&
+         (n = recv(fds[1], out + len, size - len - 1, 0)) > 0) {
+    len += (size_t)n;
+  }
+  out[len] = '\0';
+  close(fds[1]);
+  return len;
+}
+
+static int freed;
+
+static void count_free(void *body) {
+  freed++;
+  free(body);
+}
+
+static int test_tw_response_body_ownership(void) {
+  TEST_BEGIN();
+
+  tw_response res;
+  tw_response_init(&res);
+
+  static const char message[] = "static message";
+  tw_response_borrow_body(&res, message, strlen(message));
+  ASSERT(res.body == message && res.body_free == NULL);
+
+  static char out[4096];
+  send_response(&res, out, sizeof(out));
+  ASSERT(strstr(out, "Content-Length: 14\r\n") != NULL);
+  ASSERT(strstr(out, "\r\n\r\nstatic message") != NULL);
+
+  /* a handed over buffer is released with its own function */
+  char *heap = strdup("heap");
+  tw_response_take_body(&res, heap, 4, count_free);
+  ASSERT(res.body == heap);
+  tw_response_set_body(&res, heap + 1, 3);
+  ASSERT(freed == 1 && !strcmp(res.body, "eap"));
+  tw_response_take_body(&res, strdup("again"), 5, count_free);
+  tw_response_free(&res);
+  ASSERT(freed == 2);
+
+  /* appending to a borrowed body copies it first */
+  tw_response_init(&res);
+  tw_response_borrow_body(&res, message, 6);
+  ASSERT(tw_response_append(&res, "!", 1));
+  ASSERT(res.body != message && !strcmp(res.body, "static!"));
+  tw_response_free(&res);
+
+  TEST_END();
+}
+
+static int test_tw_response_writer(void) {
+  TEST_BEGIN();
+
+  tw_response res;
+  tw_response_init(&res);
+
+  ASSERT(tw_response_printf(&res, "{\"items\":["));
+  for (int i = 0; i < 1000; i++) {
+    ASSERT(tw_response_printf(&res, "%s{\"id\":%d}", i ? "," : "", i));
+  }
+  char *dst = tw_response_reserve(&res, 2);
+  ASSERT(dst != NULL);
+  memcpy(dst, "]}", 2);
+  tw_response_commit(&res, 2);
+
+  ASSERT(res.body_len == strlen(res.body));
+  ASSERT(res.body_cap > res.body_len);
+  ASSERT(!strncmp(res.body, "{\"items\":[{\"id\":0},{\"id\":1},", 28));
+  const char *end = "{\"id\":999}]}";
+  ASSERT(!strcmp(res.body + res.body_len - strlen(end), end));
+
+  /* longer than the spare room in one go */
+  char long_text[2000];
+  memset(long_text, 'x', sizeof(long_text) - 1);
+  long_text[sizeof(long_text) - 1] = '\0';
+  size_t before = res.body_len;
+  ASSERT(tw_response_printf(&res, "%s", long_text));
+  ASSERT(res.body_len == before + sizeof(long_text) - 1);
+
+  tw_response_set_body(&res, "short", 5);
+  ASSERT(res.body_len == 5 && !strcmp(res.body, "short"));
+
+  static char out[4096];
+  send_response(&res, out, sizeof(out));
+  ASSERT(strstr(out, "Content-Length: 5\r\n") != NULL);
+  tw_response_free(&res);
+
+  TEST_END();
+}
+
+static void handle_path(tw_conn *conn, tw_request *req, tw_response *res) {
+  tw_response_set_body(res, req->path, req->path_len);
+  tw_response_send(conn, res);
+}
+
+static int test_tw_response_pipelined(void) {
+  TEST_BEGIN();
+
+  ASSERT(server_setup(NULL));
+
+  /* every write is a packet of its own */
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == 0);
+  tw_conn *conn = server_add_conn(fds[0]);
+
+  char raw[1024];
+  size_t raw_len = 0;
+  for (int i = 0; i < 16; i++) {
+    raw_len += (size_t)snprintf(raw + raw_len, sizeof(raw) - raw_len,
+                                "GET /%d HTTP/1.1\r\n\r\n", i);
+  }
+  send(fds[1], raw, raw_len, 0);
+  ASSERT(tw__conn_serve(conn, handle_path));
+  /* nothing is held for an idle connection */
+  ASSERT(conn->out == NULL && conn->memory == 0);
+
+  /* the sixteen responses went out in order with one write */
+  static char out[8192];
+  ssize_t n = recv(fds[1], out, sizeof(out) - 1, MSG_DONTWAIT);
+  ASSERT(n > 0);
+  out[n > 0 ? n : 0] = '\0';
+  const char *pos = out;
+  for (int i = 0; i < 16; i++) {
+    char body[16];
+    snprintf(body, sizeof(body), "\r\n\r\n/%d", i);
+    pos = strstr(pos, body);
+    ASSERT(pos != NULL);
+    if (pos == NULL) break;
+  }
+  ASSERT(recv(fds[1], out, sizeof(out), MSG_DONTWAIT) < 0);
+
+  /* a single request is answered right away */
+  const char *single = "GET /x HTTP/1.1\r\n\r\n";
+  send(fds[1], single, strlen(single), 0);
+  ASSERT(tw__conn_serve(conn, handle_path));
+  ASSERT(conn->out == NULL);
+
+  tw_conn_close(conn);
+  close(fds[1]);
+  tw_server_stop(&server);
+
+  TEST_END();
+}
+
+/* Answers /large with a megabyte, other paths with 1000 bytes that start
+ * with the path. */
+static void handle_large(tw_conn *conn, tw_request *req, tw_response *res) {
+  if (strcmp(req->path, "/large") == 0) {
+    char *large = (char *)malloc(1 << 20);
+    if (large != NULL) memset(large, 'y', 1 << 20);
+    tw_response_take_body(res, large, large != NULL ? 1 << 20 : 0, free);
+  } else {
+    char body[1000];
+    memset(body, 'x', sizeof(body));
+    memcpy(body, req->path, req->path_len);
+    tw_response_set_body(res, body, sizeof(body));
+  }
+  tw_response_send(conn, res);
+}
+
+/* Reads what the peer has, then writes what the socket takes next, as
+ * the loop would on POLLOUT. Returns the bytes read. */
+static size_t drain(tw_conn *conn, int peer, char *out, size_t *len,
+                    size_t size) {
+  size_t before = *len;
+  ssize_t n;
+  while (*len < size &&
+         (n = recv(peer, out + *len, size - *len, MSG_DONTWAIT)) > 0) {
+    *len += (size_t)n;
+  }
+  if (conn->blocked && tw__conn_flush(conn) && !conn->blocked) {
+    tw__conn_free_out(conn);
+    if (!conn->closing) tw__conn_serve(conn, handle_large);
+  }
+  return *len - before;
+}
+
+static int test_tw_response_blocked(void) {
+  TEST_BEGIN();
+
+  ASSERT(server_setup(NULL));
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  int size = 4096;
+  setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+  setsockopt(fds[1], SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  tw_conn *conn = server_add_conn(fds[0]);
+
+  /* more responses than the socket takes */
+  static char raw[4096];
+  size_t raw_len = 0;
+  for (int i = 0; i < 64; i++) {
+    raw_len += (size_t)snprintf(raw + raw_len, sizeof(raw) - raw_len,
+                                "GET /%d HTTP/1.1\r\n\r\n", i);
+  }
+  ASSERT(send(fds[1], raw, raw_len, 0) == (ssize_t)raw_len);
+  ASSERT(tw__conn_serve(conn, handle_large));
+  /* the rest waits for POLLOUT, and so does the next request */
+  ASSERT(conn->blocked && server.fds[0].events == POLLOUT);
+  ASSERT(tw__conn_events(conn) == POLLOUT);
+
+  static char out[1 << 21];
+  size_t len = 0;
+  for (int i = 0; i < 10000 && drain(conn, fds[1], out, &len, sizeof(out));
+       i++) {
+  }
+  ASSERT(!conn->blocked && conn->out == NULL);
+
+  /* all of them came in order, none cut short */
+  const char *pos = out;
+  for (int i = 0; i < 64; i++) {
+    char body[32];
+    ASSERT(strncmp(pos, "HTTP/1.1 200 OK\r\n", 17) == 0);
+    pos = strstr(pos, "\r\n\r\n");
+    ASSERT(pos != NULL);
+    if (pos == NULL) break;
+    snprintf(body, sizeof(body), "/%dx", i);
+    ASSERT(strncmp(pos + 4, body, strlen(body)) == 0);
+    pos += 4 + 1000;
+  }
+  ASSERT(pos == out + len);
+
+  /* a large response that closes the connection is written to its end */
+  const char *large = "GET /large HTTP/1.1\r\nConnection: close\r\n\r\n";
+  send(fds[1], large, strlen(large), 0);
+  ASSERT(tw__conn_serve(conn, handle_large));
+  ASSERT(conn->blocked && conn->closing);
+  len = 0;
+  for (int i = 0; i < 10000 && drain(conn, fds[1], out, &len, sizeof(out));
+       i++) {
+  }
+  ASSERT(!conn->blocked && conn->closing);
+  pos = strstr(out, "\r\n\r\n");
+  ASSERT(pos != NULL && out + len - (pos + 4) == 1 << 20);
+
+  tw_conn_close(conn);
+  close(fds[1]);
+  tw_server_stop(&server);
+
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_response_body_ownership);
+  RUN_TEST(test_tw_response_writer);
+  RUN_TEST(test_tw_response_pipelined);
+  RUN_TEST(test_tw_response_blocked);
+
+  return test_summary();
+}
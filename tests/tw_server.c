@@ -0,0 +1,408 @@
+#include <assert.h>
+
+#include "test.h"
+
+/* IPv4, IPv6 twice and two Unix sockets */
+#define TW_MAX_LISTENERS 5
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+#include "server.h"
+
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* A port for the tests to listen on, different for every run. */
+static int test_port(void) {
+  static int next;
+  if (next == 0) next = 20000 + (int)(getpid() % 20000);
+  return next++;
+}
+
+/* Initializes the server on 127.0.0.1 with config, moving on to the next
+ * port while one is taken. */
+static bool init_local(tw_server_config *config) {
+  config->bind_addr = "127.0.0.1";
+  for (int i = 0; i < 16; i++) {
+    config->port = test_port();
+    if (tw_server_init_ex(&server, config)) return true;
+  }
+  return false;
+}
+
+static int get_option(int fd, int level, int name) {
+  int value = 0;
+  socklen_t len = sizeof(value);
+  getsockopt(fd, level, name, &value, &len);
+  return value;
+}
+
+static int test_tw_server_config(void) {
+  TEST_BEGIN();
+
+  tw_server_config config;
+  tw_server_config_init(&config);
+  ASSERT(config.port == TW_DEFAULT_PORT && config.bind_addr == NULL);
+  ASSERT(config.backlog == TW_DEFAULT_BACKLOG && config.reuse_addr);
+  ASSERT(config.tcp_nodelay && config.recv_buf_size == 0);
+  ASSERT(config.memory_budget == 0);
+  ASSERT(config.max_connections == TW_MAX_CLIENTS);
+  ASSERT(config.overload_policy == TW_OVERLOAD_REJECT);
+  ASSERT(config.max_body_size == TW_MAX_REQUEST_BODY);
+  ASSERT(config.drain_timeout == TW_DRAIN_TIMEOUT);
+
+  /* values left at zero or out of range fall back to the defaults */
+  memset(&config, 0, sizeof(config));
+  config.max_connections = TW_MAX_CLIENTS + 1;
+  ASSERT(server_setup(&config));
+  ASSERT(server.config.port == TW_DEFAULT_PORT);
+  ASSERT(server.config.backlog == TW_DEFAULT_BACKLOG);
+  ASSERT(server.config.max_body_size == TW_MAX_REQUEST_BODY);
+  ASSERT(server.config.max_connections == TW_MAX_CLIENTS);
+  ASSERT(server.config.drain_timeout == TW_DRAIN_TIMEOUT);
+  ASSERT(server.num_listeners == 0 && server.nfds == 0);
+  tw_server_stop(&server);
+
+  TEST_END();
+}
+
+static int test_tw_server_socket_options(void) {
+  TEST_BEGIN();
+
+  tw_server_config config;
+  tw_server_config_init(&config);
+  config.recv_buf_size = 256 * 1024;
+  config.defer_accept = 5;
+  ASSERT(init_local(&config));
+  ASSERT(server.num_listeners == 1 && server.nfds == 1);
+
+  int fd = server.listeners[0].fd;
+  ASSERT(get_option(fd, SOL_SOCKET, SO_RCVBUF) >= config.recv_buf_size);
+  ASSERT(get_option(fd, IPPROTO_TCP, TCP_NODELAY) != 0);
+#ifdef TCP_DEFER_ACCEPT
+  ASSERT(get_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT) > 0);
+#endif
+  ASSERT(tw_server_stop(&server));
+  ASSERT(server.num_listeners == 0);
+
+  TEST_END();
+}
+
+/* Connects to the address the listener is bound to. */
+static int connect_to(const tw_listener *listener) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(listener->fd, (struct sockaddr *)&addr, &len) != 0) {
+    return -1;
+  }
+  int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, len) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int test_tw_server_listen(void) {
+  TEST_BEGIN();
+
+  tw_server_config config;
+  tw_server_config_init(&config);
+  ASSERT(init_local(&config));
+  int port = config.port;
+
+  char path[64];
+  snprintf(path, sizeof(path), "unix:/tmp/tw_server_%d.sock", (int)getpid());
+  char abstract[64];
+  snprintf(abstract, sizeof(abstract), "unix:@tw_server_%d", (int)getpid());
+  ASSERT(!tw_server_listen(&server, "not an address", port));
+  ASSERT(!tw_server_listen(&server, "unix:", 0));
+  ASSERT(tw_server_listen(&server, "::1", port));
+  ASSERT(tw_server_listen(&server, "[::1]", port + 1));
+  ASSERT(tw_server_listen(&server, path, 0));
+  ASSERT(tw_server_listen(&server, abstract, 0));
+  /* no more than TW_MAX_LISTENERS */
+  ASSERT(!tw_server_listen(&server, "::1", port + 2));
+  ASSERT(server.num_listeners == 5 && server.nfds == 5);
+  ASSERT(access(path + 5, F_OK) == 0);
+
+  /* each of them accepts */
+  const int families[5] = {AF_INET, AF_INET6, AF_INET6, AF_UNIX, AF_UNIX};
+  int peers[5];
+  for (int l = 0; l < 5; l++) {
+    ASSERT(server.listeners[l].addr.ss_family == families[l]);
+    peers[l] = connect_to(&server.listeners[l]);
+    ASSERT(peers[l] >= 0);
+    tw__server_accept(&server, &server.listeners[l]);
+    ASSERT(server.nfds == 6 + l);
+  }
+  ASSERT(server.conns[5].addr.sa.sa_family == AF_INET);
+  ASSERT(server.conns[6].addr.sa.sa_family == AF_INET6);
+
+  /* but no more listeners are added once connections are open */
+  ASSERT(!tw_server_listen(&server, "127.0.0.1", port + 2));
+
+  for (int l = 0; l < 5; l++) {
+    tw_conn_close(&server.conns[5 + l]);
+    close(peers[l]);
+  }
+  server.nfds = server.num_listeners;
+  ASSERT(tw_server_stop(&server));
+  /* the socket file goes with the server */
+  ASSERT(access(path + 5, F_OK) != 0);
+
+  TEST_END();
+}
+
+/* Connects three clients to a server that admits two, with policy. */
+static bool overload(tw_overload_policy policy, int peers[3]) {
+  tw_server_config config;
+  tw_server_config_init(&config);
+  config.max_connections = 2;
+  config.overload_policy = policy;
+  if (!init_local(&config)) return false;
+  for (int i = 0; i < 3; i++) {
+    peers[i] = connect_to(&server.listeners[0]);
+    if (peers[i] < 0) return false;
+    if (i == 1) {
+      tw__server_accept(&server, &server.listeners[0]);
+      /* the first two have been idle for a while */
+      server.tick++;
+    }
+  }
+  tw__server_accept(&server, &server.listeners[0]);
+  return true;
+}
+
+/* Reads what the server sent to peer before closing it. */
+static ssize_t closed_with(int peer, char *buf, size_t size) {
+  size_t total = 0;
+  ssize_t n;
+  while (total < size - 1 &&
+         (n = recv(peer, buf + total, size - 1 - total, MSG_DONTWAIT)) > 0) {
+    total += (size_t)n;
+  }
+  buf[total] = '\0';
+  return n == 0 ? (ssize_t)total : -1;
+}
+
+static void overload_end(int peers[3]) {
+  for (int i = server.num_listeners; i < server.nfds; i++) {
+    tw_conn_close(&server.conns[i]);
+  }
+  server.nfds = server.num_listeners;
+  for (int i = 0; i < 3; i++) close(peers[i]);
+  tw_server_stop(&server);
+}
+
+static int test_tw_server_overload(void) {
+  TEST_BEGIN();
+
+  int peers[3];
+  static char buf[256];
+
+  /* the new connection is answered with 503 */
+  ASSERT(overload(TW_OVERLOAD_REJECT, peers));
+  ASSERT(server.nfds == 3);
+  ASSERT(closed_with(peers[2], buf, sizeof(buf)) > 0);
+  ASSERT(strncmp(buf, "HTTP/1.1 503 ", 13) == 0);
+  ASSERT(closed_with(peers[0], buf, sizeof(buf)) < 0);
+  overload_end(peers);
+
+  /* the connection idle the longest makes room for it */
+  ASSERT(overload(TW_OVERLOAD_DROP_IDLE, peers));
+  ASSERT(server.nfds == 3);
+  ASSERT(closed_with(peers[0], buf, sizeof(buf)) == 0);
+  ASSERT(closed_with(peers[1], buf, sizeof(buf)) < 0);
+  ASSERT(closed_with(peers[2], buf, sizeof(buf)) < 0);
+  overload_end(peers);
+
+  /* it waits in the listen queue until a slot is free */
+  ASSERT(overload(TW_OVERLOAD_BACKLOG, peers));
+  ASSERT(server.nfds == 3);
+  ASSERT(closed_with(peers[2], buf, sizeof(buf)) < 0);
+  tw_conn_close(&server.conns[2]);
+  server.nfds--;
+  /* or until the server is back under its memory budget */
+  server.reads_paused = true;
+  tw__server_accept(&server, &server.listeners[0]);
+  ASSERT(server.nfds == 2);
+  ASSERT(closed_with(peers[2], buf, sizeof(buf)) < 0);
+  server.reads_paused = false;
+  tw__server_accept(&server, &server.listeners[0]);
+  ASSERT(server.nfds == 3);
+  overload_end(peers);
+
+  TEST_END();
+}
+
+/* Which of the two servers answered, for the handoff tests. */
+static const char *server_name;
+
+static void handle_name(tw_conn *conn, tw_request *req, tw_response *res) {
+  (void)req;
+  tw_response_set_body(res, server_name, strlen(server_name));
+  tw_response_send(conn, res);
+}
+
+static void drain_on_alarm(int sig) {
+  (void)sig;
+  tw_server_drain(&server);
+}
+
+/* Exits with 0 once the successor took over the listeners. */
+static void take_over(const char *path) {
+  tw_server_config config;
+  tw_server_config_init(&config);
+  memset(&server, 0, sizeof(server));
+  bool ok = tw_server_init_handoff(&server, &config, path);
+  _exit(ok && server.num_listeners == 1 ? 0 : 1);
+}
+
+static int test_tw_server_handoff_retry(void) {
+  TEST_BEGIN();
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/tw_handoff_%d.sock", (int)getpid());
+  tw_server_config config;
+  tw_server_config_init(&config);
+  ASSERT(init_local(&config));
+  ASSERT(tw_server_enable_handoff(&server, path));
+  ASSERT(server.num_listeners == 2 && server.listeners[1].handoff);
+
+  /* a successor that went away before the send */
+  int peer = connect_to(&server.listeners[1]);
+  ASSERT(peer >= 0);
+  close(peer);
+  tw__server_handoff(&server, 1);
+  ASSERT(!server.handed_off && !server.drain_requested);
+  ASSERT(server.listeners[1].fd >= 0 && server.fds[1].fd >= 0);
+  ASSERT(access(path, F_OK) == 0);
+
+  /* the next one still gets the listeners */
+  pid_t child = fork();
+  ASSERT(child >= 0);
+  if (child == 0) take_over(path);
+  struct pollfd pfd = {server.listeners[1].fd, POLLIN, 0};
+  ASSERT(poll(&pfd, 1, 5000) == 1);
+  tw__server_handoff(&server, 1);
+  ASSERT(server.handed_off && server.drain_requested);
+  ASSERT(server.listeners[1].fd < 0 && server.fds[1].fd < 0);
+  int status;
+  ASSERT(waitpid(child, &status, 0) == child);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  tw_server_stop(&server);
+  unlink(path);
+
+  TEST_END();
+}
+
+/* Sends requests to port until the new server answered a few of them,
+ * exiting with the number of requests that failed. */
+static void request_loop(int port) {
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons((uint16_t)port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  const char request[] = "GET / HTTP/1.1\r\nConnection: close\r\n\r\n";
+
+  int failed = 0, old = 0, new = 0;
+  for (int i = 0; i < 10000 && new < 20; i++) {
+    char buf[512];
+    size_t total = 0;
+    ssize_t n = -1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        send(fd, request, sizeof(request) - 1, 0) > 0) {
+      while (total < sizeof(buf) - 1 &&
+             (n = recv(fd, buf + total, sizeof(buf) - 1 - total, 0)) > 0) {
+        total += (size_t)n;
+      }
+    }
+    close(fd);
+    buf[total] = '\0';
+    if (n != 0 || strncmp(buf, "HTTP/1.1 200 ", 13) != 0) {
+      failed++;
+    } else if (strstr(buf, "\r\n\r\nold") != NULL) {
+      old++;
+    } else if (strstr(buf, "\r\n\r\nnew") != NULL) {
+      new++;
+    }
+  }
+  _exit(old > 0 && new > 0 ? (failed < 255 ? failed : 255) : 255);
+}
+
+static int test_tw_server_handoff(void) {
+  TEST_BEGIN();
+
+  char path[64];
+  snprintf(path, sizeof(path), "/tmp/tw_handoff_%d.sock", (int)getpid());
+  int ready[2];
+  ASSERT(pipe(ready) == 0);
+
+  /* the old server answers until it handed its listener over */
+  pid_t old = fork();
+  ASSERT(old >= 0);
+  if (old == 0) {
+    tw_server_config config;
+    tw_server_config_init(&config);
+    server_name = "old";
+    if (!init_local(&config) || !tw_server_enable_handoff(&server, path)) {
+      _exit(1);
+    }
+    ssize_t n = write(ready[1], &config.port, sizeof(config.port));
+    bool ok = n == sizeof(config.port) && tw_server_run(&server, handle_name);
+    _exit(ok && server.handed_off ? 0 : 1);
+  }
+  int port = 0;
+  ASSERT(read(ready[0], &port, sizeof(port)) == sizeof(port));
+  close(ready[0]);
+  close(ready[1]);
+
+  pid_t client = fork();
+  ASSERT(client >= 0);
+  if (client == 0) request_loop(port);
+  /* let the old server answer some first */
+  usleep(100 * 1000);
+
+  tw_server_config config;
+  tw_server_config_init(&config);
+  config.drain_timeout = 100;
+  ASSERT(tw_server_init_handoff(&server, &config, path));
+  ASSERT(server.num_listeners == 1);
+  ASSERT(tw_server_enable_handoff(&server, path));
+
+  int status;
+  ASSERT(waitpid(old, &status, 0) == old);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+  server_name = "new";
+  signal(SIGALRM, drain_on_alarm);
+  struct itimerval timer = {{0, 0}, {1, 0}};
+  setitimer(ITIMER_REAL, &timer, NULL);
+  ASSERT(tw_server_run(&server, handle_name));
+  signal(SIGALRM, SIG_DFL);
+  tw_server_stop(&server);
+
+  /* no request was refused while the listener changed hands */
+  ASSERT(waitpid(client, &status, 0) == client);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  ASSERT(access(path, F_OK) != 0);
+
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_server_config);
+  RUN_TEST(test_tw_server_socket_options);
+  RUN_TEST(test_tw_server_listen);
+  RUN_TEST(test_tw_server_overload);
+  RUN_TEST(test_tw_server_handoff_retry);
+  RUN_TEST(test_tw_server_handoff);
+
+  return test_summary();
+}
@@ -0,0 +1,477 @@
+#include <assert.h>
+
+#include "test.h"
+
+/* small enough for the tests to fill */
+#define TW_FILE_CACHE_SIZE 2
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+
+static char dir[] = "/tmp/tw_static_XXXXXX";
+static char file_path[64];
+static const char content[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+/* the server of the connections serve() answers on, for its file cache */
+static tw_server *serve_server;
+/* the largest output queue of the last serve() */
+static size_t serve_out_cap;
+
+/* Answers raw with the file at path, or with root when path is NULL, and
+ * reads back what was sent. */
+static size_t serve(const char *raw, const char *path, char *out,
+                    size_t size) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return 0;
+  send(fds[1], raw, strlen(raw), 0);
+
+  static tw_conn conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.fd = fds[0];
+  conn.server = serve_server;
+  tw__set_nonblocking(fds[0]);
+
+  static tw_request req;
+  tw_request_init(&req);
+  if (tw_request_parse(&conn, &req) != TW_REQUEST_PARSE_SUCCESS) {
+    tw_conn_close(&conn);
+    close(fds[1]);
+    return 0;
+  }
+
+  tw_response res;
+  tw_response_init(&res);
+  res.head = strcmp(req.method, "HEAD") == 0;
+  if (path != NULL) {
+    tw_response_send_file(&conn, &req, &res, path);
+  } else {
+    tw_serve_static(&conn, &req, &res, dir);
+  }
+  tw_response_free(&res);
+  tw_request_free(&req);
+
+  /* what the socket did not take goes out as it is read */
+  size_t len = 0;
+  ssize_t n;
+  serve_out_cap = conn.out_cap;
+  while (conn.blocked && len + 1 < size) {
+    n = recv(fds[1], out + len, size - len - 1, MSG_DONTWAIT);
+    if (n > 0) len += (size_t)n;
+    if (!tw__conn_flush(&conn)) break;
+    if (conn.out_cap > serve_out_cap) serve_out_cap = conn.out_cap;
+  }
+  tw_conn_close(&conn);
+
+  while (len + 1 < size &&
+         (n = recv(fds[1], out + len, size - len - 1, 0)) > 0) {
+    len += (size_t)n;
+  }
+  out[len] = '\0';
+  close(fds[1]);
+  return len;
+}
+
+/* Sends a GET for the test file with extra header lines. */
+static size_t get(const char *headers, char *out, size_t size) {
+  char raw[512];
+  snprintf(raw, sizeof(raw), "GET /data.txt HTTP/1.1\r\n%s\r\n", headers);
+  return serve(raw, file_path, out, size);
+}
+
+static const char *body_of(const char *response) {
+  const char *end = strstr(response, "\r\n\r\n");
+  return end ? end + 4 : "";
+}
+
+static bool write_file(const char *path, const char *data) {
+  FILE *file = fopen(path, "wb");
+  if (file == NULL) return false;
+  fputs(data, file);
+  return fclose(file) == 0;
+}
+
+static int test_tw_http_date(void) {
+  TEST_BEGIN();
+
+  char date[30];
+  tw_http_date(784111777, date);
+  ASSERT(!strcmp(date, "Sun, 06 Nov 1994 08:49:37 GMT"));
+  tw_http_date(951782400, date);
+  ASSERT(!strcmp(date, "Tue, 29 Feb 2000 00:00:00 GMT"));
+
+  time_t t = 0;
+  ASSERT(tw_parse_http_date("Sun, 06 Nov 1994 08:49:37 GMT", &t));
+  ASSERT(t == 784111777);
+  t = 0;
+  ASSERT(tw_parse_http_date("Sunday, 06-Nov-94 08:49:37 GMT", &t));
+  ASSERT(t == 784111777);
+  t = 0;
+  ASSERT(tw_parse_http_date("Sun Nov  6 08:49:37 1994", &t));
+  ASSERT(t == 784111777);
+
+  ASSERT(!tw_parse_http_date("Sun, 06 Nov 1994 08:49:37 CET", &t));
+  ASSERT(!tw_parse_http_date("Sun, 06 Foo 1994 08:49:37 GMT", &t));
+  ASSERT(!tw_parse_http_date("yesterday", &t));
+
+  TEST_END();
+}
+
+static int test_tw_etag_match(void) {
+  TEST_BEGIN();
+
+  ASSERT(tw__etag_match("\"a\", \"b\"", "\"b\"", false));
+  ASSERT(tw__etag_match("*", "\"b\"", false));
+  ASSERT(!tw__etag_match("\"a\"", "\"b\"", true));
+  /* weak tags only match in weak comparison */
+  ASSERT(tw__etag_match("W/\"b\"", "\"b\"", true));
+  ASSERT(!tw__etag_match("W/\"b\"", "\"b\"", false));
+  ASSERT(tw__etag_match("\"b\"", "W/\"b\"", true));
+  ASSERT(!tw__etag_match("\"b\"", "W/\"b\"", false));
+
+  TEST_END();
+}
+
+static int test_tw_parse_ranges(void) {
+  TEST_BEGIN();
+
+  tw__byte_range r[TW_MAX_RANGES];
+  ASSERT(tw__parse_ranges("bytes=0-4", 10, r) == 1);
+  ASSERT(r[0].first == 0 && r[0].last == 4);
+  ASSERT(tw__parse_ranges("bytes=5-", 10, r) == 1);
+  ASSERT(r[0].first == 5 && r[0].last == 9);
+  ASSERT(tw__parse_ranges("bytes=-3", 10, r) == 1);
+  ASSERT(r[0].first == 7 && r[0].last == 9);
+  ASSERT(tw__parse_ranges("bytes=-30", 10, r) == 1);
+  ASSERT(r[0].first == 0 && r[0].last == 9);
+  ASSERT(tw__parse_ranges("bytes=8-20", 10, r) == 1);
+  ASSERT(r[0].first == 8 && r[0].last == 9);
+
+  ASSERT(tw__parse_ranges("bytes=0-0, 4-5 ,20-", 10, r) == 2);
+  ASSERT(r[1].first == 4 && r[1].last == 5);
+
+  /* unsatisfiable */
+  ASSERT(tw__parse_ranges("bytes=10-", 10, r) == 0);
+  ASSERT(tw__parse_ranges("bytes=-0", 10, r) == 0);
+
+  /* ignored */
+  ASSERT(tw__parse_ranges("items=0-1", 10, r) == -1);
+  ASSERT(tw__parse_ranges("bytes=5-1", 10, r) == -1);
+  ASSERT(tw__parse_ranges("bytes=a-b", 10, r) == -1);
+  ASSERT(tw__parse_ranges("bytes=", 10, r) == -1);
+  ASSERT(tw__parse_ranges("bytes=0-5,3-8", 10, r) == -1);
+  ASSERT(tw__parse_ranges("bytes=0-0,1-1,2-2,3-3,4-4,5-5,6-6,7-7,8-8,9-9,"
+                          "10-10,11-11,12-12,13-13,14-14,15-15,16-16",
+                          20, r) == -1);
+
+  TEST_END();
+}
+
+static int test_tw_send_file(void) {
+  TEST_BEGIN();
+
+  static char out[4096];
+  ASSERT(get("", out, sizeof(out)) > 0);
+  ASSERT(strncmp(out, "HTTP/1.1 200 OK\r\n", 17) == 0);
+  ASSERT(strstr(out, "Content-Type: text/plain") != NULL);
+  ASSERT(strstr(out, "Accept-Ranges: bytes") != NULL);
+  ASSERT(!strcmp(body_of(out), content));
+
+  char etag[64] = "";
+  const char *pos = strstr(out, "ETag: ");
+  ASSERT(pos != NULL);
+  if (pos != NULL) sscanf(pos + 6, "%63[^\r]", etag);
+  char last_modified[64] = "";
+  pos = strstr(out, "Last-Modified: ");
+  ASSERT(pos != NULL);
+  if (pos != NULL) sscanf(pos + 15, "%63[^\r]", last_modified);
+
+  /* revalidation costs no body */
+  char headers[256];
+  snprintf(headers, sizeof(headers), "If-None-Match: \"x\", %s\r\n", etag);
+  get(headers, out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 304", 12) == 0);
+  ASSERT(strstr(out, "Content-Length") == NULL);
+  ASSERT(!strcmp(body_of(out), ""));
+
+  snprintf(headers, sizeof(headers), "If-Modified-Since: %s\r\n",
+           last_modified);
+  get(headers, out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 304", 12) == 0);
+
+  /* If-None-Match takes precedence over the date */
+  snprintf(headers, sizeof(headers),
+           "If-None-Match: \"x\"\r\nIf-Modified-Since: %s\r\n",
+           last_modified);
+  get(headers, out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 200", 12) == 0);
+
+  get("If-Match: \"x\"\r\n", out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 412", 12) == 0);
+  get("If-Unmodified-Since: Sun, 06 Nov 1994 08:49:37 GMT\r\n", out,
+      sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 412", 12) == 0);
+
+  TEST_END();
+}
+
+static int test_tw_send_file_ranges(void) {
+  TEST_BEGIN();
+
+  static char out[4096];
+  get("Range: bytes=2-5\r\n", out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 206", 12) == 0);
+  ASSERT(strstr(out, "Content-Range: bytes 2-5/36\r\n") != NULL);
+  ASSERT(strstr(out, "Content-Length: 4\r\n") != NULL);
+  ASSERT(!strcmp(body_of(out), "2345"));
+
+  get("Range: bytes=-3\r\n", out, sizeof(out));
+  ASSERT(!strcmp(body_of(out), "xyz"));
+
+  get("Range: bytes=40-\r\n", out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 416", 12) == 0);
+  ASSERT(strstr(out, "Content-Range: bytes */36\r\n") != NULL);
+
+  /* a stale If-Range gets the whole file */
+  get("Range: bytes=2-5\r\nIf-Range: \"old\"\r\n", out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 200", 12) == 0);
+  ASSERT(!strcmp(body_of(out), content));
+
+  get("Range: bytes=0-1,10-11\r\n", out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 206", 12) == 0);
+  char boundary[80] = "";
+  const char *pos = strstr(out, "multipart/byteranges; boundary=");
+  ASSERT(pos != NULL);
+  if (pos != NULL) sscanf(pos + 31, "%79[^\r]", boundary);
+
+  char expected[512];
+  snprintf(expected, sizeof(expected),
+           "--%s\r\nContent-Type: text/plain; charset=utf-8\r\n"
+           "Content-Range: bytes 0-1/36\r\n\r\n01\r\n"
+           "--%s\r\nContent-Type: text/plain; charset=utf-8\r\n"
+           "Content-Range: bytes 10-11/36\r\n\r\nab\r\n--%s--\r\n",
+           boundary, boundary, boundary);
+  ASSERT(!strcmp(body_of(out), expected));
+
+  char length[48];
+  snprintf(length, sizeof(length), "Content-Length: %zu\r\n",
+           strlen(expected));
+  ASSERT(strstr(out, length) != NULL);
+
+  TEST_END();
+}
+
+static int test_tw_serve_static(void) {
+  TEST_BEGIN();
+
+  static char out[4096];
+  serve("HEAD /data.txt HTTP/1.1\r\n\r\n", NULL, out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 200", 12) == 0);
+  ASSERT(strstr(out, "Content-Length: 36\r\n") != NULL);
+  ASSERT(!strcmp(body_of(out), ""));
+
+  serve("GET /sub/../%64ata.txt HTTP/1.1\r\n\r\n", NULL, out, sizeof(out));
+  ASSERT(!strcmp(body_of(out), content));
+
+  serve("GET /../data.txt HTTP/1.1\r\n\r\n", NULL, out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 404", 12) == 0);
+  serve("GET /missing HTTP/1.1\r\n\r\n", NULL, out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 404", 12) == 0);
+  serve("POST /data.txt HTTP/1.1\r\n\r\n", NULL, out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 405", 12) == 0);
+
+  /* a FIFO without a writer is not waited on */
+  char fifo[80];
+  snprintf(fifo, sizeof(fifo), "%s/fifo", dir);
+  ASSERT(mkfifo(fifo, 0600) == 0);
+  serve("GET /fifo HTTP/1.1\r\n\r\n", NULL, out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 404", 12) == 0);
+  unlink(fifo);
+
+  serve("GET /sub?x=1 HTTP/1.1\r\n\r\n", NULL, out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 301", 12) == 0);
+  ASSERT(strstr(out, "Location: /sub/?x=1\r\n") != NULL);
+  serve("GET /sub/ HTTP/1.1\r\n\r\n", NULL, out, sizeof(out));
+  ASSERT(strstr(out, "Content-Type: text/html") != NULL);
+  ASSERT(!strcmp(body_of(out), "<p>index</p>"));
+
+  /* redirects name the resolved path, never another host */
+  serve("GET //evil.example/.. HTTP/1.1\r\n\r\n", NULL, out, sizeof(out));
+  ASSERT(strncmp(out, "HTTP/1.1 301", 12) == 0);
+  ASSERT(strstr(out, "Location: /\r\n") != NULL);
+  char space[80];
+  snprintf(space, sizeof(space), "%s/sub/a b", dir);
+  ASSERT(mkdir(space, 0700) == 0);
+  serve("GET //sub/./a%20b HTTP/1.1\r\n\r\n", NULL, out, sizeof(out));
+  ASSERT(strstr(out, "Location: /sub/a%20b/\r\n") != NULL);
+  rmdir(space);
+
+  TEST_END();
+}
+
+static int test_tw_send_file_stream(void) {
+  TEST_BEGIN();
+
+  /* far more than a socket buffer, sent without reading it whole */
+  size_t size = 4 * 1024 * 1024;
+  char *data = (char *)malloc(size);
+  ASSERT(data != NULL);
+  if (data == NULL) TEST_END();
+  for (size_t i = 0; i < size; i++) data[i] = (char)('a' + i * 7 % 26);
+  char big[80];
+  snprintf(big, sizeof(big), "%s/big.bin", dir);
+  FILE *file = fopen(big, "wb");
+  ASSERT(file != NULL && fwrite(data, 1, size, file) == size);
+  if (file != NULL) fclose(file);
+
+  size_t out_size = size + 4096;
+  char *out = (char *)malloc(out_size);
+  ASSERT(out != NULL);
+  if (out == NULL) {
+    free(data);
+    TEST_END();
+  }
+  serve("GET /big.bin HTTP/1.1\r\n\r\n", NULL, out, out_size);
+  ASSERT(strncmp(out, "HTTP/1.1 200", 12) == 0);
+  const char *body = body_of(out);
+  ASSERT(!memcmp(body, data, size));
+  ASSERT(serve_out_cap < 64 * 1024);
+
+  serve("GET /big.bin HTTP/1.1\r\nRange: bytes=1000-2099999\r\n\r\n",
+        NULL, out, out_size);
+  ASSERT(strncmp(out, "HTTP/1.1 206", 12) == 0);
+  ASSERT(strstr(out, "Content-Length: 2099000\r\n") != NULL);
+  ASSERT(!memcmp(body_of(out), data + 1000, 2099000));
+
+  /* a streamed multipart body matches the one built from a pinned file */
+  const char *raw = "GET /big.bin HTTP/1.1\r\n"
+                    "Range: bytes=0-99999,3000000-4000000,-10\r\n\r\n";
+  size_t len = serve(raw, NULL, out, out_size);
+  ASSERT(strncmp(out, "HTTP/1.1 206", 12) == 0);
+  ASSERT(serve_out_cap < 64 * 1024);
+
+  static tw_server server;
+  memset(&server, 0, sizeof(server));
+  tw_file_cache_init(&server.file_cache);
+  server.file_cache.enabled = true;
+  server.file_cache.max_pinned = size;
+  serve_server = &server;
+  char *pinned = (char *)malloc(out_size);
+  ASSERT(pinned != NULL);
+  if (pinned != NULL) {
+    ASSERT(serve(raw, NULL, pinned, out_size) == len);
+    ASSERT(!memcmp(out, pinned, len));
+    free(pinned);
+  }
+  serve_server = NULL;
+  tw_file_cache_free(&server.file_cache);
+
+  unlink(big);
+  free(out);
+  free(data);
+  TEST_END();
+}
+
+static int test_tw_file_cache(void) {
+  TEST_BEGIN();
+
+  static tw_file_cache cache;
+  tw_file_cache_init(&cache);
+  cache.check_interval = 0;
+
+  int status = 0;
+  const tw_file_cache_entry *data = tw_file_cache_get(&cache, file_path,
+                                                      &status);
+  ASSERT(data != NULL && data->size == 36);
+  ASSERT(data->data != NULL && data->file == NULL);
+  ASSERT(!memcmp(data->data, content, 36));
+  ASSERT(!strcmp(data->content_type, "text/plain; charset=utf-8"));
+  ASSERT(tw_file_cache_get(&cache, file_path, &status) == data);
+
+  /* a changed file is loaded again on the next hit */
+  ASSERT(write_file(file_path, "changed"));
+  data = tw_file_cache_get(&cache, file_path, &status);
+  ASSERT(data != NULL && data->size == 7);
+  ASSERT(!memcmp(data->data, "changed", 7));
+  ASSERT(write_file(file_path, content));
+
+  char other[80];
+  snprintf(other, sizeof(other), "%s/sub/other.txt", dir);
+  ASSERT(write_file(other, "other"));
+  cache.max_pinned = 0;
+  const tw_file_cache_entry *entry = tw_file_cache_get(&cache, other,
+                                                       &status);
+  ASSERT(entry != NULL && entry->file != NULL && entry->data == NULL);
+
+  /* the least recently used entry makes room */
+  ASSERT(tw_file_cache_get(&cache, file_path, &status) != NULL);
+  char index[80];
+  snprintf(index, sizeof(index), "%s/sub/index.html", dir);
+  ASSERT(tw_file_cache_get(&cache, index, &status) != NULL);
+  ASSERT(tw__file_cache_find(&cache, other, tw__hash(other, strlen(other))) ==
+         NULL);
+  ASSERT(tw__file_cache_find(&cache, file_path,
+                             tw__hash(file_path, strlen(file_path))) != NULL);
+
+  ASSERT(tw_file_cache_get(&cache, dir, &status) == NULL && status == 404);
+  tw_file_cache_free(&cache);
+
+#ifdef __linux__
+  /* with a watch, changes evict without a stat on every hit */
+  tw_file_cache_init(&cache);
+  cache.check_interval = 60 * 1000;
+  cache.watch = true;
+  ASSERT(tw_file_cache_get(&cache, other, &status) != NULL);
+  ASSERT(write_file(other, "changed"));
+  entry = tw_file_cache_get(&cache, other, &status);
+  ASSERT(entry != NULL && entry->size == 7);
+  tw_file_cache_free(&cache);
+#endif
+  unlink(other);
+
+  /* responses come out the same through the cache */
+  static tw_server server;
+  memset(&server, 0, sizeof(server));
+  tw_file_cache_init(&server.file_cache);
+  server.file_cache.enabled = true;
+  serve_server = &server;
+
+  static char out[4096];
+  for (int i = 0; i < 2; i++) {
+    serve("GET /data.txt HTTP/1.1\r\nRange: bytes=0-3\r\n\r\n", NULL, out,
+          sizeof(out));
+    ASSERT(strncmp(out, "HTTP/1.1 206", 12) == 0);
+    ASSERT(!strcmp(body_of(out), "0123"));
+  }
+  serve("GET /sub/ HTTP/1.1\r\n\r\n", NULL, out, sizeof(out));
+  ASSERT(!strcmp(body_of(out), "<p>index</p>"));
+
+  serve_server = NULL;
+  tw_file_cache_free(&server.file_cache);
+
+  TEST_END();
+}
+
+int main(void) {
+  if (mkdtemp(dir) == NULL) return 1;
+  snprintf(file_path, sizeof(file_path), "%s/data.txt", dir);
+  char sub[64], index[80];
+  snprintf(sub, sizeof(sub), "%s/sub", dir);
+  snprintf(index, sizeof(index), "%s/index.html", sub);
+  if (!write_file(file_path, content) || mkdir(sub, 0700) != 0 ||
+      !write_file(index, "<p>index</p>")) {
+    return 1;
+  }
+
+  RUN_TEST(test_tw_http_date);
+  RUN_TEST(test_tw_etag_match);
+  RUN_TEST(test_tw_parse_ranges);
+  RUN_TEST(test_tw_send_file);
+  RUN_TEST(test_tw_send_file_ranges);
+  RUN_TEST(test_tw_serve_static);
+  RUN_TEST(test_tw_send_file_stream);
+  RUN_TEST(test_tw_file_cache);
+
+  unlink(index);
+  rmdir(sub);
+  unlink(file_path);
+  rmdir(dir);
+  return test_summary();
+}
@@ -0,0 +1,293 @@
+#include <assert.h>
+
+#include "test.h"
+
+#define TW_ENABLE_TLS
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+#include "server.h"
+
+#include <openssl/pem.h>
+#include <openssl/x509.h>
+
+static char cert_path[] = "/tmp/tw_tls_XXXXXX";
+
+/* Writes a self-signed certificate for localhost and its key to one file. */
+static bool write_cert(void) {
+  int fd = mkstemp(cert_path);
+  if (fd < 0) return false;
+  FILE *file = fdopen(fd, "w");
+  EVP_PKEY *key = EVP_EC_gen("P-256");
+  X509 *cert = X509_new();
+  if (file == NULL || key == NULL || cert == NULL) return false;
+
+  ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+  X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+  X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+  X509_set_pubkey(cert, key);
+  X509_NAME *name = X509_get_subject_name(cert);
+  X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC,
+                             (const unsigned char *)"localhost", -1, -1, 0);
+  X509_set_issuer_name(cert, name);
+  bool ok = X509_sign(cert, key, EVP_sha256()) > 0 &&
+            PEM_write_X509(file, cert) == 1 &&
+            PEM_write_PrivateKey(file, key, NULL, NULL, 0, NULL, NULL) == 1;
+
+  X509_free(cert);
+  EVP_PKEY_free(key);
+  return fclose(file) == 0 && ok;
+}
+
+static bool setup(const char *cert_file) {
+  tw_server_config config;
+  tw_server_config_init(&config);
+  config.tls_cert_file = cert_file;
+  return server_setup(&config);
+}
+
+static void handle_request(tw_conn *conn, tw_request *req, tw_response *res) {
+  tw_response_set_body(res, req->path, strlen(req->path));
+  tw_response_send(conn, res);
+}
+
+/* Accepts fd as tw__server_accept would. */
+static tw_conn *add_conn(int fd) {
+  tw_conn *conn = server_add_conn(fd);
+  return tw__tls_accept(&server, conn) ? conn : NULL;
+}
+
+/* Takes both sides of the handshake in turns until they are done. */
+static bool handshake(SSL *client, tw_conn *conn) {
+  for (int i = 0; i < 16; i++) {
+    int ret = SSL_do_handshake(client);
+    if (ret != 1 && SSL_get_error(client, ret) != SSL_ERROR_WANT_READ) {
+      return false;
+    }
+    if (conn->tls_handshake != 0 && !tw__tls_handshake(conn)) {
+      return false;
+    }
+    if (ret == 1 && conn->tls_handshake == 0) return true;
+  }
+  return false;
+}
+
+/* Requests path over a new connection, resuming session when given, and
+ * returns the session to resume the next time. */
+static SSL_SESSION *fetch(SSL_CTX *ctx, const char *path,
+                          SSL_SESSION *session, bool *resumed) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return NULL;
+  tw_conn *conn = add_conn(fds[0]);
+  SSL *client = SSL_new(ctx);
+  tw__set_nonblocking(fds[1]);
+  SSL_set_fd(client, fds[1]);
+  SSL_set_connect_state(client);
+  if (session != NULL) SSL_set_session(client, session);
+
+  SSL_SESSION *next = NULL;
+  char request[128];
+  char response[256];
+  int len = snprintf(request, sizeof(request),
+                     "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+  if (conn != NULL && handshake(client, conn) &&
+      SSL_write(client, request, len) == len &&
+      tw__conn_serve(conn, handle_request)) {
+    /* head and body come as separate records, the session tickets of
+     * TLS 1.3 before them */
+    size_t total = 0;
+    int n;
+    while (total < sizeof(response) - 1 &&
+           (n = SSL_read(client, response + total,
+                         (int)(sizeof(response) - 1 - total))) > 0) {
+      total += (size_t)n;
+    }
+    response[total] = '\0';
+    const char *body = strstr(response, "\r\n\r\n");
+    if (strncmp(response, "HTTP/1.1 200", 12) == 0 && body != NULL &&
+        strcmp(body + 4, path) == 0) {
+      next = SSL_get1_session(client);
+      *resumed = SSL_session_reused(client);
+    }
+  }
+
+  /* a session is only resumable after a clean shutdown */
+  SSL_shutdown(client);
+  SSL_free(client);
+  close(fds[1]);
+  if (conn != NULL) tw_conn_close(conn);
+  server.nfds--;
+  return next;
+}
+
+static int test_tw_tls_setup(void) {
+  TEST_BEGIN();
+
+  ASSERT(!setup("/nonexistent/cert.pem"));
+  ASSERT(server.tls_ctx == NULL);
+
+  ASSERT(setup(NULL));
+  ASSERT(server.tls_ctx == NULL);
+  tw_server_stop(&server);
+
+  /* the key is read from the certificate file without tls_key_file */
+  ASSERT(setup(cert_path));
+  ASSERT(server.tls_ctx != NULL);
+  tw_server_stop(&server);
+  ASSERT(server.tls_ctx == NULL);
+
+  TEST_END();
+}
+
+static int test_tw_tls_request(void) {
+  TEST_BEGIN();
+
+  ASSERT(setup(cert_path));
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  ASSERT(ctx != NULL);
+  SSL_CTX_set_alpn_protos(ctx, (const unsigned char *)"\x08http/1.1", 9);
+
+  bool resumed = true;
+  SSL_SESSION *session = fetch(ctx, "/first", NULL, &resumed);
+  ASSERT(session != NULL && !resumed);
+
+  /* the second connection skips the full handshake */
+  SSL_SESSION *again = fetch(ctx, "/second", session, &resumed);
+  ASSERT(again != NULL && resumed);
+
+  SSL_SESSION_free(session);
+  SSL_SESSION_free(again);
+  SSL_CTX_free(ctx);
+  tw_server_stop(&server);
+
+  TEST_END();
+}
+
+static int test_tw_tls_plaintext(void) {
+  TEST_BEGIN();
+
+  ASSERT(setup(cert_path));
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  tw_conn *conn = add_conn(fds[0]);
+  ASSERT(conn != NULL && conn->tls_handshake == POLLIN);
+
+  /* the handshake waits for more, then fails on a plaintext request */
+  ASSERT(tw__tls_handshake(conn) && conn->tls_handshake == POLLIN);
+  const char *raw = "GET / HTTP/1.1\r\n\r\n";
+  send(fds[1], raw, strlen(raw), 0);
+  ASSERT(!tw__tls_handshake(conn));
+  ASSERT(!tw_conn_ktls_send(conn) && !tw_conn_ktls_recv(conn));
+
+  tw_conn_close(conn);
+  close(fds[1]);
+  tw_server_stop(&server);
+
+  TEST_END();
+}
+
+static int test_tw_tls_pending(void) {
+  TEST_BEGIN();
+
+  ASSERT(setup(cert_path));
+  SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+  ASSERT(ctx != NULL);
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  tw_conn *conn = add_conn(fds[0]);
+  SSL *client = SSL_new(ctx);
+  tw__set_nonblocking(fds[1]);
+  SSL_set_fd(client, fds[1]);
+  SSL_set_connect_state(client);
+  ASSERT(conn != NULL && handshake(client, conn));
+
+  /* the rest of a record read in part is only visible to OpenSSL */
+  const char *data = "0123456789abcdefghij";
+  ASSERT(SSL_write(client, data, 20) == 20);
+  char buf[32];
+  ASSERT(tw__conn_recv(conn, buf, 5) == 5);
+  server.fds[0].revents = 0;
+  ASSERT(tw__tls_pending(&server, true) == 1);
+  ASSERT(server.fds[0].revents == POLLIN);
+
+  /* a connection not waiting to read is left alone */
+  server.fds[0].events = POLLOUT;
+  ASSERT(tw__tls_pending(&server, false) == 0);
+  server.fds[0].events = POLLIN;
+
+  ASSERT(tw__conn_recv(conn, buf, sizeof(buf)) == 15);
+  ASSERT(tw__tls_pending(&server, false) == 0);
+
+  SSL_free(client);
+  close(fds[1]);
+  tw_conn_close(conn);
+  server.nfds--;
+  SSL_CTX_free(ctx);
+  tw_server_stop(&server);
+
+  TEST_END();
+}
+
+/* Connects to the listener as a client would. */
+static int connect_to(const tw_listener *listener) {
+  struct sockaddr_storage addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(listener->fd, (struct sockaddr *)&addr, &len) != 0) {
+    return -1;
+  }
+  int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, len) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int test_tw_tls_refuse(void) {
+  TEST_BEGIN();
+
+  ASSERT(setup(cert_path));
+  char path[64];
+  snprintf(path, sizeof(path), "unix:@tw_tls_%d", (int)getpid());
+  ASSERT(tw_server_listen(&server, path, 0));
+
+  /* a refused connection is closed without a session or a plaintext 503 */
+  server.reads_paused = true;
+  int peer = connect_to(&server.listeners[0]);
+  ASSERT(peer >= 0);
+  tw__server_accept(&server, &server.listeners[0]);
+  ASSERT(server.nfds == 1);
+  char buf[16];
+  ASSERT(recv(peer, buf, sizeof(buf), 0) == 0);
+  close(peer);
+
+  /* an admitted one gets its session */
+  server.reads_paused = false;
+  peer = connect_to(&server.listeners[0]);
+  ASSERT(peer >= 0);
+  tw__server_accept(&server, &server.listeners[0]);
+  ASSERT(server.nfds == 2);
+  ASSERT(server.conns[1].tls != NULL);
+
+  tw_conn_close(&server.conns[1]);
+  server.nfds--;
+  close(peer);
+  tw_server_stop(&server);
+
+  TEST_END();
+}
+
+int main(void) {
+  if (!write_cert()) {
+    fprintf(stderr, "Failed to write a certificate\n");
+    return 1;
+  }
+
+  RUN_TEST(test_tw_tls_setup);
+  RUN_TEST(test_tw_tls_request);
+  RUN_TEST(test_tw_tls_plaintext);
+  RUN_TEST(test_tw_tls_pending);
+  RUN_TEST(test_tw_tls_refuse);
+
+  unlink(cert_path);
+  return test_summary();
+}
@@ -0,0 +1,101 @@
+#include <assert.h>
+
+#include "test.h"
+
+/* small enough for the tests to wrap */
+#define TW_TRACE_EVENTS 8
+#define TW_ENABLE_TRACE
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+#include "server.h"
+
+static void handle_request(tw_conn *conn, tw_request *req, tw_response *res) {
+  (void)req;
+  tw_response_set_body(res, "ok", 2);
+  tw_response_send(conn, res);
+}
+
+/* Counts the events named name in the dump at path. */
+static int count_events(const char *path, const char *name) {
+  static char json[8192];
+  FILE *file = fopen(path, "r");
+  if (file == NULL) return -1;
+  size_t len = fread(json, 1, sizeof(json) - 1, file);
+  fclose(file);
+  json[len] = '\0';
+
+  char needle[64];
+  snprintf(needle, sizeof(needle), "\"name\":\"%s\"", name);
+  int count = 0;
+  for (const char *p = json; (p = strstr(p, needle)) != NULL; p++) {
+    count++;
+  }
+  return count;
+}
+
+static int test_tw_trace_phases(void) {
+  TEST_BEGIN();
+
+  ASSERT(server_setup(NULL));
+  server.trace.enabled = true;
+
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  const char *raw = "GET / HTTP/1.1\r\n\r\nGET / HTTP/1.1\r\n"
+                    "Connection: close\r\n\r\n";
+  send(fds[1], raw, strlen(raw), 0);
+
+  tw_conn *conn = server_add_conn(fds[0]);
+
+  /* both requests are served, the connection closes after the second */
+  ASSERT(!tw__conn_serve(conn, handle_request));
+  /* the connection was not accepted, its first request has no wait */
+  ASSERT(server.trace.next == 7);
+  for (int i = 0; i < 3; i++) {
+    tw_trace_event *event = &server.trace.events[i];
+    ASSERT(event->fd == fds[0] && event->start <= event->end);
+    ASSERT(event->phase == (i == 0 ? TW_TRACE_PARSE
+                            : i == 1 ? TW_TRACE_SEND
+                                     : TW_TRACE_HANDLER));
+  }
+  /* the second request waited from the end of the first */
+  ASSERT(server.trace.events[3].phase == TW_TRACE_WAIT);
+  ASSERT(server.trace.events[3].start == server.trace.events[2].end);
+
+  char path[] = "/tmp/tw_trace_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT(fd >= 0);
+  close(fd);
+  ASSERT(tw_trace_dump(&server, path));
+  ASSERT(count_events(path, "parse") == 2);
+  ASSERT(count_events(path, "handler") == 2);
+  ASSERT(count_events(path, "send") == 2);
+  ASSERT(count_events(path, "wait") == 1);
+
+  /* past TW_TRACE_EVENTS only the latest are kept */
+  server.trace.next = 0;
+  for (int i = 0; i < 12; i++) {
+    uint64_t start = tw__trace_fd(&server, 3, TW_TRACE_PARSE, 0);
+    tw__trace_fd(&server, 3, i < 4 ? TW_TRACE_WAIT : TW_TRACE_SEND, start);
+  }
+  ASSERT(tw_trace_dump(&server, path));
+  ASSERT(count_events(path, "wait") == 0);
+  ASSERT(count_events(path, "send") == 8);
+
+  /* nothing is recorded while tracing is off */
+  server.trace.enabled = false;
+  ASSERT(tw__trace_fd(&server, 3, TW_TRACE_SEND, 1) == 0);
+  ASSERT(server.trace.next == 12);
+
+  unlink(path);
+  close(fds[1]);
+  tw_server_stop(&server);
+
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_trace_phases);
+
+  return test_summary();
+}
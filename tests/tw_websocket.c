@@ -0,0 +1,200 @@
+#include <assert.h>
+
+#include "test.h"
+
+#define TW_ENABLE_WEBSOCKET
+#define THINWIRE_IMPL
+#include "../thinwire.h"
+
+static int test_tw_ws_accept_key(void) {
+  TEST_BEGIN();
+
+  /* RFC 6455 section 1.3 */
+  char accept[29];
+  tw_ws_accept_key("dGhlIHNhbXBsZSBub25jZQ==", accept);
+  ASSERT(!strcmp(accept, "s3pPLMBiTxaQ9kYGzzhZRbK+xOo="));
+
+  TEST_END();
+}
+
+static int test_tw_ws_unmask(void) {
+  TEST_BEGIN();
+
+  const uint8_t mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+  char data[300];
+  char expected[300];
+
+  /* every length exercises a different mix of vector and scalar steps */
+  for (size_t len = 0; len < sizeof(data); len++) {
+    for (size_t i = 0; i < len; i++) {
+      data[i] = (char)(i * 31 + len);
+      expected[i] = (char)(data[i] ^ mask[i % 4]);
+    }
+    tw_ws_unmask(data, len, mask);
+    ASSERT(memcmp(data, expected, len) == 0);
+  }
+
+  TEST_END();
+}
+
+static int test_tw_utf8_valid(void) {
+  TEST_BEGIN();
+
+  ASSERT(tw__utf8_valid("", 0));
+  ASSERT(tw__utf8_valid("plain ascii text", 16));
+  ASSERT(tw__utf8_valid("h\xc3\xa9llo \xe2\x9c\x93 \xf0\x9f\x98\x80", 15));
+  ASSERT(!tw__utf8_valid("\xff", 1));
+  ASSERT(!tw__utf8_valid("\xc3", 1));
+  ASSERT(!tw__utf8_valid("\xc0\xaf", 2));
+  ASSERT(!tw__utf8_valid("\xed\xa0\x80", 3));
+  ASSERT(!tw__utf8_valid("\xf4\x90\x80\x80", 4));
+
+  TEST_END();
+}
+
+static char received[64];
+static size_t received_len;
+static tw_ws_opcode received_opcode;
+static int messages;
+
+static void on_message(tw_websocket *ws, tw_ws_opcode opcode,
+                       const char *data, size_t len) {
+  (void)ws;
+  memcpy(received, data, len);
+  received_len = len;
+  received_opcode = opcode;
+  messages++;
+}
+
+static size_t masked_frame(char *out, uint8_t b0, const char *data,
+                           size_t len) {
+  const uint8_t mask[4] = {1, 2, 3, 4};
+  out[0] = (char)b0;
+  out[1] = (char)(0x80 | len);
+  memcpy(out + 2, mask, 4);
+  for (size_t i = 0; i < len; i++) {
+    out[6 + i] = (char)(data[i] ^ mask[i % 4]);
+  }
+  return 6 + len;
+}
+
+static int test_tw_ws_process(void) {
+  TEST_BEGIN();
+
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+
+  tw_conn conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.fd = fds[0];
+
+  tw_websocket ws;
+  memset(&ws, 0, sizeof(ws));
+  ws.conn = &conn;
+  ws.handlers.on_message = on_message;
+
+  /* a fragmented text message with a ping in between, split mid-frame */
+  char wire[128];
+  size_t len = masked_frame(wire, 0x01, "hel", 3);
+  len += masked_frame(wire + len, 0x89, "p", 1);
+  len += masked_frame(wire + len, 0x80, "lo", 2);
+
+  ws.in = (char *)malloc(sizeof(wire));
+  ws.in_cap = sizeof(wire);
+  memcpy(ws.in, wire, len - 3);
+  ws.in_len = len - 3;
+  tw__ws_process(&ws);
+  ASSERT(messages == 0);
+  ASSERT(ws.message_len == 3);
+
+  memcpy(ws.in + ws.in_len, wire + len - 3, 3);
+  ws.in_len += 3;
+  tw__ws_process(&ws);
+  ASSERT(messages == 1);
+  ASSERT(received_opcode == TW_WS_TEXT);
+  ASSERT(received_len == 5 && memcmp(received, "hello", 5) == 0);
+  ASSERT(ws.in_len == 0);
+
+  /* the ping was answered */
+  char pong[8];
+  ASSERT(recv(fds[1], pong, sizeof(pong), 0) == 3);
+  ASSERT((uint8_t)pong[0] == 0x8a && pong[1] == 1 && pong[2] == 'p');
+
+  /* unmasked client frames are a protocol error */
+  ws.in[0] = (char)0x82;
+  ws.in[1] = 0;
+  ws.in_len = 2;
+  tw__ws_process(&ws);
+  ASSERT(ws.closing);
+  ASSERT(ws.close_code == 1002);
+
+  free(ws.in);
+  free(ws.message);
+  free(ws.out);
+  close(fds[0]);
+  close(fds[1]);
+  TEST_END();
+}
+
+static int test_tw_ws_backlog(void) {
+  TEST_BEGIN();
+
+  int fds[2];
+  ASSERT(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+  tw__set_nonblocking(fds[0]);
+  tw__set_nonblocking(fds[1]);
+
+  tw_conn conn;
+  memset(&conn, 0, sizeof(conn));
+  conn.fd = fds[0];
+
+  tw_websocket ws;
+  memset(&ws, 0, sizeof(ws));
+  ws.conn = &conn;
+  ws.handlers.on_message = on_message;
+
+  /* a client that sends PINGs and never reads the PONGs */
+  static char pings[4096];
+  size_t len = 0;
+  while (len + 6 + 100 <= sizeof(pings)) {
+    static const char payload[100] = "ping";
+    len += masked_frame(pings + len, 0x89, payload, sizeof(payload));
+  }
+  bool backlogged = false;
+  for (int i = 0; i < 2000 && !backlogged; i++) {
+    send(fds[1], pings, len, 0);
+    ASSERT(tw__ws_on_ready(&ws, POLLIN));
+    ASSERT(ws.out_len - ws.out_off <= TW_OUTPUT_HIGH_WATER + len);
+    backlogged = !(tw__ws_events(&ws) & POLLIN);
+  }
+  ASSERT(backlogged);
+
+  /* nothing more is queued until it reads */
+  tw_websocket *sockets[1] = {&ws};
+  ASSERT(!tw_ws_send(&ws, TW_WS_TEXT, "x", 1));
+  ASSERT(tw_ws_broadcast(sockets, 1, TW_WS_TEXT, "x", 1) == 0);
+  ASSERT(!ws.closing);
+  static char buf[64 * 1024];
+  while (recv(fds[1], buf, sizeof(buf), 0) > 0) {
+    ASSERT(tw__ws_on_ready(&ws, POLLOUT));
+  }
+  ASSERT(ws.out_len == 0 && (tw__ws_events(&ws) & POLLIN));
+  ASSERT(tw_ws_send(&ws, TW_WS_TEXT, "x", 1));
+
+  free(ws.in);
+  free(ws.message);
+  free(ws.out);
+  close(fds[0]);
+  close(fds[1]);
+  TEST_END();
+}
+
+int main(void) {
+  RUN_TEST(test_tw_ws_accept_key);
+  RUN_TEST(test_tw_ws_unmask);
+  RUN_TEST(test_tw_utf8_valid);
+  RUN_TEST(test_tw_ws_process);
+  RUN_TEST(test_tw_ws_backlog);
+
+  return test_summary();
+}
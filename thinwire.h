@@ -9,22 +9,73 @@ extern "C" {
 #define TWDEF
 #endif
 
+/* accept4() is a GNU extension; this only takes effect when thinwire.h is
+ * included before any system header */
+#if defined(THINWIRE_IMPL) && defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
+/* macOS only declares the ucontext routines for XSI programs */
+#if defined(THINWIRE_IMPL) && defined(TW_ENABLE_COROUTINES) && \
+    defined(__APPLE__) && !defined(_XOPEN_SOURCE)
+#define _XOPEN_SOURCE 600
+#define _DARWIN_C_SOURCE
+#endif
+
+#include <errno.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #ifdef _WIN32
+#include <io.h>
 #include <winsock2.h>
 #else
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <strings.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 #include <unistd.h>
 #endif
 
+#ifdef TW_ENABLE_COMPRESSION
+#include <zlib.h>
+#endif
+
+#ifdef TW_ENABLE_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#if defined(TW_ENABLE_COROUTINES) && !defined(_WIN32)
+#include <sys/mman.h>
+#include <ucontext.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #ifdef _WIN32
 typedef int socklen_t;
 #define close(fd) closesocket(fd)
@@ -59,18 +110,512 @@ TWDEF bool tw_map_empty(tw_map *map);
 #define TW_MAX_CLIENTS 100
 #endif
 
+#ifndef TW_MAX_LISTENERS
+#define TW_MAX_LISTENERS 4
+#endif
+
+#ifndef TW_DEFAULT_BACKLOG
+#define TW_DEFAULT_BACKLOG 511
+#endif
+
+#ifndef TW_RETRY_AFTER
+#define TW_RETRY_AFTER 1
+#endif
+
+/* milliseconds a draining server waits for in-flight requests */
+#ifndef TW_DRAIN_TIMEOUT
+#define TW_DRAIN_TIMEOUT 30000
+#endif
+
+/* upper bound on connections taken from one listener per wakeup */
+#ifndef TW_ACCEPT_BATCH
+#define TW_ACCEPT_BATCH 64
+#endif
+
+/* bytes of responses to pipelined requests collected into one write */
+#ifndef TW_COALESCE_SIZE
+#define TW_COALESCE_SIZE (16 * 1024)
+#endif
+
+/* bytes queued for an HTTP/2 or websocket peer that does not read, above
+ * which its input is left unread until the output drains */
+#ifndef TW_OUTPUT_HIGH_WATER
+#define TW_OUTPUT_HIGH_WATER (1024 * 1024)
+#endif
+
+/* connection buffers are taken from per-size free lists, in powers of two
+ * from TW_BUFFER_POOL_MIN to TW_BUFFER_POOL_MAX bytes; larger ones come
+ * from malloc */
+#ifndef TW_BUFFER_POOL_MIN
+#define TW_BUFFER_POOL_MIN 512
+#endif
+#ifndef TW_BUFFER_POOL_MAX
+#define TW_BUFFER_POOL_MAX (64 * 1024)
+#endif
+/* bytes of returned buffers kept for reuse, the rest is freed */
+#ifndef TW_BUFFER_POOL_IDLE
+#define TW_BUFFER_POOL_IDLE (4 * 1024 * 1024)
+#endif
+
+#ifdef TW_ENABLE_TLS
+/* TLS sessions the server keeps for resumption by session ID; clients
+ * that support tickets resume without any server state */
+#ifndef TW_TLS_SESSION_CACHE_SIZE
+#define TW_TLS_SESSION_CACHE_SIZE 1024
+#endif
+#endif
+
+#ifdef TW_ENABLE_COROUTINES
+/* stack of a handler coroutine, a guard page below it faults on overflow */
+#ifndef TW_CORO_STACK_SIZE
+#define TW_CORO_STACK_SIZE (64 * 1024)
+#endif
+
+/* finished coroutines kept for reuse, the rest are unmapped */
+#ifndef TW_CORO_POOL_SIZE
+#define TW_CORO_POOL_SIZE 16
+#endif
+#endif
+
+#if defined(__linux__) && defined(SOCK_NONBLOCK) && \
+    (defined(__USE_GNU) || (!defined(__GLIBC__) && defined(_GNU_SOURCE)))
+#define TW_HAVE_ACCEPT4
+#endif
+
+/* what happens to new connections while the server is at capacity */
+typedef enum {
+  /* answer with a preformatted 503 and Retry-After, then close */
+  TW_OVERLOAD_REJECT = 0,
+  /* close the least recently active idle keep-alive connection to make
+   * room, rejecting only when there is none */
+  TW_OVERLOAD_DROP_IDLE,
+  /* stop accepting and leave connections in the kernel backlog */
+  TW_OVERLOAD_BACKLOG
+} tw_overload_policy;
+
+typedef struct {
+  int port;
+  /* numeric IPv4 or IPv6 address, "unix:/path" or "unix:@abstract" (Linux)
+   * to listen on, NULL listens on all IPv4 interfaces; port is ignored
+   * for Unix domain sockets */
+  const char *bind_addr;
+  int backlog;
+  bool reuse_addr;
+  /* the options below are set on the listening socket and apply to every
+   * accepted connection, 0 or false keeps the system default */
+  int recv_buf_size;
+  int send_buf_size;
+  bool tcp_nodelay;
+  /* seconds the kernel may hold a connection until data arrives (Linux) */
+  int defer_accept;
+  /* length of the TCP Fast Open queue */
+  int fastopen_queue;
+  /* microseconds to busy poll the device queue on reads (Linux) */
+  int busy_poll;
+  /* bytes all connections may hold in request bodies and protocol
+   * buffers, 0 is unlimited */
+  size_t memory_budget;
+  /* open connections before the overload policy applies, at most and by
+   * default TW_MAX_CLIENTS; a server above 7/8 of its memory budget
+   * counts as overloaded as well */
+  int max_connections;
+  tw_overload_policy overload_policy;
+  /* largest Content-Length admitted, TW_MAX_REQUEST_BODY by default */
+  size_t max_body_size;
+  /* milliseconds tw_server_drain waits before closing what is left,
+   * TW_DRAIN_TIMEOUT by default */
+  int drain_timeout;
+#ifdef TW_ENABLE_TLS
+  /* PEM files with the certificate chain and its private key; when set,
+   * every listener speaks TLS */
+  const char *tls_cert_file;
+  const char *tls_key_file;
+#endif
+} tw_server_config;
+
+typedef enum {
+  TW_ENCODING_IDENTITY = 0,
+  TW_ENCODING_DEFLATE = 1 << 0,
+  TW_ENCODING_GZIP = 1 << 1
+} tw_encoding;
+
+#ifdef TW_ENABLE_COMPRESSION
+
+#ifndef TW_COMPRESSION_MIN_SIZE
+#define TW_COMPRESSION_MIN_SIZE 1024
+#endif
+
+#ifndef TW_COMPRESSION_CACHE_SIZE
+#define TW_COMPRESSION_CACHE_SIZE 64
+#endif
+
+#ifndef TW_COMPRESSION_CACHE_MAX_BODY
+#define TW_COMPRESSION_CACHE_MAX_BODY (1024 * 1024)
+#endif
+
+typedef struct {
+  bool enabled;
+  int level;
+  size_t min_size;
+  /* NULL-terminated list of content type prefixes, NULL uses the defaults */
+  const char *const *content_types;
+  bool cache;
+} tw_compression_config;
+
+typedef struct {
+  /* the hash only narrows the search, hits compare the body itself */
+  uint64_t hash;
+  char *body;
+  size_t body_len;
+  tw_encoding encoding;
+  int level;
+  char *data;
+  size_t data_len;
+  uint64_t last_used;
+} tw_compression_cache_entry;
+
+typedef struct {
+  tw_compression_cache_entry entries[TW_COMPRESSION_CACHE_SIZE];
+  uint64_t clock;
+} tw_compression_cache;
+
+#endif
+
+/* buckets of the rate limiter, a power of two */
+#ifndef TW_RATE_LIMIT_SIZE
+#define TW_RATE_LIMIT_SIZE 1024
+#endif
+
+/* buckets a client may land in, the least recently seen is evicted */
+#ifndef TW_RATE_LIMIT_PROBE
+#define TW_RATE_LIMIT_PROBE 8
+#endif
+
+#ifndef TW_RATE_LIMIT_RATE
+#define TW_RATE_LIMIT_RATE 50
+#endif
+
+#ifndef TW_RATE_LIMIT_BURST
+#define TW_RATE_LIMIT_BURST 100
+#endif
+
+/* proxies whose rate limit header is believed */
+#ifndef TW_RATE_LIMIT_TRUSTED
+#define TW_RATE_LIMIT_TRUSTED 4
+#endif
+
+/* bytes of a client key kept in its bucket, longer keys are told apart by
+ * their first bytes, length and hash */
+#ifndef TW_RATE_LIMIT_KEY_SIZE
+#define TW_RATE_LIMIT_KEY_SIZE 40
+#endif
+
+typedef struct {
+  /* hash of the client, 0 when the bucket is free */
+  uint64_t hash;
+  /* milliseconds timestamp of the last refill, which is the last time the
+   * client was seen */
+  uint64_t refilled;
+  /* in thousandths of a request */
+  uint32_t tokens;
+  /* the key of the client, so that a hash collision is not a match */
+  uint32_t key_len;
+  char key[TW_RATE_LIMIT_KEY_SIZE];
+} tw_rate_bucket;
+
+typedef struct {
+  bool enabled;
+  /* requests per second a client may sustain and may make at once */
+  uint32_t rate;
+  uint32_t burst;
+  /* a request header to tell clients apart by instead of their address,
+   * such as an API key or X-Forwarded-For. Only believed on connections
+   * from a proxy added with tw_rate_limit_trust, and of a list only the
+   * last entry counts, the one that proxy added */
+  const char *header;
+  /* trusted proxy addresses as IPv6, IPv4 ones mapped */
+  unsigned char trusted[TW_RATE_LIMIT_TRUSTED][16];
+  int num_trusted;
+  /* peers on Unix sockets are trusted */
+  bool trust_unix;
+  /* milliseconds timestamp, updated once per poll wakeup */
+  uint64_t now;
+  tw_rate_bucket buckets[TW_RATE_LIMIT_SIZE];
+} tw_rate_limit;
+
+#ifndef TW_FILE_CACHE_SIZE
+#define TW_FILE_CACHE_SIZE 64
+#endif
+
+#ifndef TW_FILE_CACHE_CHECK_INTERVAL
+#define TW_FILE_CACHE_CHECK_INTERVAL 1000
+#endif
+
+#ifndef TW_FILE_CACHE_MAX_PINNED
+#define TW_FILE_CACHE_MAX_PINNED (64 * 1024)
+#endif
+
+typedef struct {
+  /* the key, NULL when the entry is free */
+  char *path;
+  uint64_t hash;
+  /* open while the contents are not pinned in data */
+  FILE *file;
+  char *data;
+  uint64_t size;
+  time_t mtime;
+  uint64_t ino;
+  char etag[48];
+  char last_modified[30];
+  const char *content_type;
+  /* milliseconds timestamp of the last stat */
+  uint64_t checked;
+  uint64_t last_used;
+  /* inotify watch descriptor, -1 without one */
+  int watch;
+} tw_file_cache_entry;
+
+typedef struct {
+  bool enabled;
+  /* milliseconds a hit is trusted before the file is stat'ed again, 0
+   * checks on every hit */
+  int check_interval;
+  /* files up to this size are kept in memory instead of open, larger
+   * ones are streamed from the file and never compressed */
+  size_t max_pinned;
+  /* on Linux, evict entries when inotify reports a change instead */
+  bool watch;
+  tw_file_cache_entry entries[TW_FILE_CACHE_SIZE];
+  uint64_t clock;
+  int inotify_fd;
+} tw_file_cache;
+
+#ifdef TW_ENABLE_TRACE
+
+/* events kept per server, a power of two */
+#ifndef TW_TRACE_EVENTS
+#define TW_TRACE_EVENTS 4096
+#endif
+
+#ifndef TW_TRACE_PATH
+#define TW_TRACE_PATH "thinwire-trace.json"
+#endif
+
+typedef enum {
+  TW_TRACE_ACCEPT,
+  /* from accept or the previous response to the next request */
+  TW_TRACE_WAIT,
+  /* tw_request_parse and admitting the body */
+  TW_TRACE_PARSE,
+  TW_TRACE_HANDLER,
+  TW_TRACE_SEND
+} tw_trace_phase;
+
+/* a phase of a connection, in ticks of the trace clock */
 typedef struct {
+  uint64_t start;
+  uint64_t end;
   int fd;
-  struct sockaddr_in addr;
+  int phase;
+} tw_trace_event;
+
+typedef struct {
+  bool enabled;
+  /* where a requested dump goes, TW_TRACE_PATH when NULL */
+  const char *path;
+  /* set by tw_trace_request_dump, possibly from a signal handler */
+  volatile sig_atomic_t dump_requested;
+  /* a ring of the latest events */
+  tw_trace_event events[TW_TRACE_EVENTS];
+  uint64_t next;
+  /* ticks and nanoseconds at the same instant, for converting ticks */
+  uint64_t origin_ticks;
+  uint64_t origin_ns;
+} tw_trace;
+
+#endif
+
+struct tw_server;
+struct tw_request;
+struct tw_h2_session;
+struct tw_websocket;
+struct tw_client_call;
+struct tw_coro;
+
+/* a peer address, without the room sockaddr_storage keeps for others */
+typedef union {
+  struct sockaddr sa;
+  struct sockaddr_in in;
+  struct sockaddr_in6 in6;
+} tw_sockaddr;
+
+/* Connections live in the server's table for as long as they are open, so
+ * an idle one holds nothing but this struct. Buffers come from the
+ * server's pool while there is something to read or write. */
+typedef struct {
+  int fd;
+  socklen_t addr_len;
+  tw_sockaddr addr;
+  struct tw_server *server;
+
+  /* bytes charged to the server memory budget, of which buffered belong
+   * to the HTTP/2 or websocket state */
+  size_t memory;
+  size_t buffered;
+  /* server tick of the last activity, for picking idle victims */
+  uint64_t last_active;
+  /* bytes read past the end of the last request, charged to memory */
+  char *pipelined;
+  size_t pipelined_len;
+  /* responses held back while the next pipelined request is answered,
+   * and what the socket did not take yet from out_off on. The out_cap
+   * bytes of out are charged to memory while allocated */
+  char *out;
+  size_t out_len;
+  size_t out_off;
+  size_t out_cap;
+  bool coalesce;
+  /* out was flushed but not all of it written, nothing more is read
+   * until it was */
+  bool blocked;
+  /* the connection closes once out was written */
+  bool closing;
+  /* a file body written after out as the socket takes it */
+  struct tw__file_body *file_body;
+  /* an error response was already sent, the connection must close */
+  bool rejected;
+  /* a request was answered, until then the first one is on its way */
+  bool served;
+
+#ifdef TW_ENABLE_HTTP2
+  /* set once the connection speaks HTTP/2 */
+  struct tw_h2_session *h2;
+#endif
+
+#ifdef TW_ENABLE_WEBSOCKET
+  /* set once the connection was upgraded to a websocket */
+  struct tw_websocket *ws;
+#endif
+
+#ifdef TW_ENABLE_CLIENT
+  /* set when the connection leads to an upstream server */
+  struct tw_client_call *upstream;
+  /* the call a handler is waiting on before this connection answers */
+  struct tw_client_call *waiting;
+  /* read again on the next pass, a pipelined request may be buffered */
+  bool resume;
+#endif
+
+#ifdef TW_ENABLE_COROUTINES
+  /* the coroutine serving requests, kept while the handler is suspended */
+  struct tw_coro *coro;
+#endif
+
+#ifdef TW_ENABLE_TRACE
+  /* trace ticks when the connection started waiting for a request */
+  uint64_t trace_mark;
+#endif
+
+#ifdef TW_ENABLE_PARK
+  /* set while the handler's response is written through a handle */
+  struct tw_parked *parked;
+#endif
+
+#ifdef TW_ENABLE_TLS
+  /* set on connections accepted by a TLS server */
+  SSL *tls;
+  /* the events the unfinished handshake waits for, 0 once it is done */
+  short tls_handshake;
+#endif
 } tw_conn;
 
 typedef struct {
   int fd;
-  struct sockaddr_in addr;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  /* the control socket a successor connects to for the listeners */
+  bool handoff;
+  /* the read end of the wakeup for parked connections */
+  bool wakeup;
+} tw_listener;
+
+/* Decides whether a request body is read before the handler runs. Returns
+ * 0 to admit it, or the status to reject the request with. */
+typedef int (*tw_body_admission_fn)(tw_conn *conn, struct tw_request *req,
+                                    size_t content_length);
+
+/* Free lists of connection buffers by size class, linked through the
+ * buffers themselves. */
+typedef struct {
+  void *free[16];
+  /* bytes held in the lists */
+  size_t idle;
+} tw_buffer_pool;
+
+typedef struct tw_server {
+  tw_listener listeners[TW_MAX_LISTENERS];
+  int num_listeners;
+  tw_server_config config;
+  size_t memory_used;
+  bool reads_paused;
+  /* incremented once per poll wakeup */
+  uint64_t tick;
+
+  /* optional, consulted for every HTTP/1 request that declares a body */
+  tw_body_admission_fn body_admission;
+
+  /* set by tw_server_drain, possibly from a signal handler */
+  volatile sig_atomic_t drain_requested;
+  bool draining;
+  uint64_t drain_deadline;
+  /* the listeners now belong to another process */
+  bool handed_off;
+
+#ifdef TW_ENABLE_CLIENT
+  /* a connection has resume set, poll must not block */
+  bool resume_pending;
+#endif
+
+#ifdef TW_ENABLE_COROUTINES
+  /* finished coroutines with their stacks, ready for the next request */
+  struct tw_coro *coro_pool;
+  int coro_pooled;
+#endif
 
-  struct pollfd fds[TW_MAX_CLIENTS + 1];
-  tw_conn conns[TW_MAX_CLIENTS + 1];
+  /* the first num_listeners slots poll the listeners */
+  struct pollfd fds[TW_MAX_LISTENERS + TW_MAX_CLIENTS];
+  tw_conn conns[TW_MAX_LISTENERS + TW_MAX_CLIENTS];
   int nfds;
+
+  /* buffers connections returned once they went idle */
+  tw_buffer_pool buffers;
+
+#ifdef TW_ENABLE_COMPRESSION
+  tw_compression_config compression;
+  tw_compression_cache compression_cache;
+#endif
+
+  /* open files and validators for tw_response_send_file */
+  tw_file_cache file_cache;
+
+  /* answers clients over their request rate with 429 */
+  tw_rate_limit rate_limit;
+
+#ifdef TW_ENABLE_TRACE
+  tw_trace trace;
+#endif
+
+#ifdef TW_ENABLE_TLS
+  /* set when config.tls_cert_file is */
+  SSL_CTX *tls_ctx;
+#endif
+
+#ifdef TW_ENABLE_PARK
+  /* messages for parked connections from any thread, newest first */
+  struct tw_park_msg *park_inbox;
+  /* written to when the inbox was empty, the listener slot reads it */
+  int park_wakeup;
+#endif
 } tw_server;
 
 #ifndef TW_MAX_HEADERS
@@ -98,22 +643,78 @@ typedef struct {
 #define TW_MAX_REQUEST_BODY (128 * 1024 * 1024)
 #endif
 
+/* header fields the parser resolves while scanning, so that lookups of
+ * them do not need to search the header block */
+typedef enum {
+  TW_HEADER_HOST = 0,
+  TW_HEADER_CONNECTION,
+  TW_HEADER_CONTENT_LENGTH,
+  TW_HEADER_CONTENT_TYPE,
+  TW_HEADER_TRANSFER_ENCODING,
+  TW_HEADER_EXPECT,
+  TW_HEADER_KNOWN_COUNT
+} tw_known_header;
+
+/* a header field as offsets into tw_request.buf, both NUL-terminated */
+typedef struct {
+  uint32_t name;
+  uint32_t name_len;
+  uint32_t value;
+  uint32_t value_len;
+} tw_header_ref;
+
+#ifndef TW_MAX_INLINE_PARAMS
+#define TW_MAX_INLINE_PARAMS 16
+#endif
+
+/* a decoded query parameter; name and value are NUL-terminated but may
+ * also contain NULs that were percent-encoded */
 typedef struct {
+  const char *name;
+  size_t name_len;
+  const char *value;
+  size_t value_len;
+} tw_param;
+
+typedef struct tw_request {
   char method[64];
   size_t method_len;
 
   char version[16];
   size_t version_len;
 
+  /* request target up to the '?' */
   char path[1024];
   size_t path_len;
 
-  tw_map headers;
+  /* raw query string without the '?', "" when the target has none */
+  const char *query;
+  size_t query_len;
+
+  /* query parameters, decoded on first access */
+  tw_param *params;
+  size_t num_params;
+  size_t params_cap;
+  bool params_parsed;
+  tw_param params_inline[TW_MAX_INLINE_PARAMS];
+  char *params_data;
+
+  /* raw request head; header names and values point into it */
+  char buf[TW_MAX_REQUEST_SIZE];
+  size_t buf_len;
+  tw_header_ref headers[TW_MAX_HEADERS];
+  size_t num_headers;
+  /* index into headers per tw_known_header, or -1 when absent */
+  int known_headers[TW_HEADER_KNOWN_COUNT];
 
   bool keep_alive;
 
   char *body;
   size_t body_len;
+
+  /* the connection the body memory is charged to */
+  tw_conn *conn;
+  size_t memory;
 } tw_request;
 
 typedef struct {
@@ -123,16 +724,63 @@ typedef struct {
 
   char *body;
   size_t body_len;
+  /* bytes allocated at body when the writer functions own it, else 0 */
+  size_t body_cap;
+  /* releases body, free by default and NULL while it is borrowed */
+  void (*body_free)(void *body);
+
+  /* encodings accepted by the client, a mask of tw_encoding values */
+  int accept_encoding;
+
+  /* the request was HEAD: the headers describe the body, which is not
+   * sent, so body may be NULL with body_len set */
+  bool head;
 } tw_response;
 
 typedef void (*tw_request_handler_fn)(tw_conn *conn, tw_request *req,
                                       tw_response *res);
 
+TWDEF void tw_server_config_init(tw_server_config *config);
 TWDEF bool tw_server_init(tw_server *server, int port);
+TWDEF bool tw_server_init_ex(tw_server *server,
+                             const tw_server_config *config);
+TWDEF bool tw_server_listen(tw_server *server, const char *bind_addr,
+                            int port);
 TWDEF bool tw_server_run(tw_server *server, tw_request_handler_fn handler);
 TWDEF bool tw_server_stop(tw_server *server);
+/* Stops accepting and lets open connections finish their current request
+ * with "Connection: close"; tw_server_run returns true once they are gone
+ * or config.drain_timeout has passed. Safe to call from a signal handler. */
+TWDEF void tw_server_drain(tw_server *server);
+/* Listens for a successor process on the Unix socket at path. When one
+ * connects it receives the listening sockets and this server drains. */
+TWDEF bool tw_server_enable_handoff(tw_server *server, const char *path);
+/* Initializes the server with the listening sockets of the process
+ * serving the handoff socket at path. Fails when there is none, in which
+ * case the caller falls back to tw_server_init_ex. */
+TWDEF bool tw_server_init_handoff(tw_server *server,
+                                  const tw_server_config *config,
+                                  const char *path);
+
+#ifdef TW_ENABLE_TRACE
+/* Writes the recorded events as Chrome trace_event JSON, to be opened in
+ * chrome://tracing or Perfetto. */
+TWDEF bool tw_trace_dump(tw_server *server, const char *path);
+/* Makes tw_server_run dump to trace.path on its next wakeup. It only sets
+ * a flag and can be called from a signal handler. */
+TWDEF void tw_trace_request_dump(tw_server *server);
+#endif
+
 TWDEF bool tw__set_nonblocking(int fd);
 
+#ifdef TW_ENABLE_TLS
+/* Whether the kernel encrypts what the connection sends and decrypts what
+ * it receives, which is the case after the handshake where kTLS is
+ * available. */
+TWDEF bool tw_conn_ktls_send(tw_conn *conn);
+TWDEF bool tw_conn_ktls_recv(tw_conn *conn);
+#endif
+
 TWDEF ssize_t tw_conn_read(tw_conn *conn, char *buf, size_t len);
 TWDEF ssize_t tw_conn_write(tw_conn *conn, const char *buf, size_t len);
 TWDEF void tw_conn_close(tw_conn *conn);
@@ -140,7 +788,11 @@ TWDEF void tw_conn_close(tw_conn *conn);
 typedef enum {
   TW_REQUEST_PARSE_SUCCESS = 0,
   TW_REQUEST_PARSE_ERROR = 1,
-  TW_REQUEST_PARSE_BLOCK = 2
+  TW_REQUEST_PARSE_BLOCK = 2,
+  /* an error response was sent and the connection has to be closed */
+  TW_REQUEST_PARSE_REJECTED = 3,
+  /* the peer closed the connection between requests */
+  TW_REQUEST_PARSE_CLOSED = 4
 } tw_request_parse_result;
 
 TWDEF bool tw_request_init(tw_request *req);
@@ -149,6 +801,88 @@ TWDEF tw_request_parse_result tw_request_parse(tw_conn *conn, tw_request *req);
 TWDEF tw_request_parse_result tw_request_parse_body(tw_conn *conn,
                                                     tw_request *req);
 TWDEF const char *tw_request_get_header(tw_request *req, const char *name);
+TWDEF const char *tw_request_get_known_header(tw_request *req,
+                                              tw_known_header header);
+TWDEF bool tw_request_header_at(tw_request *req, size_t index,
+                                const char **name, const char **value);
+TWDEF const char *tw_request_get_param(tw_request *req, const char *name);
+TWDEF size_t tw_request_param_count(tw_request *req);
+TWDEF const tw_param *tw_request_param_at(tw_request *req, size_t index);
+TWDEF size_t tw_percent_decode(char *dst, const char *src, size_t len,
+                               bool plus_as_space);
+
+#ifndef TW_MULTIPART_MAX_HEAD
+#define TW_MULTIPART_MAX_HEAD 4096
+#endif
+
+#ifndef TW_MULTIPART_CHUNK_SIZE
+#define TW_MULTIPART_CHUNK_SIZE (16 * 1024)
+#endif
+
+/* the headers of a multipart/form-data part, NULL when absent */
+typedef struct {
+  const char *name;
+  const char *filename;
+  const char *content_type;
+} tw_multipart_part;
+
+typedef struct tw_multipart tw_multipart;
+
+/* The callbacks return false to stop parsing. Data chunks point into the
+ * buffer being parsed and are only valid during the call. */
+typedef bool (*tw_multipart_part_fn)(tw_multipart *mp,
+                                     const tw_multipart_part *part);
+typedef bool (*tw_multipart_data_fn)(tw_multipart *mp, const char *data,
+                                     size_t len);
+typedef bool (*tw_multipart_end_fn)(tw_multipart *mp);
+
+struct tw_multipart {
+  tw_multipart_part_fn on_part;
+  tw_multipart_data_fn on_data;
+  tw_multipart_end_fn on_part_end;
+  void *data;
+
+  /* "\r\n--" followed by the boundary */
+  char delimiter[76];
+  size_t delimiter_len;
+  int state;
+  /* the end of the last input that may start a delimiter, with room for
+   * a delimiter more */
+  char tail[2 * 76];
+  size_t tail_len;
+  char head[TW_MULTIPART_MAX_HEAD];
+  size_t head_len;
+  tw_multipart_part part;
+  /* set by tw_multipart_spool for the current part */
+  int spool_fd;
+  /* a callback or the spool failed, as opposed to a malformed body */
+  bool aborted;
+
+  /* body bytes tw_request_parse_multipart has yet to read */
+  size_t remaining;
+  bool started;
+  char chunk[TW_MULTIPART_CHUNK_SIZE];
+};
+
+/* Prepares mp for a body of the given Content-Type. Fails unless it is a
+ * multipart type with a valid boundary. */
+TWDEF bool tw_multipart_init(tw_multipart *mp, const char *content_type);
+/* Parses the next len bytes of the body. */
+TWDEF bool tw_multipart_feed(tw_multipart *mp, const char *data, size_t len);
+/* Whether the closing delimiter was parsed. */
+TWDEF bool tw_multipart_done(const tw_multipart *mp);
+/* Writes the data of the current part to fd instead of passing it to
+ * on_data. Called from on_part, it applies until the part ends. */
+TWDEF void tw_multipart_spool(tw_multipart *mp, int fd);
+/* Reads the request body through mp a chunk at a time instead of into
+ * req->body. Returns TW_REQUEST_PARSE_BLOCK when the socket has no more
+ * data yet; calling it again continues where it stopped. A malformed body
+ * is answered with 400 and TW_REQUEST_PARSE_REJECTED. When mp was aborted,
+ * the rest of the body is read and dropped and the result is
+ * TW_REQUEST_PARSE_ERROR, leaving the response to the handler. */
+TWDEF tw_request_parse_result tw_request_parse_multipart(tw_conn *conn,
+                                                         tw_request *req,
+                                                         tw_multipart *mp);
 
 TWDEF bool tw_response_init(tw_response *res);
 TWDEF void tw_response_free(tw_response *res);
@@ -157,110 +891,614 @@ TWDEF void tw_response_set_header(tw_response *res, const char *name,
                                   const char *value);
 TWDEF bool tw_response_set_body(tw_response *res, const char *body,
                                 size_t body_len);
+/* Sends body without copying it. It must stay unchanged until the response
+ * was sent, a static string for example. */
+TWDEF void tw_response_borrow_body(tw_response *res, const char *body,
+                                   size_t body_len);
+/* Hands a heap buffer over to res, which releases it with body_free, or
+ * with free when that is NULL. */
+TWDEF void tw_response_take_body(tw_response *res, char *body,
+                                 size_t body_len,
+                                 void (*body_free)(void *body));
+/* Returns room for len more bytes at the end of the body, to be written
+ * in place and added with tw_response_commit. NULL when out of memory. */
+TWDEF char *tw_response_reserve(tw_response *res, size_t len);
+TWDEF void tw_response_commit(tw_response *res, size_t len);
+TWDEF bool tw_response_append(tw_response *res, const char *data,
+                              size_t len);
+/* Appends printf-style formatted text to the body. */
+TWDEF bool tw_response_printf(tw_response *res, const char *fmt, ...);
 TWDEF bool tw_response_send(tw_conn *conn, tw_response *res);
 
-#ifdef __cplusplus
-}
+/* byte ranges served per request, more are answered with the full file */
+#ifndef TW_MAX_RANGES
+#define TW_MAX_RANGES 16
 #endif
 
-#endif  // THINWIRE_H
+/* bytes of a file read for each write while it is streamed */
+#ifndef TW_FILE_CHUNK_SIZE
+#define TW_FILE_CHUNK_SIZE (16 * 1024)
+#endif
 
-#ifdef THINWIRE_IMPL
+/* Answers a GET or HEAD request with the file at path. The response
+ * carries ETag and Last-Modified, conditional requests get 304 or 412 and
+ * Range requests 206 or 416. Headers already set on res are kept. */
+TWDEF bool tw_response_send_file(tw_conn *conn, tw_request *req,
+                                 tw_response *res, const char *path);
+/* Serves the file under root named by the request path. Paths leaving
+ * root are not found, directories serve their index.html. */
+TWDEF bool tw_serve_static(tw_conn *conn, tw_request *req, tw_response *res,
+                           const char *root);
+/* Content type for the extension of path, application/octet-stream when
+ * it is unknown. */
+TWDEF const char *tw_mime_type(const char *path);
+/* Formats t as an IMF-fixdate, out holds at least 30 bytes. */
+TWDEF void tw_http_date(time_t t, char *out);
+/* Parses the three date formats of RFC 9110 section 5.6.7. */
+TWDEF bool tw_parse_http_date(const char *value, time_t *out);
+
+TWDEF void tw_rate_limit_init(tw_rate_limit *limit);
+/* Takes a request from the bucket of the client identified by key.
+ * Returns false when the client is over its rate. */
+TWDEF bool tw_rate_limit_take(tw_rate_limit *limit, const char *key,
+                              size_t len);
+/* Believes the rate limit header on connections from addr, an IPv4 or
+ * IPv6 address, or "unix" for all peers on Unix sockets. */
+TWDEF bool tw_rate_limit_trust(tw_rate_limit *limit, const char *addr);
+
+TWDEF void tw_file_cache_init(tw_file_cache *cache);
+TWDEF void tw_file_cache_free(tw_file_cache *cache);
+/* Returns the entry for the file at path, opening it on a miss or when it
+ * changed. On failure returns NULL and sets status to answer with. */
+TWDEF const tw_file_cache_entry *tw_file_cache_get(tw_file_cache *cache,
+                                                   const char *path,
+                                                   int *status);
+
+TWDEF int tw_parse_accept_encoding(const char *value);
+
+#ifdef TW_ENABLE_COMPRESSION
+TWDEF void tw_compression_config_init(tw_compression_config *config);
+TWDEF bool tw_compress(tw_encoding encoding, int level, const char *src,
+                       size_t src_len, char **out, size_t *out_len);
+TWDEF void tw_compression_cache_init(tw_compression_cache *cache);
+TWDEF void tw_compression_cache_free(tw_compression_cache *cache);
+TWDEF const tw_compression_cache_entry *tw_compression_cache_get(
+    tw_compression_cache *cache, tw_encoding encoding, const char *body,
+    size_t body_len, int level);
+#endif
 
-TWDEF void tw_log(tw_log_level level, const char *fmt, ...) {
-  FILE *stream = stdout;
+#ifdef TW_ENABLE_HTTP2
 
-  switch (level) {
-    case TW_INFO:
-      fprintf(stream, "[INFO] ");
-      break;
-    case TW_WARNING:
-      fprintf(stream, "[WARNING] ");
-      break;
-    case TW_ERROR:
-      stream = stderr;
-      fprintf(stream, "[ERROR] ");
-      break;
-    default:
-      break;
-  }
+#ifndef TW_H2_MAX_STREAMS
+#define TW_H2_MAX_STREAMS 100
+#endif
 
-  va_list args;
-  va_start(args, fmt);
-  vfprintf(stream, fmt, args);
-  va_end(args);
-  fprintf(stream, "\n");
-}
+#ifndef TW_H2_WINDOW_SIZE
+#define TW_H2_WINDOW_SIZE 65535
+#endif
 
-TWDEF bool tw_map_init(tw_map *map) {
-  map->values = NULL;
-  map->keys = (char **)malloc(sizeof(char *));
-  if (map->keys == NULL) {
-    tw_log(TW_ERROR, "Failed to allocate memory for tw_map->keys");
-    return false;
-  }
-  map->keys[0] = NULL;
+#ifndef TW_H2_HEADER_TABLE_SIZE
+#define TW_H2_HEADER_TABLE_SIZE 4096
+#endif
 
-  map->values = (char **)malloc(sizeof(char *));
-  if (map->values == NULL) {
-    tw_log(TW_ERROR, "Failed to allocate memory for tw_map->values");
-    free(map->keys);
-    map->keys = NULL;
-    return false;
-  }
-  map->values[0] = NULL;
+#ifndef TW_H2_MAX_HEADER_LIST
+#define TW_H2_MAX_HEADER_LIST (64 * 1024)
+#endif
 
-  map->capacity = 1;
-  map->size = 0;
+/* bytes of PING and SETTINGS acks and RST_STREAM a peer may have queued
+ * without reading them before it gets GOAWAY(ENHANCE_YOUR_CALM) */
+#ifndef TW_H2_MAX_CONTROL_QUEUED
+#define TW_H2_MAX_CONTROL_QUEUED (64 * 1024)
+#endif
 
-  return true;
-}
+/* largest frame payload we accept, this is the protocol minimum */
+#define TW_H2_MAX_FRAME_SIZE 16384
 
-TWDEF void tw_map_free(tw_map *map) {
-  for (size_t i = 0; i < map->size; i++) {
-    free(map->keys[i]);
-    free(map->values[i]);
-  }
+typedef struct {
+  char *name;
+  char *value;
+  size_t size;
+} tw_hpack_entry;
 
-  free(map->keys);
-  free(map->values);
-  map->keys = NULL;
-  map->values = NULL;
-  map->capacity = 0;
-  map->size = 0;
-}
+typedef struct {
+  tw_hpack_entry *entries;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  size_t size;
+  size_t max_size;
+  size_t limit;
+} tw_hpack_table;
 
-TWDEF bool tw_map_set(tw_map *map, const char *key, const char *value) {
-  for (size_t i = 0; i < map->size; i++) {
-    if (strcmp(map->keys[i], key) == 0) {
-      char *dup_value = strdup(value);
-      if (dup_value == NULL) {
-        tw_log(TW_ERROR, "Failed to allocate memory for tw_map->values");
-        return false;
-      }
+TWDEF bool tw_hpack_table_init(tw_hpack_table *table, size_t limit);
+TWDEF void tw_hpack_table_free(tw_hpack_table *table);
+TWDEF bool tw_hpack_decode(tw_hpack_table *table, const uint8_t *src,
+                           size_t len, tw_map *headers);
+TWDEF bool tw_hpack_huffman_decode(const uint8_t *src, size_t len, char *dst,
+                                   size_t *dst_len);
 
-      free(map->values[i]);
-      map->values[i] = dup_value;
-      return true;
-    }
-  }
+typedef enum {
+  TW_H2_STREAM_IDLE = 0,
+  TW_H2_STREAM_OPEN,
+  TW_H2_STREAM_HALF_CLOSED_REMOTE
+} tw_h2_stream_state;
 
-  if (map->size >= map->capacity) {
-    size_t new_capacity = map->capacity * 2;
-    char **new_keys =
-        (char **)realloc(map->keys, new_capacity * sizeof(char *));
-    if (new_keys == NULL) {
-      tw_log(TW_ERROR, "Failed to allocate memory for tw_map->keys");
-      return false;
-    }
-    map->keys = new_keys;
+typedef struct {
+  uint32_t id;
+  tw_h2_stream_state state;
+  tw_map headers;
 
-    char **new_values =
-        (char **)realloc(map->values, new_capacity * sizeof(char *));
-    if (new_values == NULL) {
-      tw_log(TW_ERROR, "Failed to allocate memory for tw_map->values");
-      return false;
-    }
+  char *body;
+  size_t body_len;
+  size_t body_cap;
+
+  int64_t send_window;
+  int64_t recv_window;
+
+  /* response data held back by flow control */
+  char *pending;
+  size_t pending_len;
+  size_t pending_off;
+
+  bool responded;
+} tw_h2_stream;
+
+typedef struct tw_h2_session {
+  tw_hpack_table decoder;
+
+  char in[9 + TW_H2_MAX_FRAME_SIZE];
+  size_t in_len;
+
+  char *out;
+  size_t out_len;
+  size_t out_off;
+  size_t out_cap;
+  /* bytes of control frames queued since out last drained */
+  size_t control_queued;
+
+  bool preface_received;
+  bool closing;
+  /* a graceful GOAWAY was sent, only the open streams are finished */
+  bool going_away;
+
+  uint32_t max_frame_size;
+  int64_t initial_window_size;
+  int64_t send_window;
+  int64_t recv_window;
+
+  uint32_t last_stream_id;
+
+  /* header block being reassembled from HEADERS and CONTINUATION frames */
+  uint32_t header_stream_id;
+  uint8_t header_flags;
+  char *header_block;
+  size_t header_block_len;
+
+  tw_h2_stream streams[TW_H2_MAX_STREAMS];
+  tw_h2_stream *current;
+} tw_h2_session;
+
+#endif
+
+#ifdef TW_ENABLE_WEBSOCKET
+
+#ifndef TW_WS_MAX_MESSAGE
+#define TW_WS_MAX_MESSAGE (16 * 1024 * 1024)
+#endif
+
+typedef enum {
+  TW_WS_CONTINUATION = 0x0,
+  TW_WS_TEXT = 0x1,
+  TW_WS_BINARY = 0x2,
+  TW_WS_CLOSE = 0x8,
+  TW_WS_PING = 0x9,
+  TW_WS_PONG = 0xa
+} tw_ws_opcode;
+
+typedef struct tw_websocket tw_websocket;
+
+typedef void (*tw_ws_message_fn)(tw_websocket *ws, tw_ws_opcode opcode,
+                                 const char *data, size_t len);
+typedef void (*tw_ws_close_fn)(tw_websocket *ws, uint16_t code);
+
+typedef struct {
+  tw_ws_message_fn on_message;
+  tw_ws_close_fn on_close;
+  void *user_data;
+} tw_ws_handlers;
+
+struct tw_websocket {
+  tw_conn *conn;
+  tw_ws_handlers handlers;
+
+  char *in;
+  size_t in_len;
+  size_t in_cap;
+
+  /* fragments of the message being reassembled */
+  char *message;
+  size_t message_len;
+  size_t message_cap;
+  tw_ws_opcode message_opcode;
+
+  char *out;
+  size_t out_len;
+  size_t out_off;
+  size_t out_cap;
+
+  uint16_t close_code;
+  bool close_sent;
+  bool closing;
+};
+
+TWDEF tw_websocket *tw_ws_upgrade(tw_conn *conn, tw_request *req,
+                                  const tw_ws_handlers *handlers);
+TWDEF bool tw_ws_send(tw_websocket *ws, tw_ws_opcode opcode, const char *data,
+                      size_t len);
+TWDEF bool tw_ws_close(tw_websocket *ws, uint16_t code, const char *reason);
+TWDEF size_t tw_ws_broadcast(tw_websocket **sockets, size_t count,
+                             tw_ws_opcode opcode, const char *data,
+                             size_t len);
+TWDEF void tw_ws_unmask(char *data, size_t len, const uint8_t mask[4]);
+TWDEF void tw_ws_accept_key(const char *key, char accept[29]);
+
+#endif
+
+#ifdef TW_ENABLE_CLIENT
+
+/* idle keep-alive connections kept per upstream */
+#ifndef TW_CLIENT_MAX_IDLE
+#define TW_CLIENT_MAX_IDLE 8
+#endif
+
+/* milliseconds a blocking call waits for the upstream */
+#ifndef TW_CLIENT_TIMEOUT
+#define TW_CLIENT_TIMEOUT 30000
+#endif
+
+typedef struct {
+  /* "GET" when NULL */
+  const char *method;
+  /* request target, "/" when NULL */
+  const char *path;
+  /* extra header fields, may be NULL */
+  tw_map *headers;
+  const char *body;
+  size_t body_len;
+} tw_client_request;
+
+typedef struct {
+  int status;
+
+  /* raw response head; header names and values point into it */
+  char buf[TW_MAX_REQUEST_SIZE];
+  size_t buf_len;
+  tw_header_ref headers[TW_MAX_HEADERS];
+  size_t num_headers;
+  int known_headers[TW_HEADER_KNOWN_COUNT];
+
+  bool keep_alive;
+
+  /* NUL-terminated, chunked bodies are already decoded */
+  char *body;
+  size_t body_len;
+  size_t body_cap;
+} tw_client_response;
+
+/* A pool of keep-alive connections to one upstream server. */
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  /* sent as the Host header unless the request sets one */
+  char host[256];
+  int timeout;
+
+  int idle[TW_CLIENT_MAX_IDLE];
+  size_t num_idle;
+} tw_client;
+
+/* Called from tw_server_run with the response, or NULL when the upstream
+ * could not be reached. It must answer conn with tw_response_send. */
+typedef void (*tw_client_callback_fn)(tw_conn *conn, tw_client_response *res,
+                                      void *user_data);
+
+/* addr takes the same forms as tw_server_config.bind_addr, NULL is
+ * 127.0.0.1 */
+TWDEF bool tw_client_init(tw_client *client, const char *addr, int port);
+TWDEF void tw_client_free(tw_client *client);
+/* Sends req and waits for the response on a pooled connection. */
+TWDEF bool tw_client_fetch(tw_client *client, const tw_client_request *req,
+                           tw_client_response *res);
+/* Writes all requests on one connection before reading the responses.
+ * Requests left unanswered when the upstream closes are sent again on a
+ * new connection. */
+TWDEF bool tw_client_pipeline(tw_client *client,
+                              const tw_client_request *reqs,
+                              tw_client_response *res, size_t count);
+/* Sends req from a handler without blocking. conn stops being read until
+ * callback ran from the server loop, and the handler returns without
+ * sending a response itself. Not available on HTTP/2 or websocket
+ * connections. */
+TWDEF bool tw_client_send(tw_client *client, tw_conn *conn,
+                          const tw_client_request *req,
+                          tw_client_callback_fn callback, void *user_data);
+TWDEF const char *tw_client_response_get_header(tw_client_response *res,
+                                                const char *name);
+TWDEF void tw_client_response_free(tw_client_response *res);
+
+#endif
+
+#ifdef TW_ENABLE_PARK
+
+/* bytes queued on one parked connection before it counts as too slow to
+ * keep up and is closed */
+#ifndef TW_PARK_MAX_QUEUED
+#define TW_PARK_MAX_QUEUED (1024 * 1024)
+#endif
+
+/* Bytes for one or more parked connections. A broadcast queues the same
+ * chunk on every connection, the last one to write it frees it. */
+typedef struct tw_chunk {
+  int refs;
+  size_t len;
+  char data[];
+} tw_chunk;
+
+/* A write or the end of a parked response, queued by any thread on the
+ * server inbox and then on the connection until written. */
+typedef struct tw_park_msg {
+  struct tw_park_msg *next;
+  struct tw_parked *parked;
+  /* NULL for the end of the response */
+  tw_chunk *chunk;
+  /* serve requests again after the end instead of closing */
+  bool keep_alive;
+} tw_park_msg;
+
+/* A connection whose handler returned without answering. The handle
+ * stays valid until tw_parked_release, also after the connection closed;
+ * writes then fail. */
+typedef struct tw_parked {
+  tw_server *server;
+  int refs;
+  /* set once the response ended or the connection closed */
+  int done;
+
+  /* only touched by the loop, conn is NULL once it let go */
+  tw_conn *conn;
+  tw_park_msg *queue;
+  tw_park_msg *queue_tail;
+  size_t queue_off;
+  size_t queued;
+  bool keep_alive;
+  bool head;
+  /* the response is an event stream delimited by the close */
+  bool stream;
+  /* the client sent more, which waits until the response went out */
+  bool input;
+} tw_parked;
+
+/* Parks conn from its handler, which then returns without sending res.
+ * The response is written later through the handle, from the loop or
+ * from any other thread. Only HTTP/1 connections can be parked. */
+TWDEF tw_parked *tw_conn_park(tw_conn *conn, tw_response *res);
+/* Queues raw response bytes. Thread-safe, fails once the connection is
+ * gone or the response ended. */
+TWDEF bool tw_parked_write(tw_parked *parked, const char *data, size_t len);
+/* Ends a parked request with res, to which it adds the Connection
+ * header. The connection serves the next request afterwards unless the
+ * client asked to close. Thread-safe. */
+TWDEF bool tw_parked_respond(tw_parked *parked, tw_response *res);
+/* Closes the connection once what is queued was written. Thread-safe. */
+TWDEF bool tw_parked_close(tw_parked *parked);
+/* Queues the same bytes on every handle, copied once. Returns the number
+ * of connections they were queued on. Thread-safe. */
+TWDEF size_t tw_parked_broadcast(tw_parked **parked, size_t count,
+                                 const char *data, size_t len);
+/* Gives up the handle. Thread-safe. */
+TWDEF void tw_parked_release(tw_parked *parked);
+
+/* Parks conn and starts a text/event-stream response with the headers
+ * set on res. */
+TWDEF tw_parked *tw_sse_start(tw_conn *conn, tw_response *res);
+/* Queues an event, every line of data in a data field of its own. event
+ * may be NULL for the default "message" type, and an event with a line
+ * break is refused. Thread-safe. */
+TWDEF bool tw_sse_send(tw_parked *parked, const char *event,
+                       const char *data);
+/* Formats an event once and queues it on every stream. Thread-safe. */
+TWDEF size_t tw_sse_broadcast(tw_parked **parked, size_t count,
+                              const char *event, const char *data);
+
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // THINWIRE_H
+
+#ifdef THINWIRE_IMPL
+
+/* a peer that went away must not raise SIGPIPE */
+#ifdef MSG_NOSIGNAL
+#define TW__SEND_FLAGS MSG_NOSIGNAL
+#else
+#define TW__SEND_FLAGS 0
+#endif
+
+static const char *tw_status_text(int status);
+static bool tw__conn_flush(tw_conn *conn);
+static bool tw__conn_write_all(tw_conn *conn, const char *buf, size_t len);
+static bool tw__file_body_write(tw_conn *conn);
+static void tw__file_body_free(tw_conn *conn);
+static bool tw__request_admit_body(tw_conn *conn, tw_request *req);
+static bool tw__parse_content_length(const char *value, size_t *out);
+
+#ifdef TW_ENABLE_HTTP2
+static void tw__h2_session_free(struct tw_h2_session *s);
+static size_t tw__h2_memory(struct tw_h2_session *s);
+static short tw__h2_events(struct tw_h2_session *s);
+static void tw__h2_shutdown(struct tw_h2_session *s);
+static bool tw__h2_on_ready(tw_conn *conn, short revents,
+                            tw_request_handler_fn handler);
+static bool tw__h2_start(tw_conn *conn, tw_request *req,
+                         tw_request_handler_fn handler, bool *started);
+static bool tw__h2_send_response(tw_conn *conn, tw_response *res,
+                                 const char *body, size_t body_len);
+#endif
+
+#ifdef TW_ENABLE_CLIENT
+static void tw__client_call_free(struct tw_client_call *call);
+static void tw__client_call_keep_alive(struct tw_client_call *call,
+                                       bool keep_alive);
+static void tw__client_call_move(struct tw_client_call *call, tw_conn *conn);
+static short tw__client_events(struct tw_client_call *call);
+static bool tw__client_on_ready(tw_conn *conn, short revents);
+#endif
+
+#ifdef TW_ENABLE_PARK
+static bool tw__park_open(tw_server *server);
+static void tw__park_close(tw_server *server);
+static void tw__park_dispatch(tw_server *server, int slot);
+static void tw__park_detach(struct tw_parked *parked);
+static short tw__park_events(struct tw_parked *parked);
+static bool tw__park_on_ready(tw_conn *conn, short revents);
+#endif
+
+#ifdef TW_ENABLE_WEBSOCKET
+static void tw__ws_free(struct tw_websocket *ws);
+static void tw__ws_process(struct tw_websocket *ws);
+static size_t tw__ws_memory(struct tw_websocket *ws);
+static short tw__ws_events(struct tw_websocket *ws);
+static bool tw__ws_on_ready(struct tw_websocket *ws, short revents);
+#endif
+
+#ifdef TW_ENABLE_COROUTINES
+/* A handler coroutine. Its entry function serves one batch of requests
+ * per run and then switches back, so the stack is reused without being
+ * set up again. */
+typedef struct tw_coro {
+#ifdef _WIN32
+  void *fiber;
+  void *caller;
+#else
+  ucontext_t ctx;
+  ucontext_t caller;
+  char *stack;
+  size_t stack_size;
+#endif
+  tw_conn *conn;
+  tw_request_handler_fn handler;
+  /* set while the handler runs, reads and writes may switch back */
+  bool suspendable;
+  /* what the suspended handler waits for */
+  short events;
+  /* the connection is closing, reads and writes fail */
+  bool cancelled;
+  /* switched to and not suspended */
+  bool running;
+  bool done;
+  /* result of tw__conn_serve */
+  bool keep;
+  struct tw_coro *next;
+} tw_coro;
+#endif
+
+TWDEF void tw_log(tw_log_level level, const char *fmt, ...) {
+  FILE *stream = stdout;
+
+  switch (level) {
+    case TW_INFO:
+      fprintf(stream, "[INFO] ");
+      break;
+    case TW_WARNING:
+      fprintf(stream, "[WARNING] ");
+      break;
+    case TW_ERROR:
+      stream = stderr;
+      fprintf(stream, "[ERROR] ");
+      break;
+    default:
+      break;
+  }
+
+  va_list args;
+  va_start(args, fmt);
+  vfprintf(stream, fmt, args);
+  va_end(args);
+  fprintf(stream, "\n");
+}
+
+TWDEF bool tw_map_init(tw_map *map) {
+  map->values = NULL;
+  map->keys = (char **)malloc(sizeof(char *));
+  if (map->keys == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for tw_map->keys");
+    return false;
+  }
+  map->keys[0] = NULL;
+
+  map->values = (char **)malloc(sizeof(char *));
+  if (map->values == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for tw_map->values");
+    free(map->keys);
+    map->keys = NULL;
+    return false;
+  }
+  map->values[0] = NULL;
+
+  map->capacity = 1;
+  map->size = 0;
+
+  return true;
+}
+
+TWDEF void tw_map_free(tw_map *map) {
+  for (size_t i = 0; i < map->size; i++) {
+    free(map->keys[i]);
+    free(map->values[i]);
+  }
+
+  free(map->keys);
+  free(map->values);
+  map->keys = NULL;
+  map->values = NULL;
+  map->capacity = 0;
+  map->size = 0;
+}
+
+TWDEF bool tw_map_set(tw_map *map, const char *key, const char *value) {
+  for (size_t i = 0; i < map->size; i++) {
+    if (strcmp(map->keys[i], key) == 0) {
+      char *dup_value = strdup(value);
+      if (dup_value == NULL) {
+        tw_log(TW_ERROR, "Failed to allocate memory for tw_map->values");
+        return false;
+      }
+
+      free(map->values[i]);
+      map->values[i] = dup_value;
+      return true;
+    }
+  }
+
+  if (map->size >= map->capacity) {
+    size_t new_capacity = map->capacity * 2;
+    char **new_keys =
+        (char **)realloc(map->keys, new_capacity * sizeof(char *));
+    if (new_keys == NULL) {
+      tw_log(TW_ERROR, "Failed to allocate memory for tw_map->keys");
+      return false;
+    }
+    map->keys = new_keys;
+
+    char **new_values =
+        (char **)realloc(map->values, new_capacity * sizeof(char *));
+    if (new_values == NULL) {
+      tw_log(TW_ERROR, "Failed to allocate memory for tw_map->values");
+      return false;
+    }
     map->values = new_values;
 
     map->capacity = new_capacity;
@@ -338,669 +1576,8831 @@ TWDEF bool tw_map_empty(tw_map *map) {
   return tw_map_init(map);
 }
 
-TWDEF bool tw_server_init(tw_server *server, int port) {
-#ifdef _WIN32
-  WSADATA wsa;
-  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
-    tw_log(TW_ERROR, "WSAStartup failed");
-    return false;
-  }
+TWDEF void tw_server_config_init(tw_server_config *config) {
+  config->port = TW_DEFAULT_PORT;
+  config->bind_addr = NULL;
+  config->backlog = TW_DEFAULT_BACKLOG;
+  config->reuse_addr = true;
+  config->recv_buf_size = 0;
+  config->send_buf_size = 0;
+  /* responses go out as separate header and body writes */
+  config->tcp_nodelay = true;
+  config->defer_accept = 0;
+  config->fastopen_queue = 0;
+  config->busy_poll = 0;
+  config->memory_budget = 0;
+  config->max_connections = TW_MAX_CLIENTS;
+  config->overload_policy = TW_OVERLOAD_REJECT;
+  config->max_body_size = TW_MAX_REQUEST_BODY;
+  config->drain_timeout = TW_DRAIN_TIMEOUT;
+#ifdef TW_ENABLE_TLS
+  config->tls_cert_file = NULL;
+  config->tls_key_file = NULL;
 #endif
+}
 
-  if ((server->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-    tw_log(TW_ERROR, "Socket failed");
+static bool tw__setsockopt_int(int fd, int level, int name, int value,
+                               const char *what) {
+  if (setsockopt(fd, level, name, (const char *)&value, sizeof(value)) < 0) {
+    tw_log(TW_WARNING, "Failed to set %s: %s", what, strerror(errno));
     return false;
   }
+  return true;
+}
 
-  if (port <= 0) {
-    port = TW_DEFAULT_PORT;
+TWDEF bool tw_server_init(tw_server *server, int port) {
+  tw_server_config config;
+  tw_server_config_init(&config);
+  config.port = port;
+  return tw_server_init_ex(server, &config);
+}
+
+/* Parses "unix:/path", "unix:@abstract", an IPv6 literal with or without
+ * brackets, or an IPv4 literal. NULL selects all IPv4 interfaces. */
+static bool tw__parse_address(const char *bind_addr, int port,
+                              struct sockaddr_storage *addr,
+                              socklen_t *addr_len) {
+  memset(addr, 0, sizeof(*addr));
+
+#ifndef _WIN32
+  if (bind_addr != NULL && strncmp(bind_addr, "unix:", 5) == 0) {
+    struct sockaddr_un *un = (struct sockaddr_un *)addr;
+    const char *path = bind_addr + 5;
+    size_t path_len = strlen(path);
+    if (path_len == 0 || path_len >= sizeof(un->sun_path)) {
+      return false;
+    }
+    un->sun_family = AF_UNIX;
+    memcpy(un->sun_path, path, path_len);
+    *addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + path_len);
+    if (path[0] == '@') {
+#ifdef __linux__
+      /* abstract names start with a NUL and are not terminated */
+      un->sun_path[0] = '\0';
+#else
+      return false;
+#endif
+    } else {
+      *addr_len += 1;
+    }
+    return true;
   }
+#endif
 
-  server->addr.sin_family = AF_INET;
-  server->addr.sin_addr.s_addr = INADDR_ANY;
-  server->addr.sin_port = htons(port);
+  if (bind_addr != NULL && strchr(bind_addr, ':') != NULL) {
+    struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+    char literal[INET6_ADDRSTRLEN];
+    size_t len = strlen(bind_addr);
+    if (bind_addr[0] == '[' && len > 2 && bind_addr[len - 1] == ']') {
+      bind_addr++;
+      len -= 2;
+    }
+    if (len >= sizeof(literal)) return false;
+    memcpy(literal, bind_addr, len);
+    literal[len] = '\0';
+
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+    if (inet_pton(AF_INET6, literal, &in6->sin6_addr) != 1) return false;
+    *addr_len = sizeof(*in6);
+    return true;
+  }
 
-  if (bind(server->fd, (struct sockaddr *)&server->addr, sizeof(server->addr)) <
-      0) {
-    tw_log(TW_ERROR, "Socket bind failed");
+  struct sockaddr_in *in = (struct sockaddr_in *)addr;
+  in->sin_family = AF_INET;
+  in->sin_port = htons(port);
+  in->sin_addr.s_addr = INADDR_ANY;
+  if (bind_addr != NULL && inet_pton(AF_INET, bind_addr, &in->sin_addr) != 1) {
     return false;
   }
+  *addr_len = sizeof(*in);
+  return true;
+}
 
-  if (listen(server->fd, 10) < 0) {
-    tw_log(TW_ERROR, "Socket listen failed");
-    return false;
+#ifdef TW_ENABLE_TRACE
+static uint64_t tw__trace_now_ns(void) {
+#ifdef _WIN32
+  return (uint64_t)GetTickCount64() * 1000000;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/* The time stamp counter costs a few nanoseconds to read, a fraction of
+ * clock_gettime; ticks are converted to time only when dumping. */
+static inline uint64_t tw__trace_ticks(void) {
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+  return __builtin_ia32_rdtsc();
+#else
+  return tw__trace_now_ns();
+#endif
+}
+
+static void tw__trace_init(tw_trace *trace) {
+  trace->enabled = false;
+  trace->path = NULL;
+  trace->dump_requested = 0;
+  trace->next = 0;
+  trace->origin_ticks = tw__trace_ticks();
+  trace->origin_ns = tw__trace_now_ns();
+}
+
+/* Records phase of conn from start until now, unless start is 0, and
+ * returns now. Returns 0 while tracing is off. */
+static inline uint64_t tw__trace_fd(tw_server *server, int fd,
+                                    tw_trace_phase phase, uint64_t start) {
+  if (server == NULL || !server->trace.enabled) return 0;
+  uint64_t now = tw__trace_ticks();
+  if (start != 0) {
+    tw_trace *trace = &server->trace;
+    tw_trace_event *event =
+        &trace->events[trace->next++ & (TW_TRACE_EVENTS - 1)];
+    event->start = start;
+    event->end = now;
+    event->fd = fd;
+    event->phase = (int)phase;
   }
+  return now;
+}
+
+static inline uint64_t tw__trace(tw_conn *conn, tw_trace_phase phase,
+                                 uint64_t start) {
+  return tw__trace_fd(conn->server, conn->fd, phase, start);
+}
 
-  if (!tw__set_nonblocking(server->fd)) {
+TWDEF bool tw_trace_dump(tw_server *server, const char *path) {
+  static const char *const names[] = {"accept", "wait", "parse", "handler",
+                                      "send"};
+  tw_trace *trace = &server->trace;
+
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    tw_log(TW_ERROR, "Failed to open %s: %s", path, strerror(errno));
     return false;
   }
 
-  server->nfds = 1;
-  memset(server->fds, 0, sizeof(server->fds));
-  server->fds[0].fd = server->fd;
-  server->fds[0].events = POLLIN;
+  /* how many nanoseconds a tick took since the trace started */
+  uint64_t ticks = tw__trace_ticks() - trace->origin_ticks;
+  uint64_t ns = tw__trace_now_ns() - trace->origin_ns;
+  double scale = ticks > 0 ? (double)ns / (double)ticks : 1.0;
+
+  uint64_t count =
+      trace->next < TW_TRACE_EVENTS ? trace->next : TW_TRACE_EVENTS;
+  fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+  for (uint64_t i = trace->next - count; i < trace->next; i++) {
+    const tw_trace_event *event = &trace->events[i & (TW_TRACE_EVENTS - 1)];
+    /* microseconds */
+    double ts = (double)(event->start - trace->origin_ticks) * scale / 1000;
+    double dur = (double)(event->end - event->start) * scale / 1000;
+    fprintf(file,
+            "%s\n{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\",\"pid\":1,"
+            "\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+            i == trace->next - count ? "" : ",", names[event->phase],
+            event->fd, ts, dur);
+  }
+  fprintf(file, "\n]}\n");
 
+  if (fclose(file) != 0) {
+    tw_log(TW_ERROR, "Failed to write %s", path);
+    return false;
+  }
   return true;
 }
 
-TWDEF bool tw_server_run(tw_server *server, tw_request_handler_fn handler) {
-  while (1) {
-    int ret = poll(server->fds, server->nfds, -1);
-    if (ret < 0) {
-      tw_log(TW_ERROR, "Poll failed");
-      return false;
-    }
-
-    if (server->fds[0].revents & (POLLIN | POLLERR | POLLHUP)) {
-      while (server->nfds < TW_MAX_CLIENTS + 1) {
-        tw_conn conn;
-        socklen_t addr_len = sizeof(conn.addr);
-#ifdef _WIN32
-        SOCKET conn_fd =
-            accept(server->fd, (struct sockaddr *)&conn.addr, &addr_len);
-        if (conn_fd == INVALID_SOCKET) {
-          int werr = WSAGetLastError();
-          if (werr == WSAEWOULDBLOCK) {
-            /* no more pending connections */
-            break;
-          } else {
-            tw_log(TW_ERROR, "accept failed: %d", werr);
-            break;
-          }
-        }
-        conn.fd = (int)conn_fd;
-#else
-        int conn_fd =
-            accept(server->fd, (struct sockaddr *)&conn.addr, &addr_len);
-        if (conn_fd < 0) {
-          if (errno == EAGAIN || errno == EWOULDBLOCK) {
-            /* no more pending connections */
-            break;
-          } else {
-            tw_log(TW_ERROR, "accept failed: %s", strerror(errno));
-            break;
-          }
-        }
-        conn.fd = conn_fd;
+TWDEF void tw_trace_request_dump(tw_server *server) {
+  server->trace.dump_requested = 1;
+}
 #endif
 
-        tw__set_nonblocking(conn_fd);
+#ifdef TW_ENABLE_TLS
+/* The reason for the last OpenSSL error, which is cleared. */
+static const char *tw__tls_reason(void) {
+  static char reason[256];
+  unsigned long err = ERR_get_error();
+  ERR_clear_error();
+  if (err == 0) return "unknown error";
+  ERR_error_string_n(err, reason, sizeof(reason));
+  return reason;
+}
 
-        server->conns[server->nfds] = conn;
-        server->fds[server->nfds].fd = conn_fd;
-        server->fds[server->nfds].events = POLLIN;
-        server->fds[server->nfds].revents = 0;
-        server->nfds++;
-      }
+/* Prefers HTTP/2 when it is compiled in, a client that offers it then
+ * starts with the connection preface as with prior knowledge. */
+static int tw__tls_alpn(SSL *ssl, const unsigned char **out,
+                        unsigned char *out_len, const unsigned char *in,
+                        unsigned int in_len, void *arg) {
+  (void)ssl;
+  (void)arg;
+  static const unsigned char protocols[] =
+#ifdef TW_ENABLE_HTTP2
+      "\x02h2"
+#endif
+      "\x08http/1.1";
+  unsigned char *selected;
+  if (SSL_select_next_proto(&selected, out_len, protocols,
+                            sizeof(protocols) - 1, in,
+                            in_len) != OPENSSL_NPN_NEGOTIATED) {
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
 
-      server->fds[0].revents = 0;
-    }
+static bool tw__tls_setup(tw_server *server) {
+  const tw_server_config *config = &server->config;
+  server->tls_ctx = NULL;
+  if (config->tls_cert_file == NULL) {
+    return true;
+  }
 
-    for (int i = 1; i < server->nfds; i++) {
-      tw_conn *conn = &server->conns[i];
-      short revents = server->fds[i].revents;
+  SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+  if (ctx == NULL) {
+    tw_log(TW_ERROR, "Failed to create TLS context: %s", tw__tls_reason());
+    return false;
+  }
 
-      if (!(revents & POLLIN)) {
-        if (revents & (POLLHUP | POLLERR | POLLNVAL)) {
-          tw_conn_close(conn);
-#ifdef _WIN32
-          server->fds[i].fd = (SOCKET)-1;
-#else
-          server->fds[i].fd = -1;
+  SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+  uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+  /* few clients send close_notify, their FIN reads as a close */
+  options |= SSL_OP_IGNORE_UNEXPECTED_EOF;
 #endif
-          conn->fd = -1;
-        }
-        server->fds[i].revents = 0;
-        continue;
-      }
-
-      bool keep_alive = true;
-      while (keep_alive) {
-        tw_request req;
-        if (!tw_request_init(&req)) {
-          keep_alive = false;
-          break;
-        };
-
-        tw_request_parse_result req_parse_result = tw_request_parse(conn, &req);
-        if (req_parse_result == TW_REQUEST_PARSE_ERROR) {
-          tw_response res;
-          if (!tw_response_init(&res)) {
-            keep_alive = false;
-            break;
-          };
-
-          tw_response_set_status(&res, 400);
-          const char *body = "Bad Request";
-          tw_response_set_body(&res, body, strlen(body));
-
-          tw_response_send(conn, &res);
-          tw_request_free(&req);
-          tw_response_free(&res);
-          keep_alive = false;
-          break;
-        } else if (req_parse_result == TW_REQUEST_PARSE_BLOCK) {
-          /* no data available yet */
-          tw_request_free(&req);
-          keep_alive = false;
-          break;
-        }
+#ifdef SSL_OP_ENABLE_KTLS
+  /* the kernel takes over the record layer after the handshake */
+  options |= SSL_OP_ENABLE_KTLS;
+#endif
+  SSL_CTX_set_options(ctx, options);
+  /* writes may be partial like send() and retried from another buffer;
+   * idle connections hold no record buffers */
+  SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+                            SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+                            SSL_MODE_RELEASE_BUFFERS);
+  SSL_CTX_set_session_id_context(ctx, (const unsigned char *)"thinwire", 8);
+  SSL_CTX_sess_set_cache_size(ctx, TW_TLS_SESSION_CACHE_SIZE);
+  SSL_CTX_set_alpn_select_cb(ctx, tw__tls_alpn, NULL);
+
+  const char *key_file =
+      config->tls_key_file != NULL ? config->tls_key_file
+                                   : config->tls_cert_file;
+  if (SSL_CTX_use_certificate_chain_file(ctx, config->tls_cert_file) != 1) {
+    tw_log(TW_ERROR, "Failed to load %s: %s", config->tls_cert_file,
+           tw__tls_reason());
+    SSL_CTX_free(ctx);
+    return false;
+  }
+  if (SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+      SSL_CTX_check_private_key(ctx) != 1) {
+    tw_log(TW_ERROR, "Failed to load %s: %s", key_file, tw__tls_reason());
+    SSL_CTX_free(ctx);
+    return false;
+  }
 
-        tw_response res;
-        if (!tw_response_init(&res)) {
-          tw_request_free(&req);
-          keep_alive = false;
-          break;
-        };
+#ifndef _WIN32
+  /* OpenSSL writes without MSG_NOSIGNAL, a peer that went away must not
+   * raise SIGPIPE unless the program handles it */
+  struct sigaction action;
+  if (sigaction(SIGPIPE, NULL, &action) == 0 &&
+      action.sa_handler == SIG_DFL) {
+    signal(SIGPIPE, SIG_IGN);
+  }
+#endif
 
-        if (req.keep_alive) {
-          tw_response_set_header(&res, "Connection", "keep-alive");
-        } else {
-          tw_response_set_header(&res, "Connection", "close");
-          keep_alive = false;
-        }
+  server->tls_ctx = ctx;
+  return true;
+}
 
-        handler(conn, &req, &res);
+/* Starts the server side of the handshake on an accepted connection. */
+static bool tw__tls_accept(tw_server *server, tw_conn *conn) {
+  conn->tls = SSL_new(server->tls_ctx);
+  if (conn->tls == NULL || SSL_set_fd(conn->tls, conn->fd) != 1) {
+    tw_log(TW_ERROR, "Failed to set up TLS: %s", tw__tls_reason());
+    SSL_free(conn->tls);
+    conn->tls = NULL;
+    return false;
+  }
+  SSL_set_accept_state(conn->tls);
+  conn->tls_handshake = POLLIN;
+  return true;
+}
 
-        tw_request_free(&req);
-        tw_response_free(&res);
+/* Takes the handshake as far as the socket allows. Returns false when it
+ * failed. */
+static bool tw__tls_handshake(tw_conn *conn) {
+  ERR_clear_error();
+  int ret = SSL_do_handshake(conn->tls);
+  if (ret == 1) {
+    conn->tls_handshake = 0;
+    return true;
+  }
+  switch (SSL_get_error(conn->tls, ret)) {
+    case SSL_ERROR_WANT_READ:
+      conn->tls_handshake = POLLIN;
+      return true;
+    case SSL_ERROR_WANT_WRITE:
+      conn->tls_handshake = POLLOUT;
+      return true;
+    default:
+      /* scanners and plaintext clients end up here, not worth a log line */
+      ERR_clear_error();
+      return false;
+  }
+}
 
-        if (!keep_alive) {
-          tw_conn_close(conn);
+/* Maps a failed SSL_read_ex or SSL_write_ex to what recv or send would
+ * have returned. */
+static ssize_t tw__tls_failed(tw_conn *conn, int ret) {
+  int err = SSL_get_error(conn->tls, ret);
+  ERR_clear_error();
+  switch (err) {
+    case SSL_ERROR_ZERO_RETURN:
+      return 0;
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
 #ifdef _WIN32
-          server->fds[i].fd = (SOCKET)-1;
+      WSASetLastError(WSAEWOULDBLOCK);
 #else
-          server->fds[i].fd = -1;
+      errno = EAGAIN;
 #endif
-          conn->fd = -1;
-          break;
-        }
-      }
+      return -1;
+    case SSL_ERROR_SYSCALL:
+      if (errno == 0) errno = ECONNRESET;
+      return -1;
+    default:
+      errno = EPROTO;
+      return -1;
+  }
+}
 
-      server->fds[i].revents = 0;
+/* Counts the connections waiting to read that have decrypted bytes left
+ * in OpenSSL, which poll() does not see, and marks them readable when
+ * mark is set. */
+static int tw__tls_pending(tw_server *server, bool mark) {
+  if (server->tls_ctx == NULL) return 0;
+  int pending = 0;
+  for (int i = server->num_listeners; i < server->nfds; i++) {
+    tw_conn *conn = &server->conns[i];
+    if (conn->fd < 0 || conn->tls == NULL || conn->tls_handshake != 0 ||
+        !(server->fds[i].events & POLLIN) || SSL_pending(conn->tls) <= 0) {
+      continue;
     }
+    pending++;
+    if (mark) server->fds[i].revents |= POLLIN;
+  }
+  return pending;
+}
 
-    int current = 1;
-    for (int i = 1; i < server->nfds; i++) {
-#ifdef _WIN32
-      if (server->fds[i].fd != (SOCKET)-1) {
+TWDEF bool tw_conn_ktls_send(tw_conn *conn) {
+#ifndef OPENSSL_NO_KTLS
+  return conn->tls != NULL && BIO_get_ktls_send(SSL_get_wbio(conn->tls));
 #else
-      if (server->fds[i].fd != -1) {
+  (void)conn;
+  return false;
 #endif
-        if (current != i) {
-          server->fds[current] = server->fds[i];
-          server->conns[current] = server->conns[i];
-        }
-        current++;
-      } else {
-        server->fds[i].events = 0;
-        server->fds[i].revents = 0;
-        server->conns[i].fd = -1;
-      }
-    }
+}
 
-    server->nfds = current;
+TWDEF bool tw_conn_ktls_recv(tw_conn *conn) {
+#ifndef OPENSSL_NO_KTLS
+  return conn->tls != NULL && BIO_get_ktls_recv(SSL_get_rbio(conn->tls));
+#else
+  (void)conn;
+  return false;
+#endif
+}
+#endif
+
+/* One recv() on the connection, decrypted when it speaks TLS. OpenSSL
+ * leaves the record layer to the kernel where kTLS is on. */
+static ssize_t tw__conn_recv(tw_conn *conn, char *buf, size_t len) {
+#ifdef TW_ENABLE_TLS
+  if (conn->tls != NULL) {
+    size_t n;
+    ERR_clear_error();
+    int ret = SSL_read_ex(conn->tls, buf, len, &n);
+    return ret == 1 ? (ssize_t)n : tw__tls_failed(conn, ret);
   }
+#endif
+  return recv(conn->fd, buf, len, 0);
+}
 
-  return true;
+/* One send() on the connection, encrypted when it speaks TLS. */
+static ssize_t tw__conn_send(tw_conn *conn, const char *buf, size_t len) {
+#ifdef TW_ENABLE_TLS
+  if (conn->tls != NULL) {
+    /* partial writes stop after each record, send() goes on until the
+     * socket buffer is full */
+    size_t sent = 0;
+    while (sent < len) {
+      size_t n;
+      ERR_clear_error();
+      int ret = SSL_write_ex(conn->tls, buf + sent, len - sent, &n);
+      if (ret != 1) {
+        ssize_t failed = tw__tls_failed(conn, ret);
+        return sent > 0 ? (ssize_t)sent : failed;
+      }
+      sent += n;
+    }
+    return (ssize_t)sent;
+  }
+#endif
+  return send(conn->fd, buf, len, TW__SEND_FLAGS);
 }
 
-TWDEF bool tw_server_stop(tw_server *server) {
-  if (close(server->fd) < 0) {
+/* Copies the config with defaults filled in and resets the server
+ * state, without opening any socket. */
+static bool tw__server_setup(tw_server *server,
+                             const tw_server_config *config) {
+#ifdef _WIN32
+  WSADATA wsa;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+    tw_log(TW_ERROR, "WSAStartup failed");
     return false;
   }
+#endif
+
+  server->config = *config;
+  if (server->config.port <= 0) {
+    server->config.port = TW_DEFAULT_PORT;
+  }
+  if (server->config.backlog <= 0) {
+    server->config.backlog = TW_DEFAULT_BACKLOG;
+  }
+  if (server->config.max_body_size == 0) {
+    server->config.max_body_size = TW_MAX_REQUEST_BODY;
+  }
+  if (server->config.max_connections <= 0 ||
+      server->config.max_connections > TW_MAX_CLIENTS) {
+    server->config.max_connections = TW_MAX_CLIENTS;
+  }
+  if (server->config.drain_timeout <= 0) {
+    server->config.drain_timeout = TW_DRAIN_TIMEOUT;
+  }
 
-#ifdef _WIN32
-  WSACleanup();
+  server->num_listeners = 0;
+  server->nfds = 0;
+  server->memory_used = 0;
+  server->reads_paused = false;
+  server->tick = 0;
+  server->body_admission = NULL;
+  server->drain_requested = 0;
+  server->draining = false;
+  server->drain_deadline = 0;
+  server->handed_off = false;
+  memset(server->fds, 0, sizeof(server->fds));
+#ifdef TW_ENABLE_PARK
+  server->park_inbox = NULL;
+  server->park_wakeup = -1;
+#endif
+#ifdef TW_ENABLE_COROUTINES
+  server->coro_pool = NULL;
+  server->coro_pooled = 0;
+#endif
+
+#ifdef TW_ENABLE_COMPRESSION
+  tw_compression_config_init(&server->compression);
+  tw_compression_cache_init(&server->compression_cache);
+#endif
+  tw_file_cache_init(&server->file_cache);
+  tw_rate_limit_init(&server->rate_limit);
+#ifdef TW_ENABLE_TRACE
+  tw__trace_init(&server->trace);
+#endif
+#ifdef TW_ENABLE_TLS
+  if (!tw__tls_setup(server)) {
+    return false;
+  }
 #endif
 
   return true;
 }
 
-TWDEF bool tw__set_nonblocking(int fd) {
-#ifdef _WIN32
-  DWORD mode = 1;
-  if (ioctlsocket(fd, FIONBIO, &mode) != 0) {
-    tw_log(TW_ERROR, "ioctlsocket failed");
+TWDEF bool tw_server_init_ex(tw_server *server,
+                             const tw_server_config *config) {
+  if (!tw__server_setup(server, config)) {
     return false;
   }
-#else
-  int flags = fcntl(fd, F_GETFL, 0);
-  if (flags == -1) {
-    tw_log(TW_ERROR, "fcntl(F_GETFL) failed");
+  return tw_server_listen(server, config->bind_addr, server->config.port);
+}
+
+TWDEF bool tw_server_listen(tw_server *server, const char *bind_addr,
+                            int port) {
+  const tw_server_config *config = &server->config;
+
+  if (server->nfds != server->num_listeners) {
+    tw_log(TW_ERROR, "Listeners must be added before tw_server_run");
     return false;
   }
-  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
-    tw_log(TW_ERROR, "fcntl(F_SETFL) failed");
+  if (server->num_listeners == TW_MAX_LISTENERS) {
+    tw_log(TW_ERROR, "Too many listeners, raise TW_MAX_LISTENERS");
+    return false;
+  }
+
+  tw_listener *listener = &server->listeners[server->num_listeners];
+  if (!tw__parse_address(bind_addr, port, &listener->addr,
+                         &listener->addr_len)) {
+    tw_log(TW_ERROR, "Invalid bind address: %s", bind_addr);
+    return false;
+  }
+
+  int family = listener->addr.ss_family;
+  if ((listener->fd = socket(family, SOCK_STREAM, 0)) < 0) {
+    tw_log(TW_ERROR, "Socket failed");
     return false;
   }
+  bool tcp = family == AF_INET || family == AF_INET6;
+
+#ifndef _WIN32
+  /* on Windows SO_REUSEADDR allows stealing a port that is in use */
+  if (tcp && config->reuse_addr) {
+    tw__setsockopt_int(listener->fd, SOL_SOCKET, SO_REUSEADDR, 1,
+                       "SO_REUSEADDR");
+  }
+#endif
+  if (family == AF_INET6) {
+    /* IPv4 clients are served by an IPv4 listener on the same port */
+    tw__setsockopt_int(listener->fd, IPPROTO_IPV6, IPV6_V6ONLY, 1,
+                       "IPV6_V6ONLY");
+  }
+  /* buffer sizes must be set before listen() to affect window scaling */
+  if (config->recv_buf_size > 0) {
+    tw__setsockopt_int(listener->fd, SOL_SOCKET, SO_RCVBUF,
+                       config->recv_buf_size, "SO_RCVBUF");
+  }
+  if (config->send_buf_size > 0) {
+    tw__setsockopt_int(listener->fd, SOL_SOCKET, SO_SNDBUF,
+                       config->send_buf_size, "SO_SNDBUF");
+  }
+  if (tcp && config->tcp_nodelay) {
+    tw__setsockopt_int(listener->fd, IPPROTO_TCP, TCP_NODELAY, 1,
+                       "TCP_NODELAY");
+  }
+#ifdef TCP_DEFER_ACCEPT
+  if (tcp && config->defer_accept > 0) {
+    tw__setsockopt_int(listener->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                       config->defer_accept, "TCP_DEFER_ACCEPT");
+  }
+#endif
+#ifdef SO_BUSY_POLL
+  if (tcp && config->busy_poll > 0) {
+    tw__setsockopt_int(listener->fd, SOL_SOCKET, SO_BUSY_POLL,
+                       config->busy_poll, "SO_BUSY_POLL");
+  }
 #endif
-  return true;
-}
 
-TWDEF ssize_t tw_conn_read(tw_conn *conn, char *buf, size_t len) {
-  ssize_t bytes_read = recv(conn->fd, buf, len, 0);
-  return bytes_read;
-};
+#ifndef _WIN32
+  if (family == AF_UNIX) {
+    /* a socket file left behind by a previous run blocks bind() */
+    struct sockaddr_un *un = (struct sockaddr_un *)&listener->addr;
+    struct stat st;
+    if (un->sun_path[0] != '\0' && stat(un->sun_path, &st) == 0 &&
+        S_ISSOCK(st.st_mode)) {
+      unlink(un->sun_path);
+    }
+  }
+#endif
 
-TWDEF ssize_t tw_conn_write(tw_conn *conn, const char *buf, size_t len) {
-  ssize_t bytes_sent = send(conn->fd, buf, len, 0);
-  return bytes_sent;
-};
+  if (bind(listener->fd, (struct sockaddr *)&listener->addr,
+           listener->addr_len) < 0) {
+    tw_log(TW_ERROR, "Socket bind failed: %s", strerror(errno));
+    close(listener->fd);
+    return false;
+  }
 
-TWDEF void tw_conn_close(tw_conn *conn) { close(conn->fd); };
+#ifdef TCP_FASTOPEN
+  if (tcp && config->fastopen_queue > 0) {
+    tw__setsockopt_int(listener->fd, IPPROTO_TCP, TCP_FASTOPEN,
+                       config->fastopen_queue, "TCP_FASTOPEN");
+  }
+#endif
 
-TWDEF bool tw_request_init(tw_request *req) {
-  if (req != NULL) {
-    tw_map_init(&req->headers);
-    req->keep_alive = false;
-    req->body = NULL;
-    req->body_len = 0;
-    return true;
-  } else {
+  if (listen(listener->fd, config->backlog) < 0) {
+    tw_log(TW_ERROR, "Socket listen failed");
+    close(listener->fd);
     return false;
   }
-}
 
-TWDEF void tw_request_free(tw_request *req) {
-  if (req != NULL) {
-    free(req->body);
-    tw_map_free(&req->headers);
-    req->body = NULL;
-    req->body_len = 0;
+  if (!tw__set_nonblocking(listener->fd)) {
+    close(listener->fd);
+    return false;
   }
-}
 
-TWDEF tw_request_parse_result tw_request_parse(tw_conn *conn, tw_request *req) {
-  char buf[TW_MAX_REQUEST_SIZE];
-  ssize_t bytes_read = 0;
-  ssize_t total_read = 0;
-  const char *headers_end = NULL;
+  listener->handoff = false;
+  listener->wakeup = false;
+  server->fds[server->num_listeners].fd = listener->fd;
+  server->fds[server->num_listeners].events = POLLIN;
+  server->num_listeners++;
+  server->nfds = server->num_listeners;
 
-  while (total_read < TW_MAX_REQUEST_SIZE - 1) {
-    bytes_read = tw_conn_read(conn, buf + total_read,
-                              TW_MAX_REQUEST_SIZE - total_read - 1);
-    if (bytes_read <= 0) {
+  return true;
+}
+
+TWDEF bool tw_server_enable_handoff(tw_server *server, const char *path) {
 #ifdef _WIN32
-      if (WSAGetLastError() == WSAEWOULDBLOCK) {
-        return TW_REQUEST_PARSE_BLOCK;
-      }
+  (void)server;
+  (void)path;
+  tw_log(TW_ERROR, "Listener handoff is not supported on Windows");
+  return false;
 #else
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        return TW_REQUEST_PARSE_BLOCK;
-      }
-#endif
-      return TW_REQUEST_PARSE_ERROR;
-    }
-
-    total_read += bytes_read;
-    buf[total_read] = '\0';
-
-    headers_end = strstr(buf, "\r\n\r\n");
-    if (headers_end) {
-      break;
-    }
+  char bind_addr[sizeof(struct sockaddr_un) + 6];
+  if (path == NULL || strlen(path) + 6 > sizeof(bind_addr)) {
+    tw_log(TW_ERROR, "Invalid handoff path");
+    return false;
   }
+  snprintf(bind_addr, sizeof(bind_addr), "unix:%s", path);
 
-  if (!headers_end) {
-    /* headers too large or malformed */
-    return TW_REQUEST_PARSE_ERROR;
+  if (!tw_server_listen(server, bind_addr, 0)) {
+    return false;
   }
+  server->listeners[server->num_listeners - 1].handoff = true;
+  return true;
+#endif
+}
 
-  const char *pos = buf;
-
-  const char *method_end = strchr(buf, ' ');
-  if (!method_end) {
-    return TW_REQUEST_PARSE_ERROR;
+TWDEF bool tw_server_init_handoff(tw_server *server,
+                                  const tw_server_config *config,
+                                  const char *path) {
+#ifdef _WIN32
+  (void)server;
+  (void)config;
+  (void)path;
+  tw_log(TW_ERROR, "Listener handoff is not supported on Windows");
+  return false;
+#else
+  char connect_addr[sizeof(struct sockaddr_un) + 6];
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  if (path == NULL || strlen(path) + 6 > sizeof(connect_addr)) {
+    tw_log(TW_ERROR, "Invalid handoff path");
+    return false;
   }
-  req->method_len = (size_t)(method_end - pos);
-  if (req->method_len >= sizeof(req->method)) {
-    return TW_REQUEST_PARSE_ERROR;
+  snprintf(connect_addr, sizeof(connect_addr), "unix:%s", path);
+  if (!tw__parse_address(connect_addr, 0, &addr, &addr_len)) {
+    tw_log(TW_ERROR, "Invalid handoff path: %s", path);
+    return false;
   }
-  memcpy(req->method, pos, req->method_len);
-  req->method[req->method_len] = '\0';
 
-  const char *path_start = method_end + 1;
-  const char *path_end = strchr(path_start, ' ');
-  if (!path_end) {
-    return TW_REQUEST_PARSE_ERROR;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    tw_log(TW_ERROR, "Socket failed");
+    return false;
   }
-  req->path_len = (size_t)(path_end - path_start);
-  if (req->path_len >= sizeof(req->path)) {
-    return TW_REQUEST_PARSE_ERROR;
+  if (connect(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+    tw_log(TW_INFO, "No server to take listeners over from at %s", path);
+    close(fd);
+    return false;
   }
-  memcpy(req->path, path_start, req->path_len);
-  req->path[req->path_len] = '\0';
 
-  const char *version_start = path_end + 1;
-  const char *version_end = strstr(version_start, "\r\n");
-  if (!version_end) {
-    version_end = strchr(version_start, '\n');
-    if (!version_end) {
-      return TW_REQUEST_PARSE_ERROR;
+  /* the old server answers from its event loop */
+  struct timeval timeout = {5, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  unsigned char count = 0;
+  struct iovec iov = {&count, 1};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * TW_MAX_LISTENERS)];
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+  flags |= MSG_CMSG_CLOEXEC;
+#endif
+  ssize_t n = recvmsg(fd, &msg, flags);
+  close(fd);
+
+  int fds[TW_MAX_LISTENERS];
+  int num_fds = 0;
+  if (n == 1) {
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        continue;
+      }
+      size_t len = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (len > (size_t)(TW_MAX_LISTENERS - num_fds)) {
+        len = (size_t)(TW_MAX_LISTENERS - num_fds);
+      }
+      memcpy(fds + num_fds, CMSG_DATA(cmsg), len * sizeof(int));
+      num_fds += (int)len;
     }
   }
-  req->version_len = (size_t)(version_end - version_start);
-  if (req->version_len >= sizeof(req->version)) {
-    return TW_REQUEST_PARSE_ERROR;
+  if (n != 1 || num_fds != count || num_fds == 0) {
+    tw_log(TW_ERROR, "Listener handoff failed");
+    for (int i = 0; i < num_fds; i++) {
+      close(fds[i]);
+    }
+    return false;
   }
-  memcpy(req->version, version_start, req->version_len);
-  req->version[req->version_len] = '\0';
 
-  pos = version_end + 2;
+  if (!tw__server_setup(server, config)) {
+    for (int i = 0; i < num_fds; i++) {
+      close(fds[i]);
+    }
+    return false;
+  }
 
-  while (*pos && !(pos[0] == '\r' && pos[1] == '\n')) {
-    const char *colon = strchr(pos, ':');
-    if (!colon) return TW_REQUEST_PARSE_ERROR;
+  for (int i = 0; i < num_fds; i++) {
+    tw_listener *listener = &server->listeners[i];
+    listener->fd = fds[i];
+    listener->addr_len = sizeof(listener->addr);
+    if (getsockname(fds[i], (struct sockaddr *)&listener->addr,
+                    &listener->addr_len) < 0) {
+      memset(&listener->addr, 0, sizeof(listener->addr));
+      listener->addr_len = 0;
+    }
+    listener->handoff = false;
+    listener->wakeup = false;
+    tw__set_nonblocking(fds[i]);
+#ifndef MSG_CMSG_CLOEXEC
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+#endif
+    server->fds[i].fd = fds[i];
+    server->fds[i].events = POLLIN;
+  }
+  server->num_listeners = num_fds;
+  server->nfds = num_fds;
 
-    size_t name_len = (size_t)(colon - pos);
-    if (name_len >= TW_MAX_HEADER_NAME) return TW_REQUEST_PARSE_ERROR;
-    char name[TW_MAX_HEADER_NAME];
-    memcpy(name, pos, name_len);
-    name[name_len] = '\0';
+  tw_log(TW_INFO, "Took over %d listeners", num_fds);
+  return true;
+#endif
+}
 
-    const char *value_start = colon + 1;
-    while (*value_start == ' ') value_start++;
+/* Fails when charging bytes would exceed the memory budget. Output that
+ * was already produced is charged with force, since dropping it would
+ * break the connection anyway. */
+static bool tw__memory_charge(tw_conn *conn, size_t bytes, bool force) {
+  if (conn == NULL || conn->server == NULL) return true;
+  tw_server *server = conn->server;
+  size_t budget = server->config.memory_budget;
+  if (!force && budget > 0 && server->memory_used + bytes > budget) {
+    return false;
+  }
+  server->memory_used += bytes;
+  conn->memory += bytes;
+  return true;
+}
 
-    const char *line_end = strstr(value_start, "\r\n");
-    if (!line_end) return TW_REQUEST_PARSE_ERROR;
+static void tw__memory_release(tw_conn *conn, size_t bytes) {
+  if (bytes == 0 || conn == NULL || conn->server == NULL) return;
+  if (bytes > conn->memory) bytes = conn->memory;
+  conn->server->memory_used -= bytes;
+  conn->memory -= bytes;
+}
 
-    size_t value_len = (size_t)(line_end - value_start);
-    if (value_len >= TW_MAX_HEADER_VALUE) return TW_REQUEST_PARSE_ERROR;
-    char value[TW_MAX_HEADER_VALUE];
-    memcpy(value, value_start, value_len);
-    value[value_len] = '\0';
+/* The bytes tw__pool_get allocates for a buffer of size bytes. */
+static size_t tw__pool_size(size_t size) {
+  if (size > TW_BUFFER_POOL_MAX) return size;
+  size_t class_size = TW_BUFFER_POOL_MIN;
+  while (class_size < size) class_size *= 2;
+  return class_size;
+}
 
-    tw_map_set(&req->headers, name, value);
-    pos = line_end + 2;
+/* Returns the free list for buffers of size bytes, or NULL when they are
+ * not kept. */
+static void **tw__pool_list(tw_conn *conn, size_t size) {
+  if (conn == NULL || conn->server == NULL || size > TW_BUFFER_POOL_MAX) {
+    return NULL;
   }
+  tw_buffer_pool *pool = &conn->server->buffers;
+  size_t c = 0;
+  size_t class_size = TW_BUFFER_POOL_MIN;
+  while (class_size < size) {
+    class_size *= 2;
+    c++;
+  }
+  if (class_size != size || c >= sizeof(pool->free) / sizeof(pool->free[0])) {
+    return NULL;
+  }
+  return &pool->free[c];
+}
 
-  req->keep_alive = false;
-
-  const char *conn_hdr = tw_request_get_header(req, "Connection");
-  if (conn_hdr) {
-    if (strcasecmp(conn_hdr, "keep-alive") == 0) {
-      req->keep_alive = true;
+/* Takes a buffer of at least size bytes, tw__pool_size(size) to be exact,
+ * from the server's free lists or from malloc. */
+static char *tw__pool_get(tw_conn *conn, size_t size) {
+  size = tw__pool_size(size);
+  void **list = tw__pool_list(conn, size);
+  if (list != NULL) {
+    void *buf = *list;
+    if (buf != NULL) {
+      memcpy(list, buf, sizeof(void *));
+      conn->server->buffers.idle -= size;
+      return (char *)buf;
     }
+  }
+  return (char *)malloc(size);
+}
+
+/* Returns a buffer of size bytes. Only buffers of a pool size are kept,
+ * up to TW_BUFFER_POOL_IDLE bytes of them. */
+static void tw__pool_put(tw_conn *conn, char *buf, size_t size) {
+  if (buf == NULL) return;
+  void **list = tw__pool_list(conn, size);
+  if (list != NULL &&
+      conn->server->buffers.idle + size <= TW_BUFFER_POOL_IDLE) {
+    memcpy(buf, list, sizeof(void *));
+    *list = buf;
+    conn->server->buffers.idle += size;
+    return;
+  }
+  free(buf);
+}
+
+static void tw__pool_free(tw_buffer_pool *pool) {
+  for (size_t c = 0; c < sizeof(pool->free) / sizeof(pool->free[0]); c++) {
+    while (pool->free[c] != NULL) {
+      void *buf = pool->free[c];
+      memcpy(&pool->free[c], buf, sizeof(void *));
+      free(buf);
+    }
+  }
+  pool->idle = 0;
+}
+
+#if defined(TW_ENABLE_HTTP2) || defined(TW_ENABLE_WEBSOCKET)
+static bool tw__memory_available(tw_conn *conn, size_t bytes) {
+  if (conn == NULL || conn->server == NULL) return true;
+  size_t budget = conn->server->config.memory_budget;
+  return budget == 0 || conn->server->memory_used + bytes <= budget;
+}
+
+/* Brings the charge for the HTTP/2 or websocket state of conn in line
+ * with the buffers it currently holds. */
+static void tw__memory_sync(tw_conn *conn) {
+  size_t buffered = 0;
+#ifdef TW_ENABLE_HTTP2
+  if (conn->h2 != NULL) buffered += tw__h2_memory(conn->h2);
+#endif
+#ifdef TW_ENABLE_WEBSOCKET
+  if (conn->ws != NULL) buffered += tw__ws_memory(conn->ws);
+#endif
+  if (buffered > conn->buffered) {
+    tw__memory_charge(conn, buffered - conn->buffered, true);
+  } else {
+    tw__memory_release(conn, conn->buffered - buffered);
+  }
+  conn->buffered = buffered;
+}
+#endif
+
+static const char tw__response_413[] =
+    "HTTP/1.1 413 Content Too Large\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+#define TW__STR(x) #x
+#define TW__XSTR(x) TW__STR(x)
+
+static const char tw__response_503[] =
+    "HTTP/1.1 503 Service Unavailable\r\n"
+    "Content-Length: 0\r\n"
+    "Retry-After: " TW__XSTR(TW_RETRY_AFTER) "\r\n"
+    "Connection: close\r\n\r\n";
+
+static const char tw__response_429[] =
+    "HTTP/1.1 429 Too Many Requests\r\n"
+    "Content-Length: 0\r\n"
+    "Retry-After: " TW__XSTR(TW_RETRY_AFTER) "\r\n"
+    "Connection: close\r\n\r\n";
+
+static const char tw__response_100[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+static uint64_t tw__hash(const char *data, size_t len) {
+  /* FNV-1a */
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (unsigned char)data[i];
+    hash *= 0x100000001b3ULL;
+  }
+  return hash;
+}
+
+TWDEF void tw_rate_limit_init(tw_rate_limit *limit) {
+  limit->enabled = false;
+  limit->rate = TW_RATE_LIMIT_RATE;
+  limit->burst = TW_RATE_LIMIT_BURST;
+  limit->header = NULL;
+  limit->num_trusted = 0;
+  limit->trust_unix = false;
+  limit->now = 0;
+  memset(limit->buckets, 0, sizeof(limit->buckets));
+}
+
+/* A word at a time, an address takes one or two multiplications where
+ * FNV-1a takes one per byte. */
+static uint64_t tw__rate_limit_hash(const char *key, size_t len) {
+  uint64_t hash = 0x9e3779b97f4a7c15ULL ^ len;
+  while (len > 0) {
+    uint64_t word;
+    if (len >= 8) {
+      memcpy(&word, key, 8);
+      key += 8;
+      len -= 8;
+    } else if (len >= 4) {
+      uint32_t half;
+      memcpy(&half, key, 4);
+      word = half;
+      key += 4;
+      len -= 4;
+    } else {
+      word = (unsigned char)*key++;
+      len--;
+    }
+    hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 32;
+  }
+  return hash;
+}
+
+TWDEF bool tw_rate_limit_take(tw_rate_limit *limit, const char *key,
+                              size_t len) {
+  uint64_t hash = tw__rate_limit_hash(key, len);
+  hash += hash == 0;
+  uint64_t full = (uint64_t)limit->burst * 1000;
+
+  size_t kept = len < TW_RATE_LIMIT_KEY_SIZE ? len : TW_RATE_LIMIT_KEY_SIZE;
+
+  for (size_t i = 0; i < TW_RATE_LIMIT_PROBE; i++) {
+    tw_rate_bucket *bucket =
+        &limit->buckets[(hash + i) & (TW_RATE_LIMIT_SIZE - 1)];
+    if (bucket->hash != hash || bucket->key_len != len ||
+        memcmp(bucket->key, key, kept) != 0) {
+      continue;
+    }
+
+    /* refilled lazily, a thousandth of a request per millisecond for each
+     * request per second */
+    uint64_t tokens = bucket->tokens;
+    if (limit->now > bucket->refilled) {
+      uint64_t elapsed = limit->now - bucket->refilled;
+      tokens = elapsed >= full ? full : tokens + elapsed * limit->rate;
+      if (tokens > full) tokens = full;
+    }
+    bucket->refilled = limit->now;
+    if (tokens < 1000) {
+      bucket->tokens = (uint32_t)tokens;
+      return false;
+    }
+    bucket->tokens = (uint32_t)(tokens - 1000);
+    return true;
+  }
+
+  /* a client not seen recently takes a free bucket or the one of the
+   * client seen least recently, starting out full */
+  if (full < 1000) return false;
+  tw_rate_bucket *victim = &limit->buckets[hash & (TW_RATE_LIMIT_SIZE - 1)];
+  for (size_t i = 1; i < TW_RATE_LIMIT_PROBE && victim->hash != 0; i++) {
+    tw_rate_bucket *bucket =
+        &limit->buckets[(hash + i) & (TW_RATE_LIMIT_SIZE - 1)];
+    if (bucket->hash == 0 || bucket->refilled < victim->refilled) {
+      victim = bucket;
+    }
+  }
+  victim->hash = hash;
+  victim->key_len = (uint32_t)len;
+  memcpy(victim->key, key, kept);
+  victim->refilled = limit->now;
+  victim->tokens = (uint32_t)(full - 1000);
+  return true;
+}
+
+static const unsigned char tw__v4_mapped[12] = {0, 0, 0, 0, 0,    0,
+                                                0, 0, 0, 0, 0xff, 0xff};
+
+/* Parses an IPv4 or IPv6 address to IPv6, IPv4 ones mapped. */
+static bool tw__rate_limit_parse(const char *text, unsigned char out[16]) {
+  struct in_addr in;
+  if (inet_pton(AF_INET, text, &in) == 1) {
+    memcpy(out, tw__v4_mapped, 12);
+    memcpy(out + 12, &in, 4);
+    return true;
+  }
+  return inet_pton(AF_INET6, text, out) == 1;
+}
+
+TWDEF bool tw_rate_limit_trust(tw_rate_limit *limit, const char *addr) {
+  if (strcmp(addr, "unix") == 0) {
+    limit->trust_unix = true;
+    return true;
+  }
+  if (limit->num_trusted == TW_RATE_LIMIT_TRUSTED) {
+    tw_log(TW_ERROR, "Too many proxies, raise TW_RATE_LIMIT_TRUSTED");
+    return false;
+  }
+  if (!tw__rate_limit_parse(addr, limit->trusted[limit->num_trusted])) {
+    tw_log(TW_ERROR, "Invalid proxy address: %s", addr);
+    return false;
+  }
+  limit->num_trusted++;
+  return true;
+}
+
+/* Takes a request from the bucket of a client address. An IPv6 client
+ * usually holds a whole /64, so that is what it is keyed on. The first
+ * byte keeps addresses apart from header values. */
+static bool tw__rate_limit_take_addr(tw_rate_limit *limit,
+                                     const unsigned char addr[16]) {
+  char key[9];
+  if (memcmp(addr, tw__v4_mapped, 12) == 0) {
+    key[0] = 4;
+    memcpy(key + 1, addr + 12, 4);
+    return tw_rate_limit_take(limit, key, 5);
+  }
+  key[0] = 6;
+  memcpy(key + 1, addr, 8);
+  return tw_rate_limit_take(limit, key, 9);
+}
+
+/* Takes a request from the client's bucket. Peers of Unix sockets have no
+ * address to tell them apart by, only the header can. */
+static bool tw__rate_limit_admit(tw_conn *conn, tw_request *req) {
+  tw_rate_limit *limit = &conn->server->rate_limit;
+  const tw_sockaddr *peer = &conn->addr;
+  unsigned char addr[16];
+  bool has_addr = true;
+  bool trusted = false;
+  if (peer->sa.sa_family == AF_INET) {
+    memcpy(addr, tw__v4_mapped, 12);
+    memcpy(addr + 12, &peer->in.sin_addr, 4);
+  } else if (peer->sa.sa_family == AF_INET6) {
+    memcpy(addr, &peer->in6.sin6_addr, 16);
+  } else {
+    has_addr = false;
+    trusted = limit->trust_unix;
+  }
+  for (int i = 0; has_addr && i < limit->num_trusted; i++) {
+    if (memcmp(addr, limit->trusted[i], 16) == 0) trusted = true;
+  }
+
+  const char *value = NULL;
+  if (trusted && limit->header != NULL) {
+    value = tw_request_get_header(req, limit->header);
+  }
+  if (value != NULL) {
+    /* earlier entries of a list come from the client */
+    const char *last = strrchr(value, ',');
+    if (last != NULL) value = last + 1;
+    while (*value == ' ' || *value == '\t') value++;
+    size_t len = strlen(value);
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t')) {
+      len--;
+    }
+
+    /* a forwarded address is keyed like a peer address */
+    char text[INET6_ADDRSTRLEN];
+    unsigned char forwarded[16];
+    if (len > 0 && len < sizeof(text)) {
+      memcpy(text, value, len);
+      text[len] = '\0';
+      if (tw__rate_limit_parse(text, forwarded)) {
+        return tw__rate_limit_take_addr(limit, forwarded);
+      }
+    }
+    if (len > 0) return tw_rate_limit_take(limit, value, len);
+  }
+
+  return has_addr ? tw__rate_limit_take_addr(limit, addr) : true;
+}
+
+/* Sends a prebuilt error response without allocating. */
+static void tw__conn_reject(tw_conn *conn, const char *response, size_t len) {
+  if (!conn->rejected) {
+    tw__conn_write_all(conn, response, len);
+    conn->rejected = true;
+  }
+}
+
+static void tw__conn_reject_status(tw_conn *conn, int status) {
+  if (status == 413) {
+    tw__conn_reject(conn, tw__response_413, sizeof(tw__response_413) - 1);
+  } else if (status == 503) {
+    tw__conn_reject(conn, tw__response_503, sizeof(tw__response_503) - 1);
+  } else {
+    char response[128];
+    int len = snprintf(response, sizeof(response),
+                       "HTTP/1.1 %d %s\r\n"
+                       "Content-Length: 0\r\n"
+                       "Connection: close\r\n\r\n",
+                       status, tw_status_text(status));
+    tw__conn_reject(conn, response, (size_t)len);
+  }
+}
+
+/* Answers a connection that is not admitted. Its request is never read.
+ * What already arrived of it is drained once, so that close() sends a FIN
+ * rather than a reset that could destroy the response. This is best
+ * effort: a larger head, or one that arrives after the drain, can still
+ * make close() reset the connection. */
+static void tw__refuse_conn(int fd) {
+  send(fd, tw__response_503, sizeof(tw__response_503) - 1, TW__SEND_FLAGS);
+#ifdef _WIN32
+  shutdown(fd, SD_SEND);
+#else
+  shutdown(fd, SHUT_WR);
+#endif
+  char drain[512];
+  recv(fd, drain, sizeof(drain), 0);
+  close(fd);
+}
+
+/* The least recently active HTTP/1 connection. Accepting happens before
+ * any handler runs, so every HTTP/1 connection is between requests. */
+static int tw__server_oldest_idle(tw_server *server) {
+  int oldest = -1;
+  for (int i = server->num_listeners; i < server->nfds; i++) {
+    tw_conn *conn = &server->conns[i];
+#ifdef TW_ENABLE_HTTP2
+    if (conn->h2 != NULL) continue;
+#endif
+#ifdef TW_ENABLE_WEBSOCKET
+    if (conn->ws != NULL) continue;
+#endif
+#ifdef TW_ENABLE_CLIENT
+    if (conn->upstream != NULL || conn->waiting != NULL) continue;
+#endif
+#ifdef TW_ENABLE_COROUTINES
+    if (conn->coro != NULL) continue;
+#endif
+#ifdef TW_ENABLE_PARK
+    if (conn->parked != NULL) continue;
+#endif
+    /* skip free slots, connections with a request waiting or accepted
+     * just now */
+    if (conn->fd < 0) continue;
+    if (server->fds[i].revents != 0 || conn->last_active == server->tick ||
+        conn->pipelined_len > 0) {
+      continue;
+    }
+    if (oldest < 0 || conn->last_active < server->conns[oldest].last_active) {
+      oldest = i;
+    }
+  }
+  return oldest;
+}
+
+/* Where a new connection goes. Slots in front of a suspended handler are
+ * not compacted and are filled first. */
+static int tw__server_free_slot(tw_server *server) {
+#ifdef TW_ENABLE_COROUTINES
+  for (int i = server->num_listeners; i < server->nfds; i++) {
+    if (server->conns[i].fd < 0) return i;
+  }
+#endif
+  return server->nfds;
+}
+
+/* Closes the connection in slot and frees the slot for the next
+ * compaction of the table. */
+static void tw__server_close_slot(tw_server *server, int slot) {
+  tw_conn_close(&server->conns[slot]);
+#ifdef _WIN32
+  server->fds[slot].fd = (SOCKET)-1;
+#else
+  server->fds[slot].fd = -1;
+#endif
+  server->fds[slot].revents = 0;
+  server->conns[slot].fd = -1;
+}
+
+static void tw__server_accept(tw_server *server, tw_listener *listener) {
+  int limit = server->num_listeners + server->config.max_connections;
+  tw_overload_policy policy = server->config.overload_policy;
+
+  for (int accepted = 0; accepted < TW_ACCEPT_BATCH; accepted++) {
+    int free_slot = tw__server_free_slot(server);
+    /* a server over its memory budget is overloaded as well */
+    bool full = free_slot >= limit;
+    if ((full || server->reads_paused) && policy == TW_OVERLOAD_BACKLOG) {
+      break;
+    }
+
+    tw_conn conn;
+    memset(&conn, 0, sizeof(conn));
+    conn.addr_len = sizeof(conn.addr);
+#ifdef TW_ENABLE_TRACE
+    uint64_t trace_start = tw__trace_fd(server, -1, TW_TRACE_ACCEPT, 0);
+#endif
+#ifdef _WIN32
+    SOCKET conn_fd = accept(listener->fd, &conn.addr.sa,
+                            &conn.addr_len);
+    if (conn_fd == INVALID_SOCKET) {
+      int werr = WSAGetLastError();
+      if (werr == WSAEWOULDBLOCK) {
+        /* no more pending connections */
+        break;
+      } else {
+        tw_log(TW_ERROR, "accept failed: %d", werr);
+        break;
+      }
+    }
+    conn.fd = (int)conn_fd;
+    conn.server = server;
+#else
+#ifdef TW_HAVE_ACCEPT4
+    int conn_fd = accept4(listener->fd, &conn.addr.sa,
+                          &conn.addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    int conn_fd = accept(listener->fd, &conn.addr.sa,
+                         &conn.addr_len);
+#endif
+    if (conn_fd < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        /* no more pending connections */
+        break;
+      } else {
+        tw_log(TW_ERROR, "accept failed: %s", strerror(errno));
+        break;
+      }
+    }
+    conn.fd = conn_fd;
+    conn.server = server;
+#endif
+#ifdef TW_ENABLE_TRACE
+    conn.trace_mark =
+        tw__trace_fd(server, conn.fd, TW_TRACE_ACCEPT, trace_start);
+#endif
+
+#ifndef TW_HAVE_ACCEPT4
+    tw__set_nonblocking(conn_fd);
+#endif
+#ifndef __linux__
+    /* Linux copies TCP_NODELAY from the listening socket */
+    if (server->config.tcp_nodelay && listener->addr.ss_family != AF_UNIX) {
+      tw__setsockopt_int((int)conn_fd, IPPROTO_TCP, TCP_NODELAY, 1,
+                         "TCP_NODELAY");
+    }
+#endif
+
+    conn.last_active = server->tick;
+
+    int slot = free_slot;
+    bool drop = full || server->reads_paused;
+    if (drop) {
+      slot = -1;
+      /* idle connections hold no memory, dropping one only frees a slot */
+      if (full && policy == TW_OVERLOAD_DROP_IDLE) {
+        slot = tw__server_oldest_idle(server);
+      }
+      if (slot < 0) {
+#ifdef TW_ENABLE_TLS
+        if (server->tls_ctx != NULL) {
+          /* a plaintext 503 means nothing to a TLS client */
+          close(conn_fd);
+          continue;
+        }
+#endif
+        tw__refuse_conn((int)conn_fd);
+        continue;
+      }
+    }
+#ifdef TW_ENABLE_TLS
+    /* only admitted connections cost a TLS session */
+    if (server->tls_ctx != NULL && !tw__tls_accept(server, &conn)) {
+      close(conn_fd);
+      continue;
+    }
+#endif
+
+    if (drop) {
+      /* the new connection takes over the slot of the dropped one */
+      tw_conn_close(&server->conns[slot]);
+    } else if (slot == server->nfds) {
+      server->nfds++;
+    }
+
+    server->conns[slot] = conn;
+    server->fds[slot].fd = conn_fd;
+    server->fds[slot].events = POLLIN;
+    server->fds[slot].revents = 0;
+  }
+}
+
+static short tw__conn_events(tw_conn *conn) {
+  (void)conn;
+#ifdef TW_ENABLE_TLS
+  if (conn->tls_handshake != 0) return conn->tls_handshake;
+#endif
+#ifdef TW_ENABLE_HTTP2
+  if (conn->h2 != NULL) return tw__h2_events(conn->h2);
+#endif
+#ifdef TW_ENABLE_WEBSOCKET
+  if (conn->ws != NULL) return tw__ws_events(conn->ws);
+#endif
+#ifdef TW_ENABLE_CLIENT
+  if (conn->upstream != NULL) return tw__client_events(conn->upstream);
+  if (conn->waiting != NULL) return 0;
+#endif
+#ifdef TW_ENABLE_COROUTINES
+  if (conn->coro != NULL) return conn->coro->events;
+#endif
+#ifdef TW_ENABLE_PARK
+  if (conn->parked != NULL) return tw__park_events(conn->parked);
+#endif
+  return conn->blocked ? POLLOUT : POLLIN;
+}
+
+/* Near the memory budget, stops reading from connections that hold more
+ * than their share so that they can only drain; reading resumes once
+ * usage falls back under three quarters of the budget. */
+static void tw__server_apply_backpressure(tw_server *server) {
+  size_t budget = server->config.memory_budget;
+  if (budget == 0) return;
+
+  bool pause = server->memory_used >= budget - budget / 8;
+  if (!pause && !server->reads_paused) return;
+  if (server->reads_paused && server->memory_used >= budget - budget / 4) {
+    pause = true;
+  }
+
+  int conns = server->nfds - server->num_listeners;
+  size_t share = conns > 0 ? server->memory_used / (size_t)conns : 0;
+  server->reads_paused = pause;
+  for (int i = server->num_listeners; i < server->nfds; i++) {
+    short events = tw__conn_events(&server->conns[i]);
+    if (pause && server->conns[i].buffered > share) {
+      events &= ~POLLIN;
+    }
+    server->fds[i].events = events;
+  }
+}
+
+static uint64_t tw__now_ms(void) {
+#ifdef _WIN32
+  return (uint64_t)GetTickCount64();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+static bool tw__listener_close(tw_listener *listener, bool remove_path) {
+  if (listener->fd < 0) return true;
+#ifndef _WIN32
+  struct sockaddr_un *un = (struct sockaddr_un *)&listener->addr;
+  if (remove_path && listener->addr.ss_family == AF_UNIX &&
+      un->sun_path[0] != '\0') {
+    unlink(un->sun_path);
+  }
+#endif
+  bool ok = close(listener->fd) == 0;
+  listener->fd = -1;
+  return ok;
+}
+
+TWDEF void tw_server_drain(tw_server *server) { server->drain_requested = 1; }
+
+/* Passes the listening sockets to the process that connected to the
+ * handoff socket and starts draining once it has them. */
+static void tw__server_handoff(tw_server *server, int slot) {
+#ifdef _WIN32
+  (void)server;
+  (void)slot;
+#else
+  tw_listener *control = &server->listeners[slot];
+  int fd = accept(control->fd, NULL, NULL);
+  if (fd < 0) return;
+
+  int fds[TW_MAX_LISTENERS];
+  int count = 0;
+  for (int l = 0; l < server->num_listeners; l++) {
+    tw_listener *listener = &server->listeners[l];
+    if (!listener->handoff && !listener->wakeup && listener->fd >= 0) {
+      fds[count++] = listener->fd;
+    }
+  }
+
+  unsigned char count_byte = (unsigned char)count;
+  struct iovec iov = {&count_byte, 1};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int) * TW_MAX_LISTENERS)];
+  } control_msg;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  memset(&control_msg, 0, sizeof(control_msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  if (count > 0) {
+    msg.msg_control = control_msg.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * (size_t)count);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * (size_t)count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * (size_t)count);
+  }
+
+  int flags = 0;
+#ifdef MSG_NOSIGNAL
+  flags |= MSG_NOSIGNAL;
+#endif
+  ssize_t sent = sendmsg(fd, &msg, flags);
+  close(fd);
+  if (sent != 1) {
+    /* the control socket stays, another successor can try again */
+    tw_log(TW_ERROR, "Listener handoff failed: %s", strerror(errno));
+    return;
+  }
+
+  /* the successor binds its own handoff socket to the same path, maybe
+   * already, so the path is left alone */
+  tw__listener_close(control, false);
+  server->fds[slot].fd = -1;
+  tw_log(TW_INFO, "Handed %d listeners over, draining", count);
+  server->handed_off = true;
+  tw_server_drain(server);
+#endif
+}
+
+/* Returns false when the connection can be closed right away. */
+static bool tw__conn_drain(tw_conn *conn, tw_request_handler_fn handler) {
+  (void)handler;
+#ifdef TW_ENABLE_HTTP2
+  if (conn->h2 != NULL) {
+    tw__h2_shutdown(conn->h2);
+    return tw__h2_on_ready(conn, 0, handler);
+  }
+#endif
+#ifdef TW_ENABLE_WEBSOCKET
+  if (conn->ws != NULL) {
+    if (!conn->ws->closing) {
+      tw_ws_close(conn->ws, 1001, NULL);
+    }
+    return tw__ws_on_ready(conn->ws, 0);
+  }
+#endif
+#ifdef TW_ENABLE_CLIENT
+  /* the response is on its way */
+  if (conn->upstream != NULL || conn->waiting != NULL) return true;
+#endif
+#ifdef TW_ENABLE_COROUTINES
+  /* a suspended handler has yet to answer */
+  if (conn->coro != NULL) return true;
+#endif
+#ifdef TW_ENABLE_PARK
+  /* an event stream never ends on its own */
+  if (conn->parked != NULL) return !conn->parked->stream;
+#endif
+  /* responses the socket did not take yet are still written */
+  if (conn->blocked) {
+    conn->closing = true;
+    return true;
+  }
+  /* a connection accepted just before the drain waits for its request */
+  if (!conn->served || conn->pipelined_len > 0) return true;
+  /* keep-alive connections are idle here unless a request already came */
+  char byte;
+  return recv(conn->fd, &byte, 1, MSG_PEEK) > 0;
+}
+
+static void tw__server_begin_drain(tw_server *server,
+                                   tw_request_handler_fn handler) {
+  server->draining = true;
+  server->drain_deadline =
+      tw__now_ms() + (uint64_t)server->config.drain_timeout;
+
+  for (int l = 0; l < server->num_listeners; l++) {
+    /* parked connections are still woken up while they finish */
+    if (server->listeners[l].wakeup) continue;
+    tw__listener_close(&server->listeners[l], !server->handed_off);
+#ifdef _WIN32
+    server->fds[l].fd = (SOCKET)-1;
+#else
+    server->fds[l].fd = -1;
+#endif
+  }
+
+  for (int i = server->num_listeners; i < server->nfds; i++) {
+    tw_conn *conn = &server->conns[i];
+    if (conn->fd < 0) continue;
+
+    if (tw__conn_drain(conn, handler)) {
+#if defined(TW_ENABLE_HTTP2) || defined(TW_ENABLE_WEBSOCKET)
+      tw__memory_sync(conn);
+#endif
+      server->fds[i].events = tw__conn_events(conn);
+    } else {
+      tw__server_close_slot(server, i);
+    }
+  }
+}
+
+/* Returns true once a draining server has no connections left, closing
+ * them first when the drain timeout has passed. Otherwise sets the
+ * milliseconds to wait for in timeout. */
+static bool tw__server_drained(tw_server *server, int *timeout) {
+  int open = 0;
+  for (int i = server->num_listeners; i < server->nfds; i++) {
+    if (server->conns[i].fd >= 0) open++;
+  }
+
+  uint64_t now = tw__now_ms();
+  if (open > 0 && now < server->drain_deadline) {
+    *timeout = (int)(server->drain_deadline - now);
+    return false;
+  }
+
+  if (open > 0) {
+    tw_log(TW_WARNING, "Drain timed out, closing %d connections", open);
+  }
+  for (int i = server->num_listeners; i < server->nfds; i++) {
+    if (server->conns[i].fd >= 0) tw__server_close_slot(server, i);
+  }
+  server->nfds = server->num_listeners;
+  return true;
+}
+
+static bool tw__conn_serve_requests(tw_conn *conn,
+                                    tw_request_handler_fn handler) {
+  tw_server *server = conn->server;
+  int slot = (int)(conn - server->conns);
+  (void)slot;
+
+  bool keep_alive = true;
+  while (keep_alive) {
+    tw_request req;
+    if (!tw_request_init(&req)) {
+      return true;
+    };
+
+#ifdef TW_ENABLE_TRACE
+    uint64_t mark = tw__trace(conn, TW_TRACE_WAIT, conn->trace_mark);
+    conn->trace_mark = 0;
+#endif
+
+    tw_request_parse_result req_parse_result = tw_request_parse(conn, &req);
+    if (req_parse_result == TW_REQUEST_PARSE_ERROR) {
+      tw_response res;
+      if (!tw_response_init(&res)) {
+        return true;
+      };
+
+      tw_response_set_status(&res, 400);
+      const char *body = "Bad Request";
+      tw_response_set_body(&res, body, strlen(body));
+
+      tw_response_send(conn, &res);
+      tw_request_free(&req);
+      tw_response_free(&res);
+      return false;
+    } else if (req_parse_result == TW_REQUEST_PARSE_BLOCK) {
+      /* no data available yet */
+      tw_request_free(&req);
+      return true;
+    } else if (req_parse_result == TW_REQUEST_PARSE_REJECTED ||
+               req_parse_result == TW_REQUEST_PARSE_CLOSED) {
+      tw_request_free(&req);
+      return false;
+    }
+
+#ifdef TW_ENABLE_HTTP2
+    bool h2_started = false;
+    bool h2_ok = tw__h2_start(conn, &req, handler, &h2_started);
+    if (h2_ok && h2_started) {
+      tw_request_free(&req);
+      tw__memory_sync(conn);
+      server->fds[slot].events = tw__h2_events(conn->h2);
+      return true;
+    } else if (!h2_ok) {
+      tw_request_free(&req);
+      return false;
+    }
+#endif
+
+    if (server->rate_limit.enabled && !tw__rate_limit_admit(conn, &req)) {
+      /* answered before the body is read, so the connection closes */
+      tw__conn_reject(conn, tw__response_429, sizeof(tw__response_429) - 1);
+      tw_request_free(&req);
+      return false;
+    }
+
+    if (!tw__request_admit_body(conn, &req)) {
+      tw_request_free(&req);
+      return false;
+    }
+
+    tw_response res;
+    if (!tw_response_init(&res)) {
+      tw_request_free(&req);
+      return true;
+    };
+
+    res.accept_encoding = tw_parse_accept_encoding(
+        tw_request_get_header(&req, "Accept-Encoding"));
+    res.head = strcmp(req.method, "HEAD") == 0;
+
+    if (req.keep_alive && !server->draining) {
+      tw_response_set_header(&res, "Connection", "keep-alive");
+    } else {
+      tw_response_set_header(&res, "Connection", "close");
+      keep_alive = false;
+    }
+
+#ifdef TW_ENABLE_TRACE
+    mark = tw__trace(conn, TW_TRACE_PARSE, mark);
+#endif
+
+    /* with the next request buffered, its response can join this one */
+    conn->coalesce = conn->pipelined_len > 0;
+#ifdef TW_ENABLE_COROUTINES
+    /* only the handler waits for the socket, an idle connection must not
+     * hold a stack */
+    if (conn->coro != NULL) conn->coro->suspendable = true;
+    handler(conn, &req, &res);
+    if (conn->coro != NULL) conn->coro->suspendable = false;
+#else
+    handler(conn, &req, &res);
+#endif
+    conn->coalesce = false;
+    conn->served = true;
+
+#ifdef TW_ENABLE_TRACE
+    conn->trace_mark = tw__trace(conn, TW_TRACE_HANDLER, mark);
+#endif
+
+    tw_request_free(&req);
+    tw_response_free(&res);
+
+    if (conn->rejected) {
+      /* the body was refused and is still unread */
+      keep_alive = false;
+    }
+
+#ifdef TW_ENABLE_PARK
+    if (conn->parked != NULL) {
+      /* the response is written through the handle */
+      server->fds[slot].events = tw__park_events(conn->parked);
+      return true;
+    }
+#endif
+
+#ifdef TW_ENABLE_CLIENT
+    if (conn->waiting != NULL) {
+      /* the handler answers once its upstream call completed */
+      tw__client_call_keep_alive(conn->waiting, keep_alive);
+      server->fds[slot].events = 0;
+      return true;
+    }
+#endif
+
+#ifdef TW_ENABLE_WEBSOCKET
+    if (conn->ws != NULL) {
+      /* the handler upgraded the connection */
+      tw__ws_process(conn->ws);
+      if (tw__ws_on_ready(conn->ws, 0)) {
+        tw__memory_sync(conn);
+        server->fds[slot].events = tw__ws_events(conn->ws);
+        return true;
+      }
+      keep_alive = false;
+    }
+#endif
+
+    if (conn->blocked) {
+      /* the next request waits until the socket took these responses */
+      if (!keep_alive) conn->closing = true;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void tw__conn_free_out(tw_conn *conn) {
+  if (conn->out == NULL) return;
+  tw__pool_put(conn, conn->out, conn->out_cap);
+  tw__memory_release(conn, conn->out_cap);
+  conn->out = NULL;
+  conn->out_len = 0;
+  conn->out_off = 0;
+  conn->out_cap = 0;
+  conn->blocked = false;
+}
+
+/* Answers the HTTP/1 requests that are ready on conn. Returns false when
+ * the connection has to be closed. */
+static bool tw__conn_serve(tw_conn *conn, tw_request_handler_fn handler) {
+  bool open = tw__conn_serve_requests(conn, handler);
+  /* the responses to a pipelined batch go out together */
+  if (!tw__conn_flush(conn)) return false;
+  if (conn->blocked) {
+    /* the rest is written once the socket takes more */
+    if (!open) conn->closing = true;
+    conn->server->fds[conn - conn->server->conns].events = POLLOUT;
+    return true;
+  }
+  /* the buffer goes back to the pool */
+  tw__conn_free_out(conn);
+  return open;
+}
+
+#ifdef TW_ENABLE_COROUTINES
+static void tw__coro_serve(tw_coro *coro) {
+  for (;;) {
+    coro->keep = tw__conn_serve(coro->conn, coro->handler);
+    coro->done = true;
+#ifdef _WIN32
+    SwitchToFiber(coro->caller);
+#else
+    swapcontext(&coro->ctx, &coro->caller);
+#endif
+  }
+}
+
+#ifdef _WIN32
+static VOID CALLBACK tw__coro_main(LPVOID arg) {
+  tw__coro_serve((tw_coro *)arg);
+}
+#else
+/* makecontext only passes int arguments */
+static void tw__coro_main(unsigned int hi, unsigned int lo) {
+  tw__coro_serve((tw_coro *)(uintptr_t)(((uint64_t)hi << 32) | lo));
+}
+#endif
+
+static void tw__coro_destroy(tw_coro *coro) {
+#ifdef _WIN32
+  DeleteFiber(coro->fiber);
+#else
+  munmap(coro->stack, coro->stack_size);
+#endif
+  free(coro);
+}
+
+#ifndef _WIN32
+/* Points the context of coro at its stack above the guard page. Kept out of
+ * tw__coro_create, whose locals getcontext could clobber. */
+static bool tw__coro_make_context(tw_coro *coro, size_t page) {
+  if (getcontext(&coro->ctx) != 0) return false;
+  uintptr_t arg = (uintptr_t)coro;
+  coro->ctx.uc_stack.ss_sp = coro->stack + page;
+  coro->ctx.uc_stack.ss_size = coro->stack_size - page;
+  coro->ctx.uc_link = NULL;
+  makecontext(&coro->ctx, (void (*)(void))tw__coro_main, 2,
+              (unsigned int)((uint64_t)arg >> 32), (unsigned int)arg);
+  return true;
+}
+#endif
+
+static tw_coro *tw__coro_create(void) {
+  tw_coro *coro = (tw_coro *)calloc(1, sizeof(tw_coro));
+  if (coro == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for coroutine");
+    return NULL;
+  }
+
+#ifdef _WIN32
+  coro->fiber = CreateFiber(TW_CORO_STACK_SIZE, tw__coro_main, coro);
+  if (coro->fiber == NULL) {
+    tw_log(TW_ERROR, "CreateFiber failed: %lu", GetLastError());
+    free(coro);
+    return NULL;
+  }
+#else
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t size = (TW_CORO_STACK_SIZE + page - 1) / page * page;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+  flags |= MAP_STACK;
+#endif
+  coro->stack_size = size + page;
+  coro->stack = (char *)mmap(NULL, coro->stack_size, PROT_READ | PROT_WRITE,
+                             flags, -1, 0);
+  if (coro->stack == MAP_FAILED) {
+    tw_log(TW_ERROR, "Failed to map coroutine stack: %s", strerror(errno));
+    free(coro);
+    return NULL;
+  }
+  /* stacks grow down, the lowest page catches overflows */
+  mprotect(coro->stack, page, PROT_NONE);
+
+  if (!tw__coro_make_context(coro, page)) {
+    tw__coro_destroy(coro);
+    return NULL;
+  }
+#endif
+
+  return coro;
+}
+
+/* Runs the coroutine of conn until its handler finishes or waits for the
+ * socket. Returns false when the connection has to be closed. */
+static bool tw__coro_enter(tw_conn *conn) {
+  tw_coro *coro = conn->coro;
+  tw_server *server = conn->server;
+  int slot = (int)(conn - server->conns);
+
+  coro->running = true;
+#ifdef _WIN32
+  if (!IsThreadAFiber()) {
+    ConvertThreadToFiber(NULL);
+  }
+  coro->caller = GetCurrentFiber();
+  SwitchToFiber(coro->fiber);
+#else
+  swapcontext(&coro->caller, &coro->ctx);
+#endif
+  coro->running = false;
+
+  if (!coro->done) {
+    server->fds[slot].events = coro->events;
+    return true;
+  }
+
+  bool keep = coro->keep;
+  conn->coro = NULL;
+  if (server->coro_pooled < TW_CORO_POOL_SIZE) {
+    coro->next = server->coro_pool;
+    server->coro_pool = coro;
+    server->coro_pooled++;
+  } else {
+    tw__coro_destroy(coro);
+  }
+
+  if (keep) {
+    server->fds[slot].events = tw__conn_events(conn);
+  }
+  return keep;
+}
+
+/* Serves the requests on conn from a pooled coroutine. */
+static bool tw__coro_start(tw_conn *conn, tw_request_handler_fn handler) {
+  tw_server *server = conn->server;
+  tw_coro *coro = server->coro_pool;
+  if (coro != NULL) {
+    server->coro_pool = coro->next;
+    server->coro_pooled--;
+  } else {
+    coro = tw__coro_create();
+    if (coro == NULL) {
+      /* without a stack the handler runs on the loop, as it would
+       * without coroutines */
+      return tw__conn_serve(conn, handler);
+    }
+  }
+
+  coro->conn = conn;
+  coro->handler = handler;
+  coro->suspendable = false;
+  coro->events = 0;
+  coro->cancelled = false;
+  coro->done = false;
+  coro->next = NULL;
+  conn->coro = coro;
+  return tw__coro_enter(conn);
+}
+
+/* Suspends the handler of conn until the socket is ready for events.
+ * Returns false when the connection is closing. */
+static bool tw__coro_wait(tw_conn *conn, short events) {
+  tw_coro *coro = conn->coro;
+  if (!coro->cancelled) {
+    coro->events = events;
+#ifdef _WIN32
+    SwitchToFiber(coro->caller);
+#else
+    swapcontext(&coro->ctx, &coro->caller);
+#endif
+  }
+  if (coro->cancelled) {
+#ifdef _WIN32
+    WSASetLastError(WSAECONNABORTED);
+#else
+    errno = ECONNABORTED;
+#endif
+    return false;
+  }
+  return true;
+}
+
+static bool tw__coro_would_block(void) {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/* Reads like a blocking socket, with the loop serving others meanwhile. */
+static ssize_t tw__coro_read(tw_conn *conn, char *buf, size_t len) {
+  for (;;) {
+    ssize_t bytes_read = tw__conn_recv(conn, buf, len);
+    if (bytes_read >= 0 || !tw__coro_would_block()) {
+      return bytes_read;
+    }
+    /* responses held back go out before the handler waits */
+    if (!tw__conn_flush(conn) || !tw__coro_wait(conn, POLLIN)) {
+      return -1;
+    }
+  }
+}
+
+/* Writes all of buf like a blocking socket. */
+static ssize_t tw__coro_write(tw_conn *conn, const char *buf, size_t len) {
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t n = tw__conn_send(conn, buf + sent, len - sent);
+    if (n >= 0) {
+      sent += (size_t)n;
+      continue;
+    }
+    if (!tw__coro_would_block() || !tw__coro_wait(conn, POLLOUT)) {
+      return sent > 0 ? (ssize_t)sent : -1;
+    }
+  }
+  return (ssize_t)sent;
+}
+
+/* Lets the suspended handler of a closing connection run to its end with
+ * every read and write failing. */
+static void tw__coro_cancel(tw_conn *conn) {
+  tw_coro *coro = conn->coro;
+  coro->cancelled = true;
+  /* no further requests are read */
+  conn->rejected = true;
+  while (conn->coro == coro) {
+    tw__coro_enter(conn);
+  }
+}
+
+static void tw__coro_pool_free(tw_server *server) {
+  while (server->coro_pool != NULL) {
+    tw_coro *coro = server->coro_pool;
+    server->coro_pool = coro->next;
+    tw__coro_destroy(coro);
+  }
+  server->coro_pooled = 0;
+}
+#endif
+
+TWDEF bool tw_server_run(tw_server *server, tw_request_handler_fn handler) {
+#ifdef TW_ENABLE_PARK
+  if (!tw__park_open(server)) {
+    return false;
+  }
+#endif
+
+  while (1) {
+    int timeout = -1;
+#ifdef TW_ENABLE_TRACE
+    if (server->trace.dump_requested) {
+      server->trace.dump_requested = 0;
+      tw_trace_dump(server, server->trace.path != NULL ? server->trace.path
+                                                       : TW_TRACE_PATH);
+    }
+#endif
+    if (server->drain_requested && !server->draining) {
+      tw__server_begin_drain(server, handler);
+    }
+    if (server->draining && tw__server_drained(server, &timeout)) {
+      return true;
+    }
+
+    tw__server_apply_backpressure(server);
+
+#ifdef TW_ENABLE_CLIENT
+    if (server->resume_pending) {
+      timeout = 0;
+      server->resume_pending = false;
+    }
+#endif
+#ifdef TW_ENABLE_TLS
+    /* a record can hold more than the last read took */
+    if (tw__tls_pending(server, false) > 0) timeout = 0;
+#endif
+
+    int ret = poll(server->fds, server->nfds, timeout);
+    if (ret < 0) {
+#ifndef _WIN32
+      if (errno == EINTR) {
+        continue;
+      }
+#endif
+      tw_log(TW_ERROR, "Poll failed");
+      return false;
+    }
+    server->tick++;
+    if (server->rate_limit.enabled) {
+      server->rate_limit.now = tw__now_ms();
+    }
+#ifdef TW_ENABLE_TLS
+    tw__tls_pending(server, true);
+#endif
+
+    for (int l = 0; l < server->num_listeners; l++) {
+      if (server->fds[l].revents & (POLLIN | POLLERR | POLLHUP)) {
+        if (server->listeners[l].handoff) {
+          tw__server_handoff(server, l);
+#ifdef TW_ENABLE_PARK
+        } else if (server->listeners[l].wakeup) {
+          tw__park_dispatch(server, l);
+#endif
+        } else {
+          tw__server_accept(server, &server->listeners[l]);
+        }
+      }
+      server->fds[l].revents = 0;
+    }
+
+    for (int i = server->num_listeners; i < server->nfds; i++) {
+      tw_conn *conn = &server->conns[i];
+      short revents = server->fds[i].revents;
+      if (revents != 0) {
+        conn->last_active = server->tick;
+      }
+
+#ifdef TW_ENABLE_TLS
+      if (conn->tls_handshake != 0) {
+        if (revents == 0) {
+          continue;
+        }
+
+        if (!tw__tls_handshake(conn)) {
+          tw__server_close_slot(server, i);
+          continue;
+        }
+        if (conn->tls_handshake != 0) {
+          server->fds[i].events = conn->tls_handshake;
+          server->fds[i].revents = 0;
+          continue;
+        }
+        /* the first request may have come with the client's last flight */
+        server->fds[i].events = POLLIN;
+        revents = POLLIN;
+      }
+#endif
+
+#ifdef TW_ENABLE_CLIENT
+      if (conn->upstream != NULL) {
+        if (revents == 0) {
+          continue;
+        }
+
+        if (tw__client_on_ready(conn, revents)) {
+          server->fds[i].events = tw__client_events(conn->upstream);
+        } else {
+          tw__server_close_slot(server, i);
+        }
+        server->fds[i].revents = 0;
+        continue;
+      }
+
+      if (conn->waiting != NULL) {
+        /* nothing is read until the upstream answered */
+        if (revents & (POLLHUP | POLLERR | POLLNVAL)) {
+          tw__server_close_slot(server, i);
+        }
+        server->fds[i].revents = 0;
+        continue;
+      }
+
+      if (conn->resume) {
+        conn->resume = false;
+        revents |= POLLIN;
+      }
+#endif
+
+#ifdef TW_ENABLE_PARK
+      if (conn->parked != NULL) {
+        if (revents == 0) {
+          continue;
+        }
+
+        bool open = tw__park_on_ready(conn, revents);
+        if (open && conn->parked != NULL) {
+          server->fds[i].events = tw__park_events(conn->parked);
+          server->fds[i].revents = 0;
+          continue;
+        } else if (!open) {
+          tw__server_close_slot(server, i);
+          continue;
+        }
+        /* the response ended, a request may already be waiting */
+        server->fds[i].events = POLLIN;
+        revents = POLLIN;
+      }
+#endif
+
+#ifdef TW_ENABLE_HTTP2
+      if (conn->h2 != NULL) {
+        if (revents == 0) {
+          continue;
+        }
+
+        if (tw__h2_on_ready(conn, revents, handler)) {
+          tw__memory_sync(conn);
+          server->fds[i].events = tw__h2_events(conn->h2);
+        } else {
+          tw__server_close_slot(server, i);
+        }
+        server->fds[i].revents = 0;
+        continue;
+      }
+#endif
+
+#ifdef TW_ENABLE_WEBSOCKET
+      if (conn->ws != NULL) {
+        if (revents == 0) {
+          continue;
+        }
+
+        if (tw__ws_on_ready(conn->ws, revents)) {
+          tw__memory_sync(conn);
+          server->fds[i].events = tw__ws_events(conn->ws);
+        } else {
+          tw__server_close_slot(server, i);
+        }
+        server->fds[i].revents = 0;
+        continue;
+      }
+#endif
+
+#ifdef TW_ENABLE_COROUTINES
+      if (conn->coro != NULL) {
+        /* the handler is suspended until its socket is ready */
+        short ready = conn->coro->events | POLLHUP | POLLERR | POLLNVAL;
+        if ((revents & ready) && !tw__coro_enter(conn)) {
+          tw__server_close_slot(server, i);
+        }
+        server->fds[i].revents = 0;
+        continue;
+      }
+#endif
+
+      if (conn->blocked) {
+        /* no request is read until the last responses were written */
+        if (!tw__conn_flush(conn)) {
+          tw__server_close_slot(server, i);
+          continue;
+        }
+        if (conn->blocked) {
+          server->fds[i].events = POLLOUT;
+          server->fds[i].revents = 0;
+          continue;
+        }
+        tw__conn_free_out(conn);
+        if (conn->closing) {
+          tw__server_close_slot(server, i);
+          continue;
+        }
+        /* the next pipelined request may already be buffered */
+        server->fds[i].events = POLLIN;
+        revents = POLLIN;
+      }
+
+      if (!(revents & POLLIN)) {
+        if (revents & (POLLHUP | POLLERR | POLLNVAL)) {
+          tw__server_close_slot(server, i);
+        }
+        server->fds[i].revents = 0;
+        continue;
+      }
+
+#ifdef TW_ENABLE_COROUTINES
+      bool open = tw__coro_start(conn, handler);
+#else
+      bool open = tw__conn_serve(conn, handler);
+#endif
+      if (!open) {
+        tw__server_close_slot(server, i);
+      }
+
+      server->fds[i].revents = 0;
+    }
+
+    int current = server->num_listeners;
+    for (int i = server->num_listeners; i < server->nfds; i++) {
+#ifdef _WIN32
+      if (server->fds[i].fd != (SOCKET)-1) {
+#else
+      if (server->fds[i].fd != -1) {
+#endif
+#ifdef TW_ENABLE_COROUTINES
+        if (server->conns[i].coro != NULL) {
+          /* the suspended handler holds pointers to its connection, free
+           * slots in front of it stay until it finished */
+          current = i;
+        }
+#endif
+        if (current != i) {
+          server->fds[current] = server->fds[i];
+          server->conns[current] = server->conns[i];
+#ifdef TW_ENABLE_WEBSOCKET
+          if (server->conns[current].ws != NULL) {
+            server->conns[current].ws->conn = &server->conns[current];
+          }
+#endif
+#ifdef TW_ENABLE_CLIENT
+          if (server->conns[current].waiting != NULL) {
+            tw__client_call_move(server->conns[current].waiting,
+                                 &server->conns[current]);
+          }
+#endif
+#ifdef TW_ENABLE_PARK
+          if (server->conns[current].parked != NULL) {
+            server->conns[current].parked->conn = &server->conns[current];
+          }
+#endif
+#ifdef TW_ENABLE_COROUTINES
+          /* the old slot may end up in front of a suspended handler */
+          memset(&server->conns[i], 0, sizeof(server->conns[i]));
+          server->conns[i].fd = -1;
+#ifdef _WIN32
+          server->fds[i].fd = (SOCKET)-1;
+#else
+          server->fds[i].fd = -1;
+#endif
+          server->fds[i].events = 0;
+          server->fds[i].revents = 0;
+#endif
+        }
+        current++;
+      } else {
+        server->fds[i].events = 0;
+        server->fds[i].revents = 0;
+        server->conns[i].fd = -1;
+      }
+    }
+
+    server->nfds = current;
+  }
+
+  return true;
+}
+
+TWDEF bool tw_server_stop(tw_server *server) {
+#ifdef TW_ENABLE_COMPRESSION
+  tw_compression_cache_free(&server->compression_cache);
+#endif
+  tw_file_cache_free(&server->file_cache);
+#ifdef TW_ENABLE_COROUTINES
+  tw__coro_pool_free(server);
+#endif
+#ifdef TW_ENABLE_TLS
+  SSL_CTX_free(server->tls_ctx);
+  server->tls_ctx = NULL;
+#endif
+#ifdef TW_ENABLE_PARK
+  tw__park_close(server);
+#endif
+  tw__pool_free(&server->buffers);
+
+  bool ok = true;
+  for (int l = 0; l < server->num_listeners; l++) {
+    /* handed over Unix sockets stay bound for the new process */
+    if (!tw__listener_close(&server->listeners[l], !server->handed_off)) {
+      ok = false;
+    }
+  }
+  server->num_listeners = 0;
+
+#ifdef _WIN32
+  WSACleanup();
+#endif
+
+  return ok;
+}
+
+TWDEF bool tw__set_nonblocking(int fd) {
+#ifdef _WIN32
+  DWORD mode = 1;
+  if (ioctlsocket(fd, FIONBIO, &mode) != 0) {
+    tw_log(TW_ERROR, "ioctlsocket failed");
+    return false;
+  }
+#else
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) {
+    tw_log(TW_ERROR, "fcntl(F_GETFL) failed");
+    return false;
+  }
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+    tw_log(TW_ERROR, "fcntl(F_SETFL) failed");
+    return false;
+  }
+#endif
+  return true;
+}
+
+TWDEF ssize_t tw_conn_read(tw_conn *conn, char *buf, size_t len) {
+#ifdef TW_ENABLE_COROUTINES
+  if (conn->coro != NULL && conn->coro->suspendable) {
+    return tw__coro_read(conn, buf, len);
+  }
+#endif
+  ssize_t bytes_read = tw__conn_recv(conn, buf, len);
+  return bytes_read;
+};
+
+static ssize_t tw__conn_write_now(tw_conn *conn, const char *buf,
+                                  size_t len) {
+#ifdef TW_ENABLE_COROUTINES
+  if (conn->coro != NULL && conn->coro->suspendable) {
+    return tw__coro_write(conn, buf, len);
+  }
+#endif
+  ssize_t bytes_sent = tw__conn_send(conn, buf, len);
+  return bytes_sent;
+}
+
+/* Writes what is queued on conn until the socket takes no more, leaving
+ * the rest for the next POLLOUT. Returns false when the connection
+ * failed. */
+static bool tw__conn_flush(tw_conn *conn) {
+  for (;;) {
+    while (conn->out_off < conn->out_len) {
+      ssize_t n = tw__conn_write_now(conn, conn->out + conn->out_off,
+                                     conn->out_len - conn->out_off);
+      if (n < 0) {
+#ifdef _WIN32
+        if (WSAGetLastError() != WSAEWOULDBLOCK) return false;
+#else
+        if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+#endif
+        conn->blocked = true;
+        return true;
+      }
+      conn->out_off += (size_t)n;
+    }
+    conn->out_len = 0;
+    conn->out_off = 0;
+    if (conn->file_body == NULL) break;
+
+    /* a file body goes on once what was queued before it went out */
+    if (!tw__file_body_write(conn)) return false;
+    if (conn->file_body != NULL && conn->out_len == 0) {
+      conn->blocked = true;
+      return true;
+    }
+  }
+  conn->blocked = false;
+  return true;
+}
+
+/* Makes room for len more bytes in out, moving the unwritten ones to the
+ * front. Output that was already produced is charged with force. */
+static bool tw__conn_reserve_out(tw_conn *conn, size_t len) {
+  if (conn->out_off > 0) {
+    memmove(conn->out, conn->out + conn->out_off,
+            conn->out_len - conn->out_off);
+    conn->out_len -= conn->out_off;
+    conn->out_off = 0;
+  }
+  if (conn->out_len + len <= conn->out_cap) return true;
+
+  size_t cap = tw__pool_size(conn->out_len + len);
+  char *out = tw__pool_get(conn, cap);
+  if (out == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for response");
+    return false;
+  }
+  if (conn->out_len > 0) memcpy(out, conn->out, conn->out_len);
+  tw__pool_put(conn, conn->out, conn->out_cap);
+  tw__memory_charge(conn, cap - conn->out_cap, true);
+  conn->out = out;
+  conn->out_cap = cap;
+  return true;
+}
+
+/* Writes buf after what is queued on conn, queuing what the socket does
+ * not take. Returns false when the connection failed. */
+static bool tw__conn_write_all(tw_conn *conn, const char *buf, size_t len) {
+  if (!tw__conn_flush(conn)) return false;
+  size_t sent = 0;
+  if (conn->out_len == 0 && conn->file_body == NULL) {
+    ssize_t n = tw__conn_write_now(conn, buf, len);
+    if (n < 0) {
+#ifdef _WIN32
+      if (WSAGetLastError() != WSAEWOULDBLOCK) return false;
+#else
+      if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+#endif
+      n = 0;
+    }
+    sent = (size_t)n;
+  }
+  if (sent == len) return true;
+  if (!tw__conn_reserve_out(conn, len - sent)) return false;
+  memcpy(conn->out + conn->out_len, buf + sent, len - sent);
+  conn->out_len += len - sent;
+  conn->blocked = true;
+  return true;
+}
+
+TWDEF ssize_t tw_conn_write(tw_conn *conn, const char *buf, size_t len) {
+  /* anything written directly goes after the responses before it */
+  if (!tw__conn_flush(conn)) return -1;
+  if (conn->blocked) {
+#ifdef _WIN32
+    WSASetLastError(WSAEWOULDBLOCK);
+#else
+    errno = EAGAIN;
+#endif
+    return -1;
+  }
+  return tw__conn_write_now(conn, buf, len);
+};
+
+/* Sends a response head and body. While another request is buffered on
+ * the connection, small responses are collected instead, and the batch
+ * is written at once when the last of them is sent. */
+static bool tw__conn_send_response(tw_conn *conn, const char *head,
+                                   size_t head_len, const char *body,
+                                   size_t body_len) {
+  size_t len = head_len + body_len;
+  if ((conn->coalesce || conn->out_len > 0) && len <= TW_COALESCE_SIZE) {
+    size_t cap = tw__pool_size(TW_COALESCE_SIZE);
+    if (conn->out == NULL && tw__memory_charge(conn, cap, false)) {
+      conn->out = tw__pool_get(conn, cap);
+      conn->out_cap = conn->out != NULL ? cap : 0;
+      if (conn->out == NULL) tw__memory_release(conn, cap);
+    }
+    if (conn->out != NULL) {
+      if (conn->out_len + len > TW_COALESCE_SIZE && !tw__conn_flush(conn)) {
+        return false;
+      }
+      if (!tw__conn_reserve_out(conn, len)) return false;
+      memcpy(conn->out + conn->out_len, head, head_len);
+      if (body_len > 0) {
+        memcpy(conn->out + conn->out_len + head_len, body, body_len);
+      }
+      conn->out_len += len;
+      return conn->coalesce || tw__conn_flush(conn);
+    }
+  }
+
+  return tw__conn_write_all(conn, head, head_len) &&
+         (body_len == 0 || tw__conn_write_all(conn, body, body_len));
+}
+
+/* Keeps bytes that belong to the next request until it is parsed. */
+static bool tw__conn_stash(tw_conn *conn, const char *data, size_t len) {
+  char *copy = tw__pool_get(conn, len);
+  if (copy == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for pipelined request");
+    return false;
+  }
+  memcpy(copy, data, len);
+  tw__memory_charge(conn, len, true);
+  conn->pipelined = copy;
+  conn->pipelined_len = len;
+  return true;
+}
+
+static void tw__conn_unstash(tw_conn *conn) {
+  if (conn->pipelined == NULL) return;
+  tw__pool_put(conn, conn->pipelined, tw__pool_size(conn->pipelined_len));
+  tw__memory_release(conn, conn->pipelined_len);
+  conn->pipelined = NULL;
+  conn->pipelined_len = 0;
+}
+
+TWDEF void tw_conn_close(tw_conn *conn) {
+#ifdef TW_ENABLE_COROUTINES
+  if (conn->coro != NULL && !conn->coro->running) {
+    tw__coro_cancel(conn);
+  }
+#endif
+#ifdef TW_ENABLE_HTTP2
+  if (conn->h2 != NULL) {
+    tw__h2_session_free(conn->h2);
+    conn->h2 = NULL;
+  }
+#endif
+#ifdef TW_ENABLE_WEBSOCKET
+  if (conn->ws != NULL) {
+    tw__ws_free(conn->ws);
+    conn->ws = NULL;
+  }
+#endif
+#ifdef TW_ENABLE_CLIENT
+  if (conn->upstream != NULL) {
+    tw__client_call_free(conn->upstream);
+    conn->upstream = NULL;
+  }
+  if (conn->waiting != NULL) {
+    /* the upstream response has nowhere to go */
+    tw__client_call_move(conn->waiting, NULL);
+    conn->waiting = NULL;
+  }
+#endif
+  tw__memory_release(conn, conn->buffered);
+  conn->buffered = 0;
+  tw__conn_unstash(conn);
+  tw__conn_free_out(conn);
+  tw__file_body_free(conn);
+#ifdef TW_ENABLE_PARK
+  if (conn->parked != NULL) {
+    tw__park_detach(conn->parked);
+  }
+#endif
+#ifdef TW_ENABLE_TLS
+  if (conn->tls != NULL) {
+    /* a close_notify after a finished handshake, the peer's is not
+     * awaited */
+    if (conn->tls_handshake == 0) SSL_shutdown(conn->tls);
+    ERR_clear_error();
+    SSL_free(conn->tls);
+    conn->tls = NULL;
+  }
+#endif
+  /* pooled upstream connections are handed back without their fd */
+  if (conn->fd >= 0) {
+    close(conn->fd);
+  }
+};
+
+TWDEF bool tw_request_init(tw_request *req) {
+  if (req != NULL) {
+    req->query = "";
+    req->query_len = 0;
+    req->params = req->params_inline;
+    req->num_params = 0;
+    req->params_cap = TW_MAX_INLINE_PARAMS;
+    req->params_parsed = false;
+    req->params_data = NULL;
+    req->buf_len = 0;
+    req->num_headers = 0;
+    for (int i = 0; i < TW_HEADER_KNOWN_COUNT; i++) {
+      req->known_headers[i] = -1;
+    }
+    req->keep_alive = false;
+    req->body = NULL;
+    req->body_len = 0;
+    req->conn = NULL;
+    req->memory = 0;
+    return true;
+  } else {
+    return false;
+  }
+}
+
+static void tw__request_free_body(tw_request *req) {
+  free(req->body);
+  req->body = NULL;
+  req->body_len = 0;
+  tw__memory_release(req->conn, req->memory);
+  req->memory = 0;
+}
+
+TWDEF void tw_request_free(tw_request *req) {
+  if (req != NULL) {
+    tw__request_free_body(req);
+    if (req->params != req->params_inline) {
+      free(req->params);
+      req->params = req->params_inline;
+      req->params_cap = TW_MAX_INLINE_PARAMS;
+    }
+    free(req->params_data);
+    req->params_data = NULL;
+    req->num_params = 0;
+    req->params_parsed = false;
+    req->num_headers = 0;
+  }
+}
+
+static bool tw__header_has_token(const char *value, const char *token) {
+  size_t token_len = strlen(token);
+  const char *pos = value;
+  while (pos != NULL && *pos) {
+    while (*pos == ' ' || *pos == '\t' || *pos == ',') pos++;
+    const char *end = pos;
+    while (*end && *end != ',' && *end != ' ' && *end != '\t') end++;
+    if ((size_t)(end - pos) == token_len &&
+        strncasecmp(pos, token, token_len) == 0) {
+      return true;
+    }
+    pos = end;
+  }
+  return false;
+}
+
+static int tw__known_header(const char *name, size_t len) {
+  switch (len) {
+    case 4:
+      if (strncasecmp(name, "Host", len) == 0) return TW_HEADER_HOST;
+      break;
+    case 6:
+      if (strncasecmp(name, "Expect", len) == 0) return TW_HEADER_EXPECT;
+      break;
+    case 10:
+      if (strncasecmp(name, "Connection", len) == 0) {
+        return TW_HEADER_CONNECTION;
+      }
+      break;
+    case 12:
+      if (strncasecmp(name, "Content-Type", len) == 0) {
+        return TW_HEADER_CONTENT_TYPE;
+      }
+      break;
+    case 14:
+      if (strncasecmp(name, "Content-Length", len) == 0) {
+        return TW_HEADER_CONTENT_LENGTH;
+      }
+      break;
+    case 17:
+      if (strncasecmp(name, "Transfer-Encoding", len) == 0) {
+        return TW_HEADER_TRANSFER_ENCODING;
+      }
+      break;
+  }
+  return -1;
+}
+
+/* Records the "name: value\r\n" lines in [pos, end) as offsets into
+ * buf. The colon and the line ending are overwritten with NULs so that
+ * names and values can be handed out without copying. Shared by requests
+ * and the responses read by tw_client. */
+static bool tw__index_headers(char *buf, tw_header_ref *headers,
+                              size_t *num_headers, int *known_headers,
+                              char *pos, const char *end) {
+  *num_headers = 0;
+  for (int i = 0; i < TW_HEADER_KNOWN_COUNT; i++) {
+    known_headers[i] = -1;
+  }
+
+  while (pos < end) {
+    char *line_end = memchr(pos, '\r', (size_t)(end - pos));
+    if (line_end == NULL || line_end + 1 >= end || line_end[1] != '\n') {
+      return false;
+    }
+
+    char *colon = memchr(pos, ':', (size_t)(line_end - pos));
+    if (colon == NULL || colon == pos || colon[-1] == ' ' ||
+        colon[-1] == '\t') {
+      return false;
+    }
+    size_t name_len = (size_t)(colon - pos);
+    if (name_len >= TW_MAX_HEADER_NAME) return false;
+
+    char *value = colon + 1;
+    while (value < line_end && (*value == ' ' || *value == '\t')) value++;
+    char *value_end = line_end;
+    while (value_end > value &&
+           (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+      value_end--;
+    }
+    size_t value_len = (size_t)(value_end - value);
+    if (value_len >= TW_MAX_HEADER_VALUE) return false;
+
+    if (*num_headers == TW_MAX_HEADERS) {
+      tw_log(TW_WARNING, "Message has more than %d headers", TW_MAX_HEADERS);
+      return false;
+    }
+
+    *colon = '\0';
+    *value_end = '\0';
+
+    int known = tw__known_header(pos, name_len);
+    if (known >= 0) {
+      int prev = known_headers[known];
+      if (prev < 0) {
+        known_headers[known] = (int)*num_headers;
+      } else if (known == TW_HEADER_CONTENT_LENGTH &&
+                 strcmp(buf + headers[prev].value, value) != 0) {
+        /* conflicting lengths make the message boundary ambiguous */
+        return false;
+      }
+    }
+
+    tw_header_ref *ref = &headers[(*num_headers)++];
+    ref->name = (uint32_t)(pos - buf);
+    ref->name_len = (uint32_t)name_len;
+    ref->value = (uint32_t)(value - buf);
+    ref->value_len = (uint32_t)value_len;
+
+    pos = line_end + 2;
+  }
+
+  return true;
+}
+
+static bool tw__request_index_headers(tw_request *req, char *pos,
+                                      const char *end) {
+  return tw__index_headers(req->buf, req->headers, &req->num_headers,
+                           req->known_headers, pos, end);
+}
+
+static const char *tw__find_header(const char *buf,
+                                   const tw_header_ref *headers,
+                                   size_t num_headers,
+                                   const int *known_headers,
+                                   const char *name) {
+  size_t name_len = strlen(name);
+  int known = tw__known_header(name, name_len);
+  if (known >= 0) {
+    int index = known_headers[known];
+    return index < 0 ? NULL : buf + headers[index].value;
+  }
+
+  /* field names are case-insensitive */
+  for (size_t i = 0; i < num_headers; i++) {
+    const tw_header_ref *ref = &headers[i];
+    if (ref->name_len == name_len &&
+        strncasecmp(buf + ref->name, name, name_len) == 0) {
+      return buf + ref->value;
+    }
+  }
+
+  return NULL;
+}
+
+TWDEF tw_request_parse_result tw_request_parse(tw_conn *conn, tw_request *req) {
+  char *buf = req->buf;
+  req->conn = conn;
+  ssize_t bytes_read = 0;
+  ssize_t total_read = 0;
+  const char *headers_end = NULL;
+
+  /* a pipelined request may already be complete */
+  if (conn->pipelined_len > 0) {
+    total_read = (ssize_t)conn->pipelined_len;
+    memcpy(buf, conn->pipelined, conn->pipelined_len);
+    buf[total_read] = '\0';
+    tw__conn_unstash(conn);
+    headers_end = strstr(buf, "\r\n\r\n");
+  }
+
+  while (headers_end == NULL && total_read < TW_MAX_REQUEST_SIZE - 1) {
+    bytes_read = tw_conn_read(conn, buf + total_read,
+                              TW_MAX_REQUEST_SIZE - total_read - 1);
+    if (bytes_read <= 0) {
+#ifdef _WIN32
+      bool blocked = bytes_read < 0 && WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+      bool blocked =
+          bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+#endif
+      if (blocked) {
+        /* the rest of the head arrives with a later read */
+        if (total_read > 0 && !tw__conn_stash(conn, buf, (size_t)total_read)) {
+          return TW_REQUEST_PARSE_ERROR;
+        }
+        return TW_REQUEST_PARSE_BLOCK;
+      }
+      if (bytes_read == 0 && total_read == 0) {
+        return TW_REQUEST_PARSE_CLOSED;
+      }
+      return TW_REQUEST_PARSE_ERROR;
+    }
+
+    total_read += bytes_read;
+    buf[total_read] = '\0';
+
+    headers_end = strstr(buf, "\r\n\r\n");
+  }
+
+  if (!headers_end) {
+    /* headers too large or malformed */
+    return TW_REQUEST_PARSE_ERROR;
+  }
+
+  const char *pos = buf;
+
+  const char *method_end = strchr(buf, ' ');
+  if (!method_end) {
+    return TW_REQUEST_PARSE_ERROR;
+  }
+  req->method_len = (size_t)(method_end - pos);
+  if (req->method_len >= sizeof(req->method)) {
+    return TW_REQUEST_PARSE_ERROR;
+  }
+  memcpy(req->method, pos, req->method_len);
+  req->method[req->method_len] = '\0';
+
+  const char *path_start = method_end + 1;
+  char *path_end = strchr(path_start, ' ');
+  if (!path_end) {
+    return TW_REQUEST_PARSE_ERROR;
+  }
+  char *query = memchr(path_start, '?', (size_t)(path_end - path_start));
+  req->path_len = (size_t)((query ? query : path_end) - path_start);
+  if (req->path_len >= sizeof(req->path)) {
+    return TW_REQUEST_PARSE_ERROR;
+  }
+  memcpy(req->path, path_start, req->path_len);
+  req->path[req->path_len] = '\0';
+
+  char *version_start = path_end + 1;
+  char *version_end = strstr(version_start, "\r\n");
+  if (!version_end) {
+    version_end = strchr(version_start, '\n');
+    if (!version_end) {
+      return TW_REQUEST_PARSE_ERROR;
+    }
+  }
+  req->version_len = (size_t)(version_end - version_start);
+  if (req->version_len >= sizeof(req->version)) {
+    return TW_REQUEST_PARSE_ERROR;
+  }
+  memcpy(req->version, version_start, req->version_len);
+  req->version[req->version_len] = '\0';
+
+  /* the query is left in place and terminated at the space before the
+   * version */
+  if (query != NULL) {
+    *path_end = '\0';
+    req->query = query + 1;
+    req->query_len = (size_t)(path_end - req->query);
+  } else {
+    req->query = "";
+    req->query_len = 0;
+  }
+
+  /* the header block ends with the CRLF of the last field line */
+  if (!tw__request_index_headers(req, version_end + 2, headers_end + 2)) {
+    return TW_REQUEST_PARSE_ERROR;
+  }
+
+  req->keep_alive = false;
+
+  const char *conn_hdr =
+      tw_request_get_known_header(req, TW_HEADER_CONNECTION);
+  if (conn_hdr && tw__header_has_token(conn_hdr, "close")) {
+    req->keep_alive = false;
+  } else if (conn_hdr && tw__header_has_token(conn_hdr, "keep-alive")) {
+    req->keep_alive = true;
   } else if (strcmp(req->version, "HTTP/1.1") == 0) {
     /* HTTP/1.1 defaults to keep-alive */
     req->keep_alive = true;
   }
 
-  size_t header_bytes = headers_end + 4 - buf;
-  size_t leftover = total_read - header_bytes;
+  size_t header_bytes = headers_end + 4 - buf;
+  size_t leftover = total_read - header_bytes;
+  req->buf_len = header_bytes;
+
+  req->body = NULL;
+  req->body_len = 0;
+
+  /* bytes past a delimited body start the next request; after a protocol
+   * switch, or with a body that cannot be delimited, they stay with this
+   * one */
+  const char *cl_hdr =
+      tw_request_get_known_header(req, TW_HEADER_CONTENT_LENGTH);
+  size_t content_length = 0;
+  if (leftover > 0 && strcmp(req->method, "PRI") != 0 &&
+      tw_request_get_header(req, "Upgrade") == NULL &&
+      tw_request_get_known_header(req, TW_HEADER_TRANSFER_ENCODING) == NULL &&
+      (cl_hdr == NULL || (tw__parse_content_length(cl_hdr, &content_length) &&
+                          content_length < leftover))) {
+    size_t next = leftover - content_length;
+    if (!tw__conn_stash(conn, buf + total_read - next, next)) {
+      return TW_REQUEST_PARSE_ERROR;
+    }
+    leftover = content_length;
+  }
+
+  if (leftover > 0) {
+    if (!tw__memory_charge(conn, leftover + 1, false)) {
+      tw__conn_reject(conn, tw__response_503, sizeof(tw__response_503) - 1);
+      return TW_REQUEST_PARSE_REJECTED;
+    }
+    req->memory = leftover + 1;
+    req->body = malloc(leftover + 1);
+    if (!req->body) {
+      tw_log(TW_ERROR, "Failed to allocate memory for request body");
+      return TW_REQUEST_PARSE_ERROR;
+    }
+    memcpy(req->body, headers_end + 4, leftover);
+    req->body[leftover] = '\0';
+    req->body_len = leftover;
+  }
+
+  return TW_REQUEST_PARSE_SUCCESS;
+}
+
+static bool tw__parse_content_length(const char *value, size_t *out) {
+  size_t length = 0;
+  if (*value == '\0') return false;
+  for (; *value; value++) {
+    if (*value < '0' || *value > '9') return false;
+    size_t digit = (size_t)(*value - '0');
+    if (length > (SIZE_MAX - digit) / 10) return false;
+    length = length * 10 + digit;
+  }
+  *out = length;
+  return true;
+}
+
+/* Runs between parsing the head and calling the handler, so that bodies
+ * the server does not want are refused before any of them is read.
+ * Clients that sent "Expect: 100-continue" are told to go ahead only once
+ * the body is admitted. Returns false when the request was rejected. */
+static bool tw__request_admit_body(tw_conn *conn, tw_request *req) {
+  const char *cl_hdr =
+      tw_request_get_known_header(req, TW_HEADER_CONTENT_LENGTH);
+  const char *expect = tw_request_get_known_header(req, TW_HEADER_EXPECT);
+  if (cl_hdr == NULL && expect == NULL &&
+      tw_request_get_known_header(req, TW_HEADER_TRANSFER_ENCODING) == NULL) {
+    return true;
+  }
+
+  int status = 0;
+  size_t content_length = 0;
+  if (tw_request_get_known_header(req, TW_HEADER_TRANSFER_ENCODING) != NULL) {
+    /* only bodies with a declared length can be read */
+    status = 411;
+  } else if (cl_hdr != NULL &&
+             !tw__parse_content_length(cl_hdr, &content_length)) {
+    status = 400;
+  } else if (expect != NULL && strcasecmp(expect, "100-continue") != 0) {
+    status = 417;
+  } else if (conn->server != NULL) {
+    if (content_length > conn->server->config.max_body_size) {
+      status = 413;
+    } else if (content_length > 0 && conn->server->body_admission != NULL) {
+      status = conn->server->body_admission(conn, req, content_length);
+    }
+  }
+
+  if (status != 0) {
+    tw__conn_reject_status(conn, status);
+    return false;
+  }
+
+  /* HTTP/1.0 clients do not expect interim responses */
+  if (expect != NULL && content_length > 0 && req->body_len == 0 &&
+      strcmp(req->version, "HTTP/1.1") == 0) {
+    tw__conn_write_all(conn, tw__response_100,
+                       sizeof(tw__response_100) - 1);
+  }
+
+  return true;
+}
+
+TWDEF tw_request_parse_result tw_request_parse_body(tw_conn *conn,
+                                                    tw_request *req) {
+#ifdef TW_ENABLE_HTTP2
+  if (conn->h2 != NULL) {
+    /* DATA frames were collected before the handler was called */
+    return TW_REQUEST_PARSE_SUCCESS;
+  }
+#endif
+
+  const char *cl_hdr =
+      tw_request_get_known_header(req, TW_HEADER_CONTENT_LENGTH);
+  if (!cl_hdr) {
+    /* no body to parse */
+    return TW_REQUEST_PARSE_SUCCESS;
+  }
+
+  size_t content_length;
+  if (!tw__parse_content_length(cl_hdr, &content_length)) {
+    return TW_REQUEST_PARSE_ERROR;
+  }
+  if (content_length == 0) {
+    /* empty body */
+    return TW_REQUEST_PARSE_SUCCESS;
+  }
+
+  size_t max_body_size =
+      conn->server ? conn->server->config.max_body_size : TW_MAX_REQUEST_BODY;
+  if (content_length > max_body_size) {
+    tw__conn_reject(conn, tw__response_413, sizeof(tw__response_413) - 1);
+    return TW_REQUEST_PARSE_REJECTED;
+  }
+
+  /* a body that can never fit is refused outright, one that does not fit
+   * right now is worth retrying */
+  size_t budget = conn->server ? conn->server->config.memory_budget : 0;
+  if (budget > 0 && content_length + 1 > budget) {
+    tw__conn_reject(conn, tw__response_413, sizeof(tw__response_413) - 1);
+    return TW_REQUEST_PARSE_REJECTED;
+  }
+  if (content_length + 1 > req->memory) {
+    size_t extra = content_length + 1 - req->memory;
+    if (!tw__memory_charge(conn, extra, false)) {
+      tw__conn_reject(conn, tw__response_503, sizeof(tw__response_503) - 1);
+      return TW_REQUEST_PARSE_REJECTED;
+    }
+    req->conn = conn;
+    req->memory += extra;
+  }
+
+  if (!req->body) {
+    /* allocate memory for the body */
+    req->body = (char *)malloc((size_t)content_length + 1);
+    if (!req->body) {
+      tw_log(TW_ERROR, "Failed to allocate memory for request body");
+      return TW_REQUEST_PARSE_ERROR;
+    }
+  } else {
+    char *new_body = realloc(req->body, content_length + 1);
+    if (!new_body) {
+      tw__request_free_body(req);
+      return TW_REQUEST_PARSE_ERROR;
+    }
+    req->body = new_body;
+  }
+
+  size_t total_read = req->body_len;
+  size_t bytes_remaining = content_length - req->body_len;
+
+  while (bytes_remaining > 0) {
+    ssize_t bytes_read =
+        tw_conn_read(conn, req->body + total_read, bytes_remaining);
+    if (bytes_read <= 0) {
+#ifdef _WIN32
+      if (WSAGetLastError() == WSAEWOULDBLOCK) {
+        return TW_REQUEST_PARSE_BLOCK;
+      }
+#else
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return TW_REQUEST_PARSE_BLOCK;
+      }
+#endif
+      tw__request_free_body(req);
+      return TW_REQUEST_PARSE_ERROR;
+    }
+
+    total_read += bytes_read;
+    bytes_remaining -= bytes_read;
+  }
+
+  req->body[content_length] = '\0';
+  req->body_len = content_length;
+
+  return TW_REQUEST_PARSE_SUCCESS;
+}
+
+TWDEF const char *tw_request_get_header(tw_request *req, const char *name) {
+  return tw__find_header(req->buf, req->headers, req->num_headers,
+                         req->known_headers, name);
+}
+
+TWDEF const char *tw_request_get_known_header(tw_request *req,
+                                              tw_known_header header) {
+  if (header < 0 || header >= TW_HEADER_KNOWN_COUNT) return NULL;
+  int index = req->known_headers[header];
+  return index < 0 ? NULL : req->buf + req->headers[index].value;
+}
+
+TWDEF bool tw_request_header_at(tw_request *req, size_t index,
+                                const char **name, const char **value) {
+  if (index >= req->num_headers) return false;
+  if (name != NULL) *name = req->buf + req->headers[index].name;
+  if (value != NULL) *value = req->buf + req->headers[index].value;
+  return true;
+}
+
+static int tw__hex_digit(char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+/* Malformed escapes are copied through verbatim. dst may equal src. */
+TWDEF size_t tw_percent_decode(char *dst, const char *src, size_t len,
+                               bool plus_as_space) {
+  size_t i = 0;
+  size_t out = 0;
+
+  while (i < len) {
+    /* skip to the next '%' (or '+') a vector at a time */
+#if defined(__SSE2__)
+    const __m128i pct = _mm_set1_epi8('%');
+    const __m128i plus = _mm_set1_epi8(plus_as_space ? '+' : '%');
+    while (i + 16 <= len) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+      int bits = _mm_movemask_epi8(
+          _mm_or_si128(_mm_cmpeq_epi8(v, pct), _mm_cmpeq_epi8(v, plus)));
+      if (bits != 0) {
+        size_t run = (size_t)__builtin_ctz((unsigned)bits);
+        memmove(dst + out, src + i, run);
+        i += run;
+        out += run;
+        break;
+      }
+      _mm_storeu_si128((__m128i *)(dst + out), v);
+      i += 16;
+      out += 16;
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const uint8x16_t pct = vdupq_n_u8('%');
+    const uint8x16_t plus = vdupq_n_u8(plus_as_space ? '+' : '%');
+    while (i + 16 <= len) {
+      uint8x16_t v = vld1q_u8((const uint8_t *)(src + i));
+      uint8x16_t hit = vorrq_u8(vceqq_u8(v, pct), vceqq_u8(v, plus));
+      if (vmaxvq_u8(hit) != 0) break;
+      vst1q_u8((uint8_t *)(dst + out), v);
+      i += 16;
+      out += 16;
+    }
+#endif
+
+    /* plain bytes up to and including the next escape */
+    while (i < len) {
+      char c = src[i];
+      if (c == '%') {
+        int hi = i + 2 < len ? tw__hex_digit(src[i + 1]) : -1;
+        int lo = hi >= 0 ? tw__hex_digit(src[i + 2]) : -1;
+        if (lo >= 0) {
+          dst[out++] = (char)((hi << 4) | lo);
+          i += 3;
+        } else {
+          dst[out++] = c;
+          i++;
+        }
+        break;
+      } else if (c == '+' && plus_as_space) {
+        dst[out++] = ' ';
+        i++;
+        break;
+      }
+      dst[out++] = c;
+      i++;
+    }
+  }
+
+  return out;
+}
+
+/* Splits and decodes the query into req->params. The decoded strings
+ * never outgrow the raw query plus a terminator, so they go in the
+ * unused tail of req->buf when there is room. */
+static bool tw__request_parse_params(tw_request *req) {
+  req->params_parsed = true;
+  if (req->query_len == 0) return true;
+
+  char *out;
+  if (req->buf_len + req->query_len + 1 <= sizeof(req->buf)) {
+    out = req->buf + req->buf_len;
+  } else {
+    out = malloc(req->query_len + 1);
+    if (out == NULL) {
+      tw_log(TW_ERROR, "Failed to allocate memory for query parameters");
+      return false;
+    }
+    req->params_data = out;
+  }
+
+  const char *pos = req->query;
+  const char *end = req->query + req->query_len;
+  while (pos < end) {
+    const char *amp = memchr(pos, '&', (size_t)(end - pos));
+    if (amp == NULL) amp = end;
+    if (amp == pos) {
+      pos++;
+      continue;
+    }
+
+    if (req->num_params == req->params_cap) {
+      size_t cap = req->params_cap * 2;
+      tw_param *params;
+      if (req->params == req->params_inline) {
+        params = malloc(cap * sizeof(*params));
+        if (params != NULL) {
+          memcpy(params, req->params_inline, sizeof(req->params_inline));
+        }
+      } else {
+        params = realloc(req->params, cap * sizeof(*params));
+      }
+      if (params == NULL) {
+        tw_log(TW_ERROR, "Failed to allocate memory for query parameters");
+        return false;
+      }
+      req->params = params;
+      req->params_cap = cap;
+    }
+
+    const char *eq = memchr(pos, '=', (size_t)(amp - pos));
+    tw_param *param = &req->params[req->num_params++];
+    param->name = out;
+    param->name_len =
+        tw_percent_decode(out, pos, (size_t)((eq ? eq : amp) - pos), true);
+    out += param->name_len;
+    *out++ = '\0';
+    if (eq != NULL) {
+      param->value = out;
+      param->value_len =
+          tw_percent_decode(out, eq + 1, (size_t)(amp - eq - 1), true);
+      out += param->value_len;
+      *out++ = '\0';
+    } else {
+      param->value = "";
+      param->value_len = 0;
+    }
+
+    pos = amp;
+  }
+
+  return true;
+}
+
+TWDEF const char *tw_request_get_param(tw_request *req, const char *name) {
+  if (!req->params_parsed) tw__request_parse_params(req);
+
+  size_t name_len = strlen(name);
+  for (size_t i = 0; i < req->num_params; i++) {
+    const tw_param *param = &req->params[i];
+    if (param->name_len == name_len &&
+        memcmp(param->name, name, name_len) == 0) {
+      return param->value;
+    }
+  }
+
+  return NULL;
+}
+
+TWDEF size_t tw_request_param_count(tw_request *req) {
+  if (!req->params_parsed) tw__request_parse_params(req);
+  return req->num_params;
+}
+
+TWDEF const tw_param *tw_request_param_at(tw_request *req, size_t index) {
+  if (!req->params_parsed) tw__request_parse_params(req);
+  return index < req->num_params ? &req->params[index] : NULL;
+}
+
+enum {
+  TW__MULTIPART_PREAMBLE,
+  /* after a delimiter, before the "--" or line break that follows */
+  TW__MULTIPART_DELIMITER,
+  TW__MULTIPART_DASH,
+  TW__MULTIPART_LF,
+  TW__MULTIPART_HEAD,
+  TW__MULTIPART_BODY,
+  TW__MULTIPART_END,
+  TW__MULTIPART_ERROR
+};
+
+TWDEF bool tw_multipart_init(tw_multipart *mp, const char *content_type) {
+  memset(mp, 0, offsetof(tw_multipart, chunk));
+  mp->spool_fd = -1;
+  mp->state = TW__MULTIPART_ERROR;
+  if (content_type == NULL || strncasecmp(content_type, "multipart/", 10)) {
+    return false;
+  }
+
+  const char *p = strchr(content_type, ';');
+  while (p != NULL) {
+    p++;
+    while (*p == ' ' || *p == '\t') p++;
+    if (strncasecmp(p, "boundary=", 9) != 0) {
+      p = strchr(p, ';');
+      continue;
+    }
+
+    p += 9;
+    size_t len;
+    if (*p == '"') {
+      p++;
+      const char *end = strchr(p, '"');
+      if (end == NULL) return false;
+      len = (size_t)(end - p);
+    } else {
+      len = strcspn(p, "; \t");
+    }
+    /* RFC 2046 section 5.1.1 */
+    if (len == 0 || len > 70 || p[len - 1] == ' ') return false;
+
+    memcpy(mp->delimiter, "\r\n--", 4);
+    memcpy(mp->delimiter + 4, p, len);
+    mp->delimiter_len = len + 4;
+    /* a body may open with the delimiter, without a line break before */
+    memcpy(mp->tail, "\r\n", 2);
+    mp->tail_len = 2;
+    mp->state = TW__MULTIPART_PREAMBLE;
+    return true;
+  }
+
+  return false;
+}
+
+TWDEF bool tw_multipart_done(const tw_multipart *mp) {
+  return mp->state == TW__MULTIPART_END;
+}
+
+TWDEF void tw_multipart_spool(tw_multipart *mp, int fd) { mp->spool_fd = fd; }
+
+/* Offset of the first needle in hay, len when there is none. */
+static size_t tw__memmem(const char *hay, size_t len, const char *needle,
+                         size_t needle_len) {
+  size_t i = 0;
+  if (needle_len == 0 || needle_len > len) return len;
+
+  /* candidates have both the first and the last byte of needle in place,
+   * sixteen of them are tested at a time */
+#if defined(__SSE2__)
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+  while (i + needle_len + 15 <= len) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + needle_len - 1));
+    unsigned bits = (unsigned)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (bits != 0) {
+      size_t at = i + (size_t)__builtin_ctz(bits);
+      if (memcmp(hay + at, needle, needle_len) == 0) return at;
+      bits &= bits - 1;
+    }
+    i += 16;
+  }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+  const uint8x16_t first = vdupq_n_u8((uint8_t)needle[0]);
+  const uint8x16_t last = vdupq_n_u8((uint8_t)needle[needle_len - 1]);
+  while (i + needle_len + 15 <= len) {
+    uint8x16_t a = vld1q_u8((const uint8_t *)(hay + i));
+    uint8x16_t b = vld1q_u8((const uint8_t *)(hay + i + needle_len - 1));
+    if (vmaxvq_u8(vandq_u8(vceqq_u8(a, first), vceqq_u8(b, last))) != 0) {
+      for (size_t at = i; at < i + 16; at++) {
+        if (memcmp(hay + at, needle, needle_len) == 0) return at;
+      }
+    }
+    i += 16;
+  }
+#endif
+
+  while (i + needle_len <= len) {
+    const char *p = memchr(hay + i, needle[0], len - needle_len + 1 - i);
+    if (p == NULL) break;
+    i = (size_t)(p - hay);
+    if (memcmp(p, needle, needle_len) == 0) return i;
+    i++;
+  }
+  return len;
+}
+
+/* Length of the longest end of data the delimiter starts with. */
+static size_t tw__multipart_partial(const tw_multipart *mp, const char *data,
+                                    size_t len) {
+  size_t max = len < mp->delimiter_len - 1 ? len : mp->delimiter_len - 1;
+  for (size_t n = max; n > 0; n--) {
+    if (data[len - n] == '\r' &&
+        memcmp(data + len - n, mp->delimiter, n) == 0) {
+      return n;
+    }
+  }
+  return 0;
+}
+
+static bool tw__multipart_emit(tw_multipart *mp, const char *data,
+                               size_t len) {
+  /* the preamble is dropped */
+  if (len == 0 || mp->state != TW__MULTIPART_BODY) return true;
+  if (mp->spool_fd < 0) {
+    if (mp->on_data == NULL || mp->on_data(mp, data, len)) return true;
+    mp->aborted = true;
+    return false;
+  }
+
+  while (len > 0) {
+#ifdef _WIN32
+    int n = _write(mp->spool_fd, data, (unsigned)len);
+#else
+    ssize_t n = write(mp->spool_fd, data, len);
+#endif
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) {
+      tw_log(TW_ERROR, "Failed to spool multipart data: %s", strerror(errno));
+      mp->aborted = true;
+      return false;
+    }
+    data += n;
+    len -= (size_t)n;
+  }
+  return true;
+}
+
+static bool tw__multipart_delimiter(tw_multipart *mp) {
+  if (mp->state == TW__MULTIPART_BODY) {
+    mp->spool_fd = -1;
+    if (mp->on_part_end != NULL && !mp->on_part_end(mp)) {
+      mp->aborted = true;
+      return false;
+    }
+  }
+  mp->state = TW__MULTIPART_DELIMITER;
+  return true;
+}
+
+/* Passes on data up to the next delimiter, which is consumed as well.
+ * What may be the start of a delimiter is held back in tail. */
+static bool tw__multipart_scan(tw_multipart *mp, const char *data, size_t len,
+                               size_t *used) {
+  size_t delimiter_len = mp->delimiter_len;
+
+  if (mp->tail_len > 0) {
+    /* look for a delimiter starting in the held back bytes */
+    size_t take = len < delimiter_len ? len : delimiter_len;
+    memcpy(mp->tail + mp->tail_len, data, take);
+    size_t scratch = mp->tail_len + take;
+    size_t at = tw__memmem(mp->tail, scratch, mp->delimiter, delimiter_len);
+    if (at < mp->tail_len) {
+      *used = at + delimiter_len - mp->tail_len;
+      mp->tail_len = 0;
+      return tw__multipart_emit(mp, mp->tail, at) &&
+             tw__multipart_delimiter(mp);
+    }
+    if (at == scratch && take == len) {
+      /* too little input to tell yet */
+      size_t keep = tw__multipart_partial(mp, mp->tail, scratch);
+      bool ok = tw__multipart_emit(mp, mp->tail, scratch - keep);
+      memmove(mp->tail, mp->tail + scratch - keep, keep);
+      mp->tail_len = keep;
+      *used = len;
+      return ok;
+    }
+    size_t tail_len = mp->tail_len;
+    mp->tail_len = 0;
+    if (!tw__multipart_emit(mp, mp->tail, tail_len)) return false;
+  }
+
+  size_t at = tw__memmem(data, len, mp->delimiter, delimiter_len);
+  if (at < len) {
+    *used = at + delimiter_len;
+    return tw__multipart_emit(mp, data, at) && tw__multipart_delimiter(mp);
+  }
+
+  size_t keep = tw__multipart_partial(mp, data, len);
+  memcpy(mp->tail, data + len - keep, keep);
+  mp->tail_len = keep;
+  *used = len;
+  return tw__multipart_emit(mp, data, len - keep);
+}
+
+/* Parses the Content-Disposition parameters after the type, in place. */
+static void tw__multipart_disposition(tw_multipart_part *part, char *p) {
+  p = strchr(p, ';');
+  while (p != NULL) {
+    p++;
+    while (*p == ' ' || *p == '\t') p++;
+    char *key = p;
+    size_t key_len = strcspn(p, "=; \t");
+    p += key_len;
+    while (*p == ' ' || *p == '\t') p++;
+    if (*p != '=') {
+      p = strchr(p, ';');
+      continue;
+    }
+    p++;
+    while (*p == ' ' || *p == '\t') p++;
+
+    char *value = p;
+    char *end;
+    if (*p == '"') {
+      /* quoted-string, unescaped over itself */
+      end = value;
+      p++;
+      while (*p != '\0' && *p != '"') {
+        if (*p == '\\' && p[1] != '\0') p++;
+        *end++ = *p++;
+      }
+    } else {
+      p += strcspn(p, "; \t");
+      end = p;
+    }
+    p = strchr(p, ';');
+    *end = '\0';
+
+    if (key_len == 4 && strncasecmp(key, "name", 4) == 0) {
+      part->name = value;
+    } else if (key_len == 8 && strncasecmp(key, "filename", 8) == 0) {
+      part->filename = value;
+    }
+  }
+}
+
+static bool tw__multipart_head(tw_multipart *mp) {
+  tw_multipart_part *part = &mp->part;
+  memset(part, 0, sizeof(*part));
+  mp->head[mp->head_len] = '\0';
+
+  char *line = mp->head;
+  char *crlf;
+  while ((crlf = strstr(line, "\r\n")) != NULL && crlf != line) {
+    *crlf = '\0';
+    char *colon = strchr(line, ':');
+    if (colon != NULL) {
+      size_t name_len = (size_t)(colon - line);
+      char *value = colon + 1;
+      while (*value == ' ' || *value == '\t') value++;
+      char *end = crlf;
+      while (end > value && (end[-1] == ' ' || end[-1] == '\t')) end--;
+      *end = '\0';
+
+      if (name_len == 19 &&
+          strncasecmp(line, "Content-Disposition", 19) == 0) {
+        tw__multipart_disposition(part, value);
+      } else if (name_len == 12 &&
+                 strncasecmp(line, "Content-Type", 12) == 0) {
+        part->content_type = value;
+      }
+    }
+    line = crlf + 2;
+  }
+
+  mp->state = TW__MULTIPART_BODY;
+  mp->spool_fd = -1;
+  if (mp->on_part != NULL && !mp->on_part(mp, part)) {
+    mp->aborted = true;
+    return false;
+  }
+  return true;
+}
+
+TWDEF bool tw_multipart_feed(tw_multipart *mp, const char *data, size_t len) {
+  size_t pos = 0;
+  while (pos < len) {
+    bool ok = true;
+    char c = data[pos];
+    switch (mp->state) {
+      case TW__MULTIPART_PREAMBLE:
+      case TW__MULTIPART_BODY: {
+        size_t used = 0;
+        ok = tw__multipart_scan(mp, data + pos, len - pos, &used);
+        pos += used;
+        break;
+      }
+      case TW__MULTIPART_DELIMITER:
+        if (c == '-') {
+          mp->state = TW__MULTIPART_DASH;
+        } else if (c == '\r') {
+          mp->state = TW__MULTIPART_LF;
+        } else if (c != ' ' && c != '\t') {
+          ok = false;
+        }
+        pos++;
+        break;
+      case TW__MULTIPART_DASH:
+        mp->state = TW__MULTIPART_END;
+        ok = c == '-';
+        pos++;
+        break;
+      case TW__MULTIPART_LF:
+        mp->state = TW__MULTIPART_HEAD;
+        mp->head_len = 0;
+        ok = c == '\n';
+        pos++;
+        break;
+      case TW__MULTIPART_HEAD: {
+        /* a line at a time until the empty one */
+        const char *lf = memchr(data + pos, '\n', len - pos);
+        size_t n = lf != NULL ? (size_t)(lf - data - pos) + 1 : len - pos;
+        if (mp->head_len + n >= sizeof(mp->head)) {
+          ok = false;
+          break;
+        }
+        memcpy(mp->head + mp->head_len, data + pos, n);
+        mp->head_len += n;
+        pos += n;
+
+        const char *head = mp->head;
+        size_t head_len = mp->head_len;
+        if (lf != NULL &&
+            ((head_len == 2 && memcmp(head, "\r\n", 2) == 0) ||
+             (head_len >= 4 &&
+              memcmp(head + head_len - 4, "\r\n\r\n", 4) == 0))) {
+          ok = tw__multipart_head(mp);
+        }
+        break;
+      }
+      case TW__MULTIPART_END:
+        /* the epilogue is dropped */
+        return true;
+      default:
+        return false;
+    }
+
+    if (!ok) {
+      mp->state = TW__MULTIPART_ERROR;
+      return false;
+    }
+  }
+
+  return true;
+}
+
+TWDEF tw_request_parse_result tw_request_parse_multipart(tw_conn *conn,
+                                                         tw_request *req,
+                                                         tw_multipart *mp) {
+#ifdef TW_ENABLE_HTTP2
+  if (conn->h2 != NULL) {
+    /* DATA frames were collected before the handler was called */
+    if (!mp->started) {
+      mp->started = true;
+      if (!tw_multipart_feed(mp, req->body, req->body_len)) {
+        return TW_REQUEST_PARSE_ERROR;
+      }
+    }
+    return tw_multipart_done(mp) ? TW_REQUEST_PARSE_SUCCESS
+                                 : TW_REQUEST_PARSE_ERROR;
+  }
+#endif
+
+  if (!mp->started) {
+    const char *cl_hdr =
+        tw_request_get_known_header(req, TW_HEADER_CONTENT_LENGTH);
+    size_t content_length = 0;
+    if (cl_hdr == NULL || !tw__parse_content_length(cl_hdr, &content_length)) {
+      tw__conn_reject_status(conn, 400);
+      return TW_REQUEST_PARSE_REJECTED;
+    }
+
+    size_t max_body_size = conn->server ? conn->server->config.max_body_size
+                                        : TW_MAX_REQUEST_BODY;
+    if (content_length > max_body_size) {
+      tw__conn_reject(conn, tw__response_413, sizeof(tw__response_413) - 1);
+      return TW_REQUEST_PARSE_REJECTED;
+    }
+
+    /* what came with the head is parsed first, then the buffer goes */
+    mp->started = true;
+    mp->remaining = content_length - req->body_len;
+    tw_multipart_feed(mp, req->body, req->body_len);
+    tw__request_free_body(req);
+  }
+
+  /* after an abort the body is still read, to keep the connection */
+  while (mp->remaining > 0 &&
+         (mp->state != TW__MULTIPART_ERROR || mp->aborted)) {
+    size_t want = mp->remaining < sizeof(mp->chunk) ? mp->remaining
+                                                   : sizeof(mp->chunk);
+    ssize_t bytes_read = tw_conn_read(conn, mp->chunk, want);
+    if (bytes_read <= 0) {
+#ifdef _WIN32
+      if (WSAGetLastError() == WSAEWOULDBLOCK) {
+        return TW_REQUEST_PARSE_BLOCK;
+      }
+#else
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return TW_REQUEST_PARSE_BLOCK;
+      }
+#endif
+      return TW_REQUEST_PARSE_ERROR;
+    }
+
+    mp->remaining -= (size_t)bytes_read;
+    tw_multipart_feed(mp, mp->chunk, (size_t)bytes_read);
+  }
+
+  if (mp->state == TW__MULTIPART_ERROR && !mp->aborted) {
+    /* the rest of the body is still unread */
+    tw__conn_reject_status(conn, 400);
+    return TW_REQUEST_PARSE_REJECTED;
+  }
+  return tw_multipart_done(mp) ? TW_REQUEST_PARSE_SUCCESS
+                               : TW_REQUEST_PARSE_ERROR;
+}
+
+TWDEF bool tw_response_init(tw_response *res) {
+  if (res != NULL) {
+    tw_map_init(&res->headers);
+    res->status = 200;
+    res->body = NULL;
+    res->body_len = 0;
+    res->body_cap = 0;
+    res->body_free = free;
+    res->accept_encoding = TW_ENCODING_IDENTITY;
+    res->head = false;
+    return true;
+  } else {
+    return false;
+  }
+}
+
+static void tw__response_release_body(tw_response *res) {
+  if (res->body != NULL && res->body_free != NULL) {
+    res->body_free(res->body);
+  }
+  res->body = NULL;
+  res->body_len = 0;
+  res->body_cap = 0;
+  res->body_free = free;
+}
+
+TWDEF void tw_response_free(tw_response *res) {
+  if (res != NULL) {
+    tw__response_release_body(res);
+    tw_map_free(&res->headers);
+  }
+}
+
+TWDEF void tw_response_set_status(tw_response *res, int status) {
+  res->status = status;
+}
+
+TWDEF void tw_response_set_header(tw_response *res, const char *name,
+                                  const char *value) {
+  size_t name_len = strlen(name);
+  if (name_len >= TW_MAX_HEADER_NAME) {
+    tw_log(TW_WARNING, "Header name too long.");
+    return;
+  }
+
+  size_t value_len = strlen(value);
+  if (value_len >= TW_MAX_HEADER_VALUE) {
+    tw_log(TW_WARNING, "Header value too long.");
+    return;
+  }
+
+  tw_map_set(&res->headers, name, value);
+}
+
+static const char *tw_status_text(int status) {
+  switch (status) {
+    case 100:
+      return "Continue";
+    case 101:
+      return "Switching Protocols";
+    case 200:
+      return "OK";
+    case 201:
+      return "Created";
+    case 202:
+      return "Accepted";
+    case 203:
+      return "Non-Authoritative Information";
+    case 204:
+      return "No Content";
+    case 205:
+      return "Reset Content";
+    case 206:
+      return "Partial Content";
+    case 207:
+      return "Multi-Status";
+    case 300:
+      return "Multiple Choices";
+    case 301:
+      return "Moved Permanently";
+    case 302:
+      return "Found";
+    case 303:
+      return "See Other";
+    case 304:
+      return "Not Modified";
+    case 307:
+      return "Temporary Redirect";
+    case 400:
+      return "Bad Request";
+    case 401:
+      return "Unauthorized";
+    case 402:
+      return "Payment Required";
+    case 403:
+      return "Forbidden";
+    case 404:
+      return "Not Found";
+    case 405:
+      return "Method Not Allowed";
+    case 406:
+      return "Not Acceptable";
+    case 407:
+      return "Proxy Authentication Required";
+    case 408:
+      return "Request Timeout";
+    case 409:
+      return "Conflict";
+    case 410:
+      return "Gone";
+    case 411:
+      return "Length Required";
+    case 412:
+      return "Precondition Failed";
+    case 413:
+      return "Content Too Large";
+    case 414:
+      return "URI Too Long";
+    case 415:
+      return "Unsupported Media Type";
+    case 416:
+      return "Range Not Satisfiable";
+    case 417:
+      return "Expectation Failed";
+    case 421:
+      return "Misdirected Request";
+    case 429:
+      return "Too Many Requests";
+    case 500:
+      return "Internal Server Error";
+    case 501:
+      return "Not Implemented";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
+    case 504:
+      return "Gateway Timeout";
+    case 505:
+      return "HTTP Version Not Supported";
+    default:
+      return "";
+  }
+}
+
+/* 1xx, 204 and 304 responses end with their header block */
+static bool tw__status_has_body(int status) {
+  return status >= 200 && status != 204 && status != 304;
+}
+
+TWDEF bool tw_response_set_body(tw_response *res, const char *body,
+                                size_t body_len) {
+  if (res != NULL && body != NULL) {
+    /* the old body goes last, body may point into it */
+    char *old = res->body;
+    void (*old_free)(void *body) = res->body_free;
+    res->body = NULL;
+    tw__response_release_body(res);
+
+    bool ok = tw_response_append(res, body, body_len);
+    if (old != NULL && old_free != NULL) old_free(old);
+    return ok;
+  } else {
+    return false;
+  }
+}
+
+TWDEF void tw_response_borrow_body(tw_response *res, const char *body,
+                                   size_t body_len) {
+  tw__response_release_body(res);
+  res->body = (char *)body;
+  res->body_len = body_len;
+  res->body_free = NULL;
+}
+
+TWDEF void tw_response_take_body(tw_response *res, char *body,
+                                 size_t body_len,
+                                 void (*body_free)(void *body)) {
+  tw__response_release_body(res);
+  res->body = body;
+  res->body_len = body_len;
+  res->body_free = body_free != NULL ? body_free : free;
+}
+
+TWDEF char *tw_response_reserve(tw_response *res, size_t len) {
+  /* one more byte keeps the body NUL-terminated */
+  if (len > SIZE_MAX / 2 - res->body_len) return NULL;
+  size_t need = res->body_len + len + 1;
+  if (res->body_cap >= need) {
+    return res->body + res->body_len;
+  }
+
+  size_t cap = res->body_cap > 0 ? res->body_cap : 256;
+  while (cap < need) cap *= 2;
+
+  /* a borrowed or handed over body becomes a copy the writer owns */
+  bool owned = res->body_cap > 0;
+  char *body = owned ? (char *)realloc(res->body, cap) : (char *)malloc(cap);
+  if (body == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for tw_response->body");
+    return NULL;
+  }
+  if (!owned) {
+    if (res->body_len > 0) memcpy(body, res->body, res->body_len);
+    if (res->body != NULL && res->body_free != NULL) {
+      res->body_free(res->body);
+    }
+    res->body_free = free;
+  }
+
+  res->body = body;
+  res->body_cap = cap;
+  return body + res->body_len;
+}
+
+TWDEF void tw_response_commit(tw_response *res, size_t len) {
+  res->body_len += len;
+  res->body[res->body_len] = '\0';
+}
+
+TWDEF bool tw_response_append(tw_response *res, const char *data,
+                              size_t len) {
+  char *dst = tw_response_reserve(res, len);
+  if (dst == NULL) return false;
+  if (len > 0) memcpy(dst, data, len);
+  tw_response_commit(res, len);
+  return true;
+}
+
+TWDEF bool tw_response_printf(tw_response *res, const char *fmt, ...) {
+  /* formats into the spare room first, which usually suffices */
+  char *dst = tw_response_reserve(res, 64);
+  if (dst == NULL) return false;
+  size_t room = res->body_cap - res->body_len;
+
+  va_list args;
+  va_start(args, fmt);
+  int len = vsnprintf(dst, room, fmt, args);
+  va_end(args);
+  if (len < 0) return false;
+
+  if ((size_t)len >= room) {
+    dst = tw_response_reserve(res, (size_t)len);
+    if (dst == NULL) return false;
+    va_start(args, fmt);
+    vsnprintf(dst, (size_t)len + 1, fmt, args);
+    va_end(args);
+  }
+
+  tw_response_commit(res, (size_t)len);
+  return true;
+}
+
+#ifdef TW_ENABLE_COMPRESSION
+static const char *const tw__compressible_types[] = {
+    "text/",           "application/json", "application/javascript",
+    "application/xml", "image/svg+xml",    NULL};
+
+/* Finds a response header whatever case the handler wrote it in, and
+ * returns its index, or the number of headers when it is not set. */
+static size_t tw__response_header_index(const tw_response *res,
+                                        const char *name) {
+  size_t i = 0;
+  while (i < res->headers.size &&
+         strcasecmp(res->headers.keys[i], name) != 0) {
+    i++;
+  }
+  return i;
+}
+
+/* Adds Accept-Encoding to the Vary field, after what the handler listed
+ * there already, such as Origin. */
+static void tw__response_vary(tw_response *res) {
+  size_t i = tw__response_header_index(res, "Vary");
+  if (i == res->headers.size) {
+    tw_map_set(&res->headers, "Vary", "Accept-Encoding");
+    return;
+  }
+
+  const char *value = res->headers.values[i];
+  const char *pos = value;
+  while (*pos) {
+    while (*pos == ' ' || *pos == '\t' || *pos == ',') pos++;
+    const char *token = pos;
+    while (*pos && *pos != ',') pos++;
+    const char *end = pos;
+    while (end > token && (end[-1] == ' ' || end[-1] == '\t')) end--;
+    size_t token_len = (size_t)(end - token);
+    /* "*" varies on everything already */
+    if ((token_len == 1 && *token == '*') ||
+        (token_len == 15 && strncasecmp(token, "Accept-Encoding", 15) == 0)) {
+      return;
+    }
+  }
+
+  size_t len = strlen(value) + strlen(", Accept-Encoding") + 1;
+  char *joined = (char *)malloc(len);
+  if (joined == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for header value");
+    return;
+  }
+  snprintf(joined, len, "%s, Accept-Encoding", value);
+  tw_map_set(&res->headers, res->headers.keys[i], joined);
+  free(joined);
+}
+
+static bool tw__response_compressible(const tw_compression_config *config,
+                                      tw_response *res) {
+  if (res->body == NULL || res->body_len < config->min_size) {
+    return false;
+  }
+
+  if (res->status < 200 || res->status == 204 || res->status == 206 ||
+      res->status == 304) {
+    return false;
+  }
+
+  if (tw__response_header_index(res, "Content-Encoding") <
+      res->headers.size) {
+    /* the handler already encoded the body */
+    return false;
+  }
+
+  const char *content_type = tw_map_get(&res->headers, "Content-Type");
+  if (content_type == NULL) {
+    return false;
+  }
+
+  const char *const *types = config->content_types != NULL
+                                 ? config->content_types
+                                 : tw__compressible_types;
+  for (size_t i = 0; types[i] != NULL; i++) {
+    if (strncasecmp(content_type, types[i], strlen(types[i])) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/* Replaces the outgoing body with a compressed variant when the client and the
+ * server configuration allow it. A variant that is not owned by the cache is
+ * returned in `owned` and must be freed by the caller. */
+static void tw__response_compress(tw_conn *conn, tw_response *res,
+                                  const char **body, size_t *body_len,
+                                  char **owned) {
+  *owned = NULL;
+  if (conn->server == NULL || !conn->server->compression.enabled) {
+    return;
+  }
+
+  tw_server *server = conn->server;
+  if (!tw__response_compressible(&server->compression, res)) {
+    return;
+  }
+
+  /* the representation depends on Accept-Encoding from now on */
+  tw__response_vary(res);
+
+  tw_encoding encoding;
+  if (res->accept_encoding & TW_ENCODING_GZIP) {
+    encoding = TW_ENCODING_GZIP;
+  } else if (res->accept_encoding & TW_ENCODING_DEFLATE) {
+    encoding = TW_ENCODING_DEFLATE;
+  } else {
+    return;
+  }
+
+  const char *data = NULL;
+  size_t data_len = 0;
+  if (server->compression.cache &&
+      res->body_len <= TW_COMPRESSION_CACHE_MAX_BODY) {
+    const tw_compression_cache_entry *entry = tw_compression_cache_get(
+        &server->compression_cache, encoding, res->body, res->body_len,
+        server->compression.level);
+    if (entry == NULL) {
+      return;
+    }
+    data = entry->data;
+    data_len = entry->data_len;
+  } else {
+    if (!tw_compress(encoding, server->compression.level, res->body,
+                     res->body_len, owned, &data_len)) {
+      return;
+    }
+    data = *owned;
+  }
+
+  if (data_len >= res->body_len) {
+    /* not worth it, send the original body */
+    free(*owned);
+    *owned = NULL;
+    return;
+  }
+
+  /* the encoded bytes are another representation, byte ranges and strong
+   * comparisons must not match them */
+  size_t etag = tw__response_header_index(res, "ETag");
+  if (etag < res->headers.size &&
+      strncmp(res->headers.values[etag], "W/", 2) != 0) {
+    char weak[TW_MAX_HEADER_VALUE];
+    snprintf(weak, sizeof(weak), "W/%s", res->headers.values[etag]);
+    tw_map_set(&res->headers, res->headers.keys[etag], weak);
+  }
+
+  tw_map_set(&res->headers, "Content-Encoding",
+             encoding == TW_ENCODING_GZIP ? "gzip" : "deflate");
+  *body = data;
+  *body_len = data_len;
+}
+#endif
+
+/* Bytes tw__format_fields needs for headers, without the terminator. */
+static size_t tw__fields_size(const tw_map *headers) {
+  size_t size = 0;
+  for (size_t i = 0; i < headers->size; i++) {
+    size += strlen(headers->keys[i]) + strlen(headers->values[i]) + 4;
+  }
+  return size;
+}
+
+/* Writes headers as "name: value\r\n" lines, returning the length. */
+static size_t tw__format_fields(char *buf, size_t size,
+                                const tw_map *headers) {
+  size_t offset = 0;
+  for (size_t i = 0; i < headers->size; i++) {
+    offset += snprintf(buf + offset, size - offset, "%s: %s\r\n",
+                       headers->keys[i], headers->values[i]);
+  }
+  return offset;
+}
+
+/* Bytes the head of res takes at most. */
+static size_t tw__response_head_size(const tw_response *res) {
+  /* status line, Content-Length and the blank line fit in 80 bytes */
+  return 80 + strlen(tw_status_text(res->status)) +
+         tw__fields_size(&res->headers);
+}
+
+/* Writes the status line and header fields of res into buf, with a
+ * Content-Length of body_len when length is set and the status has a
+ * body. buf holds tw__response_head_size bytes. */
+static size_t tw__response_head(const tw_response *res, bool length,
+                                size_t body_len, char *buf, size_t size) {
+  size_t offset = 0;
+  offset += snprintf(buf + offset, size - offset, "HTTP/1.1 %d %s\r\n",
+                     res->status, tw_status_text(res->status));
+  if (length && tw__status_has_body(res->status)) {
+    offset += snprintf(buf + offset, size - offset,
+                       "Content-Length: %zu\r\n", body_len);
+  }
+  offset += tw__format_fields(buf + offset, size - offset, &res->headers);
+  offset += snprintf(buf + offset, size - offset, "\r\n");
+  return offset;
+}
+
+TWDEF bool tw_response_send(tw_conn *conn, tw_response *res) {
+  if (conn->rejected) {
+    /* an error response already went out on this connection */
+    return false;
+  }
+#ifdef TW_ENABLE_TRACE
+  uint64_t trace_start = tw__trace(conn, TW_TRACE_SEND, 0);
+#endif
+
+  const char *body = res->body;
+  size_t body_len = res->body_len;
+#ifdef TW_ENABLE_COMPRESSION
+  char *compressed = NULL;
+  tw__response_compress(conn, res, &body, &body_len, &compressed);
+#endif
+
+#ifdef TW_ENABLE_HTTP2
+  if (conn->h2 != NULL) {
+    bool sent = tw__h2_send_response(conn, res, body, body_len);
+#ifdef TW_ENABLE_COMPRESSION
+    free(compressed);
+#endif
+#ifdef TW_ENABLE_TRACE
+    tw__trace(conn, TW_TRACE_SEND, trace_start);
+#endif
+    return sent;
+  }
+#endif
+
+  size_t header_size = tw__response_head_size(res);
+
+  /* typical headers fit on the stack */
+  char stack_buf[1024];
+  char *header_buf = stack_buf;
+  if (header_size > sizeof(stack_buf)) {
+    header_buf = (char *)malloc(header_size);
+    if (header_buf == NULL) {
+      tw_log(TW_ERROR, "Failed to allocate memory for response headers");
+#ifdef TW_ENABLE_COMPRESSION
+      free(compressed);
+#endif
+      return false;
+    }
+  }
+
+  size_t offset =
+      tw__response_head(res, true, body_len, header_buf, header_size);
+
+  if (!tw__status_has_body(res->status) || res->head || body == NULL) {
+    body_len = 0;
+  }
+  bool ok = tw__conn_send_response(conn, header_buf, offset, body, body_len);
+  if (!ok) {
+    tw_log(TW_ERROR, "Failed to send response");
+  }
+
+  if (header_buf != stack_buf) {
+    free(header_buf);
+  }
+
+#ifdef TW_ENABLE_COMPRESSION
+  free(compressed);
+#endif
+#ifdef TW_ENABLE_TRACE
+  tw__trace(conn, TW_TRACE_SEND, trace_start);
+#endif
+
+  return ok;
+}
+
+TWDEF int tw_parse_accept_encoding(const char *value) {
+  if (value == NULL) {
+    return TW_ENCODING_IDENTITY;
+  }
+
+  int accepted = 0;
+  int rejected = 0;
+  bool wildcard = false;
+
+  const char *pos = value;
+  while (*pos) {
+    while (*pos == ' ' || *pos == '\t' || *pos == ',') pos++;
+    if (!*pos) break;
+
+    const char *token = pos;
+    while (*pos && *pos != ',' && *pos != ';' && *pos != ' ' && *pos != '\t') {
+      pos++;
+    }
+    size_t token_len = (size_t)(pos - token);
+
+    /* an explicit q=0 means "not acceptable" */
+    bool acceptable = true;
+    while (*pos && *pos != ',') {
+      if (*pos == ';') {
+        pos++;
+        while (*pos == ' ' || *pos == '\t') pos++;
+        if ((*pos == 'q' || *pos == 'Q') && pos[1] == '=') {
+          acceptable = strtod(pos + 2, NULL) > 0.0;
+        }
+        continue;
+      }
+      pos++;
+    }
+
+    int encoding = 0;
+    if ((token_len == 4 && strncasecmp(token, "gzip", 4) == 0) ||
+        (token_len == 6 && strncasecmp(token, "x-gzip", 6) == 0)) {
+      encoding = TW_ENCODING_GZIP;
+    } else if (token_len == 7 && strncasecmp(token, "deflate", 7) == 0) {
+      encoding = TW_ENCODING_DEFLATE;
+    } else if (token_len == 1 && token[0] == '*') {
+      wildcard = acceptable;
+      continue;
+    }
+
+    if (acceptable) {
+      accepted |= encoding;
+    } else {
+      rejected |= encoding;
+    }
+  }
+
+  if (wildcard) {
+    accepted |= TW_ENCODING_GZIP | TW_ENCODING_DEFLATE;
+  }
+
+  return accepted & ~rejected;
+}
+
+static const char *const tw__day_names[] = {"Sun", "Mon", "Tue", "Wed",
+                                             "Thu", "Fri", "Sat"};
+static const char *const tw__month_names[] = {"Jan", "Feb", "Mar", "Apr",
+                                              "May", "Jun", "Jul", "Aug",
+                                              "Sep", "Oct", "Nov", "Dec"};
+
+/* Days since 1970-01-01 of a proleptic Gregorian date, m and d from 1. */
+static int64_t tw__days_from_civil(int64_t y, unsigned m, unsigned d) {
+  y -= m <= 2;
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  unsigned yoe = (unsigned)(y - era * 400);
+  unsigned doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + (int64_t)doe - 719468;
+}
+
+TWDEF void tw_http_date(time_t t, char *out) {
+  int64_t days = (int64_t)t / 86400;
+  int64_t secs = (int64_t)t % 86400;
+  if (secs < 0) {
+    secs += 86400;
+    days--;
+  }
+  /* 1970-01-01 was a Thursday */
+  int weekday = (int)(((days % 7) + 11) % 7);
+
+  int64_t z = days + 719468;
+  int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  unsigned doe = (unsigned)(z - era * 146097);
+  unsigned yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  unsigned doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  unsigned mp = (5 * doy + 2) / 153;
+  unsigned day = doy - (153 * mp + 2) / 5 + 1;
+  unsigned month = mp < 10 ? mp + 3 : mp - 9;
+  int64_t year = (int64_t)yoe + era * 400 + (month <= 2);
+  /* the format has four digits for the year */
+  if (year < 0) year = 0;
+  if (year > 9999) year = 9999;
+
+  snprintf(out, 30, "%s, %02u %s %04d %02d:%02d:%02d GMT",
+           tw__day_names[weekday], day % 100, tw__month_names[month - 1],
+           (int)year, (int)(secs / 3600), (int)(secs / 60 % 60),
+           (int)(secs % 60));
+}
+
+TWDEF bool tw_parse_http_date(const char *value, time_t *out) {
+  char weekday[10], month_name[4], zone[4];
+  int day, year, hour, minute, second;
+
+  if (sscanf(value, "%3[A-Za-z], %2d %3[A-Za-z] %4d %2d:%2d:%2d %3s",
+             weekday, &day, month_name, &year, &hour, &minute, &second,
+             zone) == 8) {
+    /* IMF-fixdate, Sun, 06 Nov 1994 08:49:37 GMT */
+  } else if (sscanf(value, "%9[A-Za-z], %2d-%3[A-Za-z]-%2d %2d:%2d:%2d %3s",
+                    weekday, &day, month_name, &year, &hour, &minute,
+                    &second, zone) == 8) {
+    /* RFC 850, Sunday, 06-Nov-94 08:49:37 GMT */
+    year += year < 70 ? 2000 : 1900;
+  } else if (sscanf(value, "%3[A-Za-z] %3[A-Za-z] %2d %2d:%2d:%2d %4d",
+                    weekday, month_name, &day, &hour, &minute, &second,
+                    &year) == 7) {
+    /* asctime, Sun Nov  6 08:49:37 1994 */
+    strcpy(zone, "GMT");
+  } else {
+    return false;
+  }
+
+  if (strcmp(zone, "GMT") != 0 || day < 1 || day > 31 || hour > 23 ||
+      minute > 59 || second > 60 || hour < 0 || minute < 0 || second < 0) {
+    return false;
+  }
+
+  int month = -1;
+  for (int i = 0; i < 12; i++) {
+    if (strcasecmp(month_name, tw__month_names[i]) == 0) {
+      month = i + 1;
+      break;
+    }
+  }
+  if (month < 0) return false;
+
+  int64_t days = tw__days_from_civil(year, (unsigned)month, (unsigned)day);
+  *out = (time_t)(days * 86400 + hour * 3600 + minute * 60 + second);
+  return true;
+}
+
+static const struct {
+  const char *ext;
+  const char *type;
+} tw__mime_types[] = {
+    {"html", "text/html; charset=utf-8"},
+    {"htm", "text/html; charset=utf-8"},
+    {"css", "text/css; charset=utf-8"},
+    {"js", "text/javascript; charset=utf-8"},
+    {"mjs", "text/javascript; charset=utf-8"},
+    {"json", "application/json"},
+    {"txt", "text/plain; charset=utf-8"},
+    {"md", "text/markdown; charset=utf-8"},
+    {"csv", "text/csv; charset=utf-8"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"avif", "image/avif"},
+    {"ico", "image/x-icon"},
+    {"woff", "font/woff"},
+    {"woff2", "font/woff2"},
+    {"ttf", "font/ttf"},
+    {"otf", "font/otf"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"zip", "application/zip"},
+    {"gz", "application/gzip"},
+    {"mp3", "audio/mpeg"},
+    {"ogg", "audio/ogg"},
+    {"wav", "audio/wav"},
+    {"mp4", "video/mp4"},
+    {"webm", "video/webm"},
+};
+
+TWDEF const char *tw_mime_type(const char *path) {
+  const char *slash = strrchr(path, '/');
+  const char *dot = strrchr(slash ? slash : path, '.');
+  if (dot != NULL) {
+    size_t count = sizeof(tw__mime_types) / sizeof(tw__mime_types[0]);
+    for (size_t i = 0; i < count; i++) {
+      if (strcasecmp(dot + 1, tw__mime_types[i].ext) == 0) {
+        return tw__mime_types[i].type;
+      }
+    }
+  }
+  return "application/octet-stream";
+}
+
+/* Whether an entity tag list such as If-None-Match contains etag. Weak
+ * comparison ignores W/ prefixes, strong comparison never matches them. */
+static bool tw__etag_match(const char *list, const char *etag, bool weak) {
+  bool etag_weak = strncmp(etag, "W/", 2) == 0;
+  if (etag_weak && !weak) return false;
+  const char *opaque = etag_weak ? etag + 2 : etag;
+  size_t opaque_len = strlen(opaque);
+
+  const char *pos = list;
+  while (*pos == ' ' || *pos == '\t') pos++;
+  if (*pos == '*') return true;
+
+  while (*pos) {
+    while (*pos == ' ' || *pos == '\t' || *pos == ',') pos++;
+    if (!*pos) break;
+
+    bool tag_weak = false;
+    if (pos[0] == 'W' && pos[1] == '/') {
+      tag_weak = true;
+      pos += 2;
+    }
+    if (*pos != '"') return false;
+    const char *end = strchr(pos + 1, '"');
+    if (end == NULL) return false;
+
+    size_t len = (size_t)(end - pos) + 1;
+    if ((weak || !tag_weak) && len == opaque_len &&
+        memcmp(pos, opaque, len) == 0) {
+      return true;
+    }
+    pos = end + 1;
+  }
+  return false;
+}
+
+/* Evaluates the preconditions of RFC 9110 section 13.2.2 for a GET or
+ * HEAD request. Returns 0 to go on, or the status to answer with. */
+static int tw__static_preconditions(tw_request *req, const char *etag,
+                                    time_t mtime) {
+  time_t date;
+  const char *if_match = tw_request_get_header(req, "If-Match");
+  if (if_match != NULL) {
+    if (!tw__etag_match(if_match, etag, false)) return 412;
+  } else {
+    const char *since = tw_request_get_header(req, "If-Unmodified-Since");
+    if (since != NULL && tw_parse_http_date(since, &date) && mtime > date) {
+      return 412;
+    }
+  }
+
+  const char *if_none_match = tw_request_get_header(req, "If-None-Match");
+  if (if_none_match != NULL) {
+    if (tw__etag_match(if_none_match, etag, true)) return 304;
+  } else {
+    const char *since = tw_request_get_header(req, "If-Modified-Since");
+    if (since != NULL && tw_parse_http_date(since, &date) && mtime <= date) {
+      return 304;
+    }
+  }
+
+  return 0;
+}
+
+/* A Range header only applies while If-Range, if any, still matches. */
+static bool tw__static_if_range(tw_request *req, const char *etag,
+                                time_t mtime) {
+  const char *if_range = tw_request_get_header(req, "If-Range");
+  if (if_range == NULL) return true;
+
+  while (*if_range == ' ' || *if_range == '\t') if_range++;
+  if (*if_range == '"' || strncmp(if_range, "W/", 2) == 0) {
+    return tw__etag_match(if_range, etag, false);
+  }
+  time_t date;
+  return tw_parse_http_date(if_range, &date) && date == mtime;
+}
+
+typedef struct {
+  uint64_t first;
+  uint64_t last;
+} tw__byte_range;
+
+static bool tw__parse_u64(const char **pos, uint64_t *out) {
+  const char *p = *pos;
+  if (*p < '0' || *p > '9') return false;
+  uint64_t value = 0;
+  while (*p >= '0' && *p <= '9') {
+    if (value > (UINT64_MAX - (uint64_t)(*p - '0')) / 10) return false;
+    value = value * 10 + (uint64_t)(*p - '0');
+    p++;
+  }
+  *pos = p;
+  *out = value;
+  return true;
+}
+
+/* Parses a Range value against a representation of size bytes into the
+ * satisfiable ranges and returns their count. Returns -1 when the field
+ * is to be ignored: malformed, another unit, more than TW_MAX_RANGES
+ * ranges or overlapping ones. */
+static int tw__parse_ranges(const char *value, uint64_t size,
+                            tw__byte_range *ranges) {
+  if (strncasecmp(value, "bytes=", 6) != 0) return -1;
+  const char *pos = value + 6;
+
+  int specs = 0;
+  int count = 0;
+  while (1) {
+    while (*pos == ' ' || *pos == '\t' || *pos == ',') pos++;
+    if (*pos == '\0') break;
+    if (++specs > TW_MAX_RANGES) return -1;
+
+    uint64_t first = 0;
+    uint64_t last = UINT64_MAX;
+    bool suffix = *pos == '-';
+    if (!suffix && !tw__parse_u64(&pos, &first)) return -1;
+    if (*pos++ != '-') return -1;
+    if (*pos >= '0' && *pos <= '9') {
+      if (!tw__parse_u64(&pos, &last)) return -1;
+    } else if (suffix) {
+      return -1;
+    }
+    while (*pos == ' ' || *pos == '\t') pos++;
+    if (*pos != ',' && *pos != '\0') return -1;
+
+    if (suffix) {
+      /* the last "last" bytes */
+      if (last == 0 || size == 0) continue;
+      first = last >= size ? 0 : size - last;
+      last = size - 1;
+    } else {
+      if (last < first) return -1;
+      if (first >= size) continue;
+      if (last >= size) last = size - 1;
+    }
+
+    for (int i = 0; i < count; i++) {
+      if (first <= ranges[i].last && ranges[i].first <= last) return -1;
+    }
+    ranges[count].first = first;
+    ranges[count].last = last;
+    count++;
+  }
+
+  return specs > 0 ? count : -1;
+}
+
+static void tw__file_entry_clear(tw_file_cache_entry *entry) {
+  if (entry->file != NULL) fclose(entry->file);
+  free(entry->data);
+  free(entry->path);
+  entry->file = NULL;
+  entry->data = NULL;
+  entry->path = NULL;
+}
+
+/* Opens path and fills in what serving it takes. Files up to max_pinned
+ * bytes are read into memory and closed again. Returns 0, or the status
+ * to answer with when the file cannot be served. */
+static int tw__file_entry_load(tw_file_cache_entry *entry, const char *path,
+                               size_t max_pinned) {
+  struct stat st;
+#ifdef _WIN32
+  if (stat(path, &st) != 0) {
+    return errno == EACCES ? 403 : 404;
+  }
+  if ((st.st_mode & S_IFMT) != S_IFREG) return 404;
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    return errno == EACCES ? 403 : 404;
+  }
+#else
+  /* opening a FIFO would block until a writer shows up, so the type is
+   * checked before the file is read */
+  int fd = open(path, O_RDONLY | O_NONBLOCK);
+  if (fd < 0) {
+    return errno == EACCES ? 403 : 404;
+  }
+  if (fstat(fd, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG) {
+    close(fd);
+    return 404;
+  }
+  FILE *file = fdopen(fd, "rb");
+  if (file == NULL) {
+    close(fd);
+    return 500;
+  }
+#endif
+  if ((uint64_t)st.st_size >= SIZE_MAX) {
+    fclose(file);
+    return 500;
+  }
+
+  entry->file = file;
+  entry->data = NULL;
+  entry->size = (uint64_t)st.st_size;
+  entry->mtime = st.st_mtime;
+  entry->ino = (uint64_t)st.st_ino;
+  /* a new mtime or size is a new representation */
+  snprintf(entry->etag, sizeof(entry->etag), "\"%llx-%llx\"",
+           (unsigned long long)st.st_mtime, (unsigned long long)entry->size);
+  tw_http_date(st.st_mtime, entry->last_modified);
+  entry->content_type = tw_mime_type(path);
+
+  if (entry->size <= max_pinned) {
+    char *data = (char *)malloc((size_t)entry->size + 1);
+    if (data != NULL &&
+        fread(data, 1, (size_t)entry->size, file) == entry->size) {
+      entry->data = data;
+      fclose(file);
+      entry->file = NULL;
+    } else {
+      free(data);
+    }
+  }
+  return 0;
+}
+
+static bool tw__file_read(FILE *file, uint64_t offset, char *dst,
+                          size_t len) {
+#ifdef _WIN32
+  if (_fseeki64(file, (__int64)offset, SEEK_SET) != 0) return false;
+#else
+  if (fseeko(file, (off_t)offset, SEEK_SET) != 0) return false;
+#endif
+  return fread(dst, 1, len, file) == len;
+}
+
+static bool tw__file_entry_read(const tw_file_cache_entry *entry,
+                                uint64_t offset, char *dst, size_t len) {
+  if (entry->data != NULL) {
+    memcpy(dst, entry->data + offset, len);
+    return true;
+  }
+  return tw__file_read(entry->file, offset, dst, len);
+}
+
+/* Formats the head of part i of a multipart/byteranges body, or the end
+ * of the body for i == count. */
+static size_t tw__static_part_head(char *buf, size_t size,
+                                   const char *boundary,
+                                   const char *content_type,
+                                   const tw__byte_range *ranges, int count,
+                                   int i, uint64_t file_size) {
+  if (i == count) {
+    return (size_t)snprintf(buf, size, "\r\n--%s--\r\n", boundary);
+  }
+  return (size_t)snprintf(buf, size,
+                          "%s--%s\r\nContent-Type: %s\r\n"
+                          "Content-Range: bytes %llu-%llu/%llu\r\n\r\n",
+                          i == 0 ? "" : "\r\n", boundary, content_type,
+                          (unsigned long long)ranges[i].first,
+                          (unsigned long long)ranges[i].last,
+                          (unsigned long long)file_size);
+}
+
+/* A file body written as the socket takes it, its ranges one after the
+ * other with the part heads of a multipart/byteranges body between. The
+ * file is a duplicate, so the cache may close its own. */
+typedef struct tw__file_body {
+  FILE *file;
+  uint64_t size;
+  tw__byte_range ranges[TW_MAX_RANGES];
+  int count;
+  /* the range being written, whose head went out once started is set,
+   * and its next byte */
+  int index;
+  bool started;
+  uint64_t pos;
+  /* empty unless the body is multipart */
+  char boundary[72];
+  char content_type[128];
+  char chunk[TW_FILE_CHUNK_SIZE];
+} tw__file_body;
+
+static void tw__file_body_free(tw_conn *conn) {
+  if (conn->file_body == NULL) return;
+  fclose(conn->file_body->file);
+  free(conn->file_body);
+  tw__memory_release(conn, sizeof(tw__file_body));
+  conn->file_body = NULL;
+}
+
+/* Writes the file body of conn until the socket takes no more, queuing
+ * the rest of a part head that did not fit. Returns false when the file
+ * or the connection failed. */
+static bool tw__file_body_write(tw_conn *conn) {
+  tw__file_body *body = conn->file_body;
+  char *buf = body->chunk;
+  for (;;) {
+    size_t len = 0;
+    bool data = body->started;
+    if (!body->started) {
+      /* a range starts with its head, the body ends after the last */
+      body->started = true;
+      if (body->boundary[0] != '\0') {
+        len = tw__static_part_head(buf, sizeof(body->chunk),
+                                   body->boundary, body->content_type,
+                                   body->ranges, body->count, body->index,
+                                   body->size);
+      }
+      if (body->index < body->count) {
+        body->pos = body->ranges[body->index].first;
+      }
+    } else if (body->index == body->count) {
+      tw__file_body_free(conn);
+      return true;
+    } else {
+      uint64_t left = body->ranges[body->index].last + 1 - body->pos;
+      len = sizeof(body->chunk);
+      if (left < len) len = (size_t)left;
+      if (!tw__file_read(body->file, body->pos, buf, len)) {
+        tw_log(TW_ERROR, "Failed to read a file being sent");
+        return false;
+      }
+    }
+    if (len == 0) continue;
+
+    ssize_t n = tw__conn_write_now(conn, buf, len);
+    if (n < 0) {
+#ifdef _WIN32
+      if (WSAGetLastError() != WSAEWOULDBLOCK) return false;
+#else
+      if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+#endif
+      n = 0;
+    }
+    size_t sent = (size_t)n;
+    if (data) {
+      /* a short write reads the rest again the next time */
+      body->pos += sent;
+      if (body->pos > body->ranges[body->index].last) {
+        body->index++;
+        body->started = false;
+      }
+      if (sent < len) return true;
+    } else if (sent < len) {
+      if (!tw__conn_reserve_out(conn, len - sent)) return false;
+      memcpy(conn->out + conn->out_len, buf + sent, len - sent);
+      conn->out_len += len - sent;
+      return true;
+    }
+  }
+}
+
+TWDEF void tw_file_cache_init(tw_file_cache *cache) {
+  memset(cache, 0, sizeof(*cache));
+  cache->enabled = false;
+  cache->check_interval = TW_FILE_CACHE_CHECK_INTERVAL;
+  cache->max_pinned = TW_FILE_CACHE_MAX_PINNED;
+  cache->watch = false;
+  cache->inotify_fd = -1;
+  for (size_t i = 0; i < TW_FILE_CACHE_SIZE; i++) {
+    cache->entries[i].watch = -1;
+  }
+}
+
+static void tw__file_cache_evict(tw_file_cache *cache,
+                                 tw_file_cache_entry *entry) {
+#ifdef __linux__
+  /* two paths to the same file share the watch */
+  bool shared = false;
+  for (size_t i = 0; i < TW_FILE_CACHE_SIZE; i++) {
+    tw_file_cache_entry *other = &cache->entries[i];
+    if (other != entry && other->path != NULL &&
+        other->watch == entry->watch) {
+      shared = true;
+    }
+  }
+  if (entry->watch >= 0 && cache->inotify_fd >= 0 && !shared) {
+    inotify_rm_watch(cache->inotify_fd, entry->watch);
+  }
+#else
+  (void)cache;
+#endif
+  entry->watch = -1;
+  tw__file_entry_clear(entry);
+}
+
+TWDEF void tw_file_cache_free(tw_file_cache *cache) {
+  for (size_t i = 0; i < TW_FILE_CACHE_SIZE; i++) {
+    tw__file_cache_evict(cache, &cache->entries[i]);
+  }
+#ifdef __linux__
+  if (cache->inotify_fd >= 0) close(cache->inotify_fd);
+#endif
+  cache->inotify_fd = -1;
+}
+
+/* Evicts the entries whose files changed since the last call. */
+static void tw__file_cache_sync(tw_file_cache *cache) {
+#ifdef __linux__
+  if (cache->inotify_fd < 0) {
+    cache->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (cache->inotify_fd < 0) {
+      tw_log(TW_WARNING, "inotify_init1 failed: %s", strerror(errno));
+      cache->watch = false;
+    }
+    return;
+  }
+
+  union {
+    struct inotify_event align;
+    char buf[4096];
+  } events;
+  ssize_t len;
+  while ((len = read(cache->inotify_fd, events.buf, sizeof(events.buf))) >
+         0) {
+    for (ssize_t off = 0; off < len;) {
+      struct inotify_event *event = (struct inotify_event *)(events.buf + off);
+      for (size_t i = 0; i < TW_FILE_CACHE_SIZE; i++) {
+        tw_file_cache_entry *entry = &cache->entries[i];
+        if (entry->path != NULL && entry->watch == event->wd) {
+          tw__file_cache_evict(cache, entry);
+        }
+      }
+      off += (ssize_t)(sizeof(struct inotify_event) + event->len);
+    }
+  }
+#else
+  cache->watch = false;
+#endif
+}
+
+static tw_file_cache_entry *tw__file_cache_find(tw_file_cache *cache,
+                                                const char *path,
+                                                uint64_t hash) {
+  for (size_t i = 0; i < TW_FILE_CACHE_SIZE; i++) {
+    tw_file_cache_entry *entry = &cache->entries[i];
+    if (entry->path != NULL && entry->hash == hash &&
+        strcmp(entry->path, path) == 0) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+/* Whether the file at the path of entry is still the one it describes. */
+static bool tw__file_entry_current(tw_file_cache_entry *entry) {
+  struct stat st;
+  return stat(entry->path, &st) == 0 && st.st_mtime == entry->mtime &&
+         (uint64_t)st.st_size == entry->size &&
+         (uint64_t)st.st_ino == entry->ino;
+}
+
+TWDEF const tw_file_cache_entry *tw_file_cache_get(tw_file_cache *cache,
+                                                   const char *path,
+                                                   int *status) {
+  if (cache->watch) {
+    tw__file_cache_sync(cache);
+  }
+
+  size_t path_len = strlen(path);
+  uint64_t hash = tw__hash(path, path_len);
+  uint64_t now = tw__now_ms();
+  cache->clock++;
+
+  tw_file_cache_entry *entry = tw__file_cache_find(cache, path, hash);
+  if (entry != NULL) {
+    /* watched files are evicted as soon as they change */
+    bool trusted = entry->watch >= 0 ||
+                   now - entry->checked < (uint64_t)cache->check_interval;
+    if (trusted || tw__file_entry_current(entry)) {
+      if (!trusted) entry->checked = now;
+      entry->last_used = cache->clock;
+      return entry;
+    }
+    tw__file_cache_evict(cache, entry);
+  } else {
+    entry = &cache->entries[0];
+    for (size_t i = 0; i < TW_FILE_CACHE_SIZE; i++) {
+      tw_file_cache_entry *candidate = &cache->entries[i];
+      if (candidate->path == NULL) {
+        entry = candidate;
+        break;
+      }
+      if (candidate->last_used < entry->last_used) {
+        entry = candidate;
+      }
+    }
+    tw__file_cache_evict(cache, entry);
+  }
+
+  char *key = (char *)malloc(path_len + 1);
+  if (key == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for file cache entry");
+    *status = 500;
+    return NULL;
+  }
+  memcpy(key, path, path_len + 1);
+
+  *status = tw__file_entry_load(entry, path, cache->max_pinned);
+  if (*status != 0) {
+    free(key);
+    return NULL;
+  }
+  entry->path = key;
+  entry->hash = hash;
+  entry->checked = now;
+  entry->last_used = cache->clock;
+#ifdef __linux__
+  if (cache->watch && cache->inotify_fd >= 0) {
+    entry->watch = inotify_add_watch(
+        cache->inotify_fd, path,
+        IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+  }
+#endif
+  return entry;
+}
+
+/* Answers with status and no body, keeping the headers set so far. */
+static bool tw__static_status(tw_conn *conn, tw_response *res, int status) {
+  tw__response_release_body(res);
+  tw_response_set_status(res, status);
+  return tw_response_send(conn, res);
+}
+
+/* Derived from the validator, so the same file always gets the same. */
+static void tw__static_boundary(char *buf, size_t size,
+                                const tw_file_cache_entry *file) {
+  snprintf(buf, size, "tw-range-%.*s", (int)strlen(file->etag) - 2,
+           file->etag + 1);
+}
+
+/* Reads the ranges of a file into a multipart/byteranges body. */
+static bool tw__static_multipart(tw_response *res,
+                                 const tw_file_cache_entry *file,
+                                 const tw__byte_range *ranges, int count,
+                                 const char *content_type) {
+  char boundary[72];
+  tw__static_boundary(boundary, sizeof(boundary), file);
+
+  size_t part_max = strlen(boundary) + strlen(content_type) + 128;
+  size_t total = (size_t)count * part_max + strlen(boundary) + 8;
+  for (int i = 0; i < count; i++) {
+    total += (size_t)(ranges[i].last - ranges[i].first + 1);
+  }
+
+  char *body = (char *)malloc(total);
+  if (body == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for range response");
+    return false;
+  }
+
+  size_t offset = 0;
+  for (int i = 0; i <= count; i++) {
+    offset += tw__static_part_head(body + offset, total - offset, boundary,
+                                   content_type, ranges, count, i,
+                                   file->size);
+    if (i == count) break;
+    size_t len = (size_t)(ranges[i].last - ranges[i].first + 1);
+    if (!tw__file_entry_read(file, ranges[i].first, body + offset, len)) {
+      free(body);
+      return false;
+    }
+    offset += len;
+  }
+
+  char type[128];
+  snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s",
+           boundary);
+  tw_response_set_header(res, "Content-Type", type);
+  tw_response_take_body(res, body, offset, NULL);
+  return true;
+}
+
+/* Sends the head of res, then the ranges of a file that is not pinned as
+ * the socket takes them, as a multipart/byteranges body when boundary is
+ * set. */
+static bool tw__static_stream(tw_conn *conn, tw_response *res,
+                              const char *path,
+                              const tw_file_cache_entry *file,
+                              const tw__byte_range *ranges, int count,
+                              const char *boundary,
+                              const char *content_type) {
+  tw__file_body *body = (tw__file_body *)calloc(1, sizeof(*body));
+  FILE *copy = NULL;
+  if (body != NULL) {
+    /* the cache may close its own file before the body went out */
+#ifdef _WIN32
+    int fd = _dup(_fileno(file->file));
+    if (fd >= 0 && (copy = _fdopen(fd, "rb")) == NULL) _close(fd);
+#else
+    int fd = dup(fileno(file->file));
+    if (fd >= 0 && (copy = fdopen(fd, "rb")) == NULL) close(fd);
+#endif
+  }
+  if (copy == NULL) {
+    free(body);
+    tw_log(TW_ERROR, "Failed to open %s for sending", path);
+    return tw__static_status(conn, res, 500);
+  }
+
+  body->file = copy;
+  body->size = file->size;
+  memcpy(body->ranges, ranges, (size_t)count * sizeof(*ranges));
+  body->count = count;
+  uint64_t total = 0;
+  if (boundary != NULL) {
+    snprintf(body->boundary, sizeof(body->boundary), "%s", boundary);
+    snprintf(body->content_type, sizeof(body->content_type), "%s",
+             content_type);
+    for (int i = 0; i <= count; i++) {
+      total += tw__static_part_head(NULL, 0, body->boundary,
+                                    body->content_type, ranges, count, i,
+                                    file->size);
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    total += ranges[i].last - ranges[i].first + 1;
+  }
+
+  /* only the head goes out with the response, its length announced */
+  tw__response_release_body(res);
+  res->body_len = (size_t)total;
+  if (!tw_response_send(conn, res)) {
+    fclose(copy);
+    free(body);
+    return false;
+  }
+  tw__memory_charge(conn, sizeof(*body), true);
+  conn->file_body = body;
+  return tw__conn_flush(conn);
+}
+
+static bool tw__static_send(tw_conn *conn, tw_request *req, tw_response *res,
+                            const char *path,
+                            const tw_file_cache_entry *file) {
+  bool head = strcmp(req->method, "HEAD") == 0;
+  tw_response_set_header(res, "ETag", file->etag);
+  tw_response_set_header(res, "Last-Modified", file->last_modified);
+
+  int status = tw__static_preconditions(req, file->etag, file->mtime);
+  if (status != 0) {
+    return tw__static_status(conn, res, status);
+  }
+
+  const char *content_type = tw_map_get(&res->headers, "Content-Type");
+  if (content_type == NULL) {
+    content_type = file->content_type;
+    tw_response_set_header(res, "Content-Type", content_type);
+  }
+  tw_response_set_header(res, "Accept-Ranges", "bytes");
+
+  tw__byte_range ranges[TW_MAX_RANGES];
+  int count = -1;
+  const char *range = tw_request_get_header(req, "Range");
+  if (range != NULL && !head &&
+      tw__static_if_range(req, file->etag, file->mtime)) {
+    count = tw__parse_ranges(range, file->size, ranges);
+  }
+
+  if (count == 0) {
+    char content_range[48];
+    snprintf(content_range, sizeof(content_range), "bytes */%llu",
+             (unsigned long long)file->size);
+    tw_response_set_header(res, "Content-Range", content_range);
+    return tw__static_status(conn, res, 416);
+  }
+
+  /* files that are not pinned are read as the socket takes them, only
+   * one at a time per connection */
+  bool stream = file->data == NULL && conn->file_body == NULL;
+#ifdef TW_ENABLE_HTTP2
+  stream = stream && conn->h2 == NULL;
+#endif
+
+  if (count > 1) {
+    tw_response_set_status(res, 206);
+    if (stream) {
+      char boundary[72];
+      tw__static_boundary(boundary, sizeof(boundary), file);
+      char type[128];
+      snprintf(type, sizeof(type), "multipart/byteranges; boundary=%s",
+               boundary);
+      tw_response_set_header(res, "Content-Type", type);
+      return tw__static_stream(conn, res, path, file, ranges, count,
+                               boundary, content_type);
+    }
+    if (!tw__static_multipart(res, file, ranges, count, content_type)) {
+      return tw__static_status(conn, res, 500);
+    }
+    return tw_response_send(conn, res);
+  }
+
+  uint64_t first = 0;
+  size_t len = (size_t)file->size;
+  if (count == 1) {
+    first = ranges[0].first;
+    len = (size_t)(ranges[0].last - ranges[0].first + 1);
+    char content_range[80];
+    snprintf(content_range, sizeof(content_range), "bytes %llu-%llu/%llu",
+             (unsigned long long)ranges[0].first,
+             (unsigned long long)ranges[0].last,
+             (unsigned long long)file->size);
+    tw_response_set_header(res, "Content-Range", content_range);
+  }
+
+  tw_response_set_status(res, count == 1 ? 206 : 200);
+  if (stream && !head && len > 0) {
+    if (count != 1) {
+      ranges[0].first = 0;
+      ranges[0].last = file->size - 1;
+    }
+    return tw__static_stream(conn, res, path, file, ranges, 1, NULL, NULL);
+  }
+
+  tw__response_release_body(res);
+  if (head) {
+    res->body_len = len;
+  } else if (file->data != NULL) {
+    /* cached entries outlive the response */
+    tw_response_borrow_body(res, file->data + first, len);
+  } else {
+    char *dst = tw_response_reserve(res, len);
+    if (dst == NULL || !tw__file_entry_read(file, first, dst, len)) {
+      tw_log(TW_ERROR, "Failed to read %s", path);
+      return tw__static_status(conn, res, 500);
+    }
+    tw_response_commit(res, len);
+  }
+  return tw_response_send(conn, res);
+}
+
+TWDEF bool tw_response_send_file(tw_conn *conn, tw_request *req,
+                                 tw_response *res, const char *path) {
+  bool head = strcmp(req->method, "HEAD") == 0;
+  if (!head && strcmp(req->method, "GET") != 0) {
+    tw_response_set_header(res, "Allow", "GET, HEAD");
+    return tw__static_status(conn, res, 405);
+  }
+
+  tw_server *server = conn->server;
+  if (server != NULL && server->file_cache.enabled) {
+    int status = 0;
+    const tw_file_cache_entry *file =
+        tw_file_cache_get(&server->file_cache, path, &status);
+    if (file == NULL) {
+      return tw__static_status(conn, res, status);
+    }
+    return tw__static_send(conn, req, res, path, file);
+  }
+
+  tw_file_cache_entry file;
+  memset(&file, 0, sizeof(file));
+  int status = tw__file_entry_load(&file, path, 0);
+  if (status != 0) {
+    return tw__static_status(conn, res, status);
+  }
+  bool ok = tw__static_send(conn, req, res, path, &file);
+  tw__file_entry_clear(&file);
+  return ok;
+}
+
+/* Turns a request path into a path below root, resolving "." and ".."
+ * segments and percent-encoding. Fails when the path would leave root. */
+static bool tw__static_resolve(const char *root, const char *target,
+                               size_t target_len, char *out, size_t size,
+                               size_t *root_len_out) {
+  char decoded[sizeof(((tw_request *)0)->path)];
+  if (target_len >= sizeof(decoded)) return false;
+  size_t len = tw_percent_decode(decoded, target, target_len, false);
+  if (memchr(decoded, '\0', len) != NULL) return false;
+
+  size_t root_len = strlen(root);
+  while (root_len > 1 && root[root_len - 1] == '/') root_len--;
+  if (root_len + len + 2 > size) return false;
+  memcpy(out, root, root_len);
+  *root_len_out = root_len;
+
+  size_t end = root_len;
+  size_t pos = 0;
+  while (pos < len) {
+    while (pos < len && decoded[pos] == '/') pos++;
+    size_t seg = pos;
+    while (pos < len && decoded[pos] != '/') pos++;
+    size_t seg_len = pos - seg;
+
+    if (seg_len == 0 || (seg_len == 1 && decoded[seg] == '.')) continue;
+    if (memchr(decoded + seg, '\\', seg_len) != NULL) return false;
+    if (seg_len == 2 && decoded[seg] == '.' && decoded[seg + 1] == '.') {
+      if (end == root_len) return false;
+      while (end > root_len && out[end - 1] != '/') end--;
+      end--;
+      continue;
+    }
+    out[end++] = '/';
+    memcpy(out + end, decoded + seg, seg_len);
+    end += seg_len;
+  }
+
+  out[end] = '\0';
+  return true;
+}
+
+/* Percent-encodes a resolved directory path for a Location header,
+ * between single slashes. buf holds three times the path and 3 bytes. */
+static size_t tw__static_location(char *buf, const char *path) {
+  static const char hex[] = "0123456789ABCDEF";
+  size_t len = 0;
+  if (path[0] != '/') buf[len++] = '/';
+  for (const unsigned char *p = (const unsigned char *)path; *p; p++) {
+    if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') ||
+        (*p >= '0' && *p <= '9') || strchr("-._~/!$&'()*+,;=:@", *p)) {
+      buf[len++] = (char)*p;
+    } else {
+      buf[len++] = '%';
+      buf[len++] = hex[*p >> 4];
+      buf[len++] = hex[*p & 15];
+    }
+  }
+  if (buf[len - 1] != '/') buf[len++] = '/';
+  buf[len] = '\0';
+  return len;
+}
+
+TWDEF bool tw_serve_static(tw_conn *conn, tw_request *req, tw_response *res,
+                           const char *root) {
+  char path[2048];
+  size_t root_len = 0;
+  if (!tw__static_resolve(root, req->path, req->path_len, path,
+                          sizeof(path) - strlen("/index.html"), &root_len)) {
+    return tw__static_status(conn, res, 404);
+  }
+
+  /* a cached path is known to be a file */
+  tw_server *server = conn->server;
+  bool cached = server != NULL && server->file_cache.enabled &&
+                tw__file_cache_find(&server->file_cache, path,
+                                    tw__hash(path, strlen(path))) != NULL;
+
+  struct stat st;
+  if (!cached && stat(path, &st) == 0 && (st.st_mode & S_IFMT) == S_IFDIR) {
+    if (req->path_len == 0 || req->path[req->path_len - 1] != '/') {
+      /* relative links inside the directory need the slash, the location
+       * comes from the resolved path so that it cannot name another host */
+      char location[sizeof(path) * 3 + sizeof(req->query) + 4];
+      size_t len = tw__static_location(location, path + root_len);
+      snprintf(location + len, sizeof(location) - len, "%s%s",
+               req->query_len > 0 ? "?" : "", req->query);
+      tw_response_set_header(res, "Location", location);
+      return tw__static_status(conn, res, 301);
+    }
+    strcat(path, "/index.html");
+  }
+
+  return tw_response_send_file(conn, req, res, path);
+}
+
+#ifdef TW_ENABLE_COMPRESSION
+TWDEF void tw_compression_config_init(tw_compression_config *config) {
+  config->enabled = false;
+  config->level = Z_DEFAULT_COMPRESSION;
+  config->min_size = TW_COMPRESSION_MIN_SIZE;
+  config->content_types = NULL;
+  config->cache = true;
+}
+
+TWDEF bool tw_compress(tw_encoding encoding, int level, const char *src,
+                       size_t src_len, char **out, size_t *out_len) {
+  /* 15 selects the zlib wrapper used by "deflate", +16 selects gzip */
+  int window_bits = encoding == TW_ENCODING_GZIP ? 15 + 16 : 15;
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, level, Z_DEFLATED, window_bits, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    tw_log(TW_ERROR, "deflateInit2 failed");
+    return false;
+  }
+
+  /* gzip adds a larger header and trailer than the zlib wrapper */
+  size_t capacity = deflateBound(&stream, (uLong)src_len) + 18;
+  char *buf = (char *)malloc(capacity);
+  if (buf == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for compressed body");
+    deflateEnd(&stream);
+    return false;
+  }
+
+  stream.next_in = (Bytef *)src;
+  stream.avail_in = (uInt)src_len;
+  stream.next_out = (Bytef *)buf;
+  stream.avail_out = (uInt)capacity;
+
+  if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+    tw_log(TW_ERROR, "deflate failed");
+    deflateEnd(&stream);
+    free(buf);
+    return false;
+  }
+
+  *out = buf;
+  *out_len = stream.total_out;
+  deflateEnd(&stream);
+  return true;
+}
+
+TWDEF void tw_compression_cache_init(tw_compression_cache *cache) {
+  memset(cache, 0, sizeof(*cache));
+}
+
+TWDEF void tw_compression_cache_free(tw_compression_cache *cache) {
+  for (size_t i = 0; i < TW_COMPRESSION_CACHE_SIZE; i++) {
+    free(cache->entries[i].body);
+    free(cache->entries[i].data);
+  }
+  tw_compression_cache_init(cache);
+}
+
+TWDEF const tw_compression_cache_entry *tw_compression_cache_get(
+    tw_compression_cache *cache, tw_encoding encoding, const char *body,
+    size_t body_len, int level) {
+  uint64_t hash = tw__hash(body, body_len);
+  cache->clock++;
+
+  tw_compression_cache_entry *victim = &cache->entries[0];
+  for (size_t i = 0; i < TW_COMPRESSION_CACHE_SIZE; i++) {
+    tw_compression_cache_entry *entry = &cache->entries[i];
+    if (entry->data != NULL && entry->hash == hash &&
+        entry->body_len == body_len && entry->encoding == encoding &&
+        entry->level == level && memcmp(entry->body, body, body_len) == 0) {
+      entry->last_used = cache->clock;
+      return entry;
+    }
+
+    if (entry->data == NULL) {
+      if (victim->data != NULL) victim = entry;
+    } else if (victim->data != NULL && entry->last_used < victim->last_used) {
+      victim = entry;
+    }
+  }
+
+  char *copy = (char *)malloc(body_len > 0 ? body_len : 1);
+  if (copy == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for compression cache");
+    return NULL;
+  }
+  memcpy(copy, body, body_len);
+  char *data;
+  size_t data_len;
+  if (!tw_compress(encoding, level, body, body_len, &data, &data_len)) {
+    free(copy);
+    return NULL;
+  }
+
+  free(victim->body);
+  free(victim->data);
+  victim->hash = hash;
+  victim->body = copy;
+  victim->body_len = body_len;
+  victim->encoding = encoding;
+  victim->level = level;
+  victim->data = data;
+  victim->data_len = data_len;
+  victim->last_used = cache->clock;
+  return victim;
+}
+#endif
+
+#ifdef TW_ENABLE_HTTP2
+
+/* RFC 7541 Appendix A */
+static const char *const tw__hpack_static_table[61][2] = {
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* RFC 7541 Appendix B, as a canonical code: codes of the same length are
+ * consecutive, so a code of length n decodes to
+ * symbols[offset[n] + code - first[n]] when it is below first[n] + count[n]. */
+static const uint32_t tw__hpack_huffman_first[31] = {
+    0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000, 0x00000000,
+    0x00000014, 0x0000005c, 0x000000f8, 0x00000000, 0x000003f8, 0x000007fa,
+    0x00000ffa, 0x00001ff8, 0x00003ffc, 0x00007ffc, 0x00000000, 0x00000000,
+    0x00000000, 0x0007fff0, 0x000fffe6, 0x001fffdc, 0x003fffd2, 0x007fffd8,
+    0x00ffffea, 0x01ffffec, 0x03ffffe0, 0x07ffffde, 0x0fffffe2, 0x00000000,
+    0x3ffffffc
+};
+
+static const uint8_t tw__hpack_huffman_count[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3,
+    0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4
+};
+
+static const uint16_t tw__hpack_huffman_offset[31] = {
+    0, 0, 0, 0, 0, 0, 10, 36, 68, 0, 74, 79,
+    82, 84, 90, 92, 0, 0, 0, 95, 98, 106, 119, 145,
+    174, 186, 190, 205, 224, 0, 253
+};
+
+static const uint16_t tw__hpack_huffman_symbols[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256
+};
+TWDEF bool tw_hpack_huffman_decode(const uint8_t *src, size_t len, char *dst,
+                                   size_t *dst_len) {
+  uint32_t code = 0;
+  int code_len = 0;
+  size_t out = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    for (int bit = 7; bit >= 0; bit--) {
+      code = (code << 1) | ((src[i] >> bit) & 1);
+      code_len++;
+      if (code_len > 30) {
+        return false;
+      }
+
+      uint32_t first = tw__hpack_huffman_first[code_len];
+      if (code >= first && code - first < tw__hpack_huffman_count[code_len]) {
+        uint16_t sym = tw__hpack_huffman_symbols
+            [tw__hpack_huffman_offset[code_len] + (code - first)];
+        if (sym == 256) {
+          /* EOS must not appear in the encoded string */
+          return false;
+        }
+        dst[out++] = (char)sym;
+        code = 0;
+        code_len = 0;
+      }
+    }
+  }
+
+  /* padding is at most 7 bits, all set to the most significant EOS bits */
+  if (code_len > 7 || code != (1u << code_len) - 1) {
+    return false;
+  }
+
+  *dst_len = out;
+  return true;
+}
+
+TWDEF bool tw_hpack_table_init(tw_hpack_table *table, size_t limit) {
+  /* every entry accounts for at least 32 bytes */
+  table->capacity = limit / 32 + 1;
+  table->entries =
+      (tw_hpack_entry *)calloc(table->capacity, sizeof(tw_hpack_entry));
+  if (table->entries == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for tw_hpack_table");
+    return false;
+  }
+
+  table->head = 0;
+  table->count = 0;
+  table->size = 0;
+  table->max_size = limit;
+  table->limit = limit;
+  return true;
+}
+
+static void tw__hpack_table_evict(tw_hpack_table *table) {
+  tw_hpack_entry *entry = &table->entries[table->head];
+  table->size -= entry->size;
+  free(entry->name);
+  free(entry->value);
+  entry->name = NULL;
+  entry->value = NULL;
+  table->head = (table->head + 1) % table->capacity;
+  table->count--;
+}
+
+TWDEF void tw_hpack_table_free(tw_hpack_table *table) {
+  while (table->count > 0) {
+    tw__hpack_table_evict(table);
+  }
+  free(table->entries);
+  table->entries = NULL;
+  table->capacity = 0;
+}
+
+static void tw__hpack_table_resize(tw_hpack_table *table, size_t max_size) {
+  table->max_size = max_size;
+  while (table->count > 0 && table->size > table->max_size) {
+    tw__hpack_table_evict(table);
+  }
+}
+
+static bool tw__hpack_table_add(tw_hpack_table *table, const char *name,
+                                const char *value) {
+  size_t size = strlen(name) + strlen(value) + 32;
+
+  /* copy first, the name may refer to an entry that is about to be evicted */
+  char *name_dup = NULL;
+  char *value_dup = NULL;
+  if (size <= table->max_size) {
+    name_dup = strdup(name);
+    value_dup = strdup(value);
+    if (name_dup == NULL || value_dup == NULL) {
+      tw_log(TW_ERROR, "Failed to allocate memory for tw_hpack_entry");
+      free(name_dup);
+      free(value_dup);
+      return false;
+    }
+  }
+
+  while (table->count > 0 && table->size + size > table->max_size) {
+    tw__hpack_table_evict(table);
+  }
+
+  if (name_dup == NULL) {
+    /* an entry larger than the table empties it and is not added */
+    return true;
+  }
+
+  tw_hpack_entry *entry =
+      &table->entries[(table->head + table->count) % table->capacity];
+  entry->name = name_dup;
+  entry->value = value_dup;
+  entry->size = size;
+  table->size += size;
+  table->count++;
+  return true;
+}
+
+static bool tw__hpack_lookup(tw_hpack_table *table, uint32_t index,
+                             const char **name, const char **value) {
+  if (index == 0) {
+    return false;
+  }
+
+  if (index <= 61) {
+    *name = tw__hpack_static_table[index - 1][0];
+    *value = tw__hpack_static_table[index - 1][1];
+    return true;
+  }
+
+  /* index 62 is the newest dynamic entry */
+  size_t dynamic = index - 62;
+  if (dynamic >= table->count) {
+    return false;
+  }
+
+  tw_hpack_entry *entry =
+      &table->entries[(table->head + table->count - 1 - dynamic) %
+                      table->capacity];
+  *name = entry->name;
+  *value = entry->value;
+  return true;
+}
+
+static bool tw__hpack_decode_int(const uint8_t **pos, const uint8_t *end,
+                                 int prefix_bits, uint32_t *out) {
+  if (*pos >= end) {
+    return false;
+  }
+
+  uint32_t max = (1u << prefix_bits) - 1;
+  uint32_t value = **pos & max;
+  (*pos)++;
+  if (value < max) {
+    *out = value;
+    return true;
+  }
+
+  for (int shift = 0; *pos < end && shift <= 21; shift += 7) {
+    uint8_t b = **pos;
+    (*pos)++;
+    value += (uint32_t)(b & 0x7f) << shift;
+    if (!(b & 0x80)) {
+      *out = value;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static char *tw__hpack_decode_string(const uint8_t **pos, const uint8_t *end) {
+  if (*pos >= end) {
+    return NULL;
+  }
+
+  bool huffman = (**pos & 0x80) != 0;
+  uint32_t len;
+  if (!tw__hpack_decode_int(pos, end, 7, &len) ||
+      len > (size_t)(end - *pos)) {
+    return NULL;
+  }
+
+  /* the shortest huffman code is 5 bits */
+  size_t cap = huffman ? (size_t)len * 8 / 5 + 1 : (size_t)len + 1;
+  char *str = (char *)malloc(cap);
+  if (str == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for hpack string");
+    return NULL;
+  }
+
+  size_t str_len = len;
+  if (huffman) {
+    if (!tw_hpack_huffman_decode(*pos, len, str, &str_len)) {
+      free(str);
+      return NULL;
+    }
+  } else {
+    memcpy(str, *pos, len);
+  }
+  str[str_len] = '\0';
+  *pos += len;
+
+  if (strlen(str) != str_len) {
+    /* embedded NUL */
+    free(str);
+    return NULL;
+  }
+
+  return str;
+}
+
+static bool tw__hpack_emit(tw_map *headers, const char *name,
+                           const char *value) {
+  if (strpbrk(value, "\r\n") != NULL) {
+    return false;
+  }
+
+  const char *existing = tw_map_get(headers, name);
+  if (existing == NULL) {
+    return tw_map_set(headers, name, value);
+  }
+
+  /* repeated fields are folded, cookies use their own separator */
+  const char *sep = strcmp(name, "cookie") == 0 ? "; " : ", ";
+  size_t len = strlen(existing) + strlen(sep) + strlen(value) + 1;
+  char *joined = (char *)malloc(len);
+  if (joined == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for header value");
+    return false;
+  }
+  snprintf(joined, len, "%s%s%s", existing, sep, value);
+  bool ok = tw_map_set(headers, name, joined);
+  free(joined);
+  return ok;
+}
+
+TWDEF bool tw_hpack_decode(tw_hpack_table *table, const uint8_t *src,
+                           size_t len, tw_map *headers) {
+  const uint8_t *pos = src;
+  const uint8_t *end = src + len;
+  size_t list_size = 0;
+  bool header_seen = false;
+
+  while (pos < end) {
+    uint8_t b = *pos;
+    const char *name = NULL;
+    const char *value = NULL;
+    char *name_buf = NULL;
+    char *value_buf = NULL;
+    bool index = false;
+    uint32_t idx;
+
+    if (b & 0x80) {
+      /* indexed header field */
+      if (!tw__hpack_decode_int(&pos, end, 7, &idx) ||
+          !tw__hpack_lookup(table, idx, &name, &value)) {
+        return false;
+      }
+    } else if ((b & 0xe0) == 0x20) {
+      /* dynamic table size update, only allowed before the first field */
+      if (header_seen || !tw__hpack_decode_int(&pos, end, 5, &idx) ||
+          idx > table->limit) {
+        return false;
+      }
+      tw__hpack_table_resize(table, idx);
+      continue;
+    } else {
+      /* literal, with incremental indexing (01), without indexing (0000) or
+       * never indexed (0001) */
+      index = (b & 0xc0) == 0x40;
+      if (!tw__hpack_decode_int(&pos, end, index ? 6 : 4, &idx)) {
+        return false;
+      }
+
+      if (idx == 0) {
+        name_buf = tw__hpack_decode_string(&pos, end);
+        if (name_buf == NULL) {
+          return false;
+        }
+        for (char *c = name_buf; *c; c++) {
+          if (*c >= 'A' && *c <= 'Z') *c = (char)(*c - 'A' + 'a');
+        }
+        name = name_buf;
+      } else if (!tw__hpack_lookup(table, idx, &name, &value)) {
+        return false;
+      }
+
+      value_buf = tw__hpack_decode_string(&pos, end);
+      if (value_buf == NULL) {
+        free(name_buf);
+        return false;
+      }
+      value = value_buf;
+    }
+
+    header_seen = true;
+    list_size += strlen(name) + strlen(value) + 32;
+
+    bool ok = list_size <= TW_H2_MAX_HEADER_LIST &&
+              tw__hpack_emit(headers, name, value);
+    if (ok && index) {
+      ok = tw__hpack_table_add(table, name, value);
+    }
+
+    free(name_buf);
+    free(value_buf);
+    if (!ok) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+typedef enum {
+  TW_H2_DATA = 0x0,
+  TW_H2_HEADERS = 0x1,
+  TW_H2_PRIORITY = 0x2,
+  TW_H2_RST_STREAM = 0x3,
+  TW_H2_SETTINGS = 0x4,
+  TW_H2_PUSH_PROMISE = 0x5,
+  TW_H2_PING = 0x6,
+  TW_H2_GOAWAY = 0x7,
+  TW_H2_WINDOW_UPDATE = 0x8,
+  TW_H2_CONTINUATION = 0x9
+} tw_h2_frame_type;
+
+typedef enum {
+  TW_H2_FLAG_END_STREAM = 0x1,
+  TW_H2_FLAG_ACK = 0x1,
+  TW_H2_FLAG_END_HEADERS = 0x4,
+  TW_H2_FLAG_PADDED = 0x8,
+  TW_H2_FLAG_PRIORITY = 0x20
+} tw_h2_frame_flag;
+
+typedef enum {
+  TW_H2_NO_ERROR = 0x0,
+  TW_H2_PROTOCOL_ERROR = 0x1,
+  TW_H2_INTERNAL_ERROR = 0x2,
+  TW_H2_FLOW_CONTROL_ERROR = 0x3,
+  TW_H2_STREAM_CLOSED = 0x5,
+  TW_H2_FRAME_SIZE_ERROR = 0x6,
+  TW_H2_REFUSED_STREAM = 0x7,
+  TW_H2_CANCEL = 0x8,
+  TW_H2_COMPRESSION_ERROR = 0x9,
+  TW_H2_ENHANCE_YOUR_CALM = 0xb
+} tw_h2_error;
+
+#define TW_H2_MAX_WINDOW 0x7fffffff
+
+static const char tw__h2_preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static uint32_t tw__h2_get32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static void tw__h2_put32(uint8_t *p, uint32_t value) {
+  p[0] = (uint8_t)(value >> 24);
+  p[1] = (uint8_t)(value >> 16);
+  p[2] = (uint8_t)(value >> 8);
+  p[3] = (uint8_t)value;
+}
+
+static bool tw__h2_buf_append(char **buf, size_t *len, size_t *cap,
+                              const void *data, size_t data_len) {
+  if (*len + data_len > *cap) {
+    size_t new_cap = *cap ? *cap : 256;
+    while (new_cap < *len + data_len) new_cap *= 2;
+    char *new_buf = (char *)realloc(*buf, new_cap);
+    if (new_buf == NULL) {
+      tw_log(TW_ERROR, "Failed to allocate memory for http2 buffer");
+      return false;
+    }
+    *buf = new_buf;
+    *cap = new_cap;
+  }
+
+  memcpy(*buf + *len, data, data_len);
+  *len += data_len;
+  return true;
+}
+
+static bool tw__h2_frame(tw_h2_session *s, uint8_t type, uint8_t flags,
+                         uint32_t stream_id, const void *payload, size_t len) {
+  if (s->out_off > 0 && s->out_off == s->out_len) {
+    s->out_off = 0;
+    s->out_len = 0;
+  }
+
+  uint8_t header[9];
+  header[0] = (uint8_t)(len >> 16);
+  header[1] = (uint8_t)(len >> 8);
+  header[2] = (uint8_t)len;
+  header[3] = type;
+  header[4] = flags;
+  tw__h2_put32(header + 5, stream_id & 0x7fffffff);
+
+  if (type == TW_H2_PING || type == TW_H2_SETTINGS ||
+      type == TW_H2_RST_STREAM) {
+    s->control_queued += 9 + len;
+  }
+  return tw__h2_buf_append(&s->out, &s->out_len, &s->out_cap, header, 9) &&
+         (len == 0 ||
+          tw__h2_buf_append(&s->out, &s->out_len, &s->out_cap, payload, len));
+}
+
+static void tw__h2_rst_stream(tw_h2_session *s, uint32_t stream_id,
+                              tw_h2_error code) {
+  uint8_t payload[4];
+  tw__h2_put32(payload, code);
+  tw__h2_frame(s, TW_H2_RST_STREAM, 0, stream_id, payload, 4);
+}
+
+static void tw__h2_window_update(tw_h2_session *s, uint32_t stream_id,
+                                 uint32_t increment) {
+  uint8_t payload[4];
+  tw__h2_put32(payload, increment);
+  tw__h2_frame(s, TW_H2_WINDOW_UPDATE, 0, stream_id, payload, 4);
+}
+
+static tw_h2_stream *tw__h2_stream_find(tw_h2_session *s, uint32_t id) {
+  for (size_t i = 0; i < TW_H2_MAX_STREAMS; i++) {
+    if (s->streams[i].id == id) {
+      return &s->streams[i];
+    }
+  }
+  return NULL;
+}
+
+static tw_h2_stream *tw__h2_stream_open(tw_h2_session *s, uint32_t id) {
+  tw_h2_stream *stream = tw__h2_stream_find(s, 0);
+  if (stream == NULL || !tw_map_init(&stream->headers)) {
+    return NULL;
+  }
+
+  stream->id = id;
+  stream->state = TW_H2_STREAM_IDLE;
+  stream->send_window = s->initial_window_size;
+  stream->recv_window = TW_H2_WINDOW_SIZE;
+  return stream;
+}
+
+static void tw__h2_stream_close(tw_h2_stream *stream) {
+  if (stream->headers.keys != NULL) {
+    tw_map_free(&stream->headers);
+  }
+  free(stream->body);
+  free(stream->pending);
+  memset(stream, 0, sizeof(*stream));
+}
+
+static void tw__h2_goaway(tw_h2_session *s, tw_h2_error code) {
+  uint8_t payload[8];
+  tw__h2_put32(payload, s->last_stream_id);
+  tw__h2_put32(payload + 4, code);
+  tw__h2_frame(s, TW_H2_GOAWAY, 0, 0, payload, 8);
+
+  for (size_t i = 0; i < TW_H2_MAX_STREAMS; i++) {
+    tw__h2_stream_close(&s->streams[i]);
+  }
+  s->closing = true;
+}
+
+/* Sends GOAWAY without an error; streams opened so far are still served
+ * and any later ones are refused. */
+static void tw__h2_shutdown(tw_h2_session *s) {
+  if (s->closing || s->going_away) return;
+
+  uint8_t payload[8];
+  tw__h2_put32(payload, s->last_stream_id);
+  tw__h2_put32(payload + 4, TW_H2_NO_ERROR);
+  tw__h2_frame(s, TW_H2_GOAWAY, 0, 0, payload, 8);
+  s->going_away = true;
+}
+
+static tw_h2_session *tw__h2_session_new(void) {
+  tw_h2_session *s = (tw_h2_session *)calloc(1, sizeof(tw_h2_session));
+  if (s == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for tw_h2_session");
+    return NULL;
+  }
+
+  if (!tw_hpack_table_init(&s->decoder, TW_H2_HEADER_TABLE_SIZE)) {
+    free(s);
+    return NULL;
+  }
+
+  s->max_frame_size = 16384;
+  s->initial_window_size = 65535;
+  s->send_window = 65535;
+  s->recv_window = TW_H2_WINDOW_SIZE;
+
+  /* the server connection preface */
+  uint8_t settings[18];
+  const uint32_t values[3][2] = {{0x3, TW_H2_MAX_STREAMS},
+                                 {0x4, TW_H2_WINDOW_SIZE},
+                                 {0x6, TW_H2_MAX_HEADER_LIST}};
+  for (size_t i = 0; i < 3; i++) {
+    settings[i * 6] = (uint8_t)(values[i][0] >> 8);
+    settings[i * 6 + 1] = (uint8_t)values[i][0];
+    tw__h2_put32(settings + i * 6 + 2, values[i][1]);
+  }
+  tw__h2_frame(s, TW_H2_SETTINGS, 0, 0, settings, sizeof(settings));
+
+  /* the connection window always starts at 65535 */
+  if (TW_H2_WINDOW_SIZE > 65535) {
+    tw__h2_window_update(s, 0, TW_H2_WINDOW_SIZE - 65535);
+  }
+
+  return s;
+}
+
+static size_t tw__h2_memory(tw_h2_session *s) {
+  size_t total = sizeof(*s) + s->out_cap + s->header_block_len +
+                 s->decoder.size + s->decoder.capacity * sizeof(tw_hpack_entry);
+  for (size_t i = 0; i < TW_H2_MAX_STREAMS; i++) {
+    const tw_h2_stream *stream = &s->streams[i];
+    if (stream->id != 0) {
+      total += stream->body_cap + stream->pending_len;
+    }
+  }
+  return total;
+}
+
+static void tw__h2_session_free(tw_h2_session *s) {
+  for (size_t i = 0; i < TW_H2_MAX_STREAMS; i++) {
+    tw__h2_stream_close(&s->streams[i]);
+  }
+  tw_hpack_table_free(&s->decoder);
+  free(s->header_block);
+  free(s->out);
+  free(s);
+}
+
+static bool tw__h2_flush(tw_conn *conn, tw_h2_session *s) {
+  while (s->out_off < s->out_len) {
+    ssize_t n =
+        tw_conn_write(conn, s->out + s->out_off, s->out_len - s->out_off);
+    if (n < 0) {
+#ifdef _WIN32
+      return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+    }
+    s->out_off += (size_t)n;
+  }
+
+  s->out_off = 0;
+  s->out_len = 0;
+  s->control_queued = 0;
+  return true;
+}
+
+static bool tw__h2_has_pending(tw_h2_session *s) {
+  for (size_t i = 0; i < TW_H2_MAX_STREAMS; i++) {
+    if (s->streams[i].pending != NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool tw__h2_has_streams(tw_h2_session *s) {
+  for (size_t i = 0; i < TW_H2_MAX_STREAMS; i++) {
+    if (s->streams[i].id != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Sends as much of `data` as the flow control windows allow, the last frame
+ * ends the stream. Returns the number of bytes sent. */
+static size_t tw__h2_write_data(tw_h2_session *s, tw_h2_stream *stream,
+                                const char *data, size_t len) {
+  size_t sent = 0;
+  while (sent < len) {
+    int64_t n = (int64_t)(len - sent);
+    if (n > (int64_t)s->max_frame_size) n = s->max_frame_size;
+    if (n > stream->send_window) n = stream->send_window;
+    if (n > s->send_window) n = s->send_window;
+    if (n <= 0) {
+      break;
+    }
+
+    uint8_t flags = sent + (size_t)n == len ? TW_H2_FLAG_END_STREAM : 0;
+    if (!tw__h2_frame(s, TW_H2_DATA, flags, stream->id, data + sent,
+                      (size_t)n)) {
+      break;
+    }
+
+    stream->send_window -= n;
+    s->send_window -= n;
+    sent += (size_t)n;
+  }
+
+  return sent;
+}
+
+static void tw__h2_resume(tw_h2_session *s) {
+  for (size_t i = 0; i < TW_H2_MAX_STREAMS; i++) {
+    tw_h2_stream *stream = &s->streams[i];
+    if (stream->pending == NULL) {
+      continue;
+    }
+
+    stream->pending_off +=
+        tw__h2_write_data(s, stream, stream->pending + stream->pending_off,
+                          stream->pending_len - stream->pending_off);
+    if (stream->pending_off == stream->pending_len) {
+      tw__h2_stream_close(stream);
+    }
+  }
+}
+
+static bool tw__hpack_encode_int(char **buf, size_t *len, size_t *cap,
+                                 uint8_t first, int prefix_bits,
+                                 uint32_t value) {
+  uint8_t out[6];
+  size_t n = 0;
+  uint32_t max = (1u << prefix_bits) - 1;
+
+  if (value < max) {
+    out[n++] = first | (uint8_t)value;
+  } else {
+    out[n++] = first | (uint8_t)max;
+    value -= max;
+    while (value >= 0x80) {
+      out[n++] = (uint8_t)(value & 0x7f) | 0x80;
+      value >>= 7;
+    }
+    out[n++] = (uint8_t)value;
+  }
+
+  return tw__h2_buf_append(buf, len, cap, out, n);
+}
+
+static bool tw__hpack_encode_string(char **buf, size_t *len, size_t *cap,
+                                    const char *str, size_t str_len) {
+  return tw__hpack_encode_int(buf, len, cap, 0x00, 7, (uint32_t)str_len) &&
+         tw__h2_buf_append(buf, len, cap, str, str_len);
+}
+
+/* Encodes the response header block. Fields are sent as literals without
+ * indexing so the encoder keeps no dynamic table state. */
+static bool tw__h2_encode_headers(tw_response *res, size_t body_len,
+                                  char **buf, size_t *len, size_t *cap) {
+  static const int indexed_status[] = {200, 204, 206, 304, 400, 404, 500};
+
+  bool ok = true;
+  bool indexed = false;
+  for (size_t i = 0; i < 7; i++) {
+    if (res->status == indexed_status[i]) {
+      ok = tw__hpack_encode_int(buf, len, cap, 0x80, 7, (uint32_t)(8 + i));
+      indexed = true;
+      break;
+    }
+  }
+
+  char value[32];
+  if (!indexed) {
+    int n = snprintf(value, sizeof(value), "%d", res->status);
+    ok = tw__hpack_encode_int(buf, len, cap, 0x00, 4, 8) &&
+         tw__hpack_encode_string(buf, len, cap, value, (size_t)n);
+  }
+
+  if (tw__status_has_body(res->status)) {
+    int n = snprintf(value, sizeof(value), "%zu", body_len);
+    ok = ok && tw__hpack_encode_int(buf, len, cap, 0x00, 4, 28) &&
+         tw__hpack_encode_string(buf, len, cap, value, (size_t)n);
+  }
+
+  static const char *const hop_by_hop[] = {
+      "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+      "upgrade",    "content-length"};
+
+  for (size_t i = 0; ok && i < res->headers.size; i++) {
+    char name[TW_MAX_HEADER_NAME];
+    size_t name_len = strlen(res->headers.keys[i]);
+    for (size_t j = 0; j <= name_len; j++) {
+      char c = res->headers.keys[i][j];
+      name[j] = (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c;
+    }
+
+    bool skip = false;
+    for (size_t j = 0; j < 6; j++) {
+      if (strcmp(name, hop_by_hop[j]) == 0) {
+        skip = true;
+        break;
+      }
+    }
+    if (skip) {
+      continue;
+    }
+
+    const char *field = res->headers.values[i];
+    ok = tw__hpack_encode_int(buf, len, cap, 0x00, 4, 0) &&
+         tw__hpack_encode_string(buf, len, cap, name, name_len) &&
+         tw__hpack_encode_string(buf, len, cap, field, strlen(field));
+  }
+
+  return ok;
+}
+
+static bool tw__h2_send_response(tw_conn *conn, tw_response *res,
+                                 const char *body, size_t body_len) {
+  tw_h2_session *s = conn->h2;
+  tw_h2_stream *stream = s->current;
+  if (stream == NULL || stream->responded) {
+    tw_log(TW_WARNING, "No http2 stream is waiting for a response");
+    return false;
+  }
+  stream->responded = true;
+
+  char *block = NULL;
+  size_t block_len = 0;
+  size_t block_cap = 0;
+  if (!tw__h2_encode_headers(res, body_len, &block, &block_len, &block_cap)) {
+    free(block);
+    tw__h2_rst_stream(s, stream->id, TW_H2_INTERNAL_ERROR);
+    tw__h2_stream_close(stream);
+    return false;
+  }
+
+  /* the length was announced, no DATA frames follow */
+  if (res->head || !tw__status_has_body(res->status)) {
+    body_len = 0;
+  }
+
+  size_t off = 0;
+  do {
+    size_t n = block_len - off;
+    if (n > s->max_frame_size) n = s->max_frame_size;
+
+    uint8_t flags = off + n == block_len ? TW_H2_FLAG_END_HEADERS : 0;
+    if (off == 0 && body_len == 0) flags |= TW_H2_FLAG_END_STREAM;
+    tw__h2_frame(s, off == 0 ? TW_H2_HEADERS : TW_H2_CONTINUATION, flags,
+                 stream->id, block + off, n);
+    off += n;
+  } while (off < block_len);
+  free(block);
+
+  size_t sent = 0;
+  if (body_len > 0) {
+    sent = tw__h2_write_data(s, stream, body, body_len);
+  }
+
+  if (sent < body_len) {
+    stream->pending = (char *)malloc(body_len - sent);
+    if (stream->pending == NULL) {
+      tw_log(TW_ERROR, "Failed to allocate memory for http2 stream data");
+      tw__h2_rst_stream(s, stream->id, TW_H2_INTERNAL_ERROR);
+      tw__h2_stream_close(stream);
+      return false;
+    }
+    memcpy(stream->pending, body + sent, body_len - sent);
+    stream->pending_len = body_len - sent;
+    stream->pending_off = 0;
+  } else {
+    tw__h2_stream_close(stream);
+  }
+
+  return tw__h2_flush(conn, s);
+}
+
+static void tw__h2_handle_request(tw_conn *conn, tw_h2_session *s,
+                                  tw_h2_stream *stream, tw_request *req,
+                                  tw_request_handler_fn handler) {
+  uint32_t id = stream->id;
+
+  tw_response res;
+  if (!tw_response_init(&res)) {
+    tw__h2_rst_stream(s, id, TW_H2_INTERNAL_ERROR);
+    tw__h2_stream_close(stream);
+    return;
+  }
+  res.accept_encoding =
+      tw_parse_accept_encoding(tw_request_get_header(req, "Accept-Encoding"));
+  res.head = strcmp(req->method, "HEAD") == 0;
+
+  if (conn->server->rate_limit.enabled && !tw__rate_limit_admit(conn, req)) {
+    tw_response_set_status(&res, 429);
+    tw_response_set_header(&res, "Retry-After", TW__XSTR(TW_RETRY_AFTER));
+    s->current = stream;
+    tw_response_send(conn, &res);
+    s->current = NULL;
+    tw_response_free(&res);
+    return;
+  }
+
+  s->current = stream;
+#ifdef TW_ENABLE_TRACE
+  uint64_t trace_start = tw__trace(conn, TW_TRACE_HANDLER, 0);
+  handler(conn, req, &res);
+  tw__trace(conn, TW_TRACE_HANDLER, trace_start);
+#else
+  handler(conn, req, &res);
+#endif
+  s->current = NULL;
+
+  if (stream->id == id && !stream->responded) {
+    tw__h2_rst_stream(s, id, TW_H2_INTERNAL_ERROR);
+    tw__h2_stream_close(stream);
+  }
+
+  tw_response_free(&res);
+}
+
+/* Turns the decoded header list of a stream into a tw_request. The
+ * regular fields are laid out as HTTP/1.1 field lines in req.buf so that
+ * they are indexed exactly like a parsed request head. */
+static void tw__h2_dispatch(tw_conn *conn, tw_h2_session *s,
+                            tw_h2_stream *stream,
+                            tw_request_handler_fn handler) {
+  tw_request req;
+  if (!tw_request_init(&req)) {
+    tw__h2_rst_stream(s, stream->id, TW_H2_INTERNAL_ERROR);
+    tw__h2_stream_close(stream);
+    return;
+  }
+
+  const char *method = tw_map_get(&stream->headers, ":method");
+  const char *path = tw_map_get(&stream->headers, ":path");
+  const char *authority = tw_map_get(&stream->headers, ":authority");
+  if (method == NULL || path == NULL || strlen(method) >= sizeof(req.method) ||
+      strlen(path) >= sizeof(req.path)) {
+    tw__h2_rst_stream(s, stream->id, TW_H2_PROTOCOL_ERROR);
+    tw__h2_stream_close(stream);
+    tw_request_free(&req);
+    return;
+  }
+
+  req.method_len = strlen(method);
+  memcpy(req.method, method, req.method_len + 1);
+  const char *query = strchr(path, '?');
+  req.path_len = query ? (size_t)(query - path) : strlen(path);
+  memcpy(req.path, path, req.path_len);
+  req.path[req.path_len] = '\0';
+  req.version_len = strlen("HTTP/2.0");
+  memcpy(req.version, "HTTP/2.0", req.version_len + 1);
+
+  size_t len = 0;
+  bool has_host = false;
+  bool fits = true;
+  for (size_t i = 0; i <= stream->headers.size && fits; i++) {
+    const char *key;
+    const char *value;
+    if (i < stream->headers.size) {
+      key = stream->headers.keys[i];
+      value = stream->headers.values[i];
+      if (key[0] == ':') continue;
+      if (strcmp(key, "host") == 0) has_host = true;
+    } else if (authority != NULL && !has_host) {
+      key = "host";
+      value = authority;
+    } else {
+      break;
+    }
+
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    /* RFC 9113 8.2.1: field lines must not be able to split or merge */
+    if (strpbrk(key, ":\r\n") != NULL || strpbrk(value, "\r\n") != NULL ||
+        len + key_len + value_len + 6 > sizeof(req.buf)) {
+      fits = false;
+      break;
+    }
+    memcpy(req.buf + len, key, key_len);
+    len += key_len;
+    memcpy(req.buf + len, ": ", 2);
+    len += 2;
+    memcpy(req.buf + len, value, value_len);
+    len += value_len;
+    memcpy(req.buf + len, "\r\n", 2);
+    len += 2;
+  }
+
+  size_t query_len = query ? strlen(query + 1) : 0;
+  if (fits && query != NULL) {
+    fits = len + query_len + 1 <= sizeof(req.buf);
+  }
+
+  if (!fits || !tw__request_index_headers(&req, req.buf, req.buf + len)) {
+    tw__h2_rst_stream(s, stream->id, TW_H2_PROTOCOL_ERROR);
+    tw__h2_stream_close(stream);
+    tw_request_free(&req);
+    return;
+  }
+
+  if (query != NULL) {
+    memcpy(req.buf + len, query + 1, query_len + 1);
+    req.query = req.buf + len;
+    req.query_len = query_len;
+    len += query_len + 1;
+  }
+  req.buf_len = len;
+
+  req.keep_alive = true;
+  req.body = stream->body;
+  req.body_len = stream->body_len;
+  stream->body = NULL;
+  stream->body_len = 0;
+  stream->body_cap = 0;
+
+  tw__h2_handle_request(conn, s, stream, &req, handler);
+  tw_request_free(&req);
+}
+
+static tw_h2_error tw__h2_apply_settings(tw_h2_session *s, const uint8_t *p,
+                                         size_t len) {
+  for (size_t i = 0; i + 6 <= len; i += 6) {
+    uint16_t id = (uint16_t)((p[i] << 8) | p[i + 1]);
+    uint32_t value = tw__h2_get32(p + i + 2);
+
+    switch (id) {
+      case 0x2: /* SETTINGS_ENABLE_PUSH */
+        if (value > 1) return TW_H2_PROTOCOL_ERROR;
+        break;
+      case 0x4: /* SETTINGS_INITIAL_WINDOW_SIZE */
+        if (value > TW_H2_MAX_WINDOW) return TW_H2_FLOW_CONTROL_ERROR;
+        for (size_t j = 0; j < TW_H2_MAX_STREAMS; j++) {
+          if (s->streams[j].id != 0) {
+            s->streams[j].send_window +=
+                (int64_t)value - s->initial_window_size;
+          }
+        }
+        s->initial_window_size = value;
+        break;
+      case 0x5: /* SETTINGS_MAX_FRAME_SIZE */
+        if (value < 16384 || value > 16777215) return TW_H2_PROTOCOL_ERROR;
+        s->max_frame_size = value;
+        break;
+      default:
+        /* the encoder does not index, so the table size does not matter */
+        break;
+    }
+  }
+
+  return TW_H2_NO_ERROR;
+}
+
+static tw_h2_error tw__h2_end_headers(tw_conn *conn, tw_h2_session *s,
+                                      tw_request_handler_fn handler) {
+  uint32_t id = s->header_stream_id;
+  s->header_stream_id = 0;
+
+  tw_h2_stream *stream = tw__h2_stream_find(s, id);
+
+  /* trailers and refused streams still update the decoder state */
+  tw_map scratch;
+  tw_map *target = &scratch;
+  if (stream != NULL && stream->state == TW_H2_STREAM_IDLE) {
+    target = &stream->headers;
+  } else if (!tw_map_init(&scratch)) {
+    return TW_H2_INTERNAL_ERROR;
+  }
+
+  bool ok = tw_hpack_decode(&s->decoder, (const uint8_t *)s->header_block,
+                            s->header_block_len, target);
+  if (target == &scratch) {
+    tw_map_free(&scratch);
+  }
+  if (!ok) {
+    return TW_H2_COMPRESSION_ERROR;
+  }
+
+  if (stream == NULL) {
+    tw__h2_rst_stream(s, id, TW_H2_REFUSED_STREAM);
+    return TW_H2_NO_ERROR;
+  }
+
+  stream->state = TW_H2_STREAM_OPEN;
+  if (s->header_flags & TW_H2_FLAG_END_STREAM) {
+    stream->state = TW_H2_STREAM_HALF_CLOSED_REMOTE;
+    tw__h2_dispatch(conn, s, stream, handler);
+  }
+
+  return TW_H2_NO_ERROR;
+}
+
+static tw_h2_error tw__h2_header_fragment(tw_conn *conn, tw_h2_session *s,
+                                          const uint8_t *p, size_t len,
+                                          bool end_headers,
+                                          tw_request_handler_fn handler) {
+  if (s->header_block_len + len > TW_H2_MAX_HEADER_LIST) {
+    return TW_H2_PROTOCOL_ERROR;
+  }
+
+  if (len > 0) {
+    char *block = (char *)realloc(s->header_block, s->header_block_len + len);
+    if (block == NULL) {
+      tw_log(TW_ERROR, "Failed to allocate memory for http2 header block");
+      return TW_H2_INTERNAL_ERROR;
+    }
+    s->header_block = block;
+    memcpy(s->header_block + s->header_block_len, p, len);
+    s->header_block_len += len;
+  }
+
+  if (!end_headers) {
+    return TW_H2_NO_ERROR;
+  }
+
+  tw_h2_error err = tw__h2_end_headers(conn, s, handler);
+  free(s->header_block);
+  s->header_block = NULL;
+  s->header_block_len = 0;
+  return err;
+}
+
+static tw_h2_error tw__h2_on_headers(tw_conn *conn, tw_h2_session *s,
+                                     uint8_t flags, uint32_t id,
+                                     const uint8_t *p, size_t len,
+                                     tw_request_handler_fn handler) {
+  if (id == 0 || !(id & 1)) {
+    return TW_H2_PROTOCOL_ERROR;
+  }
+
+  if (flags & TW_H2_FLAG_PADDED) {
+    if (len < 1 || p[0] >= len) return TW_H2_PROTOCOL_ERROR;
+    len -= (size_t)p[0] + 1;
+    p++;
+  }
+
+  if (flags & TW_H2_FLAG_PRIORITY) {
+    if (len < 5) return TW_H2_PROTOCOL_ERROR;
+    p += 5;
+    len -= 5;
+  }
+
+  tw_h2_stream *stream = tw__h2_stream_find(s, id);
+  if (stream != NULL) {
+    /* trailers */
+    if (stream->state != TW_H2_STREAM_OPEN) return TW_H2_STREAM_CLOSED;
+    if (!(flags & TW_H2_FLAG_END_STREAM)) return TW_H2_PROTOCOL_ERROR;
+  } else if (id <= s->last_stream_id) {
+    return TW_H2_STREAM_CLOSED;
+  } else {
+    s->last_stream_id = id;
+    /* without a stream the header block is decoded and then refused */
+    if (!s->going_away) {
+      tw__h2_stream_open(s, id);
+    }
+  }
+
+  s->header_stream_id = id;
+  s->header_flags = flags;
+  return tw__h2_header_fragment(conn, s, p, len,
+                                (flags & TW_H2_FLAG_END_HEADERS) != 0, handler);
+}
+
+static tw_h2_error tw__h2_on_data(tw_conn *conn, tw_h2_session *s,
+                                  uint8_t flags, uint32_t id, const uint8_t *p,
+                                  size_t len, tw_request_handler_fn handler) {
+  if (id == 0) {
+    return TW_H2_PROTOCOL_ERROR;
+  }
+
+  /* the whole frame, padding included, counts against the windows */
+  s->recv_window -= (int64_t)len;
+  if (s->recv_window < 0) {
+    return TW_H2_FLOW_CONTROL_ERROR;
+  }
+  if (s->recv_window < TW_H2_WINDOW_SIZE / 2) {
+    tw__h2_window_update(s, 0, (uint32_t)(TW_H2_WINDOW_SIZE - s->recv_window));
+    s->recv_window = TW_H2_WINDOW_SIZE;
+  }
+
+  tw_h2_stream *stream = tw__h2_stream_find(s, id);
+  if (stream == NULL || stream->state != TW_H2_STREAM_OPEN) {
+    if (id > s->last_stream_id) return TW_H2_PROTOCOL_ERROR;
+    tw__h2_rst_stream(s, id, TW_H2_STREAM_CLOSED);
+    return TW_H2_NO_ERROR;
+  }
+
+  stream->recv_window -= (int64_t)len;
+  if (stream->recv_window < 0) {
+    tw__h2_rst_stream(s, id, TW_H2_FLOW_CONTROL_ERROR);
+    tw__h2_stream_close(stream);
+    return TW_H2_NO_ERROR;
+  }
+
+  if (flags & TW_H2_FLAG_PADDED) {
+    if (len < 1 || p[0] >= len) return TW_H2_PROTOCOL_ERROR;
+    len -= (size_t)p[0] + 1;
+    p++;
+  }
+
+  size_t max_body_size =
+      conn->server ? conn->server->config.max_body_size : TW_MAX_REQUEST_BODY;
+  if (stream->body_len + len > max_body_size) {
+    tw__h2_rst_stream(s, id, TW_H2_CANCEL);
+    tw__h2_stream_close(stream);
+    return TW_H2_NO_ERROR;
+  }
+
+  if (stream->body_len + len + 1 > stream->body_cap) {
+    size_t cap = stream->body_cap ? stream->body_cap : 1024;
+    while (cap < stream->body_len + len + 1) cap *= 2;
+    if (!tw__memory_available(conn, cap - stream->body_cap)) {
+      /* over the memory budget, the client may retry the request */
+      tw__h2_rst_stream(s, id, TW_H2_REFUSED_STREAM);
+      tw__h2_stream_close(stream);
+      return TW_H2_NO_ERROR;
+    }
+    char *body = (char *)realloc(stream->body, cap);
+    if (body == NULL) {
+      tw_log(TW_ERROR, "Failed to allocate memory for request body");
+      tw__h2_rst_stream(s, id, TW_H2_INTERNAL_ERROR);
+      tw__h2_stream_close(stream);
+      return TW_H2_NO_ERROR;
+    }
+    stream->body = body;
+    stream->body_cap = cap;
+  }
+  if (len > 0) {
+    memcpy(stream->body + stream->body_len, p, len);
+    stream->body_len += len;
+  }
+  stream->body[stream->body_len] = '\0';
+
+  if (flags & TW_H2_FLAG_END_STREAM) {
+    stream->state = TW_H2_STREAM_HALF_CLOSED_REMOTE;
+    tw__h2_dispatch(conn, s, stream, handler);
+  } else if (stream->recv_window < TW_H2_WINDOW_SIZE / 2) {
+    tw__h2_window_update(s, id,
+                         (uint32_t)(TW_H2_WINDOW_SIZE - stream->recv_window));
+    stream->recv_window = TW_H2_WINDOW_SIZE;
+  }
+
+  return TW_H2_NO_ERROR;
+}
+
+static tw_h2_error tw__h2_on_frame(tw_conn *conn, tw_h2_session *s,
+                                   uint8_t type, uint8_t flags, uint32_t id,
+                                   const uint8_t *p, size_t len,
+                                   tw_request_handler_fn handler) {
+  if (s->header_stream_id != 0 &&
+      (type != TW_H2_CONTINUATION || id != s->header_stream_id)) {
+    return TW_H2_PROTOCOL_ERROR;
+  }
+
+  switch (type) {
+    case TW_H2_DATA:
+      return tw__h2_on_data(conn, s, flags, id, p, len, handler);
+    case TW_H2_HEADERS:
+      return tw__h2_on_headers(conn, s, flags, id, p, len, handler);
+    case TW_H2_CONTINUATION:
+      if (s->header_stream_id == 0) return TW_H2_PROTOCOL_ERROR;
+      return tw__h2_header_fragment(
+          conn, s, p, len, (flags & TW_H2_FLAG_END_HEADERS) != 0, handler);
+    case TW_H2_PRIORITY:
+      if (id == 0) return TW_H2_PROTOCOL_ERROR;
+      return len == 5 ? TW_H2_NO_ERROR : TW_H2_FRAME_SIZE_ERROR;
+    case TW_H2_RST_STREAM: {
+      if (id == 0 || id > s->last_stream_id) return TW_H2_PROTOCOL_ERROR;
+      if (len != 4) return TW_H2_FRAME_SIZE_ERROR;
+      tw_h2_stream *stream = tw__h2_stream_find(s, id);
+      if (stream != NULL) tw__h2_stream_close(stream);
+      return TW_H2_NO_ERROR;
+    }
+    case TW_H2_SETTINGS: {
+      if (id != 0) return TW_H2_PROTOCOL_ERROR;
+      if (flags & TW_H2_FLAG_ACK) {
+        return len == 0 ? TW_H2_NO_ERROR : TW_H2_FRAME_SIZE_ERROR;
+      }
+      if (len % 6 != 0) return TW_H2_FRAME_SIZE_ERROR;
+      tw_h2_error err = tw__h2_apply_settings(s, p, len);
+      if (err != TW_H2_NO_ERROR) return err;
+      tw__h2_frame(s, TW_H2_SETTINGS, TW_H2_FLAG_ACK, 0, NULL, 0);
+      tw__h2_resume(s);
+      return TW_H2_NO_ERROR;
+    }
+    case TW_H2_PUSH_PROMISE:
+      /* clients cannot push */
+      return TW_H2_PROTOCOL_ERROR;
+    case TW_H2_PING:
+      if (id != 0) return TW_H2_PROTOCOL_ERROR;
+      if (len != 8) return TW_H2_FRAME_SIZE_ERROR;
+      if (!(flags & TW_H2_FLAG_ACK)) {
+        tw__h2_frame(s, TW_H2_PING, TW_H2_FLAG_ACK, 0, p, 8);
+      }
+      return TW_H2_NO_ERROR;
+    case TW_H2_GOAWAY:
+      if (id != 0) return TW_H2_PROTOCOL_ERROR;
+      /* finish what is in flight, then close */
+      s->closing = true;
+      return TW_H2_NO_ERROR;
+    case TW_H2_WINDOW_UPDATE: {
+      if (len != 4) return TW_H2_FRAME_SIZE_ERROR;
+      uint32_t increment = tw__h2_get32(p) & 0x7fffffff;
+      if (id == 0) {
+        if (increment == 0) return TW_H2_PROTOCOL_ERROR;
+        s->send_window += increment;
+        if (s->send_window > TW_H2_MAX_WINDOW) return TW_H2_FLOW_CONTROL_ERROR;
+      } else {
+        tw_h2_stream *stream = tw__h2_stream_find(s, id);
+        if (stream == NULL) return TW_H2_NO_ERROR;
+        stream->send_window += increment;
+        if (increment == 0 || stream->send_window > TW_H2_MAX_WINDOW) {
+          tw__h2_rst_stream(s, id,
+                            increment == 0 ? TW_H2_PROTOCOL_ERROR
+                                           : TW_H2_FLOW_CONTROL_ERROR);
+          tw__h2_stream_close(stream);
+          return TW_H2_NO_ERROR;
+        }
+      }
+      tw__h2_resume(s);
+      return TW_H2_NO_ERROR;
+    }
+    default:
+      /* unknown frame types are ignored */
+      return TW_H2_NO_ERROR;
+  }
+}
+
+static void tw__h2_process(tw_conn *conn, tw_h2_session *s,
+                           tw_request_handler_fn handler) {
+  size_t pos = 0;
+
+  if (!s->preface_received) {
+    size_t n = s->in_len < 24 ? s->in_len : 24;
+    if (memcmp(s->in, tw__h2_preface, n) != 0) {
+      tw__h2_goaway(s, TW_H2_PROTOCOL_ERROR);
+      return;
+    }
+    if (n < 24) {
+      return;
+    }
+    pos = 24;
+    s->preface_received = true;
+  }
+
+  while (!s->closing && s->in_len - pos >= 9) {
+    const uint8_t *p = (const uint8_t *)s->in + pos;
+    size_t len = ((size_t)p[0] << 16) | ((size_t)p[1] << 8) | p[2];
+    if (len > TW_H2_MAX_FRAME_SIZE) {
+      tw__h2_goaway(s, TW_H2_FRAME_SIZE_ERROR);
+      return;
+    }
+    if (s->in_len - pos < 9 + len) {
+      break;
+    }
+    if (s->control_queued > TW_H2_MAX_CONTROL_QUEUED) {
+      /* the peer keeps sending frames that need an answer without
+       * reading the answers */
+      tw__h2_goaway(s, TW_H2_ENHANCE_YOUR_CALM);
+      return;
+    }
+
+    tw_h2_error err =
+        tw__h2_on_frame(conn, s, p[3], p[4], tw__h2_get32(p + 5) & 0x7fffffff,
+                        p + 9, len, handler);
+    if (err != TW_H2_NO_ERROR) {
+      tw__h2_goaway(s, err);
+      return;
+    }
+    pos += 9 + len;
+  }
+
+  memmove(s->in, s->in + pos, s->in_len - pos);
+  s->in_len -= pos;
+}
+
+static bool tw__h2_backlogged(tw_h2_session *s) {
+  return s->out_len - s->out_off > TW_OUTPUT_HIGH_WATER;
+}
+
+static short tw__h2_events(tw_h2_session *s) {
+  /* a peer that does not read gets nothing more read from it either */
+  return (tw__h2_backlogged(s) ? 0 : POLLIN) |
+         (s->out_off < s->out_len ? POLLOUT : 0);
+}
+
+/* Returns false when the connection should be closed. */
+static bool tw__h2_on_ready(tw_conn *conn, short revents,
+                            tw_request_handler_fn handler) {
+  tw_h2_session *s = conn->h2;
+  if (revents & (POLLERR | POLLNVAL)) {
+    return false;
+  }
+
+  while ((revents & (POLLIN | POLLHUP)) && !s->closing &&
+         s->in_len < sizeof(s->in) && !tw__h2_backlogged(s)) {
+    ssize_t n =
+        tw_conn_read(conn, s->in + s->in_len, sizeof(s->in) - s->in_len);
+    if (n == 0) {
+      return false;
+    }
+    if (n < 0) {
+#ifdef _WIN32
+      if (WSAGetLastError() == WSAEWOULDBLOCK) break;
+#else
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+#endif
+      return false;
+    }
+
+    s->in_len += (size_t)n;
+    tw__h2_process(conn, s, handler);
+    if (!tw__h2_flush(conn, s)) {
+      return false;
+    }
+  }
+
+  if (!tw__h2_flush(conn, s)) {
+    return false;
+  }
+
+  if (s->going_away && s->out_off == s->out_len && !tw__h2_has_streams(s)) {
+    return false;
+  }
+  return !s->closing || s->out_off < s->out_len || tw__h2_has_pending(s);
+}
+
+static size_t tw__base64url_decode(const char *src, uint8_t *dst,
+                                   size_t dst_cap) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+  uint32_t acc = 0;
+  int bits = 0;
+  size_t out = 0;
+  for (const char *c = src; *c && *c != '='; c++) {
+    const char *found = strchr(alphabet, *c);
+    if (found == NULL) {
+      return (size_t)-1;
+    }
+
+    acc = (acc << 6) | (uint32_t)(found - alphabet);
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      if (out == dst_cap) {
+        return (size_t)-1;
+      }
+      dst[out++] = (uint8_t)(acc >> bits);
+    }
+  }
+  return out;
+}
+
+/* Switches the connection to HTTP/2 when the request is the prior knowledge
+ * preface or an h2c upgrade. Returns false when the connection should be
+ * closed. */
+static bool tw__h2_start(tw_conn *conn, tw_request *req,
+                         tw_request_handler_fn handler, bool *started) {
+  *started = false;
+
+  bool prior_knowledge = strcmp(req->method, "PRI") == 0 &&
+                         strcmp(req->path, "*") == 0 &&
+                         strcmp(req->version, "HTTP/2.0") == 0;
+
+  uint8_t settings[256];
+  size_t settings_len = 0;
+  if (!prior_knowledge) {
+    const char *upgrade = tw_request_get_header(req, "Upgrade");
+    const char *h2_settings = tw_request_get_header(req, "HTTP2-Settings");
+    if (upgrade == NULL || h2_settings == NULL ||
+        !tw__header_has_token(upgrade, "h2c")) {
+      return true;
+    }
+
+    /* requests with a body are served over HTTP/1.1 */
+    const char *cl_hdr = tw_request_get_header(req, "Content-Length");
+    if ((cl_hdr != NULL && strtoul(cl_hdr, NULL, 10) > 0) ||
+        tw_request_get_header(req, "Transfer-Encoding") != NULL) {
+      return true;
+    }
+
+    settings_len =
+        tw__base64url_decode(h2_settings, settings, sizeof(settings));
+    if (settings_len == (size_t)-1 || settings_len % 6 != 0) {
+      return true;
+    }
+  } else if (req->body_len < 6 || memcmp(req->body, "SM\r\n\r\n", 6) != 0) {
+    return false;
+  }
+
+  tw_h2_session *s = tw__h2_session_new();
+  if (s == NULL) {
+    return false;
+  }
+  conn->h2 = s;
+  *started = true;
+
+  /* bytes that followed the request are already HTTP/2 frames */
+  size_t skip = prior_knowledge ? 6 : 0;
+  if (req->body_len > skip) {
+    s->in_len = req->body_len - skip;
+    memcpy(s->in, req->body + skip, s->in_len);
+  }
+  free(req->body);
+  req->body = NULL;
+  req->body_len = 0;
+
+  if (prior_knowledge) {
+    s->preface_received = true;
+  } else {
+    const char *switching =
+        "HTTP/1.1 101 Switching Protocols\r\n"
+        "Connection: Upgrade\r\n"
+        "Upgrade: h2c\r\n\r\n";
+    if (tw_conn_write(conn, switching, strlen(switching)) < 0 ||
+        tw__h2_apply_settings(s, settings, settings_len) != TW_H2_NO_ERROR) {
+      return false;
+    }
+
+    /* the upgrade request becomes stream 1, already half closed */
+    tw_h2_stream *stream = tw__h2_stream_open(s, 1);
+    if (stream == NULL) {
+      return false;
+    }
+    stream->state = TW_H2_STREAM_HALF_CLOSED_REMOTE;
+    s->last_stream_id = 1;
+    req->keep_alive = true;
+    tw__h2_handle_request(conn, s, stream, req, handler);
+  }
+
+  tw__h2_process(conn, s, handler);
+  return tw__h2_flush(conn, s);
+}
+
+#endif
+
+
+#ifdef TW_ENABLE_WEBSOCKET
+
+static void tw__sha1(const uint8_t *data, size_t len, uint8_t digest[20]) {
+  uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                   0xc3d2e1f0};
+  uint8_t block[64];
+  uint64_t bit_len = (uint64_t)len * 8;
+  size_t total = ((len + 8) / 64 + 1) * 64;
+
+  for (size_t off = 0; off < total; off += 64) {
+    for (size_t i = 0; i < 64; i++) {
+      size_t pos = off + i;
+      if (pos < len) {
+        block[i] = data[pos];
+      } else if (pos == len) {
+        block[i] = 0x80;
+      } else if (pos >= total - 8) {
+        block[i] = (uint8_t)(bit_len >> ((total - 1 - pos) * 8));
+      } else {
+        block[i] = 0;
+      }
+    }
+
+    uint32_t w[80];
+    for (size_t i = 0; i < 16; i++) {
+      w[i] = ((uint32_t)block[i * 4] << 24) |
+             ((uint32_t)block[i * 4 + 1] << 16) |
+             ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (size_t i = 16; i < 80; i++) {
+      uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+      w[i] = (x << 1) | (x >> 31);
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (size_t i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+
+      uint32_t temp = ((a << 5) | (a >> 27)) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = (b << 30) | (b >> 2);
+      b = a;
+      a = temp;
+    }
+
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+
+  for (size_t i = 0; i < 5; i++) {
+    digest[i * 4] = (uint8_t)(h[i] >> 24);
+    digest[i * 4 + 1] = (uint8_t)(h[i] >> 16);
+    digest[i * 4 + 2] = (uint8_t)(h[i] >> 8);
+    digest[i * 4 + 3] = (uint8_t)h[i];
+  }
+}
+
+TWDEF void tw_ws_accept_key(const char *key, char accept[29]) {
+  static const char guid[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+  char buf[128];
+  size_t len = (size_t)snprintf(buf, sizeof(buf), "%s%s", key, guid);
+  if (len >= sizeof(buf)) {
+    len = sizeof(buf) - 1;
+  }
+
+  uint8_t digest[20];
+  tw__sha1((const uint8_t *)buf, len, digest);
+
+  /* base64 of 20 bytes is 28 characters with one padding character */
+  size_t out = 0;
+  for (size_t i = 0; i < 20; i += 3) {
+    uint32_t n = (uint32_t)digest[i] << 16;
+    if (i + 1 < 20) n |= (uint32_t)digest[i + 1] << 8;
+    if (i + 2 < 20) n |= digest[i + 2];
+
+    accept[out++] = alphabet[(n >> 18) & 0x3f];
+    accept[out++] = alphabet[(n >> 12) & 0x3f];
+    accept[out++] = i + 1 < 20 ? alphabet[(n >> 6) & 0x3f] : '=';
+    accept[out++] = i + 2 < 20 ? alphabet[n & 0x3f] : '=';
+  }
+  accept[out] = '\0';
+}
+
+TWDEF void tw_ws_unmask(char *data, size_t len, const uint8_t mask[4]) {
+  size_t i = 0;
+  uint32_t mask32;
+  memcpy(&mask32, mask, 4);
+
+#if defined(__AVX2__)
+  __m256i mask256 = _mm256_set1_epi32((int)mask32);
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(data + i));
+    _mm256_storeu_si256((__m256i *)(data + i), _mm256_xor_si256(v, mask256));
+  }
+#endif
+#if defined(__SSE2__)
+  __m128i mask128 = _mm_set1_epi32((int)mask32);
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(data + i));
+    _mm_storeu_si128((__m128i *)(data + i), _mm_xor_si128(v, mask128));
+  }
+#elif defined(__ARM_NEON)
+  uint8x16_t mask128 = vreinterpretq_u8_u32(vdupq_n_u32(mask32));
+  for (; i + 16 <= len; i += 16) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)(data + i));
+    vst1q_u8((uint8_t *)(data + i), veorq_u8(v, mask128));
+  }
+#endif
+
+  /* every step above consumes a multiple of 4 bytes, so the mask stays
+   * aligned with i */
+  uint64_t mask64 = ((uint64_t)mask32 << 32) | mask32;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t v;
+    memcpy(&v, data + i, 8);
+    v ^= mask64;
+    memcpy(data + i, &v, 8);
+  }
+
+  for (; i < len; i++) {
+    data[i] ^= (char)mask[i & 3];
+  }
+}
+
+static bool tw__utf8_valid(const char *data, size_t len) {
+  const unsigned char *s = (const unsigned char *)data;
+  size_t i = 0;
+  while (i < len) {
+    /* skip ASCII eight bytes at a time */
+    if (i + 8 <= len) {
+      uint64_t v;
+      memcpy(&v, s + i, 8);
+      if ((v & 0x8080808080808080ULL) == 0) {
+        i += 8;
+        continue;
+      }
+    }
+
+    unsigned char c = s[i];
+    size_t n;
+    uint32_t cp;
+    if (c < 0x80) {
+      i++;
+      continue;
+    } else if (c >= 0xc2 && c <= 0xdf) {
+      n = 1;
+      cp = c & 0x1f;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      n = 2;
+      cp = c & 0x0f;
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      n = 3;
+      cp = c & 0x07;
+    } else {
+      return false;
+    }
+
+    if (i + n >= len) {
+      return false;
+    }
+    for (size_t j = 1; j <= n; j++) {
+      if ((s[i + j] & 0xc0) != 0x80) return false;
+      cp = (cp << 6) | (s[i + j] & 0x3f);
+    }
+
+    /* overlong forms, surrogates and values above U+10FFFF */
+    if ((n == 2 && cp < 0x800) || (n == 3 && cp < 0x10000) ||
+        (cp >= 0xd800 && cp <= 0xdfff) || cp > 0x10ffff) {
+      return false;
+    }
+    i += n + 1;
+  }
+  return true;
+}
+
+/* Makes room for size bytes in a buffer of ws, moving the len bytes it
+ * holds to a larger one from the pool if needed. */
+static bool tw__ws_buf_reserve(tw_websocket *ws, char **buf, size_t len,
+                               size_t *cap, size_t size) {
+  if (size <= *cap) return true;
+  size_t new_cap = *cap ? *cap : 1024;
+  while (new_cap < size) new_cap *= 2;
+  char *new_buf = tw__pool_get(ws->conn, new_cap);
+  if (new_buf == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for websocket buffer");
+    return false;
+  }
+  if (len > 0) memcpy(new_buf, *buf, len);
+  tw__pool_put(ws->conn, *buf, *cap);
+  *buf = new_buf;
+  *cap = tw__pool_size(new_cap);
+  return true;
+}
+
+/* Gives a buffer of ws back to the pool. */
+static void tw__ws_buf_release(tw_websocket *ws, char **buf, size_t *cap) {
+  tw__pool_put(ws->conn, *buf, *cap);
+  *buf = NULL;
+  *cap = 0;
+}
+
+static bool tw__ws_buf_append(tw_websocket *ws, char **buf, size_t *len,
+                              size_t *cap, const void *data,
+                              size_t data_len) {
+  if (!tw__ws_buf_reserve(ws, buf, *len, cap, *len + data_len)) {
+    return false;
+  }
+
+  memcpy(*buf + *len, data, data_len);
+  *len += data_len;
+  return true;
+}
+
+static size_t tw__ws_frame_header(uint8_t *header, tw_ws_opcode opcode,
+                                  size_t len) {
+  header[0] = 0x80 | (uint8_t)opcode;
+  if (len < 126) {
+    header[1] = (uint8_t)len;
+    return 2;
+  }
+  if (len <= 0xffff) {
+    header[1] = 126;
+    header[2] = (uint8_t)(len >> 8);
+    header[3] = (uint8_t)len;
+    return 4;
+  }
+  header[1] = 127;
+  for (size_t i = 0; i < 8; i++) {
+    header[2 + i] = (uint8_t)((uint64_t)len >> ((7 - i) * 8));
+  }
+  return 10;
+}
+
+/* The peer stopped reading: its input is left unread and nothing more is
+ * queued for it until the output drains. */
+static bool tw__ws_backlogged(tw_websocket *ws) {
+  return ws->out_len - ws->out_off > TW_OUTPUT_HIGH_WATER;
+}
+
+static bool tw__ws_flush(tw_websocket *ws) {
+  while (ws->out_off < ws->out_len) {
+    ssize_t n = tw_conn_write(ws->conn, ws->out + ws->out_off,
+                              ws->out_len - ws->out_off);
+    if (n < 0) {
+#ifdef _WIN32
+      return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+    }
+    ws->out_off += (size_t)n;
+  }
+
+  ws->out_off = 0;
+  ws->out_len = 0;
+  /* an idle websocket keeps no buffers */
+  tw__ws_buf_release(ws, &ws->out, &ws->out_cap);
+  return true;
+}
+
+/* Queues an already serialized frame, writing directly to the socket when
+ * nothing else is waiting. */
+static bool tw__ws_write_frame(tw_websocket *ws, const char *frame,
+                               size_t len) {
+  size_t sent = 0;
+  if (ws->out_off == ws->out_len) {
+    ws->out_off = 0;
+    ws->out_len = 0;
+
+    while (sent < len) {
+      ssize_t n = tw_conn_write(ws->conn, frame + sent, len - sent);
+      if (n < 0) {
+#ifdef _WIN32
+        if (WSAGetLastError() == WSAEWOULDBLOCK) break;
+#else
+        if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+#endif
+        ws->closing = true;
+        return false;
+      }
+      sent += (size_t)n;
+    }
+  }
+
+  return sent == len || tw__ws_buf_append(ws, &ws->out, &ws->out_len,
+                                          &ws->out_cap, frame + sent,
+                                          len - sent);
+}
+
+TWDEF bool tw_ws_send(tw_websocket *ws, tw_ws_opcode opcode, const char *data,
+                      size_t len) {
+  if (ws->close_sent || (opcode != TW_WS_CLOSE && tw__ws_backlogged(ws))) {
+    return false;
+  }
+
+  uint8_t header[10];
+  size_t header_len = tw__ws_frame_header(header, opcode, len);
+  if (!tw__ws_buf_append(ws, &ws->out, &ws->out_len, &ws->out_cap, header,
+                         header_len) ||
+      (len > 0 && !tw__ws_buf_append(ws, &ws->out, &ws->out_len,
+                                     &ws->out_cap, data, len))) {
+    return false;
+  }
+
+  if (opcode == TW_WS_CLOSE) {
+    ws->close_sent = true;
+  }
+
+  if (!tw__ws_flush(ws)) {
+    ws->closing = true;
+    return false;
+  }
+  return true;
+}
+
+TWDEF bool tw_ws_close(tw_websocket *ws, uint16_t code, const char *reason) {
+  char payload[125];
+  size_t len = 0;
+  if (code != 0) {
+    payload[0] = (char)(code >> 8);
+    payload[1] = (char)code;
+    len = 2;
+    if (reason != NULL) {
+      size_t reason_len = strlen(reason);
+      if (reason_len > sizeof(payload) - 2) reason_len = sizeof(payload) - 2;
+      memcpy(payload + 2, reason, reason_len);
+      len += reason_len;
+    }
+  }
+
+  bool ok = tw_ws_send(ws, TW_WS_CLOSE, payload, len);
+  ws->closing = true;
+  return ok;
+}
+
+TWDEF size_t tw_ws_broadcast(tw_websocket **sockets, size_t count,
+                             tw_ws_opcode opcode, const char *data,
+                             size_t len) {
+  /* server frames are not masked, so every socket gets the same bytes */
+  uint8_t header[10];
+  size_t header_len = tw__ws_frame_header(header, opcode, len);
+  char *frame = (char *)malloc(header_len + len);
+  if (frame == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for websocket frame");
+    return 0;
+  }
+  memcpy(frame, header, header_len);
+  if (len > 0) {
+    memcpy(frame + header_len, data, len);
+  }
+
+  size_t delivered = 0;
+  for (size_t i = 0; i < count; i++) {
+    tw_websocket *ws = sockets[i];
+    if (ws == NULL || ws->close_sent || ws->closing ||
+        tw__ws_backlogged(ws)) {
+      continue;
+    }
+    if (tw__ws_write_frame(ws, frame, header_len + len)) {
+      delivered++;
+    }
+  }
+
+  free(frame);
+  return delivered;
+}
+
+static void tw__ws_fail(tw_websocket *ws, uint16_t code) {
+  if (!ws->close_sent) {
+    tw_ws_close(ws, code, NULL);
+  }
+  if (ws->close_code == 0) {
+    ws->close_code = code;
+  }
+  ws->closing = true;
+}
+
+static void tw__ws_deliver(tw_websocket *ws, tw_ws_opcode opcode,
+                           const char *data, size_t len) {
+  if (opcode == TW_WS_TEXT && !tw__utf8_valid(data, len)) {
+    tw__ws_fail(ws, 1007);
+    return;
+  }
+
+  if (ws->handlers.on_message != NULL) {
+    ws->handlers.on_message(ws, opcode, data, len);
+  }
+}
+
+static void tw__ws_control(tw_websocket *ws, tw_ws_opcode opcode, char *data,
+                           size_t len) {
+  switch (opcode) {
+    case TW_WS_PING:
+      tw_ws_send(ws, TW_WS_PONG, data, len);
+      break;
+    case TW_WS_PONG:
+      break;
+    case TW_WS_CLOSE: {
+      uint16_t code = 1005;
+      if (len == 1) {
+        tw__ws_fail(ws, 1002);
+        return;
+      }
+      if (len >= 2) {
+        code = (uint16_t)(((uint8_t)data[0] << 8) | (uint8_t)data[1]);
+        bool valid = (code >= 1000 && code <= 1003) ||
+                     (code >= 1007 && code <= 1011) ||
+                     (code >= 3000 && code <= 4999);
+        if (!valid || !tw__utf8_valid(data + 2, len - 2)) {
+          tw__ws_fail(ws, 1002);
+          return;
+        }
+      }
+
+      ws->close_code = code;
+      if (!ws->close_sent) {
+        tw_ws_close(ws, code == 1005 ? 1000 : code, NULL);
+      }
+      ws->closing = true;
+      break;
+    }
+    default:
+      tw__ws_fail(ws, 1002);
+      break;
+  }
+}
+
+/* Parses every complete frame in the input buffer. Unfragmented messages are
+ * unmasked in place and handed to the callback without a copy. */
+static void tw__ws_process(tw_websocket *ws) {
+  size_t pos = 0;
+
+  while (!ws->closing) {
+    const uint8_t *p = (const uint8_t *)ws->in + pos;
+    size_t avail = ws->in_len - pos;
+    if (avail < 2) {
+      break;
+    }
+
+    bool fin = (p[0] & 0x80) != 0;
+    tw_ws_opcode opcode = (tw_ws_opcode)(p[0] & 0x0f);
+    uint64_t len = p[1] & 0x7f;
+    size_t header_len = 2;
+
+    if (p[0] & 0x70) {
+      /* no extensions were negotiated */
+      tw__ws_fail(ws, 1002);
+      break;
+    }
+
+    if (!(p[1] & 0x80)) {
+      /* clients must mask */
+      tw__ws_fail(ws, 1002);
+      break;
+    }
+
+    if (len == 126) {
+      if (avail < 4) break;
+      len = ((uint64_t)p[2] << 8) | p[3];
+      header_len = 4;
+    } else if (len == 127) {
+      if (avail < 10) break;
+      len = 0;
+      for (size_t i = 0; i < 8; i++) {
+        len = (len << 8) | p[2 + i];
+      }
+      header_len = 10;
+    }
+    header_len += 4;
+
+    if (len > TW_WS_MAX_MESSAGE ||
+        ws->message_len + len > TW_WS_MAX_MESSAGE) {
+      tw__ws_fail(ws, 1009);
+      break;
+    }
+
+    if (avail < header_len + len) {
+      /* make room for the rest of the frame */
+      size_t needed = pos + header_len + (size_t)len;
+      if (needed > ws->in_cap) {
+        memmove(ws->in, ws->in + pos, avail);
+        ws->in_len = avail;
+        pos = 0;
+        if (!tw__ws_buf_reserve(ws, &ws->in, ws->in_len, &ws->in_cap,
+                                header_len + (size_t)len)) {
+          tw__ws_fail(ws, 1011);
+          return;
+        }
+      }
+      break;
+    }
+
+    char *payload = ws->in + pos + header_len;
+    tw_ws_unmask(payload, (size_t)len, p + header_len - 4);
+    pos += header_len + (size_t)len;
+
+    if (opcode & 0x8) {
+      if (!fin || len > 125) {
+        tw__ws_fail(ws, 1002);
+        break;
+      }
+      tw__ws_control(ws, opcode, payload, (size_t)len);
+      continue;
+    }
+
+    if (opcode == TW_WS_CONTINUATION) {
+      if (ws->message == NULL) {
+        tw__ws_fail(ws, 1002);
+        break;
+      }
+    } else if (opcode == TW_WS_TEXT || opcode == TW_WS_BINARY) {
+      if (ws->message != NULL) {
+        tw__ws_fail(ws, 1002);
+        break;
+      }
+      if (fin) {
+        tw__ws_deliver(ws, opcode, payload, (size_t)len);
+        continue;
+      }
+      ws->message_opcode = opcode;
+    } else {
+      tw__ws_fail(ws, 1002);
+      break;
+    }
+
+    /* fragments are reassembled in a separate buffer */
+    if (ws->message_len + (size_t)len > ws->message_cap &&
+        !tw__memory_available(ws->conn, ws->message_len + (size_t)len)) {
+      /* 1013: try again later */
+      tw__ws_fail(ws, 1013);
+      break;
+    }
+    if (ws->message == NULL) {
+      ws->message_len = 0;
+      ws->message = tw__pool_get(ws->conn, len > 1024 ? (size_t)len : 1024);
+      if (ws->message == NULL) {
+        tw_log(TW_ERROR, "Failed to allocate memory for websocket message");
+        tw__ws_fail(ws, 1011);
+        break;
+      }
+      ws->message_cap = tw__pool_size(len > 1024 ? (size_t)len : 1024);
+    }
+    if (len > 0 &&
+        !tw__ws_buf_append(ws, &ws->message, &ws->message_len,
+                           &ws->message_cap, payload, (size_t)len)) {
+      tw__ws_fail(ws, 1011);
+      break;
+    }
+
+    if (fin) {
+      tw__ws_deliver(ws, ws->message_opcode, ws->message, ws->message_len);
+      tw__ws_buf_release(ws, &ws->message, &ws->message_cap);
+      ws->message_len = 0;
+    }
+  }
+
+  if (pos > 0) {
+    memmove(ws->in, ws->in + pos, ws->in_len - pos);
+    ws->in_len -= pos;
+  }
+}
+
+TWDEF tw_websocket *tw_ws_upgrade(tw_conn *conn, tw_request *req,
+                                  const tw_ws_handlers *handlers) {
+#ifdef TW_ENABLE_HTTP2
+  if (conn->h2 != NULL) {
+    return NULL;
+  }
+#endif
+
+  const char *upgrade = tw_request_get_header(req, "Upgrade");
+  const char *connection = tw_request_get_header(req, "Connection");
+  const char *key = tw_request_get_header(req, "Sec-WebSocket-Key");
+  const char *version = tw_request_get_header(req, "Sec-WebSocket-Version");
+  if (strcmp(req->method, "GET") != 0 || upgrade == NULL ||
+      strcasecmp(upgrade, "websocket") != 0 || connection == NULL ||
+      !tw__header_has_token(connection, "upgrade") || key == NULL ||
+      strlen(key) != 24 || version == NULL || strcmp(version, "13") != 0) {
+    return NULL;
+  }
+
+  tw_websocket *ws = (tw_websocket *)calloc(1, sizeof(tw_websocket));
+  if (ws == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for tw_websocket");
+    return NULL;
+  }
+  ws->conn = conn;
+  ws->handlers = *handlers;
+
+  char accept[29];
+  tw_ws_accept_key(key, accept);
+
+  char response[256];
+  int len = snprintf(response, sizeof(response),
+                     "HTTP/1.1 101 Switching Protocols\r\n"
+                     "Upgrade: websocket\r\n"
+                     "Connection: Upgrade\r\n"
+                     "Sec-WebSocket-Accept: %s\r\n\r\n",
+                     accept);
+  if (!tw__ws_buf_append(ws, &ws->out, &ws->out_len, &ws->out_cap, response,
+                         (size_t)len)) {
+    free(ws);
+    return NULL;
+  }
+
+  /* frames sent right behind the handshake were read with the request */
+  if (req->body_len > 0 &&
+      !tw__ws_buf_append(ws, &ws->in, &ws->in_len, &ws->in_cap, req->body,
+                         req->body_len)) {
+    tw__ws_buf_release(ws, &ws->out, &ws->out_cap);
+    free(ws);
+    return NULL;
+  }
+
+  conn->ws = ws;
+  tw__ws_flush(ws);
+  return ws;
+}
+
+static void tw__ws_free(tw_websocket *ws) {
+  if (ws->handlers.on_close != NULL) {
+    ws->handlers.on_close(ws, ws->close_code != 0 ? ws->close_code : 1006);
+  }
+  tw__ws_buf_release(ws, &ws->in, &ws->in_cap);
+  tw__ws_buf_release(ws, &ws->message, &ws->message_cap);
+  tw__ws_buf_release(ws, &ws->out, &ws->out_cap);
+  free(ws);
+}
+
+static size_t tw__ws_memory(tw_websocket *ws) {
+  return sizeof(*ws) + ws->in_cap + ws->message_cap + ws->out_cap;
+}
+
+static short tw__ws_events(tw_websocket *ws) {
+  return (tw__ws_backlogged(ws) ? 0 : POLLIN) |
+         (ws->out_off < ws->out_len ? POLLOUT : 0);
+}
+
+/* Returns false when the connection should be closed. */
+static bool tw__ws_on_ready(tw_websocket *ws, short revents) {
+  if (revents & (POLLERR | POLLNVAL)) {
+    return false;
+  }
+
+  while ((revents & (POLLIN | POLLHUP)) && !ws->closing &&
+         !tw__ws_backlogged(ws)) {
+    /* the input buffer is taken once the socket is readable */
+    if (ws->in_cap - ws->in_len < 4096 &&
+        !tw__ws_buf_reserve(ws, &ws->in, ws->in_len, &ws->in_cap,
+                            ws->in_cap ? ws->in_cap * 2 : 8192)) {
+      return false;
+    }
+
+    ssize_t n =
+        tw_conn_read(ws->conn, ws->in + ws->in_len, ws->in_cap - ws->in_len);
+    if (n == 0) {
+      return false;
+    }
+    if (n < 0) {
+#ifdef _WIN32
+      if (WSAGetLastError() == WSAEWOULDBLOCK) break;
+#else
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+#endif
+      return false;
+    }
+
+    ws->in_len += (size_t)n;
+    tw__ws_process(ws);
+  }
+
+  /* and returned once every frame in it was processed */
+  if (ws->in_len == 0) {
+    tw__ws_buf_release(ws, &ws->in, &ws->in_cap);
+  }
+  if (!tw__ws_flush(ws)) {
+    return false;
+  }
+
+  return !ws->closing || ws->out_off < ws->out_len;
+}
+
+#endif
+
+#ifdef TW_ENABLE_PARK
+
+static tw_chunk *tw__chunk_new(size_t len) {
+  tw_chunk *chunk = (tw_chunk *)malloc(sizeof(tw_chunk) + len);
+  if (chunk == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for parked response");
+    return NULL;
+  }
+  chunk->refs = 1;
+  chunk->len = len;
+  return chunk;
+}
+
+static void tw__chunk_release(tw_chunk *chunk) {
+  if (chunk != NULL &&
+      __atomic_sub_fetch(&chunk->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(chunk);
+  }
+}
+
+TWDEF void tw_parked_release(tw_parked *parked) {
+  if (parked != NULL &&
+      __atomic_sub_fetch(&parked->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(parked);
+  }
+}
+
+static void tw__park_msg_free(tw_park_msg *msg) {
+  tw__chunk_release(msg->chunk);
+  tw_parked_release(msg->parked);
+  free(msg);
+}
+
+/* Creates the wakeup, a pipe or on Windows a UDP socket connected to
+ * itself, and polls its read end in a listener slot. */
+static bool tw__park_open(tw_server *server) {
+  if (server->park_wakeup >= 0) return true;
+  if (server->num_listeners >= TW_MAX_LISTENERS ||
+      server->nfds != server->num_listeners) {
+    tw_log(TW_ERROR, "No listener slot left for the park wakeup");
+    return false;
+  }
+
+#ifdef _WIN32
+  SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+  struct sockaddr_in addr;
+  int addr_len = sizeof(addr);
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (sock == INVALID_SOCKET ||
+      bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      getsockname(sock, (struct sockaddr *)&addr, &addr_len) != 0 ||
+      connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      !tw__set_nonblocking((int)sock)) {
+    tw_log(TW_ERROR, "Failed to create the park wakeup");
+    if (sock != INVALID_SOCKET) closesocket(sock);
+    return false;
+  }
+  int read_fd = (int)sock;
+  server->park_wakeup = (int)sock;
+#else
+  int fds[2];
+  if (pipe(fds) != 0) {
+    tw_log(TW_ERROR, "Failed to create the park wakeup: %s",
+           strerror(errno));
+    return false;
+  }
+  for (int i = 0; i < 2; i++) {
+    tw__set_nonblocking(fds[i]);
+    fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+  }
+  int read_fd = fds[0];
+  server->park_wakeup = fds[1];
+#endif
+
+  tw_listener *listener = &server->listeners[server->num_listeners];
+  memset(listener, 0, sizeof(*listener));
+  listener->fd = read_fd;
+  listener->wakeup = true;
+  server->fds[server->num_listeners].fd = read_fd;
+  server->fds[server->num_listeners].events = POLLIN;
+  server->num_listeners++;
+  server->nfds = server->num_listeners;
+  return true;
+}
+
+static void tw__park_close(tw_server *server) {
+#ifndef _WIN32
+  /* on Windows both ends are the listener socket */
+  if (server->park_wakeup >= 0) close(server->park_wakeup);
+#endif
+  server->park_wakeup = -1;
+  tw_park_msg *msg =
+      __atomic_exchange_n(&server->park_inbox, NULL, __ATOMIC_ACQUIRE);
+  while (msg != NULL) {
+    tw_park_msg *next = msg->next;
+    tw__park_msg_free(msg);
+    msg = next;
+  }
+}
+
+/* Hands msg to the loop, waking it when the inbox was empty. */
+static void tw__park_post(tw_server *server, tw_park_msg *msg) {
+  tw_park_msg *head = __atomic_load_n(&server->park_inbox, __ATOMIC_RELAXED);
+  do {
+    msg->next = head;
+  } while (!__atomic_compare_exchange_n(&server->park_inbox, &head, msg, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  if (head == NULL) {
+    char byte = 0;
+    /* a full pipe wakes the loop already */
+#ifdef _WIN32
+    send(server->park_wakeup, &byte, 1, 0);
+#else
+    ssize_t n = write(server->park_wakeup, &byte, 1);
+    (void)n;
+#endif
+  }
+}
+
+/* Queues chunk, or the end of the response when it is NULL, taking a
+ * reference to it. */
+static bool tw__park_send(tw_parked *parked, tw_chunk *chunk, bool end,
+                          bool keep_alive) {
+  if (parked == NULL || __atomic_load_n(&parked->done, __ATOMIC_ACQUIRE)) {
+    return false;
+  }
+  if (end && __atomic_exchange_n(&parked->done, 1, __ATOMIC_ACQ_REL)) {
+    return false;
+  }
+  tw_park_msg *msg = (tw_park_msg *)malloc(sizeof(tw_park_msg));
+  if (msg == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for parked response");
+    return false;
+  }
+  __atomic_add_fetch(&parked->refs, 1, __ATOMIC_RELAXED);
+  if (chunk != NULL) __atomic_add_fetch(&chunk->refs, 1, __ATOMIC_RELAXED);
+  msg->parked = parked;
+  msg->chunk = chunk;
+  msg->keep_alive = keep_alive;
+  tw__park_post(parked->server, msg);
+  return true;
+}
+
+/* Lets go of the connection once it closed or serves requests again. */
+static void tw__park_detach(tw_parked *parked) {
+  __atomic_store_n(&parked->done, 1, __ATOMIC_RELEASE);
+  while (parked->queue != NULL) {
+    tw_park_msg *msg = parked->queue;
+    parked->queue = msg->next;
+    tw__park_msg_free(msg);
+  }
+  parked->queue_tail = NULL;
+  parked->queued = 0;
+  if (parked->conn != NULL) {
+    parked->conn->parked = NULL;
+    parked->conn = NULL;
+    /* the reference of the loop */
+    tw_parked_release(parked);
+  }
+}
+
+/* Appends msg to the queue of its connection. Returns false when the
+ * client fell too far behind. */
+static bool tw__park_enqueue(tw_parked *parked, tw_park_msg *msg) {
+  msg->next = NULL;
+  if (parked->queue_tail != NULL) {
+    parked->queue_tail->next = msg;
+  } else {
+    parked->queue = msg;
+  }
+  parked->queue_tail = msg;
+  if (msg->chunk != NULL) parked->queued += msg->chunk->len;
+  return parked->queued <= TW_PARK_MAX_QUEUED;
+}
+
+static short tw__park_events(tw_parked *parked) {
+  if (parked->queue != NULL || parked->conn->blocked) return POLLOUT;
+  return parked->input ? 0 : POLLIN;
+}
+
+/* Moves what other threads posted onto their connections, once the
+ * wakeup in listener slot is readable. */
+static void tw__park_dispatch(tw_server *server, int slot) {
+  char buf[64];
+#ifdef _WIN32
+  while (recv(server->listeners[slot].fd, buf, sizeof(buf), 0) > 0) {
+  }
+#else
+  while (read(server->listeners[slot].fd, buf, sizeof(buf)) > 0) {
+  }
+#endif
+
+  /* the inbox is newest first */
+  tw_park_msg *msg =
+      __atomic_exchange_n(&server->park_inbox, NULL, __ATOMIC_ACQUIRE);
+  tw_park_msg *ordered = NULL;
+  while (msg != NULL) {
+    tw_park_msg *next = msg->next;
+    msg->next = ordered;
+    ordered = msg;
+    msg = next;
+  }
+
+  while (ordered != NULL) {
+    msg = ordered;
+    ordered = msg->next;
+    tw_parked *parked = msg->parked;
+    tw_conn *conn = parked->conn;
+    if (conn == NULL) {
+      tw__park_msg_free(msg);
+      continue;
+    }
+    if (!tw__park_enqueue(parked, msg)) {
+      tw_log(TW_WARNING, "Closing a parked connection that fell behind");
+      tw__server_close_slot(server, (int)(conn - server->conns));
+      continue;
+    }
+    server->fds[conn - server->conns].events = POLLOUT;
+  }
+}
+
+static bool tw__park_would_block(void) {
+#ifdef _WIN32
+  return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+  return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+/* Writes what is queued on a parked connection. Returns false when it
+ * has to be closed. */
+static bool tw__park_on_ready(tw_conn *conn, short revents) {
+  tw_parked *parked = conn->parked;
+  /* nothing can be written once the peer is gone */
+  if (revents & (POLLERR | POLLHUP | POLLNVAL)) return false;
+  if (revents & POLLIN) {
+    char byte;
+    ssize_t n = recv(conn->fd, &byte, 1, MSG_PEEK);
+    if (n == 0 || (n < 0 && !tw__park_would_block())) return false;
+    if (n > 0) parked->input = true;
+  }
+  /* the responses before the parked one go first */
+  if (!tw__conn_flush(conn)) return false;
+  if (conn->blocked) return true;
+
+  while (parked->queue != NULL) {
+    tw_park_msg *msg = parked->queue;
+    if (msg->chunk == NULL) {
+      /* the end of the response */
+      bool keep_alive = msg->keep_alive && !parked->stream &&
+                        !conn->server->draining;
+      tw__park_detach(parked);
+      return keep_alive;
+    }
+    while (parked->queue_off < msg->chunk->len) {
+      ssize_t n = tw__conn_send(conn, msg->chunk->data + parked->queue_off,
+                                msg->chunk->len - parked->queue_off);
+      if (n < 0) return tw__park_would_block();
+      parked->queue_off += (size_t)n;
+    }
+    parked->queue_off = 0;
+    parked->queued -= msg->chunk->len;
+    parked->queue = msg->next;
+    if (parked->queue == NULL) parked->queue_tail = NULL;
+    tw__park_msg_free(msg);
+  }
+  return true;
+}
+
+TWDEF tw_parked *tw_conn_park(tw_conn *conn, tw_response *res) {
+  tw_server *server = conn->server;
+#ifdef TW_ENABLE_HTTP2
+  if (conn->h2 != NULL) return NULL;
+#endif
+#ifdef TW_ENABLE_WEBSOCKET
+  if (conn->ws != NULL) return NULL;
+#endif
+  /* the wakeup is opened by tw_server_run */
+  if (server == NULL || server->park_wakeup < 0 || conn->parked != NULL ||
+      conn->rejected) {
+    return NULL;
+  }
+
+  tw_parked *parked = (tw_parked *)calloc(1, sizeof(tw_parked));
+  if (parked == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for parked connection");
+    return NULL;
+  }
+  parked->server = server;
+  /* one for the caller, one for the loop */
+  parked->refs = 2;
+  parked->conn = conn;
+  const char *connection = tw_map_get(&res->headers, "Connection");
+  parked->keep_alive =
+      connection != NULL && strcmp(connection, "keep-alive") == 0;
+  parked->head = res->head;
+  conn->parked = parked;
+  return parked;
+}
+
+TWDEF bool tw_parked_write(tw_parked *parked, const char *data, size_t len) {
+  tw_chunk *chunk = tw__chunk_new(len);
+  if (chunk == NULL) return false;
+  memcpy(chunk->data, data, len);
+  bool ok = tw__park_send(parked, chunk, false, false);
+  tw__chunk_release(chunk);
+  return ok;
+}
+
+TWDEF bool tw_parked_respond(tw_parked *parked, tw_response *res) {
+  if (parked == NULL) return false;
+  tw_response_set_header(res, "Connection",
+                         parked->keep_alive ? "keep-alive" : "close");
+  size_t body_len = res->body_len;
+  size_t head_size = tw__response_head_size(res);
+  bool has_body = !parked->head && tw__status_has_body(res->status) &&
+                  res->body != NULL;
+  tw_chunk *chunk = tw__chunk_new(head_size + (has_body ? body_len : 0));
+  if (chunk == NULL) return false;
+  chunk->len = tw__response_head(res, true, body_len, chunk->data, head_size);
+  if (has_body && body_len > 0) {
+    memcpy(chunk->data + chunk->len, res->body, body_len);
+    chunk->len += body_len;
+  }
+  bool ok = tw__park_send(parked, chunk, false, false) &&
+            tw__park_send(parked, NULL, true, parked->keep_alive);
+  tw__chunk_release(chunk);
+  return ok;
+}
+
+TWDEF bool tw_parked_close(tw_parked *parked) {
+  return tw__park_send(parked, NULL, true, false);
+}
+
+static size_t tw__park_broadcast(tw_parked **parked, size_t count,
+                                 tw_chunk *chunk) {
+  size_t queued = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (tw__park_send(parked[i], chunk, false, false)) {
+      queued++;
+    }
+  }
+  tw__chunk_release(chunk);
+  return queued;
+}
+
+TWDEF size_t tw_parked_broadcast(tw_parked **parked, size_t count,
+                                 const char *data, size_t len) {
+  tw_chunk *chunk = tw__chunk_new(len);
+  if (chunk == NULL) return 0;
+  memcpy(chunk->data, data, len);
+  return tw__park_broadcast(parked, count, chunk);
+}
+
+TWDEF tw_parked *tw_sse_start(tw_conn *conn, tw_response *res) {
+  tw_response_set_header(res, "Content-Type", "text/event-stream");
+  tw_response_set_header(res, "Cache-Control", "no-cache");
+  /* the stream has no length and ends with the connection */
+  tw_response_set_header(res, "Connection", "close");
+  tw_parked *parked = tw_conn_park(conn, res);
+  if (parked == NULL) return NULL;
+  parked->stream = true;
+
+  size_t head_size = tw__response_head_size(res);
+  tw_chunk *chunk = tw__chunk_new(head_size);
+  tw_park_msg *msg = (tw_park_msg *)malloc(sizeof(tw_park_msg));
+  if (chunk == NULL || msg == NULL) {
+    free(chunk);
+    free(msg);
+    tw__park_detach(parked);
+    tw_parked_release(parked);
+    return NULL;
+  }
+  /* the head goes first, straight onto the connection */
+  chunk->len = tw__response_head(res, false, 0, chunk->data, head_size);
+  __atomic_add_fetch(&parked->refs, 1, __ATOMIC_RELAXED);
+  msg->parked = parked;
+  msg->chunk = chunk;
+  msg->keep_alive = false;
+  tw__park_enqueue(parked, msg);
+  return parked;
+}
+
+/* Formats an event, splitting data at CRLF, LF and CR. */
+static tw_chunk *tw__sse_format(const char *event, const char *data) {
+  size_t len = strlen(data);
+  size_t lines = 1;
+  for (size_t i = 0; i < len; i++) {
+    if (data[i] == '\n' || (data[i] == '\r' && data[i + 1] != '\n')) {
+      lines++;
+    }
+  }
+  size_t event_len = event != NULL ? strlen(event) : 0;
+  /* a line break in the type would start fields of its own */
+  if (event != NULL && strcspn(event, "\r\n") != event_len) {
+    tw_log(TW_ERROR, "Event type contains a line break");
+    return NULL;
+  }
+  /* "event: " and "\n", "data: " and "\n" per line, the blank line */
+  tw_chunk *chunk = tw__chunk_new((event != NULL ? event_len + 8 : 0) +
+                                  len + lines * 7 + 1);
+  if (chunk == NULL) return NULL;
+
+  char *out = chunk->data;
+  if (event != NULL) {
+    memcpy(out, "event: ", 7);
+    memcpy(out + 7, event, event_len);
+    out[7 + event_len] = '\n';
+    out += event_len + 8;
+  }
+  const char *line = data;
+  const char *end = data + len;
+  for (;;) {
+    const char *eol = line;
+    while (eol < end && *eol != '\n' && *eol != '\r') eol++;
+    memcpy(out, "data: ", 6);
+    memcpy(out + 6, line, (size_t)(eol - line));
+    out += 6 + (eol - line);
+    *out++ = '\n';
+    if (eol == end) break;
+    line = eol + (eol[0] == '\r' && eol[1] == '\n' ? 2 : 1);
+  }
+  *out++ = '\n';
+  chunk->len = (size_t)(out - chunk->data);
+  return chunk;
+}
+
+TWDEF bool tw_sse_send(tw_parked *parked, const char *event,
+                       const char *data) {
+  tw_chunk *chunk = tw__sse_format(event, data);
+  if (chunk == NULL) return false;
+  bool ok = tw__park_send(parked, chunk, false, false);
+  tw__chunk_release(chunk);
+  return ok;
+}
+
+TWDEF size_t tw_sse_broadcast(tw_parked **parked, size_t count,
+                              const char *event, const char *data) {
+  tw_chunk *chunk = tw__sse_format(event, data);
+  if (chunk == NULL) return 0;
+  return tw__park_broadcast(parked, count, chunk);
+}
+
+#endif
+
+#ifdef TW_ENABLE_CLIENT
+
+typedef enum {
+  TW__CLIENT_HEAD = 0,
+  TW__CLIENT_LENGTH,
+  TW__CLIENT_CHUNK_SIZE,
+  TW__CLIENT_CHUNK_DATA,
+  TW__CLIENT_CHUNK_END,
+  TW__CLIENT_TRAILERS,
+  TW__CLIENT_UNTIL_CLOSE,
+  TW__CLIENT_DONE
+} tw__client_state;
+
+/* One connection to the upstream with its unsent requests and unparsed
+ * response bytes. */
+typedef struct {
+  int fd;
+  bool reused;
+  bool connecting;
+
+  char *out;
+  size_t out_len;
+  size_t out_off;
+
+  char *in;
+  size_t in_len;
+  size_t in_off;
+  size_t in_cap;
+  /* bytes read since the last complete response */
+  size_t received;
+
+  tw__client_state state;
+  size_t remaining;
+  /* the response answers a HEAD request */
+  bool no_body;
+} tw__client_conn;
+
+struct tw_client_call {
+  tw_client *client;
+  tw__client_conn up;
+  bool retried;
+
+  /* the downstream connection, NULL once it went away */
+  tw_conn *conn;
+  bool keep_alive;
+
+  tw_client_callback_fn callback;
+  void *user_data;
+  tw_client_response res;
+};
+
+TWDEF bool tw_client_init(tw_client *client, const char *addr, int port) {
+#ifdef _WIN32
+  WSADATA wsa;
+  if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+    tw_log(TW_ERROR, "WSAStartup failed");
+    return false;
+  }
+#endif
+
+  if (addr == NULL) {
+    addr = "127.0.0.1";
+  }
+  if (!tw__parse_address(addr, port, &client->addr, &client->addr_len)) {
+    tw_log(TW_ERROR, "Invalid upstream address: %s", addr);
+    return false;
+  }
+
+  if (strncmp(addr, "unix:", 5) == 0) {
+    snprintf(client->host, sizeof(client->host), "localhost");
+  } else if (client->addr.ss_family == AF_INET6 && addr[0] != '[') {
+    snprintf(client->host, sizeof(client->host), "[%s]:%d", addr, port);
+  } else {
+    snprintf(client->host, sizeof(client->host), "%s:%d", addr, port);
+  }
+  client->timeout = TW_CLIENT_TIMEOUT;
+  client->num_idle = 0;
+  return true;
+}
+
+TWDEF void tw_client_free(tw_client *client) {
+  while (client->num_idle > 0) {
+    close(client->idle[--client->num_idle]);
+  }
+#ifdef _WIN32
+  WSACleanup();
+#endif
+}
+
+static void tw__client_response_init(tw_client_response *res) {
+  res->status = 0;
+  res->buf[0] = '\0';
+  res->buf_len = 0;
+  res->num_headers = 0;
+  for (int i = 0; i < TW_HEADER_KNOWN_COUNT; i++) {
+    res->known_headers[i] = -1;
+  }
+  res->keep_alive = false;
+  res->body = NULL;
+  res->body_len = 0;
+  res->body_cap = 0;
+}
+
+TWDEF void tw_client_response_free(tw_client_response *res) {
+  free(res->body);
+  res->body = NULL;
+  res->body_len = 0;
+  res->body_cap = 0;
+}
+
+TWDEF const char *tw_client_response_get_header(tw_client_response *res,
+                                                const char *name) {
+  return tw__find_header(res->buf, res->headers, res->num_headers,
+                         res->known_headers, name);
+}
+
+/* Appends the request to out in the form tw_request_parse reads. */
+static bool tw__client_serialize(tw_client *client,
+                                 const tw_client_request *req, char **out,
+                                 size_t *out_len) {
+  const char *method = req->method != NULL ? req->method : "GET";
+  const char *path = req->path != NULL ? req->path : "/";
+  bool has_host = req->headers != NULL &&
+                  tw_map_get(req->headers, "Host") != NULL;
+  bool has_body = req->body != NULL || req->body_len > 0;
+
+  /* request line, Host, Content-Length and the blank line */
+  size_t size = strlen(method) + strlen(path) + strlen(client->host) + 80;
+  if (req->headers != NULL) {
+    size += tw__fields_size(req->headers);
+  }
+
+  char *buf = (char *)realloc(*out, *out_len + size + req->body_len);
+  if (buf == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for upstream request");
+    return false;
+  }
+  *out = buf;
+  buf += *out_len;
+
+  size_t offset = 0;
+  offset += snprintf(buf + offset, size - offset, "%s %s HTTP/1.1\r\n",
+                     method, path);
+  if (!has_host) {
+    offset += snprintf(buf + offset, size - offset, "Host: %s\r\n",
+                       client->host);
+  }
+  if (has_body) {
+    offset += snprintf(buf + offset, size - offset,
+                       "Content-Length: %zu\r\n", req->body_len);
+  }
+  if (req->headers != NULL) {
+    offset += tw__format_fields(buf + offset, size - offset, req->headers);
+  }
+  offset += snprintf(buf + offset, size - offset, "\r\n");
+
+  if (req->body_len > 0) {
+    memcpy(buf + offset, req->body, req->body_len);
+    offset += req->body_len;
+  }
+
+  *out_len += offset;
+  return true;
+}
+
+/* Returns a connected or connecting socket, preferring an idle one. */
+static int tw__client_acquire(tw_client *client, tw__client_conn *c) {
+  while (client->num_idle > 0) {
+    int fd = client->idle[--client->num_idle];
+    /* an idle connection has nothing to read unless it was closed */
+    char byte;
+    if (recv(fd, &byte, 1, MSG_PEEK) < 0) {
+#ifdef _WIN32
+      bool alive = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+      bool alive = errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+      if (alive) {
+        c->fd = fd;
+        c->reused = true;
+        c->connecting = false;
+        return fd;
+      }
+    }
+    close(fd);
+  }
+
+  int family = client->addr.ss_family;
+  int fd = (int)socket(family, SOCK_STREAM, 0);
+  if (fd < 0) {
+    tw_log(TW_ERROR, "Socket failed");
+    return -1;
+  }
+  if (!tw__set_nonblocking(fd)) {
+    close(fd);
+    return -1;
+  }
+  if (family != AF_UNIX) {
+    tw__setsockopt_int(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY");
+  }
+
+  c->fd = fd;
+  c->reused = false;
+  c->connecting = false;
+  if (connect(fd, (struct sockaddr *)&client->addr, client->addr_len) < 0) {
+#ifdef _WIN32
+    bool pending = WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    bool pending = errno == EINPROGRESS;
+#endif
+    if (!pending) {
+      tw_log(TW_ERROR, "Upstream connect failed: %s", strerror(errno));
+      close(fd);
+      c->fd = -1;
+      return -1;
+    }
+    c->connecting = true;
+  }
+  return fd;
+}
+
+static void tw__client_release(tw_client *client, int fd) {
+  if (client->num_idle < TW_CLIENT_MAX_IDLE) {
+    client->idle[client->num_idle++] = fd;
+  } else {
+    close(fd);
+  }
+}
+
+static bool tw__client_connected(tw__client_conn *c) {
+  int err = 0;
+  socklen_t len = sizeof(err);
+  if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, (char *)&err, &len) < 0 ||
+      err != 0) {
+    tw_log(TW_ERROR, "Upstream connect failed: %s", strerror(err));
+    return false;
+  }
+  c->connecting = false;
+  return true;
+}
+
+/* Writes what the socket takes; false on a broken connection. */
+static bool tw__client_write(tw__client_conn *c) {
+  while (c->out_off < c->out_len) {
+    ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off,
+                     TW__SEND_FLAGS);
+    if (n < 0) {
+#ifdef _WIN32
+      return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+    }
+    c->out_off += (size_t)n;
+  }
+  return true;
+}
+
+/* Reads into the input buffer. Returns the bytes read, 0 at the end of
+ * the stream and -1 when nothing is available; errors count as the end,
+ * with *failed set. */
+static ssize_t tw__client_read(tw__client_conn *c, bool *failed) {
+  if (c->in_off > 0 && c->in_off == c->in_len) {
+    c->in_off = 0;
+    c->in_len = 0;
+  }
+  if (c->in_cap - c->in_len < 4096) {
+    size_t cap = c->in_cap ? c->in_cap * 2 : 16384;
+    char *in = (char *)realloc(c->in, cap);
+    if (in == NULL) {
+      tw_log(TW_ERROR, "Failed to allocate memory for upstream response");
+      *failed = true;
+      return 0;
+    }
+    c->in = in;
+    c->in_cap = cap;
+  }
 
-  req->body = NULL;
-  req->body_len = 0;
+  ssize_t n = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+  if (n < 0) {
+#ifdef _WIN32
+    if (WSAGetLastError() == WSAEWOULDBLOCK) return -1;
+#else
+    if (errno == EAGAIN || errno == EWOULDBLOCK) return -1;
+#endif
+    *failed = true;
+    return 0;
+  }
+  c->in_len += (size_t)n;
+  c->received += (size_t)n;
+  return n;
+}
 
-  if (leftover > 0) {
-    req->body = malloc(leftover + 1);
-    if (!req->body) {
-      tw_log(TW_ERROR, "Failed to allocate memory for request body");
-      return TW_REQUEST_PARSE_ERROR;
+static bool tw__client_body_append(tw_client_response *res, const char *data,
+                                   size_t len) {
+  if (res->body_len + len > TW_MAX_REQUEST_BODY) {
+    tw_log(TW_ERROR, "Upstream response body too large");
+    return false;
+  }
+  if (res->body_len + len + 1 > res->body_cap) {
+    size_t cap = res->body_cap ? res->body_cap * 2 : 4096;
+    while (cap < res->body_len + len + 1) cap *= 2;
+    char *body = (char *)realloc(res->body, cap);
+    if (body == NULL) {
+      tw_log(TW_ERROR, "Failed to allocate memory for upstream response");
+      return false;
     }
-    memcpy(req->body, headers_end + 4, leftover);
-    req->body[leftover] = '\0';
-    req->body_len = leftover;
+    res->body = body;
+    res->body_cap = cap;
   }
+  memcpy(res->body + res->body_len, data, len);
+  res->body_len += len;
+  res->body[res->body_len] = '\0';
+  return true;
+}
 
-  return TW_REQUEST_PARSE_SUCCESS;
+static const char *tw__client_find(const char *p, size_t len,
+                                   const char *needle, size_t needle_len) {
+  while (len >= needle_len) {
+    const char *cr = (const char *)memchr(p, needle[0], len - needle_len + 1);
+    if (cr == NULL) return NULL;
+    if (memcmp(cr, needle, needle_len) == 0) return cr;
+    len -= (size_t)(cr + 1 - p);
+    p = cr + 1;
+  }
+  return NULL;
 }
 
-TWDEF tw_request_parse_result tw_request_parse_body(tw_conn *conn,
-                                                    tw_request *req) {
-  const char *cl_hdr = tw_request_get_header(req, "Content-Length");
-  if (!cl_hdr) {
-    /* no body to parse */
-    return TW_REQUEST_PARSE_SUCCESS;
+/* Parses the status line and header block of a response head, which
+ * ends with an empty line. */
+static bool tw__client_parse_head(tw__client_conn *c, tw_client_response *res,
+                                  const char *head, size_t head_len) {
+  if (head_len >= sizeof(res->buf)) return false;
+  memcpy(res->buf, head, head_len);
+  res->buf[head_len] = '\0';
+  res->buf_len = head_len;
+
+  char *line_end = strstr(res->buf, "\r\n");
+  if (strncmp(res->buf, "HTTP/1.", 7) != 0 || line_end - res->buf < 12 ||
+      res->buf[8] != ' ') {
+    return false;
+  }
+  int status = 0;
+  for (int i = 9; i < 12; i++) {
+    if (res->buf[i] < '0' || res->buf[i] > '9') return false;
+    status = status * 10 + (res->buf[i] - '0');
   }
+  res->status = status;
 
-  size_t content_length = strtoul(cl_hdr, NULL, 10);
-  if (content_length == 0) {
-    /* empty body */
-    return TW_REQUEST_PARSE_SUCCESS;
+  if (!tw__index_headers(res->buf, res->headers, &res->num_headers,
+                         res->known_headers, line_end + 2,
+                         res->buf + head_len - 2)) {
+    return false;
   }
 
-  if (content_length > TW_MAX_REQUEST_BODY) {
-    content_length = TW_MAX_REQUEST_BODY;
+  const char *connection =
+      tw_client_response_get_header(res, "Connection");
+  if (connection != NULL && tw__header_has_token(connection, "close")) {
+    res->keep_alive = false;
+  } else if (connection != NULL &&
+             tw__header_has_token(connection, "keep-alive")) {
+    res->keep_alive = true;
+  } else {
+    res->keep_alive = res->buf[7] == '1';
   }
 
-  if (!req->body) {
-    /* allocate memory for the body */
-    req->body = (char *)malloc((size_t)content_length + 1);
-    if (!req->body) {
-      tw_log(TW_ERROR, "Failed to allocate memory for request body");
-      return TW_REQUEST_PARSE_ERROR;
+  const char *te = tw_client_response_get_header(res, "Transfer-Encoding");
+  const char *cl = tw_client_response_get_header(res, "Content-Length");
+  if (c->no_body || status == 204 || status == 304 || status < 200) {
+    c->state = TW__CLIENT_DONE;
+  } else if (te != NULL) {
+    if (!tw__header_has_token(te, "chunked")) return false;
+    c->state = TW__CLIENT_CHUNK_SIZE;
+  } else if (cl != NULL) {
+    if (!tw__parse_content_length(cl, &c->remaining) ||
+        c->remaining > TW_MAX_REQUEST_BODY) {
+      return false;
     }
+    c->state = c->remaining > 0 ? TW__CLIENT_LENGTH : TW__CLIENT_DONE;
   } else {
-    char *new_body = realloc(req->body, content_length + 1);
-    if (!new_body) {
-      free(req->body);
-      req->body = NULL;
-      req->body_len = 0;
-      return TW_REQUEST_PARSE_ERROR;
-    }
-    req->body = new_body;
+    /* the body ends with the connection */
+    res->keep_alive = false;
+    c->state = TW__CLIENT_UNTIL_CLOSE;
   }
+  return true;
+}
 
-  size_t total_read = req->body_len;
-  size_t bytes_remaining = content_length - req->body_len;
+/* Consumes buffered bytes of the response. Returns 1 once it is
+ * complete, 0 when more input is needed and -1 on a malformed one. */
+static int tw__client_parse(tw__client_conn *c, tw_client_response *res,
+                            bool eof) {
+  while (c->state != TW__CLIENT_DONE) {
+    const char *p = c->in + c->in_off;
+    size_t avail = c->in_len - c->in_off;
+
+    switch (c->state) {
+      case TW__CLIENT_HEAD: {
+        const char *end = tw__client_find(p, avail, "\r\n\r\n", 4);
+        if (end == NULL) {
+          return eof || avail >= TW_MAX_REQUEST_SIZE ? -1 : 0;
+        }
+        size_t head_len = (size_t)(end + 4 - p);
+        if (!tw__client_parse_head(c, res, p, head_len)) return -1;
+        c->in_off += head_len;
+        if (res->status >= 100 && res->status < 200 && res->status != 101) {
+          /* interim responses precede the real one */
+          c->state = TW__CLIENT_HEAD;
+        }
+        break;
+      }
 
-  while (bytes_remaining > 0) {
-    ssize_t bytes_read =
-        tw_conn_read(conn, req->body + total_read, bytes_remaining);
-    if (bytes_read <= 0) {
-#ifdef _WIN32
-      if (WSAGetLastError() == WSAEWOULDBLOCK) {
-        return TW_REQUEST_PARSE_BLOCK;
+      case TW__CLIENT_LENGTH:
+      case TW__CLIENT_CHUNK_DATA: {
+        size_t take = avail < c->remaining ? avail : c->remaining;
+        if (take > 0 && !tw__client_body_append(res, p, take)) return -1;
+        c->in_off += take;
+        c->remaining -= take;
+        if (c->remaining > 0) return eof ? -1 : 0;
+        c->state = c->state == TW__CLIENT_LENGTH ? TW__CLIENT_DONE
+                                                 : TW__CLIENT_CHUNK_END;
+        break;
       }
-#else
-      if (errno == EAGAIN || errno == EWOULDBLOCK) {
-        return TW_REQUEST_PARSE_BLOCK;
+
+      case TW__CLIENT_CHUNK_SIZE: {
+        const char *end = tw__client_find(p, avail, "\r\n", 2);
+        if (end == NULL) return eof || avail > 1024 ? -1 : 0;
+        size_t size = 0;
+        const char *digit = p;
+        for (; digit < end; digit++) {
+          int value = tw__hex_digit(*digit);
+          if (value < 0) break;
+          if (size > (SIZE_MAX >> 4)) return -1;
+          size = (size << 4) | (size_t)value;
+        }
+        /* chunk extensions are ignored */
+        if (digit == p || (digit < end && *digit != ';' && *digit != ' ')) {
+          return -1;
+        }
+        c->in_off += (size_t)(end + 2 - p);
+        c->remaining = size;
+        c->state = size > 0 ? TW__CLIENT_CHUNK_DATA : TW__CLIENT_TRAILERS;
+        break;
       }
-#endif
-      free(req->body);
-      req->body = NULL;
-      return TW_REQUEST_PARSE_ERROR;
-    }
 
-    total_read += bytes_read;
-    bytes_remaining -= bytes_read;
+      case TW__CLIENT_CHUNK_END:
+        if (avail < 2) return eof ? -1 : 0;
+        if (p[0] != '\r' || p[1] != '\n') return -1;
+        c->in_off += 2;
+        c->state = TW__CLIENT_CHUNK_SIZE;
+        break;
+
+      case TW__CLIENT_TRAILERS: {
+        const char *end = tw__client_find(p, avail, "\r\n", 2);
+        if (end == NULL) return eof || avail > 8192 ? -1 : 0;
+        c->in_off += (size_t)(end + 2 - p);
+        if (end == p) c->state = TW__CLIENT_DONE;
+        break;
+      }
+
+      case TW__CLIENT_UNTIL_CLOSE:
+        if (avail > 0 && !tw__client_body_append(res, p, avail)) return -1;
+        c->in_off += avail;
+        if (!eof) return 0;
+        c->state = TW__CLIENT_DONE;
+        break;
+
+      case TW__CLIENT_DONE:
+        break;
+    }
   }
 
-  req->body[content_length] = '\0';
-  req->body_len = content_length;
+  if (res->body == NULL && !tw__client_body_append(res, "", 0)) return -1;
+  return 1;
+}
 
-  return TW_REQUEST_PARSE_SUCCESS;
+/* Prepares the parser for the response to req. */
+static void tw__client_expect(tw__client_conn *c,
+                              const tw_client_request *req) {
+  c->state = TW__CLIENT_HEAD;
+  c->remaining = 0;
+  c->received = c->in_len - c->in_off;
+  c->no_body = req->method != NULL && strcmp(req->method, "HEAD") == 0;
 }
 
-TWDEF const char *tw_request_get_header(tw_request *req, const char *name) {
-  return tw_map_get(&req->headers, name);
+static void tw__client_conn_free(tw__client_conn *c) {
+  free(c->out);
+  free(c->in);
+  c->out = NULL;
+  c->in = NULL;
 }
 
-TWDEF bool tw_response_init(tw_response *res) {
-  if (res != NULL) {
-    tw_map_init(&res->headers);
-    res->status = 200;
-    res->body = NULL;
-    res->body_len = 0;
-    return true;
-  } else {
-    return false;
+typedef enum {
+  TW__CLIENT_OK = 0,
+  /* the upstream closed after a response, the rest was not served */
+  TW__CLIENT_CLOSED,
+  TW__CLIENT_FAILED
+} tw__client_result;
+
+/* Sends the buffered requests and reads the responses in order, until
+ * all count are answered. *answered counts the complete responses. */
+static tw__client_result tw__client_exchange(tw_client *client,
+                                             tw__client_conn *c,
+                                             const tw_client_request *reqs,
+                                             tw_client_response *res,
+                                             size_t count, size_t *answered) {
+  *answered = 0;
+  tw__client_expect(c, &reqs[0]);
+
+  while (*answered < count) {
+    struct pollfd pfd;
+    pfd.fd = c->fd;
+    pfd.events = POLLIN;
+    if (c->connecting || c->out_off < c->out_len) {
+      pfd.events |= POLLOUT;
+    }
+    pfd.revents = 0;
+    int ret = poll(&pfd, 1, client->timeout);
+    if (ret < 0 && errno == EINTR) continue;
+    if (ret <= 0) {
+      tw_log(TW_ERROR, "Upstream timed out");
+      return TW__CLIENT_FAILED;
+    }
+
+    if (c->connecting) {
+      if (!(pfd.revents & (POLLOUT | POLLERR | POLLHUP))) continue;
+      if (!tw__client_connected(c)) return TW__CLIENT_FAILED;
+    }
+    if ((pfd.revents & POLLOUT) && !tw__client_write(c)) {
+      return TW__CLIENT_FAILED;
+    }
+    if (!(pfd.revents & (POLLIN | POLLERR | POLLHUP))) continue;
+
+    bool failed = false;
+    ssize_t n = tw__client_read(c, &failed);
+    if (failed) return TW__CLIENT_FAILED;
+    if (n < 0) continue;
+
+    while (*answered < count) {
+      tw_client_response *current = &res[*answered];
+      int parsed = tw__client_parse(c, current, n == 0);
+      if (parsed < 0) return TW__CLIENT_FAILED;
+      if (parsed == 0) break;
+
+      (*answered)++;
+      if (!current->keep_alive) {
+        return *answered == count ? TW__CLIENT_OK : TW__CLIENT_CLOSED;
+      }
+      if (*answered < count) {
+        tw__client_expect(c, &reqs[*answered]);
+      }
+    }
+    if (n == 0 && *answered < count) {
+      return TW__CLIENT_FAILED;
+    }
   }
+  return TW__CLIENT_OK;
 }
 
-TWDEF void tw_response_free(tw_response *res) {
-  if (res != NULL) {
-    free(res->body);
-    tw_map_free(&res->headers);
-    res->body = NULL;
-    res->body_len = 0;
+TWDEF bool tw_client_pipeline(tw_client *client,
+                              const tw_client_request *reqs,
+                              tw_client_response *res, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    tw__client_response_init(&res[i]);
   }
-}
 
-TWDEF void tw_response_set_status(tw_response *res, int status) {
-  res->status = status;
-}
+  size_t done = 0;
+  bool retried = false;
+  while (done < count) {
+    tw__client_conn c;
+    memset(&c, 0, sizeof(c));
+    for (size_t i = done; i < count; i++) {
+      if (!tw__client_serialize(client, &reqs[i], &c.out, &c.out_len)) {
+        tw__client_conn_free(&c);
+        return false;
+      }
+    }
+    if (tw__client_acquire(client, &c) < 0) {
+      tw__client_conn_free(&c);
+      return false;
+    }
 
-TWDEF void tw_response_set_header(tw_response *res, const char *name,
-                                  const char *value) {
-  size_t name_len = strlen(name);
-  if (name_len >= TW_MAX_HEADER_NAME) {
-    tw_log(TW_WARNING, "Header name too long.");
-    return;
-  }
+    size_t answered = 0;
+    tw__client_result result = tw__client_exchange(
+        client, &c, reqs + done, res + done, count - done, &answered);
+    done += answered;
+
+    bool reusable = result == TW__CLIENT_OK && res[done - 1].keep_alive &&
+                    c.in_off == c.in_len;
+    if (reusable) {
+      tw__client_release(client, c.fd);
+    } else {
+      close(c.fd);
+    }
 
-  size_t value_len = strlen(value);
-  if (value_len >= TW_MAX_HEADER_VALUE) {
-    tw_log(TW_WARNING, "Header value too long.");
-    return;
+    /* a pooled connection may have been closed before it saw the requests,
+     * which is worth one retry */
+    bool stale = result == TW__CLIENT_FAILED && c.reused && c.received == 0;
+    tw__client_conn_free(&c);
+    if (result == TW__CLIENT_FAILED && (!stale || retried)) {
+      for (size_t i = 0; i < count; i++) {
+        tw_client_response_free(&res[i]);
+      }
+      return false;
+    }
+    retried = retried || stale;
   }
+  return true;
+}
 
-  tw_map_set(&res->headers, name, value);
+TWDEF bool tw_client_fetch(tw_client *client, const tw_client_request *req,
+                           tw_client_response *res) {
+  return tw_client_pipeline(client, req, res, 1);
 }
 
-static const char *tw_status_text(int status) {
-  switch (status) {
-    case 100:
-      return "Continue";
-    case 101:
-      return "Switching Protocols";
-    case 200:
-      return "OK";
-    case 201:
-      return "Created";
-    case 202:
-      return "Accepted";
-    case 203:
-      return "Non-Authoritative Information";
-    case 204:
-      return "No Content";
-    case 205:
-      return "Reset Content";
-    case 206:
-      return "Partial Content";
-    case 207:
-      return "Multi-Status";
-    case 300:
-      return "Multiple Choices";
-    case 301:
-      return "Moved Permanently";
-    case 302:
-      return "Found";
-    case 303:
-      return "See Other";
-    case 304:
-      return "Not Modified";
-    case 307:
-      return "Temporary Redirect";
-    case 400:
-      return "Bad Request";
-    case 401:
-      return "Unauthorized";
-    case 402:
-      return "Payment Required";
-    case 403:
-      return "Forbidden";
-    case 404:
-      return "Not Found";
-    case 405:
-      return "Method Not Allowed";
-    case 406:
-      return "Not Acceptable";
-    case 407:
-      return "Proxy Authentication Required";
-    case 408:
-      return "Request Timeout";
-    case 409:
-      return "Conflict";
-    case 410:
-      return "Gone";
-    case 411:
-      return "Length Required";
-    case 412:
-      return "Precondition Failed";
-    case 413:
-      return "Content Too Large";
-    case 414:
-      return "URI Too Long";
-    case 415:
-      return "Unsupported Media Type";
-    case 416:
-      return "Range Not Satisfiable";
-    case 417:
-      return "Expectation Failed";
-    case 421:
-      return "Misdirected Request";
-    case 500:
-      return "Internal Server Error";
-    case 501:
-      return "Not Implemented";
-    case 502:
-      return "Bad Gateway";
-    case 503:
-      return "Service Unavailable";
-    case 504:
-      return "Gateway Timeout";
-    case 505:
-      return "HTTP Version Not Supported";
-    default:
-      return "";
+static void tw__client_call_free(struct tw_client_call *call) {
+  if (call->conn != NULL) {
+    call->conn->waiting = NULL;
+  }
+  if (call->up.fd >= 0) {
+    close(call->up.fd);
   }
+  tw__client_conn_free(&call->up);
+  tw_client_response_free(&call->res);
+  free(call);
 }
 
-TWDEF bool tw_response_set_body(tw_response *res, const char *body,
-                                size_t body_len) {
-  if (res != NULL && body != NULL) {
-    free(res->body);
-    res->body = (char *)malloc(body_len + 1);
-    if (res->body == NULL) {
-      tw_log(TW_ERROR, "Failed to allocate memory for tw_response->body");
-      return false;
-    }
+static void tw__client_call_keep_alive(struct tw_client_call *call,
+                                       bool keep_alive) {
+  call->keep_alive = keep_alive;
+}
 
-    memcpy(res->body, body, body_len);
-    res->body[body_len] = '\0';
-    res->body_len = body_len;
+static void tw__client_call_move(struct tw_client_call *call, tw_conn *conn) {
+  call->conn = conn;
+}
 
-    return true;
-  } else {
-    return false;
+static short tw__client_events(struct tw_client_call *call) {
+  if (call->up.connecting || call->up.out_off < call->up.out_len) {
+    return POLLOUT;
   }
+  return POLLIN;
 }
 
-TWDEF bool tw_response_send(tw_conn *conn, tw_response *res) {
-  char header_buf[TW_MAX_HEADER_VALUE * 2];
-  int offset = 0;
+TWDEF bool tw_client_send(tw_client *client, tw_conn *conn,
+                          const tw_client_request *req,
+                          tw_client_callback_fn callback, void *user_data) {
+  tw_server *server = conn->server;
+  if (server == NULL || conn->waiting != NULL) {
+    return false;
+  }
+#ifdef TW_ENABLE_HTTP2
+  if (conn->h2 != NULL) return false;
+#endif
+#ifdef TW_ENABLE_WEBSOCKET
+  if (conn->ws != NULL) return false;
+#endif
+  if (server->nfds == TW_MAX_LISTENERS + TW_MAX_CLIENTS) {
+    tw_log(TW_WARNING, "No connection slot left for the upstream");
+    return false;
+  }
 
-  const char *status_text = tw_status_text(res->status);
-  offset += snprintf(header_buf + offset, sizeof(header_buf) - offset,
-                     "HTTP/1.1 %d %s\r\n", res->status, status_text);
+  struct tw_client_call *call =
+      (struct tw_client_call *)calloc(1, sizeof(struct tw_client_call));
+  if (call == NULL) {
+    tw_log(TW_ERROR, "Failed to allocate memory for upstream call");
+    return false;
+  }
+  call->client = client;
+  call->up.fd = -1;
+  call->keep_alive = true;
+  call->callback = callback;
+  call->user_data = user_data;
+  tw__client_response_init(&call->res);
+
+  if (!tw__client_serialize(client, req, &call->up.out, &call->up.out_len) ||
+      tw__client_acquire(client, &call->up) < 0) {
+    tw__client_call_free(call);
+    return false;
+  }
+  tw__client_expect(&call->up, req);
+
+  int slot = server->nfds++;
+  tw_conn *upstream = &server->conns[slot];
+  memset(upstream, 0, sizeof(*upstream));
+  upstream->fd = call->up.fd;
+  upstream->server = server;
+  upstream->last_active = server->tick;
+  upstream->upstream = call;
+  server->fds[slot].fd = call->up.fd;
+  server->fds[slot].events = tw__client_events(call);
+  server->fds[slot].revents = 0;
+
+  /* the socket belongs to the slot from here on */
+  call->up.fd = -1;
+  call->conn = conn;
+  conn->waiting = call;
+  return true;
+}
 
-  offset += snprintf(header_buf + offset, sizeof(header_buf) - offset,
-                     "Content-Length: %zu\r\n", res->body_len);
+/* Hands the response to the callback and lets the downstream connection
+ * continue with its next request. */
+static void tw__client_complete(tw_conn *upstream, bool ok) {
+  struct tw_client_call *call = upstream->upstream;
+  tw_conn *conn = call->conn;
+  if (conn != NULL) {
+    tw_server *server = conn->server;
+    int slot = (int)(conn - server->conns);
+
+    conn->waiting = NULL;
+    call->conn = NULL;
+    call->callback(conn, ok ? &call->res : NULL, call->user_data);
+
+    if (!call->keep_alive || conn->rejected || server->draining) {
+      tw__server_close_slot(server, slot);
+    } else {
+      server->fds[slot].events = POLLIN;
+      conn->resume = true;
+      server->resume_pending = true;
+    }
+  }
 
-  for (size_t i = 0; i < res->headers.size; i++) {
-    offset +=
-        snprintf(header_buf + offset, sizeof(header_buf) - offset, "%s: %s\r\n",
-                 res->headers.keys[i], res->headers.values[i]);
+  if (ok && call->res.keep_alive && call->up.in_off == call->up.in_len) {
+    tw__client_release(call->client, upstream->fd);
+    upstream->fd = -1;
   }
+}
 
-  offset += snprintf(header_buf + offset, sizeof(header_buf) - offset, "\r\n");
+/* Returns false when the upstream slot should be closed. */
+static bool tw__client_on_ready(tw_conn *upstream, short revents) {
+  struct tw_client_call *call = upstream->upstream;
+  tw__client_conn *c = &call->up;
+  c->fd = upstream->fd;
 
-  if (tw_conn_write(conn, header_buf, offset) < 0) {
-    tw_log(TW_ERROR, "Failed to send response headers");
-    return false;
+  bool failed = false;
+  int parsed = 0;
+  if (c->connecting) {
+    failed = !tw__client_connected(c);
   }
-
-  if (res->body && res->body_len > 0) {
-    if (tw_conn_write(conn, res->body, res->body_len) < 0) {
-      tw_log(TW_ERROR, "Failed to send response body");
-      return false;
+  if (!failed && !c->connecting && (revents & (POLLOUT | POLLERR))) {
+    failed = !tw__client_write(c);
+  }
+  while (!failed && parsed == 0 && (revents & (POLLIN | POLLHUP | POLLERR))) {
+    ssize_t n = tw__client_read(c, &failed);
+    if (failed || n < 0) break;
+    parsed = tw__client_parse(c, &call->res, n == 0);
+    if (parsed < 0 || (parsed == 0 && n == 0)) failed = true;
+  }
+  c->fd = -1;
+
+  if (failed && c->reused && c->received == 0 && !call->retried) {
+    /* the pooled connection was closed by the upstream meanwhile */
+    tw_server *server = upstream->server;
+    int slot = (int)(upstream - server->conns);
+    close(upstream->fd);
+    call->retried = true;
+    c->out_off = 0;
+    c->in_len = 0;
+    c->in_off = 0;
+    if (tw__client_acquire(call->client, c) >= 0) {
+      upstream->fd = c->fd;
+      server->fds[slot].fd = c->fd;
+      c->fd = -1;
+      return true;
     }
+    upstream->fd = -1;
   }
 
+  if (failed || parsed == 1) {
+    tw__client_complete(upstream, parsed == 1);
+    return false;
+  }
   return true;
 }
 
-#endif  // THINWIRE_IMPL
\ No newline at end of file
+#endif
+
+#endif  // THINWIRE_IMPL